@@ -0,0 +1,1203 @@
+// Copyright (c) AlgoMachines
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "SimpleDB.hpp"
+
+#include <map>
+#include <stddef.h>
+
+#pragma once
+
+#define BTREEDB_MAGIC 0x42445442 // "BTDB"
+#define BTREEDB_JOURNAL_MAGIC 0x4A445442 // "BTDJ"
+#define BTREEDB_VERSION 1 // 0 - written before the header and page checksums
+#define BTREEDB_PAGE_SIZE 4096
+#define BTREEDB_CACHE_PAGES 1024 // clean pages kept in the cache by a save, 4MB
+
+// Paged B+tree of fixed size records, for record counts which are too large to load / rewrite as one sorted array.
+//
+// File layout: page 0 holds the header, every other page is a node. Leaves hold sorted record images, internal nodes
+// hold nchildren page numbers followed by nchildren - 1 separator records, separator i being the first record of child i + 1.
+// Pages are read on demand and cached, a lookup reads the pages on one root to leaf path. SaveToFile() writes only the
+// pages which were changed (the dirty page list), then the header, and then trims the cache to the most recently used
+// clean pages. The pages used since the previous save are never dropped, so a record pointer returned by GetRecord()
+// stays valid across the save which follows the lookup.
+//
+// Crash safety: a save first writes the changed pages and the new header to <file>.journal (replacing it atomically),
+// then overwrites them in place, the header last. LoadFromFile() writes the journal's pages again unless the file already
+// holds them, so a save which was interrupted while the pages were written in place is completed by the next load. A load
+// of a file whose last save completed only reads.
+//
+// Journal: [uint32 BTREEDB_JOURNAL_MAGIC] [uint32 page size] [uint64 count] ([uint64 page number] [page])... [uint32 CRC32C
+// of everything before it]. Page 0, the header, is always one of the pages.
+//
+// The header and every node page carry a CRC32C, a page is checked when it is read. A file of version 0 has no checksums,
+// its first save rewrites it whole.
+//
+// Several processes may have the file open. A change of existing records (CanSaveInPlace()) is saved by writing their
+// leaves, the other processes read a leaf again with ReloadRecord() before they use one of its records, or drop their
+// cache with Refresh(). The saves themselves, and the loads which may replay a journal, must not overlap - a load which
+// may overlap a save disables the replay, see EnableJournalReplay().
+//
+// Records are kept sorted by RECORD_CLASS::Compare() and must be plain data (see SimpleDBRecordTraits), the page images
+// are the records themselves. Removing a record doesn't merge underfull pages - the tree never shrinks, which suits a
+// registry that only grows.
+template <class RECORD_CLASS> class BTreeDB
+{
+private:
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t page_size;
+		uint32_t record_size;
+		uint32_t version;
+		uint64_t root;			// 0 when the tree is empty
+		uint64_t npages;		// including the header page
+		uint64_t nrecords;
+		uint64_t generation;	// incremented by each save, a journal of an older generation is not applied
+		uint32_t header_crc;	// of the fields above
+		uint32_t reserved;
+	};
+
+	struct NodeHeader
+	{
+		uint16_t is_leaf;
+		uint16_t count;			// records in a leaf, separators in an internal node
+		uint32_t page_crc;		// of the page without this field
+		uint64_t reserved;
+	};
+
+	struct Page
+	{
+		uint64_t number;
+		vector<uint8_t> data;
+		bool dirty;
+		uint64_t last_use;		// m_use_count when the page was last used
+	};
+
+	struct PageLess
+	{
+		inline bool operator () (const Page* a, const Page* b) const
+		{
+			return a->last_use < b->last_use;
+		}
+	};
+
+	string m_file_name;
+	FILE* m_stream;
+	Header m_header;
+	bool m_header_dirty;
+	std::map<uint64_t, Page*> m_pages;
+	vector<Page*> m_dirty_pages;		// written by the next save
+	uint64_t m_use_count;				// page uses so far
+	uint64_t m_save_use_count;			// m_use_count at the last save
+	uint32_t m_cache_pages;
+	bool m_out_of_date;					// another process has saved pages which may be in the cache, see Refresh()
+	bool m_replay_journal;				// see EnableJournalReplay()
+	bool m_journal_pending;				// the last load found a journal which it did not apply
+
+	static inline uint32_t get_leaf_capacity(void)
+	{
+		return (BTREEDB_PAGE_SIZE - sizeof(NodeHeader)) / RECORD_CLASS::GetSizeBytes();
+	}
+
+	static inline uint32_t get_node_capacity(void)
+	{
+		return (BTREEDB_PAGE_SIZE - sizeof(NodeHeader) - sizeof(uint64_t)) / (RECORD_CLASS::GetSizeBytes() + sizeof(uint64_t));
+	}
+
+	static inline NodeHeader* node_header(Page* page)
+	{
+		return (NodeHeader*)&page->data[0];
+	}
+
+	static inline RECORD_CLASS* leaf_records(Page* page)
+	{
+		return (RECORD_CLASS*)&page->data[sizeof(NodeHeader)];
+	}
+
+	static inline uint64_t* node_children(Page* page)
+	{
+		return (uint64_t*)&page->data[sizeof(NodeHeader)];
+	}
+
+	static inline RECORD_CLASS* node_keys(Page* page)
+	{
+		return (RECORD_CLASS*)&page->data[sizeof(NodeHeader) + (get_node_capacity() + 1) * sizeof(uint64_t)];
+	}
+
+	static inline uint32_t compute_header_crc(const Header& header)
+	{
+		return CRC32C::Compute(&header, offsetof(Header, header_crc));
+	}
+
+	static inline uint32_t compute_page_crc(const uint8_t* data)
+	{
+		uint32_t crc = CRC32C::Compute(data, offsetof(NodeHeader, page_crc));
+		return CRC32C::Compute(data + offsetof(NodeHeader, reserved), BTREEDB_PAGE_SIZE - offsetof(NodeHeader, reserved), crc);
+	}
+
+	static inline bool is_valid_header(const Header& header)
+	{
+		return header.magic == BTREEDB_MAGIC && header.page_size == BTREEDB_PAGE_SIZE &&
+			header.record_size == RECORD_CLASS::GetSizeBytes() && header.version <= BTREEDB_VERSION &&
+			(header.version == 0 || header.header_crc == compute_header_crc(header)) &&
+			header.npages != 0 && header.root < header.npages;
+	}
+
+	static inline string get_journal_file_name(const char* file_name)
+	{
+		string journal_file_name = file_name;
+		journal_file_name += ".journal";
+		return journal_file_name;
+	}
+
+	inline void clear_pages(void)
+	{
+		for (typename std::map<uint64_t, Page*>::iterator it = m_pages.begin(); it != m_pages.end(); it++)
+			delete it->second;
+
+		m_pages.clear();
+		m_dirty_pages.clear();
+	}
+
+	inline void mark_dirty(Page* page)
+	{
+		if (page->dirty)
+			return;
+
+		page->dirty = true;
+		m_dirty_pages.push_back(page);
+	}
+
+	// Drops the least recently used clean pages beyond m_cache_pages, but none which was used since the last save
+	inline void trim_cache(void)
+	{
+		if (m_pages.size() <= m_cache_pages)
+			return;
+
+		vector<Page*> candidates;
+		for (typename std::map<uint64_t, Page*>::iterator it = m_pages.begin(); it != m_pages.end(); it++)
+		{
+			Page* page = it->second;
+			if (page->dirty == false && page->last_use <= m_save_use_count)
+				candidates.push_back(page);
+		}
+
+		std::sort(candidates.begin(), candidates.end(), PageLess());
+
+		for (size_t i = 0; i < candidates.size() && m_pages.size() > m_cache_pages; i++)
+		{
+			m_pages.erase(candidates[i]->number);
+			delete candidates[i];
+		}
+	}
+
+	inline void close(void)
+	{
+		if (m_stream)
+			fclose(m_stream);
+
+		m_stream = 0;
+		clear_pages();
+	}
+
+	inline void init_header(void)
+	{
+		memset(&m_header, 0, sizeof(m_header));
+		m_header.magic = BTREEDB_MAGIC;
+		m_header.page_size = BTREEDB_PAGE_SIZE;
+		m_header.record_size = RECORD_CLASS::GetSizeBytes();
+		m_header.version = BTREEDB_VERSION;
+		m_header.npages = 1;
+	}
+
+	// The next generation of the header, as the image of page 0
+	inline void seal_header(vector<uint8_t>& header_page)
+	{
+		m_header.version = BTREEDB_VERSION;
+		m_header.generation++;
+		m_header.header_crc = compute_header_crc(m_header);
+
+		header_page.assign(BTREEDB_PAGE_SIZE, 0);
+		memcpy(&header_page[0], &m_header, sizeof(m_header));
+	}
+
+	static inline void seal_page(Page* page)
+	{
+		node_header(page)->page_crc = compute_page_crc(&page->data[0]);
+	}
+
+	inline bool read_page(uint64_t number, uint8_t* data, string& err_msg)
+	{
+		if (m_stream == 0 || fseek64(m_stream, number * BTREEDB_PAGE_SIZE) == false ||
+			fread(data, BTREEDB_PAGE_SIZE, 1, m_stream) != 1)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to read page ";
+			append_integer(err_msg, (uint32_t)number);
+			err_msg += " of file: ";
+			err_msg += m_file_name.c_str();
+			return false;
+		}
+
+		return true;
+	}
+
+	inline bool check_page(uint64_t number, const uint8_t* data, string& err_msg)
+	{
+		if (m_header.version > 0 && ((const NodeHeader*)data)->page_crc != compute_page_crc(data))
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "checksum mismatch in page ";
+			append_integer(err_msg, (uint32_t)number);
+			err_msg += " of file: ";
+			err_msg += m_file_name.c_str();
+			return false;
+		}
+
+		return true;
+	}
+
+	// The header as it is in the file now, other processes may have saved since it was read
+	inline bool read_file_header(Header& header, string& err_msg)
+	{
+		if (m_stream == 0 || fseek64(m_stream, 0) == false || fread(&header, sizeof(header), 1, m_stream) != 1 ||
+			is_valid_header(header) == false)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to read the header of file: ";
+			err_msg += m_file_name.c_str();
+			return false;
+		}
+
+		return true;
+	}
+
+	// Pages are read and written whole, and other processes write them in place - nothing is buffered by the stream
+	inline bool open_stream(const char* file_name, string& err_msg)
+	{
+		m_stream = fopen(file_name, "r+b");
+		if (m_stream == 0)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to open file: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		setvbuf(m_stream, 0, _IONBF, 0);
+		return true;
+	}
+
+	inline bool write_page(uint64_t number, const uint8_t* data, string& err_msg)
+	{
+		if (fseek64(m_stream, number * BTREEDB_PAGE_SIZE) == false ||
+			fwrite(data, BTREEDB_PAGE_SIZE, 1, m_stream) != 1)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to write page ";
+			append_integer(err_msg, (uint32_t)number);
+			err_msg += " of file: ";
+			err_msg += m_file_name.c_str();
+			return false;
+		}
+
+		return true;
+	}
+
+	inline Page* get_page(uint64_t number, string& err_msg)
+	{
+		typename std::map<uint64_t, Page*>::iterator it = m_pages.find(number);
+		if (it != m_pages.end())
+		{
+			it->second->last_use = ++m_use_count;
+			return it->second;
+		}
+
+		if (number == 0 || number >= m_header.npages)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "invalid page number ";
+			append_integer(err_msg, (uint32_t)number);
+			err_msg += " in file: ";
+			err_msg += m_file_name.c_str();
+			return 0;
+		}
+
+		Page* page = new Page;
+		page->number = number;
+		page->data.resize(BTREEDB_PAGE_SIZE);
+		page->dirty = false;
+		page->last_use = ++m_use_count;
+
+		if (read_page(number, &page->data[0], err_msg) == false || check_page(number, &page->data[0], err_msg) == false)
+		{
+			delete page;
+			return 0;
+		}
+
+		m_pages[number] = page;
+		return page;
+	}
+
+	inline Page* new_page(bool is_leaf)
+	{
+		Page* page = new Page;
+		page->number = m_header.npages++;
+		page->data.resize(BTREEDB_PAGE_SIZE);
+		page->dirty = false;
+		page->last_use = ++m_use_count;
+		node_header(page)->is_leaf = is_leaf ? 1 : 0;
+
+		m_pages[page->number] = page;
+		mark_dirty(page);
+		m_header_dirty = true;
+		return page;
+	}
+
+	// Index of the first record in the leaf which is not less than record
+	static inline uint32_t leaf_search(Page* leaf, const RECORD_CLASS& record, bool& exists)
+	{
+		const RECORD_CLASS* records = leaf_records(leaf);
+
+		uint32_t istart = 0, iend = node_header(leaf)->count;
+		while (istart < iend)
+		{
+			uint32_t i = (istart + iend) / 2;
+			int state = records[i].Compare(record);
+			if (state == 0)
+			{
+				exists = true;
+				return i;
+			}
+
+			if (state < 0)
+				istart = i + 1;
+			else
+				iend = i;
+		}
+
+		exists = false;
+		return istart;
+	}
+
+	// Child of an internal node whose range holds record, i.e. the number of separators <= record
+	static inline uint32_t child_search(Page* node, const RECORD_CLASS& record)
+	{
+		const RECORD_CLASS* keys = node_keys(node);
+
+		uint32_t istart = 0, iend = node_header(node)->count;
+		while (istart < iend)
+		{
+			uint32_t i = (istart + iend) / 2;
+			if (keys[i].Compare(record) <= 0)
+				istart = i + 1;
+			else
+				iend = i;
+		}
+
+		return istart;
+	}
+
+	// Descends from the root to the leaf whose range holds record, 0 for an empty tree or on error
+	inline Page* find_leaf(const RECORD_CLASS& record, string& err_msg)
+	{
+		if (m_header.root == 0)
+			return 0;
+
+		Page* page = get_page(m_header.root, err_msg);
+		while (page && node_header(page)->is_leaf == 0)
+			page = get_page(node_children(page)[child_search(page, record)], err_msg);
+
+		return page;
+	}
+
+	// Inserts record below page_number. If the page had to be split, split_key and split_page receive the first record
+	// and page number of the new right hand page, to be added to the parent.
+	inline bool insert(uint64_t page_number, const RECORD_CLASS& record, bool& changes_made, bool& split, RECORD_CLASS& split_key, uint64_t& split_page, string& err_msg)
+	{
+		split = false;
+
+		Page* page = get_page(page_number, err_msg);
+		if (page == 0)
+			return false;
+
+		uint32_t rec_size = RECORD_CLASS::GetSizeBytes();
+
+		if (node_header(page)->is_leaf)
+		{
+			bool exists;
+			uint32_t idx = leaf_search(page, record, exists);
+			RECORD_CLASS* records = leaf_records(page);
+
+			if (exists)
+			{
+				if (records[idx].HasSameData(record) == false)
+				{
+					if (records[idx].Update(record, err_msg) == false)
+						return false;
+
+					mark_dirty(page);
+					changes_made = true;
+				}
+				return true;
+			}
+
+			uint32_t count = node_header(page)->count;
+			changes_made = true;
+			m_header.nrecords++;
+			m_header_dirty = true;
+			mark_dirty(page);
+
+			if (count < get_leaf_capacity())
+			{
+				memmove(&records[idx + 1], &records[idx], (count - idx) * rec_size);
+				memcpy(&records[idx], &record, rec_size);
+				node_header(page)->count++;
+				return true;
+			}
+
+			// Full - the cap + 1 records are split in half between this page and a new one
+			vector<uint8_t> all((count + 1) * rec_size);
+			memcpy(&all[0], records, idx * rec_size);
+			memcpy(&all[idx * rec_size], &record, rec_size);
+			memcpy(&all[(idx + 1) * rec_size], &records[idx], (count - idx) * rec_size);
+
+			Page* right = new_page(true);
+
+			uint32_t nleft = (count + 1) / 2, nright = count + 1 - nleft;
+			memcpy(records, &all[0], nleft * rec_size);
+			memcpy(leaf_records(right), &all[nleft * rec_size], nright * rec_size);
+			node_header(page)->count = nleft;
+			node_header(right)->count = nright;
+
+			memcpy(&split_key, leaf_records(right), rec_size);
+			split_page = right->number;
+			split = true;
+			return true;
+		}
+
+		uint32_t ichild = child_search(page, record);
+
+		bool child_split;
+		RECORD_CLASS child_key;
+		uint64_t child_page;
+		if (insert(node_children(page)[ichild], record, changes_made, child_split, child_key, child_page, err_msg) == false)
+			return false;
+
+		if (child_split == false)
+			return true;
+
+		mark_dirty(page);
+
+		uint32_t count = node_header(page)->count;
+		RECORD_CLASS* keys = node_keys(page);
+		uint64_t* children = node_children(page);
+
+		if (count < get_node_capacity())
+		{
+			memmove(&keys[ichild + 1], &keys[ichild], (count - ichild) * rec_size);
+			memcpy(&keys[ichild], &child_key, rec_size);
+			memmove(&children[ichild + 2], &children[ichild + 1], (count - ichild) * sizeof(uint64_t));
+			children[ichild + 1] = child_page;
+			node_header(page)->count++;
+			return true;
+		}
+
+		// Full - the middle separator of the cap + 1 moves up to the parent, the ones either side of it stay in the two halves
+		vector<uint8_t> all_keys((count + 1) * rec_size);
+		memcpy(&all_keys[0], keys, ichild * rec_size);
+		memcpy(&all_keys[ichild * rec_size], &child_key, rec_size);
+		memcpy(&all_keys[(ichild + 1) * rec_size], &keys[ichild], (count - ichild) * rec_size);
+
+		vector<uint64_t> all_children(children, children + count + 1);
+		all_children.insert(all_children.begin() + ichild + 1, child_page);
+
+		Page* right = new_page(false);
+
+		uint32_t nleft = (count + 1) / 2, nright = count - nleft;
+		memcpy(keys, &all_keys[0], nleft * rec_size);
+		memcpy(children, &all_children[0], (nleft + 1) * sizeof(uint64_t));
+		node_header(page)->count = nleft;
+
+		memcpy(node_keys(right), &all_keys[(nleft + 1) * rec_size], nright * rec_size);
+		memcpy(node_children(right), &all_children[nleft + 1], (nright + 1) * sizeof(uint64_t));
+		node_header(right)->count = nright;
+
+		memcpy(&split_key, &all_keys[nleft * rec_size], rec_size);
+		split_page = right->number;
+		split = true;
+		return true;
+	}
+
+	// The dirty pages and the header page, replacing the journal of the previous save
+	inline bool write_journal(const vector<uint8_t>& header_page, string& err_msg)
+	{
+		string journal_file_name = get_journal_file_name(m_file_name.c_str());
+
+		AtomicFileWriter writer;
+		if (writer.Open(journal_file_name.c_str(), err_msg) == false)
+			return false;
+
+		FILE* stream = writer.GetStream();
+
+		uint32_t magic = BTREEDB_JOURNAL_MAGIC;
+		uint32_t page_size = BTREEDB_PAGE_SIZE;
+		uint64_t count = m_dirty_pages.size() + 1;
+
+		uint8_t journal_header[16];
+		memcpy(&journal_header[0], &magic, sizeof(magic));
+		memcpy(&journal_header[4], &page_size, sizeof(page_size));
+		memcpy(&journal_header[8], &count, sizeof(count));
+
+		uint32_t crc = CRC32C::Compute(journal_header, sizeof(journal_header));
+		bool status = fwrite(journal_header, sizeof(journal_header), 1, stream) == 1;
+
+		for (size_t i = 0; i <= m_dirty_pages.size() && status; i++)
+		{
+			uint64_t number = i < m_dirty_pages.size() ? m_dirty_pages[i]->number : 0;
+			const uint8_t* data = i < m_dirty_pages.size() ? &m_dirty_pages[i]->data[0] : &header_page[0];
+
+			crc = CRC32C::Compute(&number, sizeof(number), crc);
+			crc = CRC32C::Compute(data, BTREEDB_PAGE_SIZE, crc);
+			status = fwrite(&number, sizeof(number), 1, stream) == 1 && fwrite(data, BTREEDB_PAGE_SIZE, 1, stream) == 1;
+		}
+
+		if (status == false || fwrite(&crc, sizeof(crc), 1, stream) != 1)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to write file: ";
+			err_msg += journal_file_name.c_str();
+			return false;
+		}
+
+		return writer.Commit(err_msg);
+	}
+
+	// Writes the pages of the journal to the file unless the file already holds them - its header is of a later generation,
+	// or of the same one and every page matches. A journal which is incomplete or damaged was never committed, the file was
+	// not written to after it.
+	inline bool replay_journal(string& err_msg)
+	{
+		string journal_file_name = get_journal_file_name(m_file_name.c_str());
+		if (DoesFileExist(journal_file_name.c_str()) == false)
+			return true;
+
+		FILE* stream = fopen(journal_file_name.c_str(), "rb");
+		if (stream == 0)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to open file: ";
+			err_msg += journal_file_name.c_str();
+			return false;
+		}
+
+		uint32_t magic = 0, page_size = 0;
+		uint64_t count = 0;
+		uint8_t journal_header[16];
+		if (fread(journal_header, sizeof(journal_header), 1, stream) == 1)
+		{
+			memcpy(&magic, &journal_header[0], sizeof(magic));
+			memcpy(&page_size, &journal_header[4], sizeof(page_size));
+			memcpy(&count, &journal_header[8], sizeof(count));
+		}
+
+		uint64_t entry_size = sizeof(uint64_t) + BTREEDB_PAGE_SIZE;
+		if (magic != BTREEDB_JOURNAL_MAGIC || page_size != BTREEDB_PAGE_SIZE || count == 0 ||
+			filelength64(journal_file_name.c_str()) != (int64_t)(sizeof(journal_header) + count * entry_size + sizeof(uint32_t)))
+		{
+			fclose(stream);
+			return true;
+		}
+
+		// The checksum, and the header which the journal was written with
+		vector<uint8_t> page(BTREEDB_PAGE_SIZE);
+		Header journal_file_header;
+		memset(&journal_file_header, 0, sizeof(journal_file_header));
+
+		uint32_t crc = CRC32C::Compute(journal_header, sizeof(journal_header));
+		uint64_t number;
+		for (uint64_t i = 0; i < count; i++)
+		{
+			if (fread(&number, sizeof(number), 1, stream) != 1 || fread(&page[0], BTREEDB_PAGE_SIZE, 1, stream) != 1)
+			{
+				fclose(stream);
+				return true;
+			}
+
+			crc = CRC32C::Compute(&number, sizeof(number), crc);
+			crc = CRC32C::Compute(&page[0], BTREEDB_PAGE_SIZE, crc);
+
+			if (number == 0)
+				memcpy(&journal_file_header, &page[0], sizeof(journal_file_header));
+		}
+
+		uint32_t stored_crc;
+		if (fread(&stored_crc, sizeof(stored_crc), 1, stream) != 1 || stored_crc != crc ||
+			is_valid_header(journal_file_header) == false || journal_file_header.version == 0)
+		{
+			fclose(stream);
+			return true;
+		}
+
+		Header file_header;
+		bool valid_file_header = fseek64(m_stream, 0) && fread(&file_header, sizeof(file_header), 1, m_stream) == 1 &&
+			is_valid_header(file_header);
+
+		if (valid_file_header && file_header.generation > journal_file_header.generation)
+		{
+			fclose(stream);
+			return true;
+		}
+
+		// The header is written last - the save of the same generation reached it, and normally the pages as well,
+		// which are only compared. Nothing is written unless one of them is missing (the header made it to the disk first).
+		if (valid_file_header && file_header.generation == journal_file_header.generation)
+		{
+			vector<uint8_t> file_page(BTREEDB_PAGE_SIZE);
+			bool applied = fseek64(stream, sizeof(journal_header));
+			for (uint64_t i = 0; i < count && applied; i++)
+			{
+				applied = fread(&number, sizeof(number), 1, stream) == 1 && fread(&page[0], BTREEDB_PAGE_SIZE, 1, stream) == 1 &&
+					fseek64(m_stream, number * BTREEDB_PAGE_SIZE) && fread(&file_page[0], BTREEDB_PAGE_SIZE, 1, m_stream) == 1 &&
+					memcmp(&page[0], &file_page[0], BTREEDB_PAGE_SIZE) == 0;
+			}
+
+			if (applied)
+			{
+				fclose(stream);
+				return true;
+			}
+		}
+
+		// Another process may be saving right now, see EnableJournalReplay()
+		if (m_replay_journal == false)
+		{
+			fclose(stream);
+			m_journal_pending = true;
+			return true;
+		}
+
+		fseek64(stream, sizeof(journal_header));
+		for (uint64_t i = 0; i < count; i++)
+		{
+			if (fread(&number, sizeof(number), 1, stream) != 1 || fread(&page[0], BTREEDB_PAGE_SIZE, 1, stream) != 1 ||
+				write_page(number, &page[0], err_msg) == false)
+			{
+				fclose(stream);
+				ERROR_LOCATION(err_msg);
+				err_msg += "unable to apply the journal: ";
+				err_msg += journal_file_name.c_str();
+				return false;
+			}
+		}
+
+		fclose(stream);
+		return FileSync::Commit(m_stream, m_file_name.c_str(), err_msg);
+	}
+
+	// Makes every page of the tree resident, used when the whole tree is written to a new file
+	inline bool load_all_pages(string& err_msg)
+	{
+		for (uint64_t number = 1; number < m_header.npages; number++)
+		{
+			if (get_page(number, err_msg) == 0)
+				return false;
+		}
+
+		return true;
+	}
+
+	// Writes every page to a new file which replaces file_name, a journal of the file it replaces is deleted first.
+	// The pages are made resident before the header is sealed, the pages of a file of version 0 have no checksums.
+	inline bool save_whole_tree(const char* file_name, string& err_msg)
+	{
+		if (m_stream && load_all_pages(err_msg) == false)
+			return false;
+
+		vector<uint8_t> header_page;
+		seal_header(header_page);
+
+		string journal_file_name = get_journal_file_name(file_name);
+		if (FileSync::Flush(err_msg) == false)
+			return false;
+
+		if (DoesFileExist(journal_file_name.c_str()) && DeleteFile(journal_file_name.c_str()) == false)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to delete file: ";
+			err_msg += journal_file_name.c_str();
+			return false;
+		}
+
+		AtomicFileWriter writer;
+		if (writer.Open(file_name, err_msg) == false)
+			return false;
+
+		bool status = fwrite(&header_page[0], BTREEDB_PAGE_SIZE, 1, writer.GetStream()) == 1;
+		for (uint64_t number = 1; number < m_header.npages && status; number++)
+		{
+			Page* page = get_page(number, err_msg);
+			if (page == 0)
+				return false;
+
+			seal_page(page);
+			status = fwrite(&page->data[0], BTREEDB_PAGE_SIZE, 1, writer.GetStream()) == 1;
+		}
+
+		if (status == false)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to write file: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		// The file may be the one which is replaced, every page is resident from here on
+		if (m_stream)
+			fclose(m_stream);
+
+		m_stream = 0;
+		m_file_name = file_name;
+
+		if (writer.Commit(err_msg) == false || open_stream(file_name, err_msg) == false)
+			return false;
+
+		for (size_t i = 0; i < m_dirty_pages.size(); i++)
+			m_dirty_pages[i]->dirty = false;
+
+		m_dirty_pages.clear();
+		m_header_dirty = false;
+
+		trim_cache();
+		m_save_use_count = m_use_count;
+		return true;
+	}
+
+	template <class VISITOR> inline bool visit(uint64_t page_number, VISITOR& visitor, string& err_msg)
+	{
+		Page* page = get_page(page_number, err_msg);
+		if (page == 0)
+			return false;
+
+		if (node_header(page)->is_leaf)
+		{
+			const RECORD_CLASS* records = leaf_records(page);
+			for (uint32_t i = 0; i < node_header(page)->count; i++)
+			{
+				if (visitor(records[i]) == false)
+					return true;
+			}
+			return true;
+		}
+
+		const uint64_t* children = node_children(page);
+		for (uint32_t i = 0; i <= node_header(page)->count; i++)
+		{
+			if (visit(children[i], visitor, err_msg) == false)
+				return false;
+		}
+
+		return true;
+	}
+
+	// Not copyable, the page cache is owned by exactly one object
+	BTreeDB(const BTreeDB&);
+	BTreeDB& operator = (const BTreeDB&);
+
+public:
+
+	inline BTreeDB(void)
+	{
+		m_stream = 0;
+		m_header_dirty = false;
+		m_use_count = 0;
+		m_save_use_count = 0;
+		m_cache_pages = BTREEDB_CACHE_PAGES;
+		m_out_of_date = false;
+		m_replay_journal = true;
+		m_journal_pending = false;
+		init_header();
+	}
+
+	inline ~BTreeDB(void)
+	{
+		close();
+	}
+
+	inline uint64_t GetNumRecords(void) const
+	{
+		return m_header.nrecords;
+	}
+
+	// Nothing is mapped, the pages are read and written through the open file (see SimpleDB::ReleaseFileMappings())
+	inline bool ReleaseFileMappings(string& err_msg)
+	{
+		return true;
+	}
+
+	// Clean pages kept in the cache by a save, the pages used since the previous save are kept as well
+	inline void SetCachePages(uint32_t cache_pages)
+	{
+		m_cache_pages = cache_pages;
+	}
+
+	inline size_t GetNumCachedPages(void) const
+	{
+		return m_pages.size();
+	}
+
+	// True if changes of records in place (MarkRecordChanged(), UpdateRecord() of an existing record) are saved by
+	// writing just their leaves to file_name - nothing was inserted or removed, and the file has checksums
+	inline bool CanSaveInPlace(const char* file_name) const
+	{
+		return m_file_name == file_name && m_stream && m_header.version == BTREEDB_VERSION && m_header_dirty == false;
+	}
+
+	// The range of the file which holds the record - the page of the leaf which has it, or would have it.
+	// Returns false for an empty tree or on error.
+	inline bool GetRecordRange(const RECORD_CLASS& token, uint64_t& offset, uint64_t& len)
+	{
+		string err_msg;
+		Page* leaf = find_leaf(token, err_msg);
+		if (leaf == 0)
+			return false;
+
+		offset = leaf->number * BTREEDB_PAGE_SIZE;
+		len = BTREEDB_PAGE_SIZE;
+		return true;
+	}
+
+	// Reads the leaf of the record from the file again, another process may have saved it in place since it was cached.
+	// Pointers into the leaf stay valid. A leaf with unsaved changes is kept as it is.
+	inline bool ReloadRecord(const RECORD_CLASS& token, string& err_msg)
+	{
+		if (m_stream == 0 || m_header.root == 0)
+			return true;
+
+		Page* leaf = find_leaf(token, err_msg);
+		if (leaf == 0)
+			return false;
+
+		if (leaf->dirty)
+			return true;
+
+		vector<uint8_t> data(BTREEDB_PAGE_SIZE);
+		if (read_page(leaf->number, &data[0], err_msg) == false || check_page(leaf->number, &data[0], err_msg) == false)
+			return false;
+
+		if (((const NodeHeader*)&data[0])->is_leaf == 0)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "the tree was changed by another process: ";
+			err_msg += m_file_name.c_str();
+			return false;
+		}
+
+		memcpy(&leaf->data[0], &data[0], BTREEDB_PAGE_SIZE);
+		return true;
+	}
+
+	// Drops the cached pages if another process has saved the file since this tree read or wrote it - before records
+	// are inserted or removed, the pages which are changed must be the file's. Pointers to records are not valid then.
+	inline bool Refresh(string& err_msg)
+	{
+		if (m_stream == 0)
+			return true;
+
+		Header file_header;
+		if (read_file_header(file_header, err_msg) == false)
+			return false;
+
+		if (m_out_of_date == false && file_header.generation == m_header.generation)
+			return true;
+
+		if (m_dirty_pages.size() || m_header_dirty)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "the tree has unsaved changes: ";
+			err_msg += m_file_name.c_str();
+			return false;
+		}
+
+		clear_pages();
+		m_header = file_header;
+		m_out_of_date = false;
+		return true;
+	}
+
+	// Deletes a tree file together with its journal. The journal goes first - it must never outlive its file,
+	// or it would be applied to the next file created with the same name.
+	static inline bool DeleteFiles(const char* file_name, string& err_msg)
+	{
+		string journal_file_name = get_journal_file_name(file_name);
+
+		if (DoesFileExist(journal_file_name.c_str()) && DeleteFile(journal_file_name.c_str()) == false)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to delete file: ";
+			err_msg += journal_file_name.c_str();
+			return false;
+		}
+
+		if (DoesFileExist(file_name) && DeleteFile(file_name) == false)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to delete file: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		return true;
+	}
+
+	// A load of a tree which another process may be saving at the same time must not write the journal's pages over
+	// the ones that process is writing. With replay disabled LoadFromFile() leaves a journal which the file does not hold
+	// yet alone and IsJournalPending() returns true - the caller loads again once no save can be in progress.
+	inline void EnableJournalReplay(bool replay_journal)
+	{
+		m_replay_journal = replay_journal;
+	}
+
+	// True if the last LoadFromFile() with replay disabled skipped a journal, or found the header invalid - the load
+	// has to be made again with replay enabled
+	inline bool IsJournalPending(void) const
+	{
+		return m_journal_pending;
+	}
+
+	// Opens the tree in file_name, a file which does not exist yet is an empty tree and is created by SaveToFile()
+	inline bool LoadFromFile(const char* file_name, string& err_msg)
+	{
+		close();
+		init_header();
+		m_header_dirty = false;
+		m_out_of_date = false;
+		m_journal_pending = false;
+		m_file_name = file_name;
+
+		if (SimpleDBRecordTraits<RECORD_CLASS>::IS_PLAIN_DATA == false || sizeof(RECORD_CLASS) != RECORD_CLASS::GetSizeBytes() ||
+			get_node_capacity() < 3)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "record type can't be stored in pages of the B+tree: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		if (DoesFileExist(file_name) == false)
+		{
+			m_header_dirty = true;
+			return true;
+		}
+
+		if (open_stream(file_name, err_msg) == false)
+			return false;
+
+		if (replay_journal(err_msg) == false)
+		{
+			close();
+			return false;
+		}
+
+		if (fseek64(m_stream, 0) == false || fread(&m_header, sizeof(m_header), 1, m_stream) != 1 ||
+			is_valid_header(m_header) == false || filelength64(file_name) < (int64_t)(m_header.npages * BTREEDB_PAGE_SIZE))
+		{
+			close();
+			init_header();
+
+			// Possibly read while a save of another process was writing it
+			if (m_replay_journal == false)
+			{
+				m_journal_pending = true;
+				return true;
+			}
+
+			ERROR_LOCATION(err_msg);
+			err_msg += "invalid B+tree file: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		return true;
+	}
+
+	// Returns 0 if the record does not exist.
+	// The record is in the page cache, the pointer stays valid until the next LoadFromFile(), or until the second
+	// SaveToFile() from now - the cache is trimmed by a save.
+	inline const RECORD_CLASS* GetRecord(const RECORD_CLASS& token)
+	{
+		string err_msg;
+		Page* leaf = find_leaf(token, err_msg);
+		if (leaf == 0)
+			return 0;
+
+		bool exists;
+		uint32_t idx = leaf_search(leaf, token, exists);
+		if (exists == false)
+			return 0;
+
+		return &leaf_records(leaf)[idx];
+	}
+
+	// Records may be modified through their mutable members (e.g. DRM_ProgramRecord::IncrementNQueries()),
+	// call this with the pointer returned by GetRecord() so that the page holding the record is saved.
+	// The page is the leaf which a lookup of the record finds, the key fields must not have been changed.
+	inline bool MarkRecordChanged(const RECORD_CLASS* rec)
+	{
+		string err_msg;
+		Page* leaf = find_leaf(*rec, err_msg);
+		if (leaf == 0)
+			return false;
+
+		const uint8_t* data = &leaf->data[0];
+		if ((const uint8_t*)rec < data || (const uint8_t*)rec >= data + BTREEDB_PAGE_SIZE)
+			return false;
+
+		mark_dirty(leaf);
+		return true;
+	}
+
+	// Updates the existing record, or inserts it
+	inline bool UpdateRecord(const RECORD_CLASS& record, bool& changes_made, string& err_msg)
+	{
+		changes_made = false;
+
+		if (m_header.root == 0)
+		{
+			Page* root = new_page(true);
+			m_header.root = root->number;
+		}
+
+		bool split;
+		RECORD_CLASS split_key;
+		uint64_t split_page;
+		if (insert(m_header.root, record, changes_made, split, split_key, split_page, err_msg) == false)
+			return false;
+
+		if (split)
+		{
+			// The tree grows by one level
+			Page* root = new_page(false);
+			node_header(root)->count = 1;
+			node_children(root)[0] = m_header.root;
+			node_children(root)[1] = split_page;
+			memcpy(node_keys(root), &split_key, RECORD_CLASS::GetSizeBytes());
+			m_header.root = root->number;
+		}
+
+		return true;
+	}
+
+	// Returns true if the record did not exist or was removed
+	inline bool RemoveRecord(const RECORD_CLASS& token, string& err_msg)
+	{
+		if (m_header.root == 0)
+			return true;
+
+		Page* leaf = find_leaf(token, err_msg);
+		if (leaf == 0)
+			return false;
+
+		bool exists;
+		uint32_t idx = leaf_search(leaf, token, exists);
+		if (exists == false)
+			return true;
+
+		RECORD_CLASS* records = leaf_records(leaf);
+		uint32_t count = node_header(leaf)->count;
+		memmove(&records[idx], &records[idx + 1], (count - idx - 1) * RECORD_CLASS::GetSizeBytes());
+		node_header(leaf)->count--;
+		mark_dirty(leaf);
+
+		m_header.nrecords--;
+		m_header_dirty = true;
+		return true;
+	}
+
+	// Calls visitor(const RECORD_CLASS&) for every record in order, until it returns false
+	template <class VISITOR> inline bool ForEachRecord(VISITOR& visitor, string& err_msg)
+	{
+		if (m_header.root == 0)
+			return true;
+
+		return visit(m_header.root, visitor, err_msg);
+	}
+
+	// Writes the changed pages and the header to the journal, then in place.
+	// Saving to a file other than the one loaded, or to a file of version 0, writes the whole tree to a new file which
+	// replaces it, and it becomes the file of this tree.
+	inline bool SaveToFile(const char* file_name, string& err_msg)
+	{
+		if (m_file_name != file_name || m_stream == 0 || m_header.version < BTREEDB_VERSION)
+			return save_whole_tree(file_name, err_msg);
+
+		if (m_dirty_pages.size() == 0 && m_header_dirty == false)
+		{
+			trim_cache();
+			m_save_use_count = m_use_count;
+			return true;
+		}
+
+		// Other processes save their changes of records in place as well - the generation goes on from the file's, and
+		// the pages which they wrote may be in the cache. Anything else changed means the tree is not the file's.
+		Header file_header;
+		if (read_file_header(file_header, err_msg) == false)
+			return false;
+
+		if (m_header_dirty == false && (file_header.root != m_header.root || file_header.npages != m_header.npages ||
+			file_header.nrecords != m_header.nrecords))
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "the tree was changed by another process: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		if (file_header.generation != m_header.generation)
+		{
+			m_out_of_date = true;
+			if (file_header.generation > m_header.generation)
+				m_header.generation = file_header.generation;
+		}
+
+		vector<uint8_t> header_page;
+		seal_header(header_page);
+
+		for (size_t i = 0; i < m_dirty_pages.size(); i++)
+			seal_page(m_dirty_pages[i]);
+
+		// Under FILESYNC_GROUPED the pages of the previous save must be on the disk before its journal is replaced,
+		// and the new journal before any page is overwritten
+		if (FileSync::Flush(err_msg) == false || write_journal(header_page, err_msg) == false || FileSync::Flush(err_msg) == false)
+			return false;
+
+		for (size_t i = 0; i < m_dirty_pages.size(); i++)
+		{
+			Page* page = m_dirty_pages[i];
+			if (write_page(page->number, &page->data[0], err_msg) == false)
+				return false;
+		}
+
+		if (write_page(0, &header_page[0], err_msg) == false || FileSync::Commit(m_stream, file_name, err_msg) == false)
+			return false;
+
+		for (size_t i = 0; i < m_dirty_pages.size(); i++)
+			m_dirty_pages[i]->dirty = false;
+
+		m_dirty_pages.clear();
+		m_header_dirty = false;
+
+		trim_cache();
+		m_save_use_count = m_use_count;
+		return true;
+	}
+
+	// Pages are only ever written when changed, same as SaveToFile()
+	inline bool SaveChangedRecords(const char* file_name, string& err_msg)
+	{
+		return SaveToFile(file_name, err_msg);
+	}
+};
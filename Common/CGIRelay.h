@@ -0,0 +1,286 @@
+// Copyright (c) AlgoMachines
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "socket_tools.h"
+
+#pragma once
+
+#ifndef WIN32
+
+// A CGI program as the thin client of a warm server process. The client forwards its CGI variables and its
+// stdin over a unix domain socket, the server sends back the output and closes the connection.
+//
+// Request:  [uint32 number of variables] ([uint32 length] NAME=VALUE)... [uint32 content length] [content]
+// Response: the output, up to the end of the connection
+
+#define CGI_RELAY_MAX_VARIABLES 64
+#define CGI_RELAY_MAX_BYTES 0x100000		// of one variable, or of the content
+#define CGI_RELAY_IO_TIMEOUT_MS 60000		// a client or a server which stops sending or reading is dropped
+#define CGI_RELAY_IDLE_MS 1000				// the server's idle callback runs at least this often while nothing arrives
+
+// Forwarded by the client when they are set
+#define CGI_RELAY_VARIABLES { "CONTENT_LENGTH", "CONTENT_TYPE", "REQUEST_METHOD", "QUERY_STRING", "REMOTE_ADDR", 0 }
+
+class CGIRelayRequest
+{
+public:
+
+	// 0 if the variable was not forwarded
+	inline const char* GetVariable(const char* name) const
+	{
+		std::map<std::string, std::string>::const_iterator it = m_variables.find(name);
+		if (it == m_variables.end())
+			return 0;
+
+		return it->second.c_str();
+	}
+
+	inline void SetVariable(const char* name, const char* value)
+	{
+		m_variables[name] = value;
+	}
+
+	// The variables of CGI_RELAY_VARIABLES which are set in this process
+	inline void SetVariablesFromEnvironment(void)
+	{
+		const char* names[] = CGI_RELAY_VARIABLES;
+		for (int i = 0; names[i]; i++)
+		{
+			const char* value = getenv(names[i]);
+			if (value)
+				SetVariable(names[i], value);
+		}
+	}
+
+	inline const std::string& GetContent(void) const
+	{
+		return m_content;
+	}
+
+	inline void SetContent(const std::string& content)
+	{
+		m_content = content;
+	}
+
+	inline bool Write(socket_t s) const
+	{
+		std::string b;
+		append_uint32(b, (uint32_t)m_variables.size());
+
+		for (std::map<std::string, std::string>::const_iterator it = m_variables.begin(); it != m_variables.end(); it++)
+		{
+			append_uint32(b, (uint32_t)(it->first.length() + 1 + it->second.length()));
+			b += it->first;
+			b += "=";
+			b += it->second;
+		}
+
+		append_uint32(b, (uint32_t)m_content.length());
+		b += m_content;
+
+		return socket_send_all(s, b.data(), b.length());
+	}
+
+	inline bool Read(socket_t s, std::string& err_msg)
+	{
+		m_variables.clear();
+		m_content.clear();
+
+		uint32_t nvariables;
+		if (read_uint32(s, nvariables) == false || nvariables > CGI_RELAY_MAX_VARIABLES)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "invalid request";
+			return false;
+		}
+
+		std::string item;
+		for (uint32_t i = 0; i < nvariables; i++)
+		{
+			size_t eq;
+			if (read_string(s, item) == false || (eq = item.find('=')) == std::string::npos)
+			{
+				ERROR_LOCATION(err_msg);
+				err_msg += "invalid request variable";
+				return false;
+			}
+
+			m_variables[item.substr(0, eq)] = item.substr(eq + 1);
+		}
+
+		if (read_string(s, m_content) == false)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "invalid request content";
+			return false;
+		}
+
+		return true;
+	}
+
+private:
+
+	std::map<std::string, std::string> m_variables;
+	std::string m_content;
+
+	static inline void append_uint32(std::string& b, uint32_t v)
+	{
+		b.append((const char*)&v, sizeof(v));
+	}
+
+	static inline bool read_uint32(socket_t s, uint32_t& v)
+	{
+		return socket_recv_all(s, &v, sizeof(v));
+	}
+
+	static inline bool read_string(socket_t s, std::string& str)
+	{
+		uint32_t len;
+		if (read_uint32(s, len) == false || len > CGI_RELAY_MAX_BYTES)
+			return false;
+
+		str.resize(len);
+		return len == 0 || socket_recv_all(s, &str[0], len);
+	}
+};
+
+// Client side. connected is false if the server could not be reached, the request has not been handled then
+// and the caller may handle it itself. Once connected, a failure means the outcome of the request is unknown.
+inline bool cgi_relay_forward(const char* address, const CGIRelayRequest& request, std::string& output, bool& connected, std::string& err_msg)
+{
+	connected = false;
+
+	socket_t s;
+	if (socket_connect(address, s, err_msg) == false)
+		return false;
+
+	connected = true;
+	socket_set_timeout(s, CGI_RELAY_IO_TIMEOUT_MS);
+
+	if (request.Write(s) == false)
+	{
+		socket_close(s);
+		ERROR_LOCATION(err_msg);
+		socket_append_error(err_msg, "send", address);
+		return false;
+	}
+
+	// The request is complete, the server reads up to the end of the connection from here on
+	shutdown(s, SHUT_WR);
+
+	char buf[0x1000];
+	while (1)
+	{
+		ssize_t n = recv(s, buf, sizeof(buf), 0);
+		if (n > 0)
+		{
+			output.append(buf, n);
+			continue;
+		}
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n < 0)
+		{
+			socket_close(s);
+			ERROR_LOCATION(err_msg);
+			socket_append_error(err_msg, "recv", address);
+			return false;
+		}
+
+		break;
+	}
+
+	socket_close(s);
+	return true;
+}
+
+// Server side - one connection at a time, in the thread which calls Run().
+//
+// The handler is called as handler(const CGIRelayRequest&, string& output) for each request, and as handler.Idle()
+// whenever nothing has arrived for CGI_RELAY_IDLE_MS.
+class CGIRelayServer
+{
+public:
+
+	inline CGIRelayServer(void)
+	{
+		m_listen = INVALID_SOCKET_T;
+	}
+
+	inline ~CGIRelayServer(void)
+	{
+		Close();
+	}
+
+	inline bool Open(const char* address, std::string& err_msg)
+	{
+		Close();
+
+		if (socket_listen(address, m_listen, err_msg) == false)
+			return false;
+
+		m_address = address;
+		return true;
+	}
+
+	inline void Close(void)
+	{
+		if (m_listen == INVALID_SOCKET_T)
+			return;
+
+		socket_close(m_listen);
+		m_listen = INVALID_SOCKET_T;
+
+		if (socket_is_unix_address(m_address.c_str()))
+			unlink(m_address.c_str());
+	}
+
+	// Returns true when a stop signal has been caught (see socket_catch_stop_signals()), false on error
+	template <class HANDLER> inline bool Run(HANDLER& handler, std::string& err_msg)
+	{
+		Connection<HANDLER> connection;
+		connection.handler = &handler;
+
+		return socket_serve_sequentially(m_listen, CGI_RELAY_IDLE_MS, CGI_RELAY_IO_TIMEOUT_MS, connection, err_msg);
+	}
+
+private:
+
+	// Not copyable, the listening socket is owned by exactly one object
+	CGIRelayServer(const CGIRelayServer&);
+	CGIRelayServer& operator = (const CGIRelayServer&);
+
+	template <class HANDLER> struct Connection
+	{
+		HANDLER* handler;
+
+		inline void Serve(socket_t s)
+		{
+			CGIRelayRequest request;
+			std::string err_msg;
+			if (request.Read(s, err_msg) == false)
+				return;
+
+			std::string output;
+			(*handler)(request, output);
+			socket_send_all(s, output.data(), output.length());
+		}
+
+		inline void Idle(void)
+		{
+			handler->Idle();
+		}
+	};
+
+	socket_t m_listen;
+	std::string m_address;
+};
+
+#endif
@@ -0,0 +1,123 @@
+// Copyright (c) AlgoMachines
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#define CRC32C_SSE42
+#endif
+
+#pragma once
+
+#if defined(CRC32C_SSE42) && !defined(_MSC_VER)
+#define CRC32C_TARGET_SSE42 __attribute__((target("sse4.2")))
+#else
+#define CRC32C_TARGET_SSE42
+#endif
+
+// CRC-32C (Castagnoli polynomial, reflected 0x82F63B78) as used by iSCSI / ext4 / leveldb.
+//
+// Uses the SSE4.2 crc32 instruction 8 bytes at a time when the CPU has it, checked once at run time (cpuid), so the
+// builds need no arch flags. A byte wise table lookup otherwise - both give the same result.
+class CRC32C
+{
+public:
+
+	// crc is the result for the preceding bytes when a checksum is computed in pieces, 0 to start
+	static inline uint32_t Compute(const void* data, size_t n, uint32_t crc = 0)
+	{
+#ifdef CRC32C_SSE42
+		if (has_sse42())
+			return ~compute_sse42((const uint8_t*)data, n, ~crc);
+#endif
+		return ~compute_table((const uint8_t*)data, n, ~crc);
+	}
+
+private:
+
+#ifdef CRC32C_SSE42
+	static inline bool detect_sse42(void)
+	{
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 1);
+		return (info[2] & (1 << 20)) != 0;
+#else
+		return __builtin_cpu_supports("sse4.2") != 0;
+#endif
+	}
+
+	static inline bool has_sse42(void)
+	{
+		static const bool supported = detect_sse42();
+		return supported;
+	}
+
+	static CRC32C_TARGET_SSE42 inline uint32_t compute_sse42(const uint8_t* b, size_t n, uint32_t c)
+	{
+#if defined(_M_X64) || defined(__x86_64__)
+		uint64_t c64 = c;
+		while (n >= 8)
+		{
+			uint64_t v;
+			memcpy(&v, b, 8);
+			c64 = _mm_crc32_u64(c64, v);
+			b += 8;
+			n -= 8;
+		}
+		c = (uint32_t)c64;
+#endif
+		while (n >= 4)
+		{
+			uint32_t v;
+			memcpy(&v, b, 4);
+			c = _mm_crc32_u32(c, v);
+			b += 4;
+			n -= 4;
+		}
+
+		while (n--)
+			c = _mm_crc32_u8(c, *b++);
+
+		return c;
+	}
+#endif
+
+	static inline uint32_t compute_table(const uint8_t* b, size_t n, uint32_t c)
+	{
+		const uint32_t* table = get_table();
+		while (n--)
+			c = table[(c ^ *b++) & 0xFF] ^ (c >> 8);
+
+		return c;
+	}
+
+	struct Table
+	{
+		uint32_t entries[256];
+
+		inline Table(void)
+		{
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				uint32_t c = i;
+				for (int k = 0; k < 8; k++)
+					c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : (c >> 1);
+				entries[i] = c;
+			}
+		}
+	};
+
+	static inline const uint32_t* get_table(void)
+	{
+		static const Table table;
+		return table.entries;
+	}
+};
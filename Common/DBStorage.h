@@ -0,0 +1,91 @@
+// Copyright (c) AlgoMachines
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "SimpleDB.hpp"
+#include "BTreeDB.hpp"
+
+#pragma once
+
+// Storage policies - how a database keeps its records in memory and on disk. A policy names its engine class
+// (Engine<RECORD_CLASS>::Type) and sets the engine's storage options in Configure().
+//
+// StorageDB<RECORD_CLASS, POLICY> is the engine configured by the policy, so a database picks its storage with a
+// typedef. The engines share the record API (GetRecord, UpdateRecord, RemoveRecord, MarkRecordChanged, GetNumRecords,
+// LoadFromFile, SaveToFile, SaveChangedRecords, static DeleteFiles). SimpleDB and BTreeDB also share the API of a file which several
+// processes change records of in place (CanSaveInPlace, GetRecordRange, ReloadRecord, Refresh). Configure() only uses EnableFileMapping / EnableLog / EnableRuns,
+// so the SimpleDB policies also apply to the composed engines (IndexedDB, SegmentedDB, ShardedDB).
+
+// Sorted vector, loaded in full and rewritten in full by every save
+struct SimpleDBVectorStorage
+{
+	template <class RECORD_CLASS> struct Engine
+	{
+		typedef SimpleDB<RECORD_CLASS> Type;
+	};
+
+	template <class DB> static inline void Configure(DB& db)
+	{
+		db.EnableFileMapping(false);
+		db.EnableLog(false);
+		db.EnableRuns(false);
+	}
+};
+
+// Sorted array served from a private mapping of the file, copied into memory at the first insert or remove
+struct SimpleDBMappedStorage
+{
+	template <class RECORD_CLASS> struct Engine
+	{
+		typedef SimpleDB<RECORD_CLASS> Type;
+	};
+
+	template <class DB> static inline void Configure(DB& db)
+	{
+		db.EnableFileMapping(true);
+		db.EnableLog(false);
+		db.EnableRuns(false);
+	}
+};
+
+// Log structured - the mapped base file is only rewritten when the sorted runs are merged, saves append
+// to <file>.log, which is collapsed into a sorted run when it is full
+struct SimpleDBLogStorage
+{
+	template <class RECORD_CLASS> struct Engine
+	{
+		typedef SimpleDB<RECORD_CLASS> Type;
+	};
+
+	template <class DB> static inline void Configure(DB& db)
+	{
+		db.EnableFileMapping(true);
+		db.EnableLog(true);
+		db.EnableRuns(true);
+	}
+};
+
+// Paged B+tree, reads and writes only the pages on the path to a record
+struct BTreeStorage
+{
+	template <class RECORD_CLASS> struct Engine
+	{
+		typedef BTreeDB<RECORD_CLASS> Type;
+	};
+
+	template <class DB> static inline void Configure(DB&)
+	{
+	}
+};
+
+template <class RECORD_CLASS, class POLICY> class StorageDB : public POLICY::template Engine<RECORD_CLASS>::Type
+{
+public:
+
+	typedef typename POLICY::template Engine<RECORD_CLASS>::Type EngineType;
+
+	inline StorageDB(void)
+	{
+		POLICY::Configure(*this);
+	}
+};
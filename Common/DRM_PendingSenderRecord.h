@@ -0,0 +1,128 @@
+// Copyright (c) AlgoMachines
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "FixedKey.h"
+
+#pragma once
+
+// Pending message summary of one sender - the number of its undelivered messages and the
+// message shards which hold them (bit k of the shard mask is shard k)
+class DRM_PendingSenderRecord
+{
+public:
+
+	inline DRM_PendingSenderRecord(void)
+	{
+		Zero();
+	}
+
+	inline void Zero(void)
+	{
+		ZERO(m_hashed_ID_Sender);
+		m_NPending = 0;
+		m_Reserved = 0;
+		m_ShardMask = 0;
+	}
+
+	static uint32_t GetSizeBytes(void)
+	{
+		return sizeof(DRM_PendingSenderRecord);
+	}
+
+	// Three way comparison of the record keys
+	inline int Compare(const DRM_PendingSenderRecord& rec) const
+	{
+		return FixedKey<sizeof(m_hashed_ID_Sender)>::Compare(m_hashed_ID_Sender, rec.m_hashed_ID_Sender);
+	}
+
+	// Leading 8 bytes of the sender as a big endian integer, ordered the same way as Compare()
+	inline uint64_t GetKeyPrefix(void) const
+	{
+		return FixedKey<sizeof(m_hashed_ID_Sender)>::GetPrefix(m_hashed_ID_Sender);
+	}
+
+	inline bool operator < (const DRM_PendingSenderRecord& rec) const
+	{
+		return Compare(rec) < 0;
+	}
+
+	inline bool HasSameData(const DRM_PendingSenderRecord& rec) const
+	{
+		if (memcmp(this, &rec, sizeof(DRM_PendingSenderRecord)))
+			return false;
+
+		return true;
+	}
+
+	inline bool Assign(const DRM_PendingSenderRecord& rec, string& err_msg)
+	{
+		memmove(this, &rec, sizeof(DRM_PendingSenderRecord));
+		return true;
+	}
+
+	inline uint32_t LoadFromBuffer(const void* b)
+	{
+		memmove(this, b, sizeof(DRM_PendingSenderRecord));
+		return sizeof(DRM_PendingSenderRecord);
+	}
+
+	inline bool Update(const DRM_PendingSenderRecord& rec, string& err_msg) const
+	{
+		m_NPending = rec.m_NPending;
+		m_ShardMask = rec.m_ShardMask;
+		return true;
+	}
+
+	inline void SetHashedIDSender(const void* buf)
+	{
+		memmove(m_hashed_ID_Sender, buf, sizeof(m_hashed_ID_Sender));
+	}
+
+	inline const void* GetHashedIDSender(void) const
+	{
+		return m_hashed_ID_Sender;
+	}
+
+	inline uint32_t GetNPending(void) const
+	{
+		return m_NPending;
+	}
+
+	inline void SetNPending(uint32_t n) const
+	{
+		m_NPending = n;
+	}
+
+	inline uint64_t GetShardMask(void) const
+	{
+		return m_ShardMask;
+	}
+
+	inline void SetShardMask(uint64_t mask) const
+	{
+		m_ShardMask = mask;
+	}
+
+	inline const char* Report(string& s) const
+	{
+		string tmp;
+		bin_to_ascii_char(m_hashed_ID_Sender, sizeof(m_hashed_ID_Sender), tmp);
+		s += "hashed_ID_Sender: ";
+		s += tmp.c_str();
+		s += "\n";
+
+		char tmp1[128];
+		sprintf(tmp1, "NPending: %lu ShardMask: %016llx\n", (unsigned long)m_NPending, (unsigned long long)m_ShardMask);
+		s += tmp1;
+
+		return s.c_str();
+	}
+
+private:
+
+	uint8_t m_hashed_ID_Sender[32];
+	mutable uint32_t m_NPending;
+	uint32_t m_Reserved;
+	mutable uint64_t m_ShardMask;
+};
@@ -2,17 +2,52 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "FixedKey.h"
+
 #pragma once
 
 class DRM_PrivateMessageRecord
 {
 public:
 
+	// Secondary indexes maintained by IndexedDB, index 0 is the primary sort order (receiver, sender, timestamp)
+	static uint32_t GetNumIndexes(void)
+	{
+		return 2;
+	}
+
 	static uint32_t SenderIDIndexNum(void)
 	{
 		return 1;
 	}
 
+	static uint32_t TimestampIndexNum(void)
+	{
+		return 2;
+	}
+
+	// Three way comparison of the key of secondary index index_num
+	inline int CompareIndexKey(uint32_t index_num, const DRM_PrivateMessageRecord& rec) const
+	{
+		if (index_num == SenderIDIndexNum())
+			return FixedKey<sizeof(m_hashed_ID_Sender)>::Compare(m_hashed_ID_Sender, rec.m_hashed_ID_Sender);
+
+		if (index_num == TimestampIndexNum())
+		{
+			if (m_Timestamp_ms < rec.m_Timestamp_ms) return -1;
+			if (m_Timestamp_ms > rec.m_Timestamp_ms) return 1;
+			return 0;
+		}
+
+		return 0;
+	}
+
+	// Three way comparison of the receiver, the leading key field - all messages for a receiver are contiguous
+	static int CompareReceiver(const DRM_PrivateMessageRecord& a, const DRM_PrivateMessageRecord& b)
+	{
+		return FixedKey<sizeof(a.m_hashed_ID_Receiver)>::Compare(a.m_hashed_ID_Receiver, b.m_hashed_ID_Receiver);
+	}
+
 	inline DRM_PrivateMessageRecord(void)
 	{
 		Zero();
@@ -26,54 +61,40 @@ public:
 		ZERO(m_Message);
 	}
 
-	inline bool operator < (const DRM_PrivateMessageRecord& rec) const
+	// Three way comparison of the record keys - receiver, sender, timestamp
+	inline int Compare(const DRM_PrivateMessageRecord& rec) const
 	{
-		int state = memcmp(m_hashed_ID_Receiver, rec.m_hashed_ID_Receiver, sizeof(m_hashed_ID_Receiver));
-		if (state < 0)
-			return true;
+		int state = FixedKey<sizeof(m_hashed_ID_Receiver)>::Compare(m_hashed_ID_Receiver, rec.m_hashed_ID_Receiver);
+		if (state)
+			return state;
 
-		if (state > 0)
-			return false;
-
-		state = memcmp(m_hashed_ID_Sender, rec.m_hashed_ID_Sender, sizeof(m_hashed_ID_Sender));
-		if (state < 0)
-			return true;
-
-		if (state > 0)
-			return false;
+		state = FixedKey<sizeof(m_hashed_ID_Sender)>::Compare(m_hashed_ID_Sender, rec.m_hashed_ID_Sender);
+		if (state)
+			return state;
 
 		if (m_Timestamp_ms < rec.m_Timestamp_ms)
-			return true;		
-		
+			return -1;
+
 		if (m_Timestamp_ms > rec.m_Timestamp_ms)
-			return false;
+			return 1;
 
-		return false; // equal
+		return 0; // equal
 	}
 
-	inline bool operator > (const DRM_PrivateMessageRecord& rec) const
+	// Leading 8 bytes of the receiver as a big endian integer, ordered the same way as Compare()
+	inline uint64_t GetKeyPrefix(void) const
 	{
-		int state = memcmp(m_hashed_ID_Receiver, rec.m_hashed_ID_Receiver, sizeof(m_hashed_ID_Receiver));
-		if (state > 0)
-			return true;
-
-		if (state < 0)
-			return false;
-
-		state = memcmp(m_hashed_ID_Sender, rec.m_hashed_ID_Sender, sizeof(m_hashed_ID_Sender));
-		if (state > 0)
-			return true;
-
-		if (state < 0)
-			return false;
-
-		if (m_Timestamp_ms > rec.m_Timestamp_ms)
-			return true;
+		return FixedKey<sizeof(m_hashed_ID_Receiver)>::GetPrefix(m_hashed_ID_Receiver);
+	}
 
-		if (m_Timestamp_ms < rec.m_Timestamp_ms)
-			return false;
+	inline bool operator < (const DRM_PrivateMessageRecord& rec) const
+	{
+		return Compare(rec) < 0;
+	}
 
-		return false; // equal
+	inline bool operator > (const DRM_PrivateMessageRecord& rec) const
+	{
+		return Compare(rec) > 0;
 	}
 
 	inline bool HasSameData(const DRM_PrivateMessageRecord& rec) const
@@ -202,7 +223,7 @@ public:
 		s += "\n";
 
 		char tmp1[128];
-		sprintf(tmp1, "Timestamp_ms: %llu\n", m_Timestamp_ms);
+		sprintf(tmp1, "Timestamp_ms: %llu\n", (unsigned long long)m_Timestamp_ms);
 		s += tmp1;
 
 		s += (const char*)m_Message;
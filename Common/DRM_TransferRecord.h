@@ -2,6 +2,8 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "FixedKey.h"
+
 #pragma once
 
 /*
@@ -59,20 +61,26 @@ public:
 		return true;
 	}
 
-	inline const bool operator < (const DRM_TransferRecord& rec) const
+	// Three way comparison of the record keys
+	inline int Compare(const DRM_TransferRecord& rec) const
 	{
-		if (memcmp(m_ID, rec.m_ID, sizeof(m_ID)) < 0)
-			return true;
+		return FixedKey<sizeof(m_ID)>::Compare(m_ID, rec.m_ID);
+	}
 
-		return false;
+	// Leading 8 bytes of the ID as a big endian integer, ordered the same way as Compare()
+	inline uint64_t GetKeyPrefix(void) const
+	{
+		return FixedKey<sizeof(m_ID)>::GetPrefix(m_ID);
 	}
 
-	inline const bool operator > (const DRM_TransferRecord& rec) const
+	inline const bool operator < (const DRM_TransferRecord& rec) const
 	{
-		if (memcmp(m_ID, rec.m_ID, sizeof(m_ID)) > 0)
-			return true;
+		return Compare(rec) < 0;
+	}
 
-		return false;
+	inline const bool operator > (const DRM_TransferRecord& rec) const
+	{
+		return Compare(rec) > 0;
 	}
 
 	inline uint32_t LoadFromBuffer(const void* buf)
@@ -0,0 +1,509 @@
+// Copyright (c) AlgoMachines
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "socket_tools.h"
+#include "time_tools.h"
+
+#pragma once
+
+// FastCGI 1.0 record types, roles and status values
+#define FCGI_VERSION_1 1
+
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_ABORT_REQUEST 2
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_DATA 8
+#define FCGI_GET_VALUES 9
+#define FCGI_GET_VALUES_RESULT 10
+#define FCGI_UNKNOWN_TYPE 11
+
+#define FCGI_KEEP_CONN 1
+
+#define FCGI_RESPONDER 1
+
+#define FCGI_REQUEST_COMPLETE 0
+#define FCGI_CANT_MPX_CONN 1
+#define FCGI_OVERLOADED 2
+#define FCGI_UNKNOWN_ROLE 3
+
+// The web server passes the listening socket as stdin when it starts the application
+#define FCGI_LISTENSOCK_FILENO 0
+
+#define FASTCGI_MAX_RECORD_CONTENT 0xFFF8	// STDOUT records are split at a multiple of 8, so no padding is needed
+#define FASTCGI_MAX_INPUT_BYTES 0x100000	// PARAMS + STDIN of one request, a connection which sends more is closed
+#define FASTCGI_MAX_CONNECTIONS 64			// kept open for the web server (FCGI_KEEP_CONN), further ones are closed after their request
+#define FASTCGI_IO_TIMEOUT_MS 10000			// a web server which stops sending a request, or reading the response, is given up on
+#define FASTCGI_IDLE_TIMEOUT_MS 60000		// a kept connection without a request for this long is closed
+
+// A request, as gathered from its FCGI_PARAMS and FCGI_STDIN streams
+class FastCGIRequest
+{
+public:
+
+	inline void Clear(void)
+	{
+		m_params.clear();
+		m_content.clear();
+	}
+
+	// 0 if the web server has not passed the parameter
+	inline const char* GetParam(const char* name) const
+	{
+		std::map<std::string, std::string>::const_iterator it = m_params.find(name);
+		if (it == m_params.end())
+			return 0;
+
+		return it->second.c_str();
+	}
+
+	// The request body (stdin of a CGI program)
+	inline const std::string& GetContent(void) const
+	{
+		return m_content;
+	}
+
+private:
+
+	friend class FastCGIServer;
+
+	std::map<std::string, std::string> m_params;
+	std::string m_content;
+};
+
+// FastCGI responder. Requests are served one at a time and a connection carries one request at a time
+// (FCGI_MPXS_CONNS is 0), so requests reach the handler in order, as they would reach a CGI program. The connections
+// which the web server keeps (FCGI_KEEP_CONN) are polled together with the listening socket, a request is read from
+// whichever is ready first.
+//
+// The handler is called as handler(const FastCGIRequest&, string& response), the response is what a CGI program
+// would print - the header lines, an empty line and the body.
+class FastCGIServer
+{
+public:
+
+	inline FastCGIServer(void)
+	{
+		m_listen = INVALID_SOCKET_T;
+		m_owns_listen = false;
+	}
+
+	inline ~FastCGIServer(void)
+	{
+		Close();
+	}
+
+	// True if the process was started by a web server as a FastCGI application - stdin is then a listening socket
+	static inline bool IsListenSocketInherited(void)
+	{
+#ifdef WIN32
+		return false;
+#else
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		return getpeername(FCGI_LISTENSOCK_FILENO, (struct sockaddr*)&addr, &len) != 0 && errno == ENOTCONN;
+#endif
+	}
+
+	// address == 0 uses the inherited listening socket, otherwise the application listens on address (host:port, or
+	// a unix socket path) and is started on its own, e.g. by spawn-fcgi or a service manager
+	inline bool Open(const char* address, std::string& err_msg)
+	{
+		Close();
+
+		if (socket_startup(err_msg) == false)
+			return false;
+
+		if (address == 0)
+		{
+			if (IsListenSocketInherited() == false)
+			{
+				ERROR_LOCATION(err_msg);
+				err_msg += "stdin is not a listening socket";
+				return false;
+			}
+
+			m_listen = FCGI_LISTENSOCK_FILENO;
+			m_owns_listen = false;
+			return true;
+		}
+
+		if (socket_listen(address, m_listen, err_msg) == false)
+			return false;
+
+		m_owns_listen = true;
+		return true;
+	}
+
+	inline void Close(void)
+	{
+		close_connections();
+
+		if (m_owns_listen)
+			socket_close(m_listen);
+
+		m_listen = INVALID_SOCKET_T;
+		m_owns_listen = false;
+	}
+
+	// Returns true when a stop signal has been caught (see socket_catch_stop_signals()), false if poll() or accept() fails
+	template <class HANDLER> inline bool Run(HANDLER& handler, std::string& err_msg)
+	{
+		bool status = true;
+		std::vector<struct pollfd> fds;
+
+		while (socket_stop_requested() == false)
+		{
+			fds.resize(1 + m_connections.size());
+			fds[0].fd = m_listen;
+			for (size_t i = 0; i < m_connections.size(); i++)
+				fds[1 + i].fd = m_connections[i].s;
+
+			for (size_t i = 0; i < fds.size(); i++)
+			{
+				fds[i].events = POLLIN;
+				fds[i].revents = 0;
+			}
+
+			int n = socket_poll(&fds[0], fds.size(), 1000);
+			if (n < 0)
+			{
+				if (socket_interrupted())
+					continue;
+
+				ERROR_LOCATION(err_msg);
+				socket_append_error(err_msg, "poll", 0);
+				status = false;
+				break;
+			}
+
+			// The kept connections, from the last so that they can be removed
+			uint64_t t_now = get_time_ms();
+			for (size_t i = m_connections.size(); i-- > 0;)
+			{
+				Connection& c = m_connections[i];
+				if (fds[1 + i].revents)
+				{
+					if (serve_connection(c.s, handler))
+					{
+						c.t_last_ms = get_time_ms();
+						continue;
+					}
+				}
+				else if (t_now < c.t_last_ms + FASTCGI_IDLE_TIMEOUT_MS)
+				{
+					continue;
+				}
+
+				socket_close(c.s);
+				m_connections.erase(m_connections.begin() + i);
+			}
+
+			if ((fds[0].revents & POLLIN) == 0)
+				continue;
+
+			socket_t s;
+			if (socket_accept(m_listen, s, err_msg) == false)
+			{
+				if (socket_interrupted())
+					continue;
+
+				status = false;
+				break;
+			}
+
+			socket_set_timeout(s, FASTCGI_IO_TIMEOUT_MS);
+			if (serve_connection(s, handler) && m_connections.size() < FASTCGI_MAX_CONNECTIONS)
+			{
+				Connection c;
+				c.s = s;
+				c.t_last_ms = get_time_ms();
+				m_connections.push_back(c);
+				continue;
+			}
+
+			socket_close(s);
+		}
+
+		close_connections();
+		return status;
+	}
+
+private:
+
+	// Not copyable, the listening socket is owned by exactly one object
+	FastCGIServer(const FastCGIServer&);
+	FastCGIServer& operator = (const FastCGIServer&);
+
+	struct Header
+	{
+		uint8_t version;
+		uint8_t type;
+		uint8_t request_id_b1;
+		uint8_t request_id_b0;
+		uint8_t content_length_b1;
+		uint8_t content_length_b0;
+		uint8_t padding_length;
+		uint8_t reserved;
+
+		inline uint16_t GetRequestID(void) const
+		{
+			return (uint16_t)((request_id_b1 << 8) | request_id_b0);
+		}
+
+		inline uint16_t GetContentLength(void) const
+		{
+			return (uint16_t)((content_length_b1 << 8) | content_length_b0);
+		}
+	};
+
+	// A connection which the web server keeps open for further requests
+	struct Connection
+	{
+		socket_t s;
+		uint64_t t_last_ms;
+	};
+
+	socket_t m_listen;
+	bool m_owns_listen;
+	std::vector<Connection> m_connections;
+
+	inline void close_connections(void)
+	{
+		for (size_t i = 0; i < m_connections.size(); i++)
+			socket_close(m_connections[i].s);
+
+		m_connections.clear();
+	}
+
+	static inline bool read_record(socket_t s, Header& header, std::vector<uint8_t>& content)
+	{
+		if (socket_recv_all(s, &header, sizeof(header)) == false || header.version != FCGI_VERSION_1)
+			return false;
+
+		content.resize(header.GetContentLength() + header.padding_length);
+		if (content.size() && socket_recv_all(s, &content[0], content.size()) == false)
+			return false;
+
+		content.resize(header.GetContentLength());
+		return true;
+	}
+
+	static inline bool write_record(socket_t s, uint8_t type, uint16_t request_id, const void* data, size_t n)
+	{
+		Header header;
+		memset(&header, 0, sizeof(header));
+		header.version = FCGI_VERSION_1;
+		header.type = type;
+		header.request_id_b1 = (uint8_t)(request_id >> 8);
+		header.request_id_b0 = (uint8_t)request_id;
+		header.content_length_b1 = (uint8_t)(n >> 8);
+		header.content_length_b0 = (uint8_t)n;
+
+		if (socket_send_all(s, &header, sizeof(header)) == false)
+			return false;
+
+		return n == 0 || socket_send_all(s, data, n);
+	}
+
+	static inline bool write_end_request(socket_t s, uint16_t request_id, uint32_t app_status, uint8_t protocol_status)
+	{
+		uint8_t body[8];
+		memset(body, 0, sizeof(body));
+		body[0] = (uint8_t)(app_status >> 24);
+		body[1] = (uint8_t)(app_status >> 16);
+		body[2] = (uint8_t)(app_status >> 8);
+		body[3] = (uint8_t)app_status;
+		body[4] = protocol_status;
+
+		return write_record(s, FCGI_END_REQUEST, request_id, body, sizeof(body));
+	}
+
+	// The response as a stream of STDOUT records, ended by an empty one
+	static inline bool write_stdout(socket_t s, uint16_t request_id, const std::string& response)
+	{
+		for (size_t pos = 0; pos < response.length(); pos += FASTCGI_MAX_RECORD_CONTENT)
+		{
+			size_t n = response.length() - pos;
+			if (n > FASTCGI_MAX_RECORD_CONTENT)
+				n = FASTCGI_MAX_RECORD_CONTENT;
+
+			if (write_record(s, FCGI_STDOUT, request_id, response.data() + pos, n) == false)
+				return false;
+		}
+
+		return write_record(s, FCGI_STDOUT, request_id, 0, 0);
+	}
+
+	// Name-value pair lengths are 1 byte, or 4 bytes with the high bit set
+	static inline bool read_length(const std::vector<uint8_t>& b, size_t& pos, uint32_t& len)
+	{
+		if (pos >= b.size())
+			return false;
+
+		if ((b[pos] & 0x80) == 0)
+		{
+			len = b[pos++];
+			return true;
+		}
+
+		if (pos + 4 > b.size())
+			return false;
+
+		len = ((uint32_t)(b[pos] & 0x7F) << 24) | ((uint32_t)b[pos + 1] << 16) | ((uint32_t)b[pos + 2] << 8) | b[pos + 3];
+		pos += 4;
+		return true;
+	}
+
+	static inline bool parse_params(const std::vector<uint8_t>& b, std::map<std::string, std::string>& params)
+	{
+		size_t pos = 0;
+		while (pos < b.size())
+		{
+			uint32_t name_len, value_len;
+			if (read_length(b, pos, name_len) == false || read_length(b, pos, value_len) == false)
+				return false;
+
+			if (name_len > b.size() - pos || value_len > b.size() - pos - name_len)
+				return false;
+
+			std::string name((const char*)&b[pos], name_len); pos += name_len;
+			params[name].assign((const char*)&b[pos], value_len); pos += value_len;
+		}
+
+		return true;
+	}
+
+	static inline void append_pair(std::vector<uint8_t>& b, const char* name, const char* value)
+	{
+		// The names and values of FCGI_GET_VALUES_RESULT are all short
+		b.push_back((uint8_t)strlen(name));
+		b.push_back((uint8_t)strlen(value));
+		b.insert(b.end(), name, name + strlen(name));
+		b.insert(b.end(), value, value + strlen(value));
+	}
+
+	static inline bool write_get_values_result(socket_t s, const std::vector<uint8_t>& query)
+	{
+		std::map<std::string, std::string> names;
+		parse_params(query, names);
+
+		std::vector<uint8_t> b;
+		char max_conns[16];
+		sprintf(max_conns, "%d", FASTCGI_MAX_CONNECTIONS);
+
+		if (names.find("FCGI_MAX_CONNS") != names.end()) append_pair(b, "FCGI_MAX_CONNS", max_conns);
+		if (names.find("FCGI_MAX_REQS") != names.end()) append_pair(b, "FCGI_MAX_REQS", "1");
+		if (names.find("FCGI_MPXS_CONNS") != names.end()) append_pair(b, "FCGI_MPXS_CONNS", "0");
+
+		return write_record(s, FCGI_GET_VALUES_RESULT, 0, b.size() ? &b[0] : 0, b.size());
+	}
+
+	// Serves one request, and the management records before it. Returns true if the connection is kept for further
+	// requests (FCGI_KEEP_CONN), false when it is to be closed - the web server has closed it, or on error.
+	template <class HANDLER> inline bool serve_connection(socket_t s, HANDLER& handler)
+	{
+		FastCGIRequest request;
+		std::vector<uint8_t> params;
+		uint16_t request_id = 0;
+		bool keep_conn = false;
+
+		Header header;
+		std::vector<uint8_t> content;
+
+		while (read_record(s, header, content))
+		{
+			uint16_t id = header.GetRequestID();
+
+			// Management records
+			if (id == 0)
+			{
+				if (header.type == FCGI_GET_VALUES)
+				{
+					if (write_get_values_result(s, content) == false)
+						return false;
+				}
+				else
+				{
+					uint8_t body[8];
+					memset(body, 0, sizeof(body));
+					body[0] = header.type;
+					if (write_record(s, FCGI_UNKNOWN_TYPE, 0, body, sizeof(body)) == false)
+						return false;
+				}
+				continue;
+			}
+
+			if (header.type == FCGI_BEGIN_REQUEST)
+			{
+				if (content.size() < 8)
+					return false;
+
+				if (request_id)
+				{
+					if (write_end_request(s, id, 0, FCGI_CANT_MPX_CONN) == false)
+						return false;
+					continue;
+				}
+
+				uint16_t role = (uint16_t)((content[0] << 8) | content[1]);
+				keep_conn = (content[2] & FCGI_KEEP_CONN) != 0;
+
+				if (role != FCGI_RESPONDER)
+					return write_end_request(s, id, 0, FCGI_UNKNOWN_ROLE) && keep_conn;
+
+				request_id = id;
+				request.Clear();
+				params.clear();
+				continue;
+			}
+
+			// Records of a request which is not active are ignored
+			if (id != request_id)
+				continue;
+
+			if (header.type == FCGI_ABORT_REQUEST)
+				return write_end_request(s, id, 0, FCGI_REQUEST_COMPLETE) && keep_conn;
+
+			if (params.size() + request.m_content.size() + content.size() > FASTCGI_MAX_INPUT_BYTES)
+				return false;
+
+			if (header.type == FCGI_PARAMS)
+			{
+				if (content.size())
+					params.insert(params.end(), content.begin(), content.end());
+				else if (parse_params(params, request.m_params) == false)
+					return false;
+				continue;
+			}
+
+			if (header.type != FCGI_STDIN)
+				continue;
+
+			if (content.size())
+			{
+				request.m_content.append((const char*)&content[0], content.size());
+				continue;
+			}
+
+			// The empty STDIN record ends the request
+			std::string response;
+			handler(request, response);
+
+			if (write_stdout(s, id, response) == false || write_end_request(s, id, 0, FCGI_REQUEST_COMPLETE) == false)
+				return false;
+
+			return keep_conn;
+		}
+
+		return false;
+	}
+};
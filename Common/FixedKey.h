@@ -0,0 +1,150 @@
+// Copyright (c) AlgoMachines
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#include <emmintrin.h>
+#define FIXEDKEY_SSE2
+#endif
+
+#ifdef WIN32
+#include <stdlib.h>
+#include <intrin.h>
+#endif
+
+#pragma once
+
+// N byte key compared as an unsigned big endian number, i.e. in memcmp() order.
+//
+// The leading 8 bytes are loaded as one big endian 64 bit prefix, which settles almost every comparison of
+// hashed IDs with a single integer compare. When the prefixes tie the rest of the key is compared 16 bytes at a
+// time with SSE2 (every x64 target has it), 8 bytes at a time otherwise.
+//
+// FixedKey<N> has the layout of uint8_t[N], record classes which store raw byte arrays (and must keep their file
+// layout) use the static Compare() / GetPrefix() on those arrays directly.
+template <uint32_t N> class FixedKey
+{
+public:
+
+	inline int Compare(const FixedKey& key) const
+	{
+		return Compare(m_bytes, key.m_bytes);
+	}
+
+	inline uint64_t GetPrefix(void) const
+	{
+		return GetPrefix(m_bytes);
+	}
+
+	inline bool operator < (const FixedKey& key) const
+	{
+		return Compare(key) < 0;
+	}
+
+	inline bool operator == (const FixedKey& key) const
+	{
+		return Compare(key) == 0;
+	}
+
+	inline const uint8_t* GetBytes(void) const
+	{
+		return m_bytes;
+	}
+
+	inline void Set(const void* bytes)
+	{
+		memmove(m_bytes, bytes, N);
+	}
+
+	// Leading 8 bytes (zero padded for shorter keys) as a big endian integer
+	static inline uint64_t GetPrefix(const void* key)
+	{
+		if (N < 8)
+		{
+			uint8_t b[8];
+			memset(b, 0, sizeof(b));
+			memcpy(b, key, N);
+			return load_be64(b);
+		}
+
+		return load_be64((const uint8_t*)key);
+	}
+
+	// Three way comparison, same sign as memcmp(a, b, N)
+	static inline int Compare(const void* a, const void* b)
+	{
+		if (N < 8)
+			return memcmp(a, b, N);
+
+		uint64_t ka = load_be64((const uint8_t*)a);
+		uint64_t kb = load_be64((const uint8_t*)b);
+		if (ka != kb)
+			return ka < kb ? -1 : 1;
+
+		return compare_bytes((const uint8_t*)a + 8, (const uint8_t*)b + 8, N - 8);
+	}
+
+private:
+
+	uint8_t m_bytes[N];
+
+	static inline uint64_t load_be64(const uint8_t* p)
+	{
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+#ifdef WIN32
+		return _byteswap_uint64(v);
+#else
+		return __builtin_bswap64(v);
+#endif
+	}
+
+	static inline uint32_t first_set_bit(uint32_t mask)
+	{
+#ifdef WIN32
+		unsigned long i;
+		_BitScanForward(&i, mask);
+		return i;
+#else
+		return __builtin_ctz(mask);
+#endif
+	}
+
+	static inline int compare_bytes(const uint8_t* a, const uint8_t* b, uint32_t n)
+	{
+		uint32_t i = 0;
+
+#ifdef FIXEDKEY_SSE2
+		for (; i + 16 <= n; i += 16)
+		{
+			__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+			__m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+			uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) ^ 0xFFFF;
+			if (mask)
+			{
+				uint32_t j = i + first_set_bit(mask);
+				return a[j] < b[j] ? -1 : 1;
+			}
+		}
+#endif
+
+		for (; i + 8 <= n; i += 8)
+		{
+			uint64_t ka = load_be64(a + i);
+			uint64_t kb = load_be64(b + i);
+			if (ka != kb)
+				return ka < kb ? -1 : 1;
+		}
+
+		for (; i < n; i++)
+		{
+			if (a[i] != b[i])
+				return a[i] < b[i] ? -1 : 1;
+		}
+
+		return 0;
+	}
+};
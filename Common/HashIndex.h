@@ -0,0 +1,187 @@
+// Copyright (c) AlgoMachines
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <string>
+#include <vector>
+
+#include "file_tools.h"
+#include "MappedFile.h"
+
+#pragma once
+
+#define HASHINDEX_MAGIC 0x58444948 // "HIDX"
+#define HASHINDEX_EMPTY 0xFFFFFFFF
+
+// Persisted open addressing hash table which maps a 64 bit record key to the index of the record in its db file.
+//
+// File layout: [Header][Slot * nslots], nslots is a power of two at least twice the number of records.
+// A slot holds the record index and a tag taken from the key hash, so colliding keys are mostly skipped
+// without touching the record. The index is only a hint - the caller compares the full key of every candidate
+// record, a stale index can cause a lookup to miss but never to return the wrong record.
+class HashIndex
+{
+public:
+
+	inline HashIndex(void)
+	{
+		m_header = 0;
+		m_slots = 0;
+	}
+
+	inline bool IsOpen(void) const
+	{
+		return m_header != 0;
+	}
+
+	inline uint32_t GetNumRecords(void) const
+	{
+		return m_header ? m_header->nrecords : 0;
+	}
+
+	// Fails if the file does not exist or does not match the record size / number of records of the db
+	inline bool Open(const char* file_name, uint32_t record_size, uint32_t nrecords, std::string& err_msg)
+	{
+		Close();
+
+		if (m_file.Open(file_name, err_msg) == false)
+			return false;
+
+		const Header* header = (const Header*)m_file.GetData();
+
+		if (m_file.GetSize() < sizeof(Header) || header->magic != HASHINDEX_MAGIC ||
+			header->record_size != record_size || header->nrecords != nrecords ||
+			header->nslots == 0 || (header->nslots & (header->nslots - 1)) ||
+			m_file.GetSize() != sizeof(Header) + (size_t)header->nslots * sizeof(Slot))
+		{
+			m_file.Close();
+			ERROR_LOCATION(err_msg);
+			err_msg += "hash index does not match the db: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		m_header = header;
+		m_slots = (const Slot*)(m_file.GetData() + sizeof(Header));
+		return true;
+	}
+
+	inline void Close(void)
+	{
+		m_header = 0;
+		m_slots = 0;
+		m_file.Close();
+	}
+
+	// Writes the index for keys[i] -> record index i
+	static inline bool Build(const char* file_name, uint32_t record_size, const std::vector<uint64_t>& keys, std::string& err_msg)
+	{
+		Header header;
+		header.magic = HASHINDEX_MAGIC;
+		header.record_size = record_size;
+		header.nrecords = (uint32_t)keys.size();
+		header.nslots = 16;
+		while (header.nslots < 2 * header.nrecords)
+			header.nslots <<= 1;
+
+		std::vector<Slot> slots;
+		slots.resize(header.nslots);
+		for (uint32_t i = 0; i < header.nslots; i++)
+		{
+			slots[i].idx = HASHINDEX_EMPTY;
+			slots[i].tag = 0;
+		}
+
+		for (uint32_t idx = 0; idx < header.nrecords; idx++)
+		{
+			uint64_t h = hash(keys[idx]);
+
+			uint32_t slot = (uint32_t)h & (header.nslots - 1);
+			while (slots[slot].idx != HASHINDEX_EMPTY)
+				slot = (slot + 1) & (header.nslots - 1);
+
+			slots[slot].idx = idx;
+			slots[slot].tag = (uint32_t)(h >> 32);
+		}
+
+		AtomicFileWriter file;
+		if (file.Open(file_name, err_msg) == false)
+			return false;
+
+		if (fwrite(&header, sizeof(header), 1, file.GetStream()) != 1 ||
+			fwrite(&slots[0], sizeof(Slot), slots.size(), file.GetStream()) != slots.size())
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "problem writing data to create file: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		return file.Commit(err_msg);
+	}
+
+	// Candidate records for key:
+	//   uint32_t slot = index.GetFirstSlot(key), idx;
+	//   while (index.GetNextCandidate(key, slot, idx)) { compare the record at idx }
+	inline uint32_t GetFirstSlot(uint64_t key) const
+	{
+		return (uint32_t)hash(key) & (m_header->nslots - 1);
+	}
+
+	inline bool GetNextCandidate(uint64_t key, uint32_t& slot, uint32_t& idx) const
+	{
+		uint32_t tag = (uint32_t)(hash(key) >> 32);
+
+		for (uint32_t nprobes = 0; nprobes < m_header->nslots; nprobes++)
+		{
+			const Slot& s = m_slots[slot];
+			slot = (slot + 1) & (m_header->nslots - 1);
+
+			if (s.idx == HASHINDEX_EMPTY)
+				return false;
+
+			if (s.tag == tag)
+			{
+				idx = s.idx;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+private:
+
+	// Not copyable, the mapping is owned by exactly one object
+	HashIndex(const HashIndex&);
+	HashIndex& operator = (const HashIndex&);
+
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t record_size;
+		uint32_t nrecords;
+		uint32_t nslots;
+	};
+
+	struct Slot
+	{
+		uint32_t idx;
+		uint32_t tag;
+	};
+
+	// MurmurHash3 64 bit finalizer, spreads keys which are not already uniformly distributed
+	static inline uint64_t hash(uint64_t key)
+	{
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdULL;
+		key ^= key >> 33;
+		key *= 0xc4ceb9fe1a85ec53ULL;
+		key ^= key >> 33;
+		return key;
+	}
+
+	MappedFile m_file;
+	const Header* m_header;
+	const Slot* m_slots;
+};
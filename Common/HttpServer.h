@@ -0,0 +1,616 @@
+// Copyright (c) AlgoMachines
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <map>
+#include <string>
+#include <vector>
+#include <ctype.h>
+
+#include "socket_tools.h"
+#include "time_tools.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/epoll.h>
+#endif
+
+#pragma once
+
+#ifdef __linux__
+
+#define HTTP_MAX_HEADER_BYTES 8192			// request line and headers, a larger request is answered with 431
+#define HTTP_MAX_CONNECTIONS 1024			// further connections are closed as they are accepted
+#define HTTP_IDLE_TIMEOUT_MS 30000			// a keep-alive connection without a request for this long is closed
+#define HTTP_MAX_EVENTS 64
+
+// A request as parsed by HttpServer, header names are lower case
+class HttpRequest
+{
+public:
+
+	inline const std::string& GetMethod(void) const
+	{
+		return m_method;
+	}
+
+	inline const std::string& GetTarget(void) const
+	{
+		return m_target;
+	}
+
+	// 0 if the header is not present, name is lower case
+	inline const char* GetHeader(const char* name) const
+	{
+		std::map<std::string, std::string>::const_iterator it = m_headers.find(name);
+		if (it == m_headers.end())
+			return 0;
+
+		return it->second.c_str();
+	}
+
+	inline const std::string& GetBody(void) const
+	{
+		return m_body;
+	}
+
+	inline bool IsKeepAlive(void) const
+	{
+		return m_keep_alive;
+	}
+
+private:
+
+	friend class HttpServer;
+
+	std::string m_method;
+	std::string m_target;
+	std::map<std::string, std::string> m_headers;
+	std::string m_body;
+	bool m_keep_alive;
+};
+
+// Single threaded HTTP/1.1 server on epoll, for clients which POST a body with a Content-Length and read the response
+// body back, e.g. through a minimal reverse proxy. Connections are kept alive, pipelined requests are answered in order -
+// each is read once the responses before it have been sent, so a connection holds at most one request of input.
+// Chunked request bodies and methods other than POST are refused.
+//
+// The handler is called as handler(const HttpRequest&, string& body) and fills in the body of a 200 response.
+// Requests are handled one at a time, in the thread which calls Run().
+class HttpServer
+{
+public:
+
+	inline HttpServer(void)
+	{
+		m_listen = INVALID_SOCKET_T;
+		m_epoll = -1;
+		m_max_content_length = 0x10000;
+		m_content_type = "text/html";
+	}
+
+	inline ~HttpServer(void)
+	{
+		Close();
+	}
+
+	// Larger bodies are answered with 413
+	inline void SetMaxContentLength(size_t max_content_length)
+	{
+		m_max_content_length = max_content_length;
+	}
+
+	inline void SetContentType(const char* content_type)
+	{
+		m_content_type = content_type;
+	}
+
+	inline bool Open(const char* address, std::string& err_msg)
+	{
+		Close();
+
+		if (socket_listen(address, m_listen, err_msg) == false)
+			return false;
+
+		if (set_nonblocking(m_listen) == false)
+		{
+			ERROR_LOCATION(err_msg);
+			socket_append_error(err_msg, "fcntl", address);
+			Close();
+			return false;
+		}
+
+		m_epoll = epoll_create1(EPOLL_CLOEXEC);
+		if (m_epoll < 0)
+		{
+			ERROR_LOCATION(err_msg);
+			socket_append_error(err_msg, "epoll_create1", address);
+			Close();
+			return false;
+		}
+
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = m_listen;
+
+		if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_listen, &ev))
+		{
+			ERROR_LOCATION(err_msg);
+			socket_append_error(err_msg, "epoll_ctl", address);
+			Close();
+			return false;
+		}
+
+		return true;
+	}
+
+	inline void Close(void)
+	{
+		for (std::map<socket_t, Connection*>::iterator it = m_connections.begin(); it != m_connections.end(); it++)
+		{
+			socket_close(it->first);
+			delete it->second;
+		}
+
+		m_connections.clear();
+
+		if (m_epoll >= 0)
+			close(m_epoll);
+
+		socket_close(m_listen);
+
+		m_epoll = -1;
+		m_listen = INVALID_SOCKET_T;
+	}
+
+	inline size_t GetNumConnections(void) const
+	{
+		return m_connections.size();
+	}
+
+	// Returns true when a stop signal has been caught (see socket_catch_stop_signals()), false if epoll fails
+	template <class HANDLER> inline bool Run(HANDLER& handler, std::string& err_msg)
+	{
+		struct epoll_event events[HTTP_MAX_EVENTS];
+
+		uint64_t t_idle_check = get_time_ms();
+
+		while (socket_stop_requested() == false)
+		{
+			int nevents = epoll_wait(m_epoll, events, HTTP_MAX_EVENTS, 1000);
+			if (nevents < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				ERROR_LOCATION(err_msg);
+				socket_append_error(err_msg, "epoll_wait", 0);
+				return false;
+			}
+
+			for (int i = 0; i < nevents; i++)
+			{
+				socket_t s = events[i].data.fd;
+
+				if (s == m_listen)
+				{
+					accept_connections();
+					continue;
+				}
+
+				std::map<socket_t, Connection*>::iterator it = m_connections.find(s);
+				if (it == m_connections.end())
+					continue;
+
+				Connection& c = *it->second;
+				c.t_last_ms = get_time_ms();
+
+				if (events[i].events & (EPOLLERR | EPOLLHUP))
+				{
+					close_connection(s);
+					continue;
+				}
+
+				if ((events[i].events & (EPOLLIN | EPOLLRDHUP)) && read_connection(c) == false)
+				{
+					close_connection(s);
+					continue;
+				}
+
+				if (serve_connection(c, handler) == false)
+					close_connection(s);
+			}
+
+			uint64_t t_now = get_time_ms();
+			if (t_now - t_idle_check >= 1000)
+			{
+				close_idle_connections(t_now);
+				t_idle_check = t_now;
+			}
+		}
+
+		return true;
+	}
+
+private:
+
+	// Not copyable, the sockets are owned by exactly one object
+	HttpServer(const HttpServer&);
+	HttpServer& operator = (const HttpServer&);
+
+	struct Connection
+	{
+		socket_t s;
+		std::string in;			// received, not yet parsed
+		std::string out;		// responses, not yet sent from out_pos
+		size_t out_pos;
+		bool closing;			// closed once out has been sent, nothing more is read
+		bool peer_closed;		// the peer has shut down its end, the requests in "in" are still answered
+		uint32_t events;		// registered with epoll
+		uint64_t t_last_ms;
+	};
+
+	socket_t m_listen;
+	int m_epoll;
+	size_t m_max_content_length;
+	std::string m_content_type;
+	std::map<socket_t, Connection*> m_connections;
+
+	static inline bool set_nonblocking(socket_t s)
+	{
+		int flags = fcntl(s, F_GETFL, 0);
+		return flags >= 0 && fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+	}
+
+	inline void accept_connections(void)
+	{
+		while (1)
+		{
+			socket_t s = accept4(m_listen, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (s == INVALID_SOCKET_T)
+			{
+				if (errno == EINTR)
+					continue;
+
+				return; // EAGAIN - no more pending connections
+			}
+
+			if (m_connections.size() >= HTTP_MAX_CONNECTIONS)
+			{
+				socket_close(s);
+				continue;
+			}
+
+			int on = 1;
+			setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+			struct epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN | EPOLLRDHUP;
+			ev.data.fd = s;
+
+			if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, s, &ev))
+			{
+				socket_close(s);
+				continue;
+			}
+
+			Connection* c = new Connection;
+			c->s = s;
+			c->out_pos = 0;
+			c->closing = false;
+			c->peer_closed = false;
+			c->events = ev.events;
+			c->t_last_ms = get_time_ms();
+
+			m_connections[s] = c;
+		}
+	}
+
+	inline void close_connection(socket_t s)
+	{
+		std::map<socket_t, Connection*>::iterator it = m_connections.find(s);
+		if (it == m_connections.end())
+			return;
+
+		epoll_ctl(m_epoll, EPOLL_CTL_DEL, s, 0);
+		socket_close(s);
+
+		delete it->second;
+		m_connections.erase(it);
+	}
+
+	inline void close_idle_connections(uint64_t t_now)
+	{
+		std::vector<socket_t> idle;
+		for (std::map<socket_t, Connection*>::iterator it = m_connections.begin(); it != m_connections.end(); it++)
+		{
+			if (t_now > it->second->t_last_ms && t_now - it->second->t_last_ms > HTTP_IDLE_TIMEOUT_MS)
+				idle.push_back(it->first);
+		}
+
+		for (size_t i = 0; i < idle.size(); i++)
+			close_connection(idle[i]);
+	}
+
+	// Input held for parsing, the largest request there can be. More is not read until requests have been taken
+	// from c.in - pipelined requests sent without reading the responses.
+	inline size_t get_max_input(void) const
+	{
+		return HTTP_MAX_HEADER_BYTES + 4 + m_max_content_length;
+	}
+
+	// Nothing is read while responses are pending or c.in is full, the client is held off by TCP flow control
+	inline bool is_reading(const Connection& c) const
+	{
+		return c.closing || (c.out.length() == 0 && c.in.length() < get_max_input());
+	}
+
+	// Returns false on error
+	inline bool read_connection(Connection& c)
+	{
+		char buf[0x4000];
+		while (c.peer_closed == false && is_reading(c))
+		{
+			ssize_t n = recv(c.s, buf, sizeof(buf), 0);
+			if (n > 0)
+			{
+				if (c.closing == false)
+					c.in.append(buf, n);
+				continue;
+			}
+
+			if (n == 0)
+			{
+				c.peer_closed = true;
+				break;
+			}
+
+			if (errno == EINTR)
+				continue;
+
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+
+		return true;
+	}
+
+	// Sends what it can, returns false on error, or when a connection which is closing has sent everything
+	inline bool write_connection(Connection& c)
+	{
+		while (c.out_pos < c.out.length())
+		{
+			ssize_t n = send(c.s, c.out.data() + c.out_pos, c.out.length() - c.out_pos, MSG_NOSIGNAL);
+			if (n > 0)
+			{
+				c.out_pos += n;
+				continue;
+			}
+
+			if (n < 0 && errno == EINTR)
+				continue;
+
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+
+			return false;
+		}
+
+		if (c.out_pos == c.out.length())
+		{
+			c.out.clear();
+			c.out_pos = 0;
+
+			if (c.closing)
+				return false;
+		}
+
+		// A peer which has shut down its end would report EPOLLIN / EPOLLRDHUP continually, and so would one which
+		// isn't read from (see is_reading())
+		uint32_t events = c.peer_closed || is_reading(c) == false ? 0 : EPOLLIN | EPOLLRDHUP;
+		if (c.out.length())
+			events |= EPOLLOUT;
+
+		if (events != c.events)
+		{
+			struct epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.events = events;
+			ev.data.fd = c.s;
+
+			if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, c.s, &ev))
+				return false;
+
+			c.events = events;
+		}
+
+		return true;
+	}
+
+	static inline const char* get_reason(int status)
+	{
+		switch (status)
+		{
+		case 200: return "OK";
+		case 400: return "Bad Request";
+		case 405: return "Method Not Allowed";
+		case 411: return "Length Required";
+		case 413: return "Payload Too Large";
+		case 431: return "Request Header Fields Too Large";
+		case 501: return "Not Implemented";
+		case 505: return "HTTP Version Not Supported";
+		}
+
+		return "Error";
+	}
+
+	// Refused requests end the connection, the rest of its input can't be relied on
+	inline void append_error(Connection& c, int status)
+	{
+		char line[256];
+		sprintf(line, "HTTP/1.1 %d %s\r\n", status, get_reason(status));
+
+		c.out += line;
+		if (status == 405)
+			c.out += "Allow: POST\r\n";
+		c.out += "Content-Length: 0\r\nConnection: close\r\n\r\n";
+
+		c.closing = true;
+		c.in.clear();
+	}
+
+	inline void append_response(Connection& c, const HttpRequest& request, const std::string& body)
+	{
+		char line[256];
+		sprintf(line, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %lu\r\n", m_content_type.c_str(), (unsigned long)body.length());
+
+		c.out += line;
+		if (request.m_keep_alive == false)
+			c.out += "Connection: close\r\n";
+		else if (request.GetHeader("connection"))
+			c.out += "Connection: keep-alive\r\n"; // HTTP/1.0 keep-alive is acknowledged
+		c.out += "\r\n";
+		c.out += body;
+
+		if (request.m_keep_alive == false)
+		{
+			c.closing = true;
+			c.in.clear();
+		}
+	}
+
+	static inline bool equals_no_case(const std::string& s, const char* t)
+	{
+		if (s.length() != strlen(t))
+			return false;
+
+		for (size_t i = 0; i < s.length(); i++)
+		{
+			if (tolower((uint8_t)s[i]) != tolower((uint8_t)t[i]))
+				return false;
+		}
+
+		return true;
+	}
+
+	// Returns 1 if a complete request has been taken from c.in, 0 if more input is needed, otherwise the
+	// status of the error response
+	inline int parse_request(Connection& c, HttpRequest& request)
+	{
+		size_t header_end = c.in.find("\r\n\r\n");
+		if (header_end == std::string::npos)
+			return c.in.length() > HTTP_MAX_HEADER_BYTES ? 431 : 0;
+
+		if (header_end > HTTP_MAX_HEADER_BYTES)
+			return 431;
+
+		request.m_headers.clear();
+
+		// Request line - METHOD SP TARGET SP VERSION
+		size_t eol = c.in.find("\r\n");
+		std::string line = c.in.substr(0, eol);
+
+		size_t sp0 = line.find(' ');
+		size_t sp1 = sp0 == std::string::npos ? std::string::npos : line.find(' ', sp0 + 1);
+		if (sp1 == std::string::npos)
+			return 400;
+
+		request.m_method = line.substr(0, sp0);
+		request.m_target = line.substr(sp0 + 1, sp1 - sp0 - 1);
+		std::string version = line.substr(sp1 + 1);
+
+		if (version != "HTTP/1.1" && version != "HTTP/1.0")
+			return 505;
+
+		size_t pos = eol + 2;
+		while (pos < header_end + 2)
+		{
+			eol = c.in.find("\r\n", pos);
+			line = c.in.substr(pos, eol - pos);
+			pos = eol + 2;
+
+			size_t colon = line.find(':');
+			if (colon == std::string::npos || colon == 0)
+				return 400;
+
+			std::string name = line.substr(0, colon);
+			for (size_t i = 0; i < name.length(); i++)
+				name[i] = (char)tolower((uint8_t)name[i]);
+
+			size_t v0 = line.find_first_not_of(" \t", colon + 1);
+			size_t v1 = line.find_last_not_of(" \t");
+			request.m_headers[name] = v0 == std::string::npos ? std::string() : line.substr(v0, v1 - v0 + 1);
+		}
+
+		const char* connection = request.GetHeader("connection");
+		if (version == "HTTP/1.1")
+			request.m_keep_alive = connection == 0 || equals_no_case(connection, "close") == false;
+		else
+			request.m_keep_alive = connection && equals_no_case(connection, "keep-alive");
+
+		if (request.GetHeader("transfer-encoding"))
+			return 501;
+
+		size_t content_length = 0;
+		const char* s_content_length = request.GetHeader("content-length");
+		if (s_content_length)
+		{
+			char* end = 0;
+			unsigned long long n = strtoull(s_content_length, &end, 10);
+			if (end == s_content_length || *end)
+				return 400;
+
+			if (n > m_max_content_length)
+				return 413;
+
+			content_length = (size_t)n;
+		}
+
+		if (request.m_method != "POST")
+			return 405;
+
+		if (s_content_length == 0)
+			return 411;
+
+		size_t body_start = header_end + 4;
+		if (c.in.length() < body_start + content_length)
+			return 0;
+
+		request.m_body = c.in.substr(body_start, content_length);
+		c.in.erase(0, body_start + content_length);
+		return 1;
+	}
+
+	// Sends the pending responses, then answers the complete requests in c.in, in order. A request is only
+	// parsed once the responses before it have been sent. Returns false when the connection is to be closed.
+	template <class HANDLER> inline bool serve_connection(Connection& c, HANDLER& handler)
+	{
+		while (1)
+		{
+			if (write_connection(c) == false)
+				return false;
+
+			if (c.closing || c.out.length())
+				return true;
+
+			HttpRequest request;
+			int status = parse_request(c, request);
+			// A full c.in holds a complete request, or one parse_request() rejects
+			if (status == 0)
+				return c.peer_closed == false && c.in.length() < get_max_input();
+
+			if (status != 1)
+			{
+				append_error(c, status);
+				continue;
+			}
+
+			std::string body;
+			handler(request, body);
+			append_response(c, request, body);
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,696 @@
+// Copyright (c) AlgoMachines
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "SimpleDB.hpp"
+
+#pragma once
+
+#define INDEXEDDB_MAGIC 0x58444953 // "SIDX"
+
+// SimpleDB with secondary indexes.
+//
+// RECORD_CLASS declares its indexes:
+//   static uint32_t GetNumIndexes(void)
+//   int CompareIndexKey(uint32_t index_num, const RECORD_CLASS& rec) const - three way comparison, index_num = 1..GetNumIndexes()
+//
+// Each index is a list of record indexes ordered by the index key, records with the same key are in primary order.
+// Indexes are loaded on the first index query after a load, and are maintained by every change after that - requests
+// which never query an index skip them entirely. Saves write them to <file>.sidx next to the file:
+//   [IndexFileHeader][INDEX_TYPE * nrecords] per index
+// The header holds the saved state of the file which the indexes were written for (SimpleDB::GetSavedState()). A load of
+// the same state reads the indexes back without touching the records, after any other (changes saved by another process
+// since) they are sorted again, O(n log n), and written by the next save.
+//
+// A mapped record whose block fails its checksum can't be compared - an index which needs it is dropped, and the index
+// queries find nothing until it can be built again.
+template <class RECORD_CLASS, class INDEX_TYPE=uint32_t> class IndexedDB
+{
+private:
+	SimpleDB<RECORD_CLASS, INDEX_TYPE> m_db;
+
+	bool m_indexes_valid;
+	vector< vector<INDEX_TYPE> > m_indexes; // m_indexes[index_num - 1]
+
+	typedef typename SimpleDB<RECORD_CLASS, INDEX_TYPE>::SavedState SavedState;
+
+	string m_file_name;			// the file the records were loaded from or last saved to
+	bool m_indexes_saved;		// m_indexes are the ones in <m_file_name>.sidx, of m_saved_state
+	SavedState m_saved_state;
+
+	// Stored little endian at the start of <file>.sidx
+	struct IndexFileHeader
+	{
+		uint32_t magic;
+		uint32_t record_size;
+		uint32_t index_size;		// sizeof(INDEX_TYPE)
+		uint32_t nindexes;
+		uint64_t nrecords;
+		SavedState state;			// of the file which the indexes were written for
+	};
+
+	// Orders record indexes by the index key, then by record index. A record which can't be read sets *failed.
+	struct IndexLess
+	{
+		const IndexedDB* db;
+		uint32_t index_num;
+		bool* failed;
+
+		inline bool operator () (INDEX_TYPE a, INDEX_TYPE b) const
+		{
+			const RECORD_CLASS* rec_a = db->m_db.GetRecordByIndex(a);
+			const RECORD_CLASS* rec_b = db->m_db.GetRecordByIndex(b);
+			if (rec_a == 0 || rec_b == 0)
+			{
+				*failed = true;
+				return a < b;
+			}
+
+			int state = rec_a->CompareIndexKey(index_num, *rec_b);
+			if (state)
+				return state < 0;
+
+			return a < b;
+		}
+	};
+
+	inline IndexLess get_index_less(uint32_t index_num, bool& failed) const
+	{
+		IndexLess less;
+		less.db = this;
+		less.index_num = index_num;
+		less.failed = &failed;
+		return less;
+	}
+
+	static inline bool is_same_state(const SavedState& a, const SavedState& b)
+	{
+		return a.generation == b.generation && a.log_bytes == b.log_bytes && a.table_crc == b.table_crc && a.nruns == b.nruns;
+	}
+
+	// A record could not be read, the indexes are built again by the next index query
+	inline void drop_indexes(void)
+	{
+		m_indexes.clear();
+		m_indexes_valid = false;
+		m_indexes_saved = false;
+	}
+
+	inline bool is_valid_index_num(uint32_t index_num) const
+	{
+		return index_num >= 1 && index_num <= RECORD_CLASS::GetNumIndexes();
+	}
+
+	static inline string get_index_file_name(const char* file_name)
+	{
+		string index_file_name = file_name;
+		index_file_name += ".sidx";
+		return index_file_name;
+	}
+
+	// Reads <m_file_name>.sidx, false if it is missing or was not written for the saved state of the records
+	inline bool load_indexes(void)
+	{
+		SavedState state;
+		if (m_file_name.size() == 0 || m_db.GetSavedState(state) == false)
+			return false;
+
+		string index_file_name = get_index_file_name(m_file_name.c_str());
+
+		uint32_t nindexes = RECORD_CLASS::GetNumIndexes();
+		INDEX_TYPE nrecords = m_db.GetNumRecords();
+
+		if (filelength64(index_file_name.c_str()) != (int64_t)(sizeof(IndexFileHeader) + (uint64_t)nindexes * nrecords * sizeof(INDEX_TYPE)))
+			return false;
+
+		FILE* stream = fopen(index_file_name.c_str(), "rb");
+		if (stream == 0)
+			return false;
+
+		IndexFileHeader header;
+		bool status = fread(&header, sizeof(header), 1, stream) == 1 && header.magic == INDEXEDDB_MAGIC &&
+			header.record_size == RECORD_CLASS::GetSizeBytes() && header.index_size == sizeof(INDEX_TYPE) &&
+			header.nindexes == nindexes && header.nrecords == nrecords && is_same_state(header.state, state);
+
+		vector< vector<INDEX_TYPE> > indexes;
+		indexes.resize(nindexes);
+
+		for (uint32_t i = 0; i < nindexes && status; i++)
+		{
+			indexes[i].resize(nrecords);
+			if (nrecords && fread(&indexes[i][0], sizeof(INDEX_TYPE), nrecords, stream) != nrecords)
+				status = false;
+		}
+
+		fclose(stream);
+
+		if (status == false)
+			return false;
+
+		m_indexes.swap(indexes);
+		m_indexes_valid = true;
+		m_indexes_saved = true;
+		m_saved_state = state;
+		return true;
+	}
+
+	// Called once the records have been saved to file_name, rewrites <file>.sidx unless it still holds the indexes of
+	// the saved state. Indexes which were not loaded since the records changed are left to be sorted by the next index query,
+	// and nothing is written if the records are not those of a saved state (see SimpleDB::GetSavedState()).
+	inline bool save_indexes(const char* file_name, string& err_msg)
+	{
+		if (m_file_name != file_name)
+		{
+			m_file_name = file_name;
+			m_indexes_saved = false;
+		}
+
+		SavedState state;
+		if (m_indexes_valid == false || m_db.GetSavedState(state) == false ||
+			(m_indexes_saved && is_same_state(state, m_saved_state)))
+		{
+			return true;
+		}
+
+		IndexFileHeader header;
+		header.magic = INDEXEDDB_MAGIC;
+		header.record_size = RECORD_CLASS::GetSizeBytes();
+		header.index_size = sizeof(INDEX_TYPE);
+		header.nindexes = (uint32_t)m_indexes.size();
+		header.nrecords = m_db.GetNumRecords();
+		header.state = state;
+
+		string index_file_name = get_index_file_name(file_name);
+
+		AtomicFileWriter file;
+		if (file.Open(index_file_name.c_str(), err_msg) == false)
+			return false;
+
+		bool status = fwrite(&header, sizeof(header), 1, file.GetStream()) == 1;
+		for (size_t i = 0; i < m_indexes.size() && status; i++)
+		{
+			const vector<INDEX_TYPE>& index = m_indexes[i];
+			if (index.size() && fwrite(&index[0], sizeof(INDEX_TYPE), index.size(), file.GetStream()) != index.size())
+				status = false;
+		}
+
+		if (status == false)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "problem writing data to create file: ";
+			err_msg += index_file_name.c_str();
+			return false;
+		}
+
+		if (file.Commit(err_msg) == false)
+			return false;
+
+		m_indexes_saved = true;
+		m_saved_state = state;
+		return true;
+	}
+
+	// False if a record can't be read
+	inline bool build_indexes(void)
+	{
+		if (m_indexes_valid)
+			return true;
+
+		if (load_indexes())
+			return true;
+
+		uint32_t nindexes = RECORD_CLASS::GetNumIndexes();
+		INDEX_TYPE nrecords = m_db.GetNumRecords();
+
+		m_indexes.resize(nindexes);
+
+		for (uint32_t i = 0; i < nindexes; i++)
+		{
+			vector<INDEX_TYPE>& index = m_indexes[i];
+
+			index.resize(nrecords);
+			for (INDEX_TYPE idx = 0; idx < nrecords; idx++)
+				index[idx] = idx;
+
+			bool failed = false;
+			std::sort(index.begin(), index.end(), get_index_less(i + 1, failed));
+			if (failed)
+			{
+				drop_indexes();
+				return false;
+			}
+		}
+
+		m_indexes_valid = true;
+		m_indexes_saved = false;
+		return true;
+	}
+
+	// A record was inserted at idx, the records after it have moved up by one
+	inline void index_inserted(INDEX_TYPE idx)
+	{
+		if (m_indexes_valid == false)
+			return;
+
+		m_indexes_saved = false;
+
+		for (uint32_t i = 0; i < m_indexes.size(); i++)
+		{
+			vector<INDEX_TYPE>& index = m_indexes[i];
+
+			for (size_t j = 0; j < index.size(); j++)
+			{
+				if (index[j] >= idx)
+					index[j]++;
+			}
+
+			bool failed = false;
+			index.insert(std::lower_bound(index.begin(), index.end(), idx, get_index_less(i + 1, failed)), idx);
+			if (failed)
+			{
+				drop_indexes();
+				return;
+			}
+		}
+	}
+
+	// The record at idx was changed in place, previous is a copy of the record before the change
+	inline void index_updated(INDEX_TYPE idx, const RECORD_CLASS& previous)
+	{
+		if (m_indexes_valid == false)
+			return;
+
+		const RECORD_CLASS* rec = m_db.GetRecordByIndex(idx);
+		if (rec == 0)
+		{
+			drop_indexes();
+			return;
+		}
+
+		for (uint32_t i = 0; i < m_indexes.size(); i++)
+		{
+			if (rec->CompareIndexKey(i + 1, previous) == 0)
+				continue; // key did not change
+
+			m_indexes_saved = false;
+
+			vector<INDEX_TYPE>& index = m_indexes[i];
+
+			for (size_t j = 0; j < index.size(); j++)
+			{
+				if (index[j] == idx)
+				{
+					index.erase(index.begin() + j);
+					break;
+				}
+			}
+
+			bool failed = false;
+			index.insert(std::lower_bound(index.begin(), index.end(), idx, get_index_less(i + 1, failed)), idx);
+			if (failed)
+			{
+				drop_indexes();
+				return;
+			}
+		}
+	}
+
+	// The records at the given sorted indexes were removed, the remaining records have moved down
+	inline void index_removed(const vector<INDEX_TYPE>& removed, INDEX_TYPE nrecords_before)
+	{
+		if (m_indexes_valid == false || removed.size() == 0)
+			return;
+
+		m_indexes_saved = false;
+
+		// New record index for each old record index, removed records map to nrecords_before
+		vector<INDEX_TYPE> remap;
+		remap.resize(nrecords_before);
+
+		INDEX_TYPE nremoved = 0;
+		size_t j = 0;
+		for (INDEX_TYPE idx = 0; idx < nrecords_before; idx++)
+		{
+			if (j < removed.size() && removed[j] == idx)
+			{
+				remap[idx] = nrecords_before;
+				nremoved++;
+
+				while (j < removed.size() && removed[j] == idx)
+					j++;
+				continue;
+			}
+
+			remap[idx] = idx - nremoved;
+		}
+
+		for (uint32_t i = 0; i < m_indexes.size(); i++)
+		{
+			vector<INDEX_TYPE>& index = m_indexes[i];
+
+			size_t iput = 0;
+			for (size_t k = 0; k < index.size(); k++)
+			{
+				INDEX_TYPE idx = remap[index[k]];
+				if (idx == nrecords_before)
+					continue;
+
+				index[iput++] = idx;
+			}
+
+			index.resize(iput);
+		}
+	}
+
+public:
+
+	inline IndexedDB(void)
+	{
+		m_indexes_valid = false;
+		m_indexes_saved = false;
+		memset(&m_saved_state, 0, sizeof(m_saved_state));
+	}
+
+	// Deletes a db file together with its log, runs, hash index and secondary indexes
+	static inline bool DeleteFiles(const char* file_name, string& err_msg)
+	{
+		string index_file_name = get_index_file_name(file_name);
+
+		if (DoesFileExist(index_file_name.c_str()) && DeleteFile(index_file_name.c_str()) == false)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to delete file: ";
+			err_msg += index_file_name.c_str();
+			return false;
+		}
+
+		return SimpleDB<RECORD_CLASS, INDEX_TYPE>::DeleteFiles(file_name, err_msg);
+	}
+
+	// True once the indexes have been loaded from <file>.sidx or sorted, see GetIndexLowerBound()
+	inline bool AreIndexesLoaded(void) const
+	{
+		return m_indexes_valid;
+	}
+
+	// True if <file>.sidx holds the current indexes
+	inline bool AreIndexesSaved(void) const
+	{
+		return m_indexes_valid && m_indexes_saved;
+	}
+
+	inline void EnableFileMapping(bool use_file_mapping)
+	{
+		m_db.EnableFileMapping(use_file_mapping);
+	}
+
+	inline void EnableLog(bool use_log, uint32_t log_compaction_bytes = SIMPLEDB_LOG_COMPACTION_BYTES)
+	{
+		m_db.EnableLog(use_log, log_compaction_bytes);
+	}
+
+	inline void EnableRuns(bool use_runs, uint32_t max_runs = SIMPLEDB_MAX_RUNS)
+	{
+		m_db.EnableRuns(use_runs, max_runs);
+	}
+
+	inline bool IsMapped(void) const
+	{
+		return m_db.IsMapped();
+	}
+
+	inline bool ReleaseFileMappings(string& err_msg)
+	{
+		return m_db.ReleaseFileMappings(err_msg);
+	}
+
+	inline INDEX_TYPE GetNumRecords(void) const
+	{
+		return m_db.GetNumRecords();
+	}
+
+	inline const RECORD_CLASS* GetRecord(const RECORD_CLASS& token, INDEX_TYPE* ret_idx = 0) const
+	{
+		return m_db.GetRecord(token, ret_idx);
+	}
+
+	inline const RECORD_CLASS* GetRecordByIndex(INDEX_TYPE idx) const
+	{
+		return m_db.GetRecordByIndex(idx);
+	}
+
+	inline INDEX_TYPE GetRecordIndex(const RECORD_CLASS& record, bool& exists) const
+	{
+		return m_db.GetRecordIndex(record, exists);
+	}
+
+	inline INDEX_TYPE LowerBound(const RECORD_CLASS& token) const
+	{
+		return m_db.LowerBound(token);
+	}
+
+	inline INDEX_TYPE UpperBound(const RECORD_CLASS& token) const
+	{
+		return m_db.UpperBound(token);
+	}
+
+	template <class PREFIX_COMPARE> inline const RECORD_CLASS* EqualRange(const RECORD_CLASS& token, PREFIX_COMPARE compare, INDEX_TYPE& istart, INDEX_TYPE& iend) const
+	{
+		return m_db.EqualRange(token, compare, istart, iend);
+	}
+
+	// Position of the first entry of index index_num whose key is not less than the key of token.
+	// 0 if a record can't be read.
+	inline INDEX_TYPE GetIndexLowerBound(uint32_t index_num, const RECORD_CLASS& token)
+	{
+		if (is_valid_index_num(index_num) == false || build_indexes() == false)
+			return 0;
+
+		const vector<INDEX_TYPE>& index = m_indexes[index_num - 1];
+
+		INDEX_TYPE istart = 0;
+		INDEX_TYPE iend = (INDEX_TYPE)index.size();
+		while (istart < iend)
+		{
+			INDEX_TYPE i = istart + (iend - istart) / 2;
+			const RECORD_CLASS* rec = m_db.GetRecordByIndex(index[i]);
+			if (rec == 0)
+				return 0;
+
+			if (rec->CompareIndexKey(index_num, token) < 0)
+				istart = i + 1;
+			else
+				iend = i;
+		}
+
+		return istart;
+	}
+
+	// Position of the first entry of index index_num whose key is greater than the key of token.
+	// 0 if a record can't be read.
+	inline INDEX_TYPE GetIndexUpperBound(uint32_t index_num, const RECORD_CLASS& token)
+	{
+		if (is_valid_index_num(index_num) == false || build_indexes() == false)
+			return 0;
+
+		const vector<INDEX_TYPE>& index = m_indexes[index_num - 1];
+
+		INDEX_TYPE istart = 0;
+		INDEX_TYPE iend = (INDEX_TYPE)index.size();
+		while (istart < iend)
+		{
+			INDEX_TYPE i = istart + (iend - istart) / 2;
+			const RECORD_CLASS* rec = m_db.GetRecordByIndex(index[i]);
+			if (rec == 0)
+				return 0;
+
+			if (rec->CompareIndexKey(index_num, token) <= 0)
+				istart = i + 1;
+			else
+				iend = i;
+		}
+
+		return istart;
+	}
+
+	// Entries [istart, iend) of index index_num have the same key as token, the range is empty if a record can't be read
+	inline void GetIndexRange(uint32_t index_num, const RECORD_CLASS& token, INDEX_TYPE& istart, INDEX_TYPE& iend)
+	{
+		istart = GetIndexLowerBound(index_num, token);
+		iend = GetIndexUpperBound(index_num, token);
+		if (iend < istart)
+			iend = istart;
+	}
+
+	// Returns the record at position pos of index index_num, ret_idx receives its record index
+	inline const RECORD_CLASS* GetRecordByIndexPosition(uint32_t index_num, INDEX_TYPE pos, INDEX_TYPE* ret_idx = 0)
+	{
+		if (is_valid_index_num(index_num) == false || build_indexes() == false)
+			return 0;
+
+		const vector<INDEX_TYPE>& index = m_indexes[index_num - 1];
+		if (pos >= index.size())
+			return 0;
+
+		if (ret_idx)
+			*ret_idx = index[pos];
+
+		return m_db.GetRecordByIndex(index[pos]);
+	}
+
+	inline bool InsertRecord(const RECORD_CLASS& record, INDEX_TYPE idx, string& err_msg)
+	{
+		if (m_db.InsertRecord(record, idx, err_msg) == false)
+			return false;
+
+		index_inserted(idx);
+		return true;
+	}
+
+	inline bool UpdateRecord(const RECORD_CLASS& record, bool& changes_made, string& err_msg)
+	{
+		changes_made = false;
+
+		bool exists;
+		INDEX_TYPE idx = m_db.GetRecordIndex(record, exists);
+
+		if (exists == false)
+		{
+			if (InsertRecord(record, idx, err_msg) == false)
+				return false;
+
+			changes_made = true;
+			return true;
+		}
+
+		RECORD_CLASS previous;
+		if (m_indexes_valid)
+		{
+			const RECORD_CLASS* rec = m_db.GetRecordByIndex(idx);
+			if (rec == 0)
+				drop_indexes();
+			else if (previous.Assign(*rec, err_msg) == false)
+				return false;
+		}
+
+		if (m_db.UpdateRecord(record, changes_made, err_msg) == false)
+			return false;
+
+		if (changes_made)
+			index_updated(idx, previous);
+
+		return true;
+	}
+
+	inline bool InsertRecords(const vector<RECORD_CLASS>& records, INDEX_TYPE& nchanged, string& err_msg)
+	{
+		m_indexes_valid = false; // rebuilt on the next index query
+
+		return m_db.InsertRecords(records, nchanged, err_msg);
+	}
+
+	// The old index key is not known, so the indexes are rebuilt on the next index query
+	inline bool MarkRecordChanged(INDEX_TYPE idx)
+	{
+		m_indexes_valid = false;
+
+		return m_db.MarkRecordChanged(idx);
+	}
+
+	inline bool RemoveRecord(INDEX_TYPE idx, string& err_msg)
+	{
+		INDEX_TYPE nrecords = m_db.GetNumRecords();
+
+		if (m_db.RemoveRecord(idx, err_msg) == false)
+			return false;
+
+		vector<INDEX_TYPE> removed;
+		removed.push_back(idx);
+		index_removed(removed, nrecords);
+
+		return true;
+	}
+
+	inline bool RemoveIndices(const vector<INDEX_TYPE>& indices, INDEX_TYPE& nremoved, string& err_msg)
+	{
+		INDEX_TYPE nrecords = m_db.GetNumRecords();
+
+		if (m_db.RemoveIndices(indices, nremoved, err_msg) == false)
+			return false;
+
+		vector<INDEX_TYPE> removed = indices;
+		std::sort(removed.begin(), removed.end());
+		index_removed(removed, nrecords);
+
+		return true;
+	}
+
+	inline bool RemoveRange(INDEX_TYPE istart, INDEX_TYPE iend, string& err_msg)
+	{
+		INDEX_TYPE nrecords = m_db.GetNumRecords();
+
+		if (m_db.RemoveRange(istart, iend, err_msg) == false)
+			return false;
+
+		vector<INDEX_TYPE> removed;
+		for (INDEX_TYPE idx = istart; idx < iend; idx++)
+			removed.push_back(idx);
+
+		index_removed(removed, nrecords);
+
+		return true;
+	}
+
+	template <class PREDICATE> inline bool RemoveIf(PREDICATE pred, INDEX_TYPE& nremoved, string& err_msg)
+	{
+		nremoved = 0;
+
+		vector<INDEX_TYPE> indices;
+		for (INDEX_TYPE idx = 0; idx < m_db.GetNumRecords(); idx++)
+		{
+			const RECORD_CLASS* rec = m_db.GetRecordByIndex(idx);
+			if (rec && pred(*rec))
+				indices.push_back(idx);
+		}
+
+		return RemoveIndices(indices, nremoved, err_msg);
+	}
+
+	inline bool LoadFromBuffer(const void* buffer, INDEX_TYPE nrecords, string& err_msg)
+	{
+		m_indexes_valid = false;
+		m_file_name.clear();
+
+		return m_db.LoadFromBuffer(buffer, nrecords, err_msg);
+	}
+
+	// The indexes are read from <file>.sidx by the first index query
+	inline bool LoadFromFile(const char* file_name, string& err_msg)
+	{
+		m_indexes_valid = false;
+		m_file_name = file_name;
+
+		return m_db.LoadFromFile(file_name, err_msg);
+	}
+
+	inline bool SaveToFile(const char* file_name, string& err_msg)
+	{
+		if (m_db.SaveToFile(file_name, err_msg) == false)
+			return false;
+
+		return save_indexes(file_name, err_msg);
+	}
+
+	inline bool SaveChangedRecords(const char* file_name, string& err_msg)
+	{
+		if (m_db.SaveChangedRecords(file_name, err_msg) == false)
+			return false;
+
+		return save_indexes(file_name, err_msg);
+	}
+
+	inline bool GenerateReport(const char* file_name, string& err_msg)
+	{
+		return m_db.GenerateReport(file_name, err_msg);
+	}
+};
@@ -0,0 +1,171 @@
+// Copyright (c) AlgoMachines
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <string>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#pragma once
+
+// Private (copy on write) mapping of an entire file.
+// Pages are writable, but writes through the mapping are never carried back to the file,
+// so the caller is free to modify mapped data in place and decide later what to persist.
+class MappedFile
+{
+public:
+
+	inline MappedFile(void)
+	{
+		m_data = 0;
+		m_size = 0;
+#ifdef WIN32
+		m_hfile = INVALID_HANDLE_VALUE;
+		m_hmap = NULL;
+#endif
+	}
+
+	inline ~MappedFile(void)
+	{
+		Close();
+	}
+
+	inline bool IsOpen(void) const
+	{
+		return m_data != 0;
+	}
+
+	inline uint8_t* GetData(void) const
+	{
+		return m_data;
+	}
+
+	inline size_t GetSize(void) const
+	{
+		return m_size;
+	}
+
+	// An empty file can't be mapped, check the file length first
+	inline bool Open(const char* file_name, std::string& err_msg)
+	{
+		Close();
+
+#ifdef WIN32
+		m_hfile = CreateFile(file_name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (m_hfile == INVALID_HANDLE_VALUE)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to open file for mapping: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		LARGE_INTEGER sz;
+		if (GetFileSizeEx(m_hfile, &sz) == FALSE || sz.QuadPart == 0)
+		{
+			Close();
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to map empty file: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		m_hmap = CreateFileMapping(m_hfile, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+		if (m_hmap == NULL)
+		{
+			Close();
+			ERROR_LOCATION(err_msg);
+			err_msg += "CreateFileMapping() fails: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		m_data = (uint8_t*)MapViewOfFile(m_hmap, FILE_MAP_COPY, 0, 0, 0);
+		if (m_data == 0)
+		{
+			Close();
+			ERROR_LOCATION(err_msg);
+			err_msg += "MapViewOfFile() fails: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		m_size = (size_t)sz.QuadPart;
+#else
+		int fd = open(file_name, O_RDONLY);
+		if (fd < 0)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to open file for mapping: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		struct stat st;
+		if (fstat(fd, &st) || st.st_size == 0)
+		{
+			close(fd);
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to map empty file: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		void* p = mmap(0, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		close(fd); // the mapping holds its own reference to the file
+
+		if (p == MAP_FAILED)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "mmap() fails: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		m_data = (uint8_t*)p;
+		m_size = (size_t)st.st_size;
+#endif
+		return true;
+	}
+
+	inline void Close(void)
+	{
+#ifdef WIN32
+		if (m_data)
+			UnmapViewOfFile(m_data);
+
+		if (m_hmap != NULL)
+			CloseHandle(m_hmap);
+
+		if (m_hfile != INVALID_HANDLE_VALUE)
+			CloseHandle(m_hfile);
+
+		m_hfile = INVALID_HANDLE_VALUE;
+		m_hmap = NULL;
+#else
+		if (m_data)
+			munmap(m_data, m_size);
+#endif
+		m_data = 0;
+		m_size = 0;
+	}
+
+private:
+
+	// Not copyable, the mapping is owned by exactly one object
+	MappedFile(const MappedFile&);
+	MappedFile& operator = (const MappedFile&);
+
+	uint8_t* m_data;
+	size_t m_size;
+
+#ifdef WIN32
+	HANDLE m_hfile;
+	HANDLE m_hmap;
+#endif
+};
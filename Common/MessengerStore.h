@@ -0,0 +1,249 @@
+// Copyright (c) AlgoMachines
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <string>
+#include <vector>
+
+#include "socket_tools.h"
+#include "DRM_ProgramRecord.h"
+
+#pragma once
+
+#ifndef WIN32
+
+// The store daemon (PrivateMessenger --store) owns the databases and applies every change from its one thread.
+// A CGI front end decrypts and validates the request itself, and sends the daemon one command per connection:
+//
+// Command: [uint8 command] [uint8 flags] [client ID, 32 bytes] [uint64 nqueries] [uint32 data size] [data]
+// Reply:   [uint8 status] [DRM_ProgramRecord] [uint32 output size] [output]
+//
+// nqueries is the query count of the record which the front end validated the request with. The command is not
+// applied, STORE_STALE, if the record has moved on since - the front end validates the request again.
+
+#define STORE_GET_CLIENT 1		// The client's record
+#define STORE_ADD_CLIENT 2		// data: the key of the new client - the client code was compiled by the front end
+#define STORE_QUERY 3			// data: the output - a request which is answered without the message db
+#define STORE_SEND_MESSAGE 4	// data: the request data of SendPrivateMessage()
+#define STORE_RECEIVE 5			// flags: STORE_DO_NOT_RETURN_MESSAGES
+
+#define STORE_DO_NOT_RETURN_MESSAGES 1
+
+#define STORE_OK 0
+#define STORE_FAILED 1			// Nothing is sent to the client
+#define STORE_NOT_FOUND 2
+#define STORE_STALE 3
+
+#define STORE_MAX_DATA_BYTES 0x10000
+#define STORE_MAX_OUTPUT_BYTES 0x1000000
+#define STORE_IO_TIMEOUT_MS 10000		// a command is sent in full right after connecting
+#define STORE_IDLE_MS 1000
+
+class StoreCommand
+{
+public:
+
+	inline StoreCommand(void)
+	{
+		command = 0;
+		flags = 0;
+		memset(id, 0, sizeof(id));
+		nqueries = 0;
+	}
+
+	uint8_t command;
+	uint8_t flags;
+	uint8_t id[ID_SIZE_BYTES];
+	uint64_t nqueries;
+	std::vector<uint8_t> data;
+
+	inline bool Write(socket_t s) const
+	{
+		uint32_t data_sz = (uint32_t)data.size();
+
+		std::vector<uint8_t> b(2 + sizeof(id) + sizeof(nqueries) + sizeof(data_sz) + data_sz);
+		uint8_t* p = &b[0];
+		*p++ = command;
+		*p++ = flags;
+		memmove(p, id, sizeof(id)); p += sizeof(id);
+		memmove(p, &nqueries, sizeof(nqueries)); p += sizeof(nqueries);
+		memmove(p, &data_sz, sizeof(data_sz)); p += sizeof(data_sz);
+		if (data_sz)
+			memmove(p, &data[0], data_sz);
+
+		return socket_send_all(s, &b[0], b.size());
+	}
+
+	inline bool Read(socket_t s)
+	{
+		uint8_t b[2 + sizeof(id) + sizeof(nqueries)];
+		if (socket_recv_all(s, b, sizeof(b)) == false)
+			return false;
+
+		command = b[0];
+		flags = b[1];
+		memmove(id, &b[2], sizeof(id));
+		memmove(&nqueries, &b[2 + sizeof(id)], sizeof(nqueries));
+
+		uint32_t data_sz;
+		if (socket_recv_all(s, &data_sz, sizeof(data_sz)) == false || data_sz > STORE_MAX_DATA_BYTES)
+			return false;
+
+		data.resize(data_sz);
+		return data_sz == 0 || socket_recv_all(s, &data[0], data_sz);
+	}
+};
+
+class StoreReply
+{
+public:
+
+	inline StoreReply(void)
+	{
+		status = STORE_FAILED;
+	}
+
+	uint8_t status;
+	DRM_ProgramRecord record;
+	std::vector<char> output;
+
+	inline bool Write(socket_t s) const
+	{
+		uint32_t output_sz = (uint32_t)output.size();
+
+		std::vector<uint8_t> b(1 + sizeof(record) + sizeof(output_sz) + output_sz);
+		uint8_t* p = &b[0];
+		*p++ = status;
+		memmove(p, &record, sizeof(record)); p += sizeof(record);
+		memmove(p, &output_sz, sizeof(output_sz)); p += sizeof(output_sz);
+		if (output_sz)
+			memmove(p, &output[0], output_sz);
+
+		return socket_send_all(s, &b[0], b.size());
+	}
+
+	inline bool Read(socket_t s)
+	{
+		uint8_t b[1 + sizeof(record)];
+		if (socket_recv_all(s, b, sizeof(b)) == false)
+			return false;
+
+		status = b[0];
+		record.LoadFromBuffer(&b[1]);
+
+		uint32_t output_sz;
+		if (socket_recv_all(s, &output_sz, sizeof(output_sz)) == false || output_sz > STORE_MAX_OUTPUT_BYTES)
+			return false;
+
+		output.resize(output_sz);
+		return output_sz == 0 || socket_recv_all(s, &output[0], output_sz);
+	}
+};
+
+// Client side. connected is false if the daemon could not be reached, the command has not been applied then.
+// Once connected, a failure means the outcome of the command is unknown.
+inline bool store_call(const char* address, const StoreCommand& command, StoreReply& reply, bool& connected, std::string& err_msg)
+{
+	connected = false;
+
+	socket_t s;
+	if (socket_connect(address, s, err_msg) == false)
+		return false;
+
+	connected = true;
+	socket_set_timeout(s, STORE_IO_TIMEOUT_MS * 6);	// the daemon may be busy with the commands of other front ends
+
+	if (command.Write(s) == false || reply.Read(s) == false)
+	{
+		ERROR_LOCATION(err_msg);
+		socket_append_error(err_msg, "send/recv", address);
+		socket_close(s);
+		return false;
+	}
+
+	socket_close(s);
+	return true;
+}
+
+// Server side - the commands are applied one at a time, in the thread which calls Run().
+//
+// The handler is called as handler(const StoreCommand&, StoreReply&) for each command, and as handler.Idle()
+// whenever nothing has arrived for STORE_IDLE_MS.
+class StoreServer
+{
+public:
+
+	inline StoreServer(void)
+	{
+		m_listen = INVALID_SOCKET_T;
+	}
+
+	inline ~StoreServer(void)
+	{
+		Close();
+	}
+
+	inline bool Open(const char* address, std::string& err_msg)
+	{
+		Close();
+
+		if (socket_listen(address, m_listen, err_msg) == false)
+			return false;
+
+		m_address = address;
+		return true;
+	}
+
+	inline void Close(void)
+	{
+		if (m_listen == INVALID_SOCKET_T)
+			return;
+
+		socket_close(m_listen);
+		m_listen = INVALID_SOCKET_T;
+
+		if (socket_is_unix_address(m_address.c_str()))
+			unlink(m_address.c_str());
+	}
+
+	// Returns true when a stop signal has been caught (see socket_catch_stop_signals()), false on error
+	template <class HANDLER> inline bool Run(HANDLER& handler, std::string& err_msg)
+	{
+		Connection<HANDLER> connection;
+		connection.handler = &handler;
+
+		return socket_serve_sequentially(m_listen, STORE_IDLE_MS, STORE_IO_TIMEOUT_MS, connection, err_msg);
+	}
+
+private:
+
+	// Not copyable, the listening socket is owned by exactly one object
+	StoreServer(const StoreServer&);
+	StoreServer& operator = (const StoreServer&);
+
+	template <class HANDLER> struct Connection
+	{
+		HANDLER* handler;
+
+		inline void Serve(socket_t s)
+		{
+			StoreCommand command;
+			if (command.Read(s) == false)
+				return;
+
+			StoreReply reply;
+			(*handler)(command, reply);
+			reply.Write(s);
+		}
+
+		inline void Idle(void)
+		{
+			handler->Idle();
+		}
+	};
+
+	socket_t m_listen;
+	std::string m_address;
+};
+
+#endif
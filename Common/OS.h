@@ -9,9 +9,15 @@
 #define WIN32
 #endif
 
+#include <stdint.h>
 #include <vector>
 #include "string.h"
 
+#ifndef WIN32
+#include <stdlib.h>
+#define __debugbreak() abort()
+#endif
+
 using namespace std;
 
 inline bool IsZero(const vector<uint8_t>& b, uint32_t offset = 0)
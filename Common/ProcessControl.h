@@ -2,8 +2,20 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "WindowsTypes.h"
+
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
 #pragma once
 
+#ifdef WIN32
+
 // Start a process and return when it has finished
 inline bool RunProcess
 (
@@ -133,3 +145,105 @@ inline bool RunProcess
 	CloseHandle(hfile);
 	return true;
 };
+
+#else
+
+// Start a process and return when it has finished. params is the rest of a command line, it is parsed by /bin/sh
+// so quoted arguments work as they do on Windows. The output is appended to target_file, stderr is discarded.
+inline bool RunProcess
+(
+	const char* exe_file,
+	const char* working_directory,
+	const char* params,
+	const char* target_file,
+	string& err_msg,
+	DWORD timeout_seconds/*=INFINITE*/,
+	DWORD* exit_code/*=0*/,
+	bool bShowProcess/*=false*/
+)
+{
+	string command_line = "\"";
+	command_line += exe_file;
+	command_line += "\" ";
+	command_line += params;
+
+	int fd = open(target_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		err_msg = "RunProcess () Problem creating file: ";
+		err_msg += target_file;
+		err_msg += ", error: ";
+		err_msg += to_string(errno);
+		return false;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		close(fd);
+
+		err_msg = "RunProcess () starting process ";
+		err_msg += exe_file;
+		err_msg += ", error: ";
+		err_msg += to_string(errno);
+		return false;
+	}
+
+	if (pid == 0)
+	{
+		// Child - only async-signal-safe calls from here on
+		int null_fd = open("/dev/null", O_RDWR);
+		dup2(null_fd, 0);
+		dup2(fd, 1);
+		dup2(null_fd, 2);
+
+		if (working_directory && working_directory[0] && chdir(working_directory))
+			_exit(127);
+
+		execl("/bin/sh", "sh", "-c", command_line.c_str(), (char*)0);
+		_exit(127);
+	}
+
+	close(fd);
+
+	// Polled, there is no waitpid() with a timeout
+	uint64_t waited_ms = 0;
+	int status = 0;
+	while (1)
+	{
+		pid_t r = waitpid(pid, &status, WNOHANG);
+		if (r == pid)
+			break;
+
+		if (r < 0 && errno != EINTR)
+		{
+			err_msg = "RunProcess () waitpid fails for ";
+			err_msg += command_line;
+			return false;
+		}
+
+		if (timeout_seconds != INFINITE && waited_ms >= timeout_seconds * 1000LLU)
+		{
+			err_msg = "RunProcess () timeout waiting for ";
+			err_msg += command_line;
+
+			kill(pid, SIGKILL);
+			waitpid(pid, &status, 0);
+
+			if (exit_code)
+				*exit_code = (DWORD)-1;
+
+			return false;
+		}
+
+		usleep(10000);
+		waited_ms += 10;
+	}
+
+	if (exit_code)
+		*exit_code = WIFEXITED(status) ? (DWORD)WEXITSTATUS(status) : (DWORD)-1;
+
+	return true;
+}
+
+#endif
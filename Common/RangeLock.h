@@ -0,0 +1,159 @@
+// Copyright (c) AlgoMachines
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <string>
+#include <string.h>
+
+#include "string_tools.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#pragma once
+
+#ifdef __linux__
+
+// Shared / exclusive locks of byte ranges of a lock file, open file description (OFD) locks. They belong to the
+// open file rather than to the process: the locks of two RangeLockFile objects conflict even in one process, and
+// closing some other descriptor of the file does not drop them. A process which is forked shares the open file
+// with its parent, so the file is opened again by the first Lock() of the child.
+class RangeLockFile
+{
+public:
+
+	inline RangeLockFile(void)
+	{
+		m_fd = -1;
+		m_pid = 0;
+	}
+
+	inline ~RangeLockFile(void)
+	{
+		Close();
+	}
+
+	inline bool Open(const char* file_name, std::string& err_msg)
+	{
+		Close();
+
+		m_fd = open(file_name, O_RDWR | O_CREAT | O_CLOEXEC, 0660);
+		if (m_fd < 0)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to open lock file: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		m_file_name = file_name;
+		m_pid = getpid();
+		return true;
+	}
+
+	// All the locks of this object are released
+	inline void Close(void)
+	{
+		if (m_fd < 0)
+			return;
+
+		close(m_fd);
+		m_fd = -1;
+	}
+
+	inline bool IsOpen(void) const
+	{
+		return m_fd >= 0;
+	}
+
+	// Waits up to timeout_ms for the range. A lock which is held already is converted to the requested type.
+	inline bool Lock(uint64_t offset, uint64_t len, bool exclusive, uint32_t timeout_ms, std::string& err_msg)
+	{
+		if (m_fd >= 0 && m_pid != getpid())
+		{
+			// The parent's open file - its locks are not ours
+			std::string file_name = m_file_name;
+			if (Open(file_name.c_str(), err_msg) == false)
+				return false;
+		}
+
+		if (m_fd < 0)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "the lock file is not open";
+			return false;
+		}
+
+		struct flock fl;
+		memset(&fl, 0, sizeof(fl));
+		fl.l_type = exclusive ? F_WRLCK : F_RDLCK;
+		fl.l_whence = SEEK_SET;
+		fl.l_start = (off_t)offset;
+		fl.l_len = (off_t)len;
+
+		struct timespec t0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+
+		// F_OFD_SETLKW can't time out, the lock is polled - starting at 100us, up to 5ms between attempts
+		uint32_t wait_us = 100;
+		while (1)
+		{
+			if (fcntl(m_fd, F_OFD_SETLK, &fl) == 0)
+				return true;
+
+			if (errno != EAGAIN && errno != EACCES && errno != EINTR)
+			{
+				ERROR_LOCATION(err_msg);
+				err_msg += "fcntl(F_OFD_SETLK) fails, error: ";
+				append_integer(err_msg, (uint32_t)errno);
+				return false;
+			}
+
+			struct timespec t1;
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			uint64_t elapsed_ms = (uint64_t)(t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec / 1000000) - (t0.tv_nsec / 1000000);
+			if (elapsed_ms >= timeout_ms)
+			{
+				ERROR_LOCATION(err_msg);
+				err_msg += "timeout waiting for a lock of: ";
+				err_msg += m_file_name;
+				return false;
+			}
+
+			usleep(wait_us);
+			if (wait_us < 5000)
+				wait_us *= 2;
+		}
+	}
+
+	inline void Unlock(uint64_t offset, uint64_t len)
+	{
+		if (m_fd < 0 || m_pid != getpid())
+			return;
+
+		struct flock fl;
+		memset(&fl, 0, sizeof(fl));
+		fl.l_type = F_UNLCK;
+		fl.l_whence = SEEK_SET;
+		fl.l_start = (off_t)offset;
+		fl.l_len = (off_t)len;
+
+		fcntl(m_fd, F_OFD_SETLK, &fl);
+	}
+
+private:
+
+	// Not copyable, the locks belong to the open file
+	RangeLockFile(const RangeLockFile&);
+	RangeLockFile& operator = (const RangeLockFile&);
+
+	int m_fd;
+	pid_t m_pid;
+	std::string m_file_name;
+};
+
+#endif
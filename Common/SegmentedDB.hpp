@@ -0,0 +1,483 @@
+// Copyright (c) AlgoMachines
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "IndexedDB.hpp"
+
+#pragma once
+
+// Default time span of one segment - one day
+#define SEGMENTEDDB_SEGMENT_MS 86400000LL
+
+// Time partitioned store - records are kept in one IndexedDB per time bucket, <file>.seg<N> holds the records
+// with timestamps in [N * segment_ms, (N + 1) * segment_ms), each segment sorted by the primary record order.
+// Expiring a whole bucket deletes its file, so the cost of expiry does not depend on the number of stored records.
+//
+// In addition to the IndexedDB protocol RECORD_CLASS provides:
+//   uint64_t GetTimestamp(void) const
+//   static uint32_t TimestampIndexNum(void) - secondary index ordered by timestamp
+//
+// NOTE: change records only through SegmentedDB, it tracks which segments need to be saved
+template <class RECORD_CLASS> class SegmentedDB
+{
+private:
+
+	struct Segment
+	{
+		uint64_t number;
+		IndexedDB<RECORD_CLASS> db;
+		bool changed;
+	};
+
+	uint64_t m_segment_ms;
+
+	bool m_use_file_mapping;
+	bool m_use_log;
+	uint32_t m_log_compaction_bytes;
+	bool m_use_runs;
+	uint32_t m_max_runs;
+
+	vector<Segment*> m_segments;	// ordered by segment number
+	vector<uint64_t> m_dropped;		// segments whose files are deleted on the next save
+	bool m_drop_unsegmented_file;	// records of an unsegmented <file> have been moved into segments
+
+	// Not copyable, the segments are owned by exactly one object
+	SegmentedDB(const SegmentedDB&);
+	SegmentedDB& operator = (const SegmentedDB&);
+
+	inline void clear(void)
+	{
+		for (size_t i = 0; i < m_segments.size(); i++)
+			delete m_segments[i];
+
+		m_segments.clear();
+		m_dropped.clear();
+		m_drop_unsegmented_file = false;
+	}
+
+	inline Segment* new_segment(uint64_t number)
+	{
+		Segment* seg = new Segment;
+		seg->number = number;
+		seg->changed = false;
+		seg->db.EnableFileMapping(m_use_file_mapping);
+		seg->db.EnableLog(m_use_log, m_log_compaction_bytes);
+		seg->db.EnableRuns(m_use_runs, m_max_runs);
+		return seg;
+	}
+
+	// Position of segment number in m_segments, or the position where it would be inserted
+	inline uint32_t find_segment(uint64_t number, bool& exists) const
+	{
+		uint32_t istart = 0;
+		uint32_t iend = (uint32_t)m_segments.size();
+		while (istart < iend)
+		{
+			uint32_t i = istart + (iend - istart) / 2;
+			if (m_segments[i]->number < number)
+				istart = i + 1;
+			else
+				iend = i;
+		}
+
+		exists = istart < m_segments.size() && m_segments[istart]->number == number;
+		return istart;
+	}
+
+	inline Segment* get_segment(uint64_t number)
+	{
+		bool exists;
+		uint32_t iseg = find_segment(number, exists);
+		if (exists)
+			return m_segments[iseg];
+
+		Segment* seg = new_segment(number);
+		m_segments.insert(m_segments.begin() + iseg, seg);
+		return seg;
+	}
+
+	inline void drop_segment(uint32_t iseg)
+	{
+		m_dropped.push_back(m_segments[iseg]->number);
+		delete m_segments[iseg];
+		m_segments.erase(m_segments.begin() + iseg);
+	}
+
+	// Segment number from the name of a segment file, rejects temporary and log files of a segment
+	static inline bool parse_segment_number(const char* s, uint64_t& number)
+	{
+		number = 0;
+
+		if (*s == 0)
+			return false;
+
+		for (; *s; s++)
+		{
+			if (*s < '0' || *s > '9')
+				return false;
+
+			number = number * 10 + (*s - '0');
+		}
+
+		return true;
+	}
+
+	// Moves the records of an unsegmented file (and its log) into their segments
+	inline bool load_unsegmented_file(const char* file_name, string& err_msg)
+	{
+		SimpleDB<RECORD_CLASS> db;
+		if (db.LoadFromFile(file_name, err_msg) == false)
+			return false;
+
+		vector< vector<RECORD_CLASS> > buckets;
+		vector<uint64_t> numbers;
+
+		for (uint32_t idx = 0; idx < db.GetNumRecords(); idx++)
+		{
+			const RECORD_CLASS* rec = db.GetRecordByIndex(idx);
+			uint64_t number = rec->GetTimestamp() / m_segment_ms;
+
+			size_t i = 0;
+			while (i < numbers.size() && numbers[i] != number)
+				i++;
+
+			if (i == numbers.size())
+			{
+				numbers.push_back(number);
+				buckets.resize(numbers.size());
+			}
+
+			buckets[i].push_back(*rec);
+		}
+
+		for (size_t i = 0; i < numbers.size(); i++)
+		{
+			Segment* seg = get_segment(numbers[i]);
+
+			uint32_t nchanged;
+			if (seg->db.InsertRecords(buckets[i], nchanged, err_msg) == false)
+				return false;
+
+			seg->changed = true;
+		}
+
+		m_drop_unsegmented_file = true;
+		return true;
+	}
+
+public:
+
+	inline SegmentedDB(void)
+	{
+		m_segment_ms = SEGMENTEDDB_SEGMENT_MS;
+		m_use_file_mapping = false;
+		m_use_log = false;
+		m_log_compaction_bytes = SIMPLEDB_LOG_COMPACTION_BYTES;
+		m_use_runs = false;
+		m_max_runs = SIMPLEDB_MAX_RUNS;
+		m_drop_unsegmented_file = false;
+	}
+
+	inline ~SegmentedDB(void)
+	{
+		clear();
+	}
+
+	// Must be set before loading, and must stay the same for the lifetime of the files
+	inline void SetSegmentDuration(uint64_t segment_ms)
+	{
+		m_segment_ms = segment_ms ? segment_ms : SEGMENTEDDB_SEGMENT_MS;
+	}
+
+	inline void EnableFileMapping(bool use_file_mapping)
+	{
+		m_use_file_mapping = use_file_mapping;
+
+		for (size_t i = 0; i < m_segments.size(); i++)
+			m_segments[i]->db.EnableFileMapping(use_file_mapping);
+	}
+
+	inline void EnableLog(bool use_log, uint32_t log_compaction_bytes = SIMPLEDB_LOG_COMPACTION_BYTES)
+	{
+		m_use_log = use_log;
+		m_log_compaction_bytes = log_compaction_bytes;
+
+		for (size_t i = 0; i < m_segments.size(); i++)
+			m_segments[i]->db.EnableLog(use_log, log_compaction_bytes);
+	}
+
+	inline void EnableRuns(bool use_runs, uint32_t max_runs = SIMPLEDB_MAX_RUNS)
+	{
+		m_use_runs = use_runs;
+		m_max_runs = max_runs;
+
+		for (size_t i = 0; i < m_segments.size(); i++)
+			m_segments[i]->db.EnableRuns(use_runs, max_runs);
+	}
+
+	static inline string GetSegmentFileName(const char* file_name, uint64_t number)
+	{
+		char ext[32];
+		sprintf(ext, ".seg%llu", (unsigned long long)number);
+
+		string segment_file_name = file_name;
+		segment_file_name += ext;
+		return segment_file_name;
+	}
+
+	inline uint32_t GetNumRecords(void) const
+	{
+		uint32_t n = 0;
+		for (size_t i = 0; i < m_segments.size(); i++)
+			n += m_segments[i]->db.GetNumRecords();
+
+		return n;
+	}
+
+	inline uint32_t GetNumSegments(void) const
+	{
+		return (uint32_t)m_segments.size();
+	}
+
+	// See SimpleDB::ReleaseFileMappings()
+	inline bool ReleaseFileMappings(string& err_msg)
+	{
+		for (size_t i = 0; i < m_segments.size(); i++)
+		{
+			if (m_segments[i]->db.ReleaseFileMappings(err_msg) == false)
+				return false;
+		}
+
+		return true;
+	}
+
+	inline uint64_t GetSegmentNumber(uint32_t iseg) const
+	{
+		return m_segments[iseg]->number;
+	}
+
+	// For lookups and index queries, use the methods below to make changes
+	inline IndexedDB<RECORD_CLASS>& GetSegment(uint32_t iseg)
+	{
+		return m_segments[iseg]->db;
+	}
+
+	inline bool UpdateRecord(const RECORD_CLASS& record, bool& changes_made, string& err_msg)
+	{
+		Segment* seg = get_segment(record.GetTimestamp() / m_segment_ms);
+
+		if (seg->db.UpdateRecord(record, changes_made, err_msg) == false)
+			return false;
+
+		if (changes_made)
+			seg->changed = true;
+
+		return true;
+	}
+
+	inline bool RemoveRecord(uint32_t iseg, uint32_t idx, string& err_msg)
+	{
+		if (iseg >= m_segments.size())
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "invalid segment";
+			return false;
+		}
+
+		if (m_segments[iseg]->db.RemoveRecord(idx, err_msg) == false)
+			return false;
+
+		m_segments[iseg]->changed = true;
+		return true;
+	}
+
+	inline bool RemoveIndices(uint32_t iseg, const vector<uint32_t>& indices, uint32_t& nremoved, string& err_msg)
+	{
+		nremoved = 0;
+
+		if (iseg >= m_segments.size())
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "invalid segment";
+			return false;
+		}
+
+		if (m_segments[iseg]->db.RemoveIndices(indices, nremoved, err_msg) == false)
+			return false;
+
+		if (nremoved)
+			m_segments[iseg]->changed = true;
+
+		return true;
+	}
+
+	inline bool RemoveRange(uint32_t iseg, uint32_t istart, uint32_t iend, string& err_msg)
+	{
+		if (iseg >= m_segments.size())
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "invalid segment";
+			return false;
+		}
+
+		if (m_segments[iseg]->db.RemoveRange(istart, iend, err_msg) == false)
+			return false;
+
+		if (istart < iend)
+			m_segments[iseg]->changed = true;
+
+		return true;
+	}
+
+	// Remove all records with timestamps before t_ms.
+	// Segments which are entirely older are dropped whole, only the segment containing t_ms is searched.
+	inline bool RemoveOlderThan(uint64_t t_ms, uint32_t& nremoved, string& err_msg)
+	{
+		nremoved = 0;
+
+		while (m_segments.size() && (m_segments[0]->number + 1) * m_segment_ms <= t_ms)
+		{
+			nremoved += m_segments[0]->db.GetNumRecords();
+			drop_segment(0);
+		}
+
+		if (m_segments.size() == 0 || m_segments[0]->number * m_segment_ms >= t_ms)
+			return true;
+
+		IndexedDB<RECORD_CLASS>& db = m_segments[0]->db;
+
+		RECORD_CLASS token;
+		token.SetTimestamp(&t_ms);
+
+		uint32_t index_num = RECORD_CLASS::TimestampIndexNum();
+		uint32_t n = db.GetIndexLowerBound(index_num, token);
+
+		vector<uint32_t> indices;
+		indices.resize(n);
+
+		for (uint32_t pos = 0; pos < n; pos++)
+			db.GetRecordByIndexPosition(index_num, pos, &indices[pos]);
+
+		uint32_t nremoved_segment;
+		if (RemoveIndices(0, indices, nremoved_segment, err_msg) == false)
+			return false;
+
+		nremoved += nremoved_segment;
+		return true;
+	}
+
+	// Loads every <file_name>.seg<N>. An unsegmented file_name left by an earlier version is split into
+	// segments, it is deleted by the next SaveToFile().
+	inline bool LoadFromFile(const char* file_name, string& err_msg)
+	{
+		clear();
+
+		string directory = ".";
+		string prefix = file_name;
+
+		size_t pos = prefix.find_last_of("/\\");
+		if (pos != string::npos)
+		{
+			directory = prefix.substr(0, pos);
+			prefix = prefix.substr(pos + 1);
+		}
+
+		prefix += ".seg";
+
+		vector<string> file_names;
+		if (GetFileNames(directory.c_str(), prefix.c_str(), file_names) == false)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to list directory: ";
+			err_msg += directory.c_str();
+			return false;
+		}
+
+		vector<uint64_t> numbers;
+		for (size_t i = 0; i < file_names.size(); i++)
+		{
+			uint64_t number;
+			if (parse_segment_number(file_names[i].c_str() + prefix.size(), number))
+				numbers.push_back(number);
+		}
+
+		std::sort(numbers.begin(), numbers.end());
+
+		for (size_t i = 0; i < numbers.size(); i++)
+		{
+			Segment* seg = new_segment(numbers[i]);
+			m_segments.push_back(seg);
+
+			string segment_file_name = GetSegmentFileName(file_name, numbers[i]);
+			if (seg->db.LoadFromFile(segment_file_name.c_str(), err_msg) == false)
+				return false;
+		}
+
+		if (DoesFileExist(file_name))
+		{
+			if (load_unsegmented_file(file_name, err_msg) == false)
+				return false;
+		}
+
+		return true;
+	}
+
+	// Saves the changed segments, segments which are now empty are deleted
+	inline bool SaveToFile(const char* file_name, string& err_msg)
+	{
+		for (size_t i = 0; i < m_segments.size(); )
+		{
+			Segment* seg = m_segments[i];
+
+			if (seg->db.GetNumRecords() == 0)
+			{
+				drop_segment((uint32_t)i);
+				continue;
+			}
+
+			if (seg->changed)
+			{
+				string segment_file_name = GetSegmentFileName(file_name, seg->number);
+				if (seg->db.SaveToFile(segment_file_name.c_str(), err_msg) == false)
+					return false;
+
+				seg->changed = false;
+			}
+
+			i++;
+		}
+
+		for (size_t i = 0; i < m_dropped.size(); i++)
+		{
+			string segment_file_name = GetSegmentFileName(file_name, m_dropped[i]);
+			if (IndexedDB<RECORD_CLASS>::DeleteFiles(segment_file_name.c_str(), err_msg) == false)
+				return false;
+		}
+
+		m_dropped.clear();
+
+		// The segments now hold every record of the unsegmented file
+		if (m_drop_unsegmented_file)
+		{
+			if (IndexedDB<RECORD_CLASS>::DeleteFiles(file_name, err_msg) == false)
+				return false;
+
+			m_drop_unsegmented_file = false;
+		}
+
+		return true;
+	}
+
+	// One report per segment, <file_name>.seg<N>
+	inline bool GenerateReport(const char* file_name, string& err_msg)
+	{
+		for (size_t i = 0; i < m_segments.size(); i++)
+		{
+			string report_file_name = GetSegmentFileName(file_name, m_segments[i]->number);
+			if (m_segments[i]->db.GenerateReport(report_file_name.c_str(), err_msg) == false)
+				return false;
+		}
+
+		return true;
+	}
+};
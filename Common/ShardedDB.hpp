@@ -0,0 +1,435 @@
+// Copyright (c) AlgoMachines
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "SegmentedDB.hpp"
+
+#pragma once
+
+#define SHARDEDDB_MAGIC 0x44524853 // "SHRD"
+#define SHARDEDDB_MAX_SHARDS 64
+
+// SegmentedDB split into shards by the leading bits of RECORD_CLASS::GetKeyPrefix(), shard k is <file>.shard<k>.
+// Records with the same leading key (e.g. the messages of one receiver) are always in the same shard, and only
+// the shards which are used by a request are loaded.
+//
+// <file>.summary holds the number of records in each shard, so the total is known without loading the shards.
+// The summary is rewritten by SaveToFile() whenever the count of a loaded shard has changed. If it is missing while
+// there are shard files (the first save was interrupted before the summary was written, or it was deleted) the
+// shards are loaded and counted.
+template <class RECORD_CLASS> class ShardedDB
+{
+private:
+	struct SummaryHeader
+	{
+		uint32_t magic;
+		uint32_t nshards;
+	};
+
+	string m_file_name;
+
+	uint32_t m_nshards;
+	uint32_t m_shard_bits;
+
+	uint64_t m_segment_ms;
+	bool m_use_file_mapping;
+	bool m_use_log;
+	uint32_t m_log_compaction_bytes;
+	bool m_use_runs;
+	uint32_t m_max_runs;
+
+	vector<SegmentedDB<RECORD_CLASS>*> m_shards;	// 0 until the shard is loaded
+	vector<uint32_t> m_counts;						// records in each shard as of the last save
+	bool m_summary_changed;
+
+	// Not copyable, the shards are owned by exactly one object
+	ShardedDB(const ShardedDB&);
+	ShardedDB& operator = (const ShardedDB&);
+
+	inline void clear(void)
+	{
+		for (size_t i = 0; i < m_shards.size(); i++)
+			delete m_shards[i];
+
+		m_shards.clear();
+		m_counts.clear();
+		m_summary_changed = false;
+	}
+
+	inline void configure(SegmentedDB<RECORD_CLASS>& db) const
+	{
+		db.SetSegmentDuration(m_segment_ms);
+		db.EnableFileMapping(m_use_file_mapping);
+		db.EnableLog(m_use_log, m_log_compaction_bytes);
+		db.EnableRuns(m_use_runs, m_max_runs);
+	}
+
+	static inline string get_summary_file_name(const char* file_name)
+	{
+		string summary_file_name = file_name;
+		summary_file_name += ".summary";
+		return summary_file_name;
+	}
+
+	inline bool read_summary(const char* summary_file_name, string& err_msg)
+	{
+		FILE* stream = fopen(summary_file_name, "rb");
+		if (stream == 0)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to open file for reading: ";
+			err_msg += summary_file_name;
+			return false;
+		}
+
+		SummaryHeader header;
+		if (fread(&header, sizeof(header), 1, stream) != 1 || header.magic != SHARDEDDB_MAGIC ||
+			fread(&m_counts[0], sizeof(uint32_t), m_nshards, stream) != m_nshards)
+		{
+			fclose(stream);
+			ERROR_LOCATION(err_msg);
+			err_msg += "invalid summary file: ";
+			err_msg += summary_file_name;
+			return false;
+		}
+
+		fclose(stream);
+
+		if (header.nshards != m_nshards)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "the number of shards does not match the summary file: ";
+			err_msg += summary_file_name;
+			return false;
+		}
+
+		return true;
+	}
+
+	inline bool write_summary(const char* file_name, string& err_msg)
+	{
+		string summary_file_name = get_summary_file_name(file_name);
+
+		AtomicFileWriter file;
+		if (file.Open(summary_file_name.c_str(), err_msg) == false)
+			return false;
+
+		SummaryHeader header;
+		header.magic = SHARDEDDB_MAGIC;
+		header.nshards = m_nshards;
+
+		if (fwrite(&header, sizeof(header), 1, file.GetStream()) != 1 ||
+			fwrite(&m_counts[0], sizeof(uint32_t), m_nshards, file.GetStream()) != m_nshards)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "problem writing data to create file: ";
+			err_msg += summary_file_name.c_str();
+			return false;
+		}
+
+		if (file.Commit(err_msg) == false)
+			return false;
+
+		m_summary_changed = false;
+		return true;
+	}
+
+	// True if a file of any shard exists, <file>.shard<k>.seg<N> and the files next to it
+	static inline bool has_shard_files(const char* file_name)
+	{
+		string directory = ".";
+		string prefix = file_name;
+
+		size_t pos = prefix.find_last_of("/\\");
+		if (pos != string::npos)
+		{
+			directory = prefix.substr(0, pos);
+			prefix = prefix.substr(pos + 1);
+		}
+
+		prefix += ".shard";
+
+		vector<string> file_names;
+		return GetFileNames(directory.c_str(), prefix.c_str(), file_names) && file_names.size();
+	}
+
+	// Loads every shard, the counts of the summary are those of the shards
+	inline bool count_shards(string& err_msg)
+	{
+		for (uint32_t ishard = 0; ishard < m_nshards; ishard++)
+		{
+			SegmentedDB<RECORD_CLASS>* db = GetShard(ishard, err_msg);
+			if (db == 0)
+				return false;
+
+			m_counts[ishard] = db->GetNumRecords();
+		}
+
+		return true;
+	}
+
+	// Moves the records of an unsharded <file> (its segments, or the file itself) into the shards.
+	// The shards and the summary are saved before the unsharded files are deleted.
+	inline bool load_unsharded_files(const char* file_name, string& err_msg)
+	{
+		SegmentedDB<RECORD_CLASS> db;
+		configure(db);
+
+		if (db.LoadFromFile(file_name, err_msg) == false)
+			return false;
+
+		if (db.GetNumSegments() == 0 && DoesFileExist(file_name) == false)
+			return true;
+
+		for (uint32_t iseg = 0; iseg < db.GetNumSegments(); iseg++)
+		{
+			IndexedDB<RECORD_CLASS>& seg = db.GetSegment(iseg);
+			for (uint32_t idx = 0; idx < seg.GetNumRecords(); idx++)
+			{
+				bool changes_made;
+				if (UpdateRecord(*seg.GetRecordByIndex(idx), changes_made, err_msg) == false)
+					return false;
+			}
+		}
+
+		if (SaveToFile(file_name, err_msg) == false)
+			return false;
+
+		uint32_t nremoved;
+		if (db.RemoveOlderThan(0xFFFFFFFFFFFFFFFFULL, nremoved, err_msg) == false)
+			return false;
+
+		return db.SaveToFile(file_name, err_msg);
+	}
+
+public:
+
+	inline ShardedDB(void)
+	{
+		m_nshards = 1;
+		m_shard_bits = 0;
+		m_segment_ms = SEGMENTEDDB_SEGMENT_MS;
+		m_use_file_mapping = false;
+		m_use_log = false;
+		m_log_compaction_bytes = SIMPLEDB_LOG_COMPACTION_BYTES;
+		m_use_runs = false;
+		m_max_runs = SIMPLEDB_MAX_RUNS;
+		m_summary_changed = false;
+	}
+
+	inline ~ShardedDB(void)
+	{
+		clear();
+	}
+
+	// Must be set before loading, and must stay the same for the lifetime of the files.
+	// nshards is a power of two, up to SHARDEDDB_MAX_SHARDS.
+	inline bool SetNumShards(uint32_t nshards)
+	{
+		if (nshards == 0 || nshards > SHARDEDDB_MAX_SHARDS || (nshards & (nshards - 1)))
+			return false;
+
+		m_nshards = nshards;
+		m_shard_bits = 0;
+		while ((1u << m_shard_bits) < nshards)
+			m_shard_bits++;
+
+		return true;
+	}
+
+	// The settings below apply to the segments of every shard, set them before loading
+	inline void SetSegmentDuration(uint64_t segment_ms)
+	{
+		m_segment_ms = segment_ms;
+	}
+
+	inline void EnableFileMapping(bool use_file_mapping)
+	{
+		m_use_file_mapping = use_file_mapping;
+	}
+
+	inline void EnableLog(bool use_log, uint32_t log_compaction_bytes = SIMPLEDB_LOG_COMPACTION_BYTES)
+	{
+		m_use_log = use_log;
+		m_log_compaction_bytes = log_compaction_bytes;
+	}
+
+	inline void EnableRuns(bool use_runs, uint32_t max_runs = SIMPLEDB_MAX_RUNS)
+	{
+		m_use_runs = use_runs;
+		m_max_runs = max_runs;
+	}
+
+	static inline string GetShardFileName(const char* file_name, uint32_t ishard)
+	{
+		string shard_file_name = file_name;
+		shard_file_name += ".shard";
+		append_integer(shard_file_name, ishard);
+		return shard_file_name;
+	}
+
+	inline uint32_t GetNumShards(void) const
+	{
+		return m_nshards;
+	}
+
+	inline uint32_t GetShardNumber(const RECORD_CLASS& record) const
+	{
+		if (m_shard_bits == 0)
+			return 0;
+
+		return (uint32_t)(record.GetKeyPrefix() >> (64 - m_shard_bits));
+	}
+
+	// Loaded shards are counted as they are now, the others as of the last save
+	inline uint32_t GetNumRecords(void) const
+	{
+		uint32_t n = 0;
+		for (uint32_t ishard = 0; ishard < m_nshards; ishard++)
+			n += m_shards[ishard] ? m_shards[ishard]->GetNumRecords() : m_counts[ishard];
+
+		return n;
+	}
+
+	inline bool IsShardLoaded(uint32_t ishard) const
+	{
+		return m_shards[ishard] != 0;
+	}
+
+	// Of the loaded shards, see SimpleDB::ReleaseFileMappings()
+	inline bool ReleaseFileMappings(string& err_msg)
+	{
+		for (size_t ishard = 0; ishard < m_shards.size(); ishard++)
+		{
+			if (m_shards[ishard] && m_shards[ishard]->ReleaseFileMappings(err_msg) == false)
+				return false;
+		}
+
+		return true;
+	}
+
+	// Loads the shard on first use, returns 0 on error
+	inline SegmentedDB<RECORD_CLASS>* GetShard(uint32_t ishard, string& err_msg)
+	{
+		if (ishard >= m_nshards)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "invalid shard";
+			return 0;
+		}
+
+		if (m_shards[ishard])
+			return m_shards[ishard];
+
+		SegmentedDB<RECORD_CLASS>* db = new SegmentedDB<RECORD_CLASS>;
+		configure(*db);
+
+		string shard_file_name = GetShardFileName(m_file_name.c_str(), ishard);
+		if (db->LoadFromFile(shard_file_name.c_str(), err_msg) == false)
+		{
+			delete db;
+			return 0;
+		}
+
+		m_shards[ishard] = db;
+		return db;
+	}
+
+	inline bool UpdateRecord(const RECORD_CLASS& record, bool& changes_made, string& err_msg)
+	{
+		SegmentedDB<RECORD_CLASS>* db = GetShard(GetShardNumber(record), err_msg);
+		if (db == 0)
+			return false;
+
+		return db->UpdateRecord(record, changes_made, err_msg);
+	}
+
+	// Loads every shard
+	inline bool RemoveOlderThan(uint64_t t_ms, uint32_t& nremoved, string& err_msg)
+	{
+		nremoved = 0;
+
+		for (uint32_t ishard = 0; ishard < m_nshards; ishard++)
+		{
+			SegmentedDB<RECORD_CLASS>* db = GetShard(ishard, err_msg);
+			if (db == 0)
+				return false;
+
+			uint32_t nremoved_shard;
+			if (db->RemoveOlderThan(t_ms, nremoved_shard, err_msg) == false)
+				return false;
+
+			nremoved += nremoved_shard;
+		}
+
+		return true;
+	}
+
+	// Reads the summary, the shards are loaded by GetShard(). Without a summary the shards are counted, and the
+	// records of a store which was saved before it was sharded are moved into the shards.
+	inline bool LoadFromFile(const char* file_name, string& err_msg)
+	{
+		clear();
+
+		m_file_name = file_name;
+		m_shards.resize(m_nshards, 0);
+		m_counts.resize(m_nshards, 0);
+
+		string summary_file_name = get_summary_file_name(file_name);
+		if (DoesFileExist(summary_file_name.c_str()))
+			return read_summary(summary_file_name.c_str(), err_msg);
+
+		m_summary_changed = true;
+
+		if (has_shard_files(file_name) && count_shards(err_msg) == false)
+			return false;
+
+		return load_unsharded_files(file_name, err_msg);
+	}
+
+	// Saves the loaded shards, then the summary if a shard count has changed
+	inline bool SaveToFile(const char* file_name, string& err_msg)
+	{
+		for (uint32_t ishard = 0; ishard < m_nshards; ishard++)
+		{
+			SegmentedDB<RECORD_CLASS>* db = m_shards[ishard];
+			if (db == 0)
+				continue;
+
+			string shard_file_name = GetShardFileName(file_name, ishard);
+			if (db->SaveToFile(shard_file_name.c_str(), err_msg) == false)
+				return false;
+
+			if (m_counts[ishard] != db->GetNumRecords())
+			{
+				m_counts[ishard] = db->GetNumRecords();
+				m_summary_changed = true;
+			}
+		}
+
+		if (m_summary_changed || m_file_name != file_name)
+		{
+			if (write_summary(file_name, err_msg) == false)
+				return false;
+		}
+
+		m_file_name = file_name;
+		return true;
+	}
+
+	// Reports of the loaded shards, one per segment, <file_name>.shard<k>.seg<N>
+	inline bool GenerateReport(const char* file_name, string& err_msg)
+	{
+		for (uint32_t ishard = 0; ishard < m_nshards; ishard++)
+		{
+			if (m_shards[ishard] == 0)
+				continue;
+
+			string shard_file_name = GetShardFileName(file_name, ishard);
+			if (m_shards[ishard]->GenerateReport(shard_file_name.c_str(), err_msg) == false)
+				return false;
+		}
+
+		return true;
+	}
+};
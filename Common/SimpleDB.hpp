@@ -4,26 +4,290 @@
 
 #include "string_tools.h"
 #include "file_tools.h"
+#include "MappedFile.h"
+#include "HashIndex.h"
+#include "CRC32C.h"
+
+#include <algorithm>
+#include <type_traits>
 
 #pragma once
 
+// Base file layout: [FileHeader][records][CRC32C of each block of records], see SimpleDB::GetFileSize()
+#define SIMPLEDB_MAGIC 0x4244454C504D4953ULL // "SIMPLEDB"
+#define SIMPLEDB_FORMAT_VERSION 1
+#define SIMPLEDB_BLOCK_SIZE 4096 // records are checksummed in blocks of about this many bytes
+
+// Operations recorded in the mutation log, each log entry is [op - 1 byte][record image]
+#define SIMPLEDB_LOG_INSERT 1
+#define SIMPLEDB_LOG_UPDATE 2
+#define SIMPLEDB_LOG_REMOVE 3
+
+// Default size at which the mutation log is folded back into a new base file, or into a sorted run (see EnableRuns())
+#define SIMPLEDB_LOG_COMPACTION_BYTES 131072
+
+// Default number of sorted runs kept before they are merged into the base file, see EnableRuns()
+#define SIMPLEDB_MAX_RUNS 4
+
+// Interpolation probes made before an interpolation search falls back to binary search
+#define SIMPLEDB_INTERPOLATION_PROBES 8
+
+// Plain fixed size records - Assign() and LoadFromBuffer() copy the whole record image and sizeof(RECORD_CLASS) == GetSizeBytes() -
+// are loaded, shifted and copied in bulk with memcpy / memmove instead of one Assign() call per record.
+// Specialize with IS_PLAIN_DATA = false for a trivially copyable record which needs its own serialization.
+template <class RECORD_CLASS> struct SimpleDBRecordTraits
+{
+	static const bool IS_PLAIN_DATA = std::is_trivially_copyable<RECORD_CLASS>::value;
+};
+
+// Records are kept sorted by RECORD_CLASS::Compare(), a three way comparison of the record keys
+// returning < 0, 0 or > 0, so every search probe costs a single key comparison.
+// RECORD_CLASS::GetKeyPrefix() returns the leading 8 key bytes as a big endian integer, see EnableInterpolationSearch().
 template <class RECORD_CLASS, class INDEX_TYPE=uint32_t> class SimpleDB 
 {
 private:
 	vector<RECORD_CLASS> m_records;
+
+	// Read mostly mode - records are served straight from a private mapping of the file
+	// until the first insert or remove, at which point they are copied into m_records.
+	bool m_use_file_mapping;
+	MappedFile m_mapped_file;
+	string m_mapped_file_name;
+	RECORD_CLASS* m_mapped_records;
+	INDEX_TYPE m_nmapped_records;
+
+	// Mutation log - changes are appended to <file>.log and replayed on load,
+	// the base file is only rewritten when the log grows past m_log_compaction_bytes
+	bool m_use_log;
+	uint32_t m_log_compaction_bytes;
+	vector<uint8_t> m_log_pending;		// entries not yet written to the log
+	uint64_t m_log_bytes;				// bytes of the log which have been applied to the records, see replay_log_tail()
+	bool m_log_unread;					// entries which another process saved before ours are not in the records, see GetSavedState()
+	string m_base_file;					// the file the records were loaded from or last saved to
+	vector<uint32_t> m_block_crcs;		// block checksums of m_base_file
+	mutable vector<bool> m_block_verified;	// mapped blocks whose checksum has been checked, see verify_block()
+	mutable string m_block_err_msg;		// the first mapped block found damaged
+	uint64_t m_generation;				// generation of m_base_file, each full save writes the next one
+	bool m_base_file_has_header;		// false for a file written before the header was added, converted by the next full save
+
+	// Sorted runs - a full log is collapsed into <file>.run<N> instead of rewriting the file,
+	// the runs are merged into the file once there are more than m_max_runs of them
+	bool m_use_runs;
+	uint32_t m_max_runs;
+	uint32_t m_nruns;					// runs of m_base_file, <file>.run0 .. <file>.run<m_nruns - 1>
+
+	// Records are fixed size, so when no record has been inserted or removed since the load
+	// the changed records can be written in place at their offset in the base file
+	bool m_structure_changed;
+	vector<INDEX_TYPE> m_changed_records;
+
+	// Interpolation search on RECORD_CLASS::GetKeyPrefix(), for uniformly distributed keys (e.g. hashed IDs)
+	bool m_use_interpolation_search;
+
+	// Hash index of the saved records in <file>.idx, used for lookups until a record is inserted or removed
+	bool m_use_hash_index;
+	HashIndex m_hash_index;
+	mutable bool m_hash_index_stale;	// a record was found which the index missed
+
+	// Stored little endian at the start of the base file, header_crc covers the bytes before it
+	struct FileHeader
+	{
+		uint64_t magic;
+		uint32_t version;
+		uint32_t header_size;
+		uint32_t record_size;
+		uint32_t records_per_block;
+		uint64_t nrecords;
+		uint64_t generation;
+		uint32_t table_crc;				// CRC32C of the block checksum table
+		uint8_t reserved[16];
+		uint32_t header_crc;
+	};
+
+	struct LogEntry
+	{
+		RECORD_CLASS record;
+		uint8_t op;
+		uint32_t seq;
+	};
+
+	struct RecordLess
+	{
+		inline bool operator () (const RECORD_CLASS& a, const RECORD_CLASS& b) const
+		{
+			return a.Compare(b) < 0;
+		}
+	};
+
+	// Orders log entries by record, then by the order in which they were logged
+	struct LogEntryLess
+	{
+		inline bool operator () (const LogEntry& a, const LogEntry& b) const
+		{
+			int state = a.record.Compare(b.record);
+			if (state)
+				return state < 0;
+
+			return a.seq < b.seq;
+		}
+	};
+
+	inline RECORD_CLASS* get_records(void) const
+	{
+		if (m_mapped_records)
+			return m_mapped_records;
+
+		if (m_records.size() == 0)
+			return 0;
+
+		return (RECORD_CLASS*)&m_records[0];
+	}
+
+	static inline bool is_plain_data(void)
+	{
+		return SimpleDBRecordTraits<RECORD_CLASS>::IS_PLAIN_DATA && sizeof(RECORD_CLASS) == RECORD_CLASS::GetSizeBytes();
+	}
+
+	static inline bool copy_record(RECORD_CLASS& dst, const RECORD_CLASS& src, string& err_msg)
+	{
+		if (is_plain_data())
+		{
+			memcpy((void*)&dst, &src, sizeof(RECORD_CLASS));
+			return true;
+		}
+
+		return dst.Assign(src, err_msg);
+	}
+
+	// Moves the n records at isrc to idst, the ranges may overlap
+	inline bool move_records(INDEX_TYPE idst, INDEX_TYPE isrc, INDEX_TYPE n, string& err_msg)
+	{
+		if (n == 0 || idst == isrc)
+			return true;
+
+		if (is_plain_data())
+		{
+			memmove((void*)&m_records[idst], &m_records[isrc], (size_t)n * sizeof(RECORD_CLASS));
+			return true;
+		}
+
+		if (idst < isrc)
+		{
+			for (INDEX_TYPE i = 0; i < n; i++)
+			{
+				if (m_records[idst + i].Assign(m_records[isrc + i], err_msg) == false)
+					return false;
+			}
+		}
+		else
+		{
+			for (INDEX_TYPE i = n; i > 0; i--)
+			{
+				if (m_records[idst + i - 1].Assign(m_records[isrc + i - 1], err_msg) == false)
+					return false;
+			}
+		}
+
+		return true;
+	}
+
+	inline void release_mapping(void)
+	{
+		m_mapped_records = 0;
+		m_nmapped_records = 0;
+		m_mapped_file.Close();
+		m_block_verified.clear();
+	}
+
+	// A mapped file is not checked by the load, each block is checked the first time one of its records is handed out.
+	// The records of a damaged block are treated as missing, and the error is kept for CheckBlocks().
+	inline bool verify_block(INDEX_TYPE idx) const
+	{
+		if (m_block_verified.size() == 0)
+			return true;
+
+		uint64_t iblock = idx / get_records_per_block();
+		if (m_block_verified[(size_t)iblock])
+			return true;
+
+		if (get_block_crc(m_mapped_records, m_nmapped_records, iblock) != m_block_crcs[(size_t)iblock])
+		{
+			if (m_block_err_msg.size() == 0)
+			{
+				ERROR_LOCATION(m_block_err_msg);
+				m_block_err_msg += "checksum mismatch in block ";
+				append_integer(m_block_err_msg, (uint32_t)iblock);
+				m_block_err_msg += " of file: ";
+				m_block_err_msg += m_mapped_file_name;
+			}
+
+			return false;
+		}
+
+		m_block_verified[(size_t)iblock] = true;
+		return true;
+	}
+
+	inline bool load_records(const void* buffer, INDEX_TYPE nrecords, string& err_msg)
+	{
+		m_records.resize(nrecords);
+
+		if (is_plain_data())
+		{
+			if (nrecords)
+				memcpy((void*)&m_records[0], buffer, (size_t)nrecords * sizeof(RECORD_CLASS));
+			return true;
+		}
+		
+		const uint8_t *b = (const uint8_t *)buffer;
+		
+		for (INDEX_TYPE irec=0; irec < nrecords; irec++)
+		{
+			INDEX_TYPE nbytes = m_records[irec].LoadFromBuffer (b);
+			if (nbytes == 0)
+			{
+				ERROR_LOCATION(err_msg);
+				err_msg += "() problem reading buffer at record ";
+				append_integer(err_msg,irec);
+				return false;
+			}
+			b += nbytes;
+		}
+		
+		return true;
+	}
+
+	// Called before any change to the number or order of the records.
+	// Changes made in place (e.g. Update()) are fine on the private mapping and don't need a copy.
+	inline bool detach_mapping(string& err_msg)
+	{
+		if (m_mapped_records == 0)
+			return true;
+
+		// The records are about to be moved away from their blocks, or written out with new checksums
+		if (CheckBlocks(err_msg) == false)
+			return false;
+
+		bool status = load_records(m_mapped_records, m_nmapped_records, err_msg);
+		release_mapping();
+		return status;
+	}
 	
 	inline INDEX_TYPE linear_search(const RECORD_CLASS &record, INDEX_TYPE istart, INDEX_TYPE iend, bool &exists) const
 	{	
+		const RECORD_CLASS* records = get_records();
+
 		INDEX_TYPE i = istart;
 		while (i <= iend)
 		{
-			if (record < m_records[i])
+			int state = record.Compare(records[i]);
+			if (state < 0)
 			{
 				exists = false;
 				return i;
 			}
 			
-			if (record > m_records[i])
+			if (state > 0)
 			{
 				i++;
 				continue;
@@ -36,132 +300,1384 @@ private:
 		exists = false;
 		return i; // i == iend + 1
 	}
-		
-public:
 
-	inline INDEX_TYPE GetNumRecords(void) const
+	inline INDEX_TYPE binary_search(const RECORD_CLASS& record, INDEX_TYPE istart, INDEX_TYPE iend, bool& exists) const
 	{
-		return (INDEX_TYPE)m_records.size();
+		const RECORD_CLASS* records = get_records();
+
+		while (iend - istart >= 4)
+		{
+			INDEX_TYPE i = istart + (iend - istart) / 2;
+
+			int state = record.Compare(records[i]);
+			if (state < 0)
+				iend = i - 1;
+			else
+			{
+				if (state > 0)
+					istart = i + 1;
+				else
+				{
+					exists = true;
+					return i;
+				}
+			}
+		}
+
+		return linear_search(record, istart, iend, exists);
 	}
 
-	inline bool RemoveRecord(INDEX_TYPE idx, string& err_msg)
+	// Probes where the key prefix of record would be if the prefixes were evenly spread between the ends of the range.
+	// The range shrinks around the record, after SIMPLEDB_INTERPOLATION_PROBES probes the rest of it is binary searched.
+	inline INDEX_TYPE interpolation_search(const RECORD_CLASS& record, INDEX_TYPE istart, INDEX_TYPE iend, bool& exists) const
 	{
-		if (idx < 0 || idx >= m_records.size())
+		const RECORD_CLASS* records = get_records();
+		uint64_t key = record.GetKeyPrefix();
+
+		for (uint32_t nprobes = 0; nprobes < SIMPLEDB_INTERPOLATION_PROBES && iend - istart >= 4; nprobes++)
 		{
-			ERROR_LOCATION(err_msg);
-			err_msg += "() invalid record index ";
-			append_integer(err_msg, idx);
-			return false;
+			uint64_t key_start = records[istart].GetKeyPrefix();
+			uint64_t key_end = records[iend].GetKeyPrefix();
+
+			if (key < key_start)
+			{
+				exists = false;
+				return istart;
+			}
+
+			if (key > key_end)
+			{
+				exists = false;
+				return iend + 1;
+			}
+
+			if (key_end == key_start)
+				break; // prefixes are no help, compare full keys
+
+			double f = (double)(key - key_start) / (double)(key_end - key_start);
+			INDEX_TYPE i = istart + (INDEX_TYPE)(f * (iend - istart));
+			if (i > iend)
+				i = iend;
+
+			int state = record.Compare(records[i]);
+			if (state == 0)
+			{
+				exists = true;
+				return i;
+			}
+
+			if (state < 0)
+			{
+				if (i == istart)
+				{
+					exists = false;
+					return istart;
+				}
+
+				iend = i - 1;
+			}
+			else
+			{
+				if (i == iend)
+				{
+					exists = false;
+					return iend + 1;
+				}
+
+				istart = i + 1;
+			}
 		}
 
-		m_records.erase(m_records.begin() + idx);
+		return binary_search(record, istart, iend, exists);
+	}
 
-		return true;
+	static inline string get_log_file_name(const char* file_name)
+	{
+		string log_file_name = file_name;
+		log_file_name += ".log";
+		return log_file_name;
 	}
 
-	inline bool LoadFromBuffer (const void *buffer, INDEX_TYPE nrecords, string &err_msg)
+	static inline string get_run_file_name(const char* file_name, uint32_t irun)
 	{
-		m_records.resize(nrecords);
-		
-		const uint8_t *b = (const uint8_t *)buffer;
-		
-		for (INDEX_TYPE irec=0; irec < nrecords; irec++)
+		string run_file_name = file_name;
+		run_file_name += ".run";
+		append_integer(run_file_name, irun);
+		return run_file_name;
+	}
+
+	static inline uint32_t count_runs(const char* file_name)
+	{
+		uint32_t nruns = 0;
+		while (DoesFileExist(get_run_file_name(file_name, nruns).c_str()))
+			nruns++;
+
+		return nruns;
+	}
+
+	static inline bool delete_runs(const char* file_name, string& err_msg)
+	{
+		for (uint32_t irun = count_runs(file_name); irun > 0; irun--)
 		{
-			INDEX_TYPE nbytes = m_records[irec].LoadFromBuffer (b);
-			if (nbytes == 0)
+			string run_file_name = get_run_file_name(file_name, irun - 1);
+			if (DeleteFile(run_file_name.c_str()) == false)
 			{
 				ERROR_LOCATION(err_msg);
-				err_msg += "() problem reading buffer at record ";
-				append_integer(err_msg,irec);
+				err_msg += "unable to delete file: ";
+				err_msg += run_file_name.c_str();
 				return false;
 			}
-			b += nbytes;
 		}
-		
+
 		return true;
 	}
 
-	inline const RECORD_CLASS* GetRecord(const RECORD_CLASS& token, INDEX_TYPE *ret_idx=0) const
+	static inline string get_hash_index_file_name(const char* file_name)
+	{
+		string index_file_name = file_name;
+		index_file_name += ".idx";
+		return index_file_name;
+	}
+
+	inline bool hash_index_lookup(const RECORD_CLASS& record, INDEX_TYPE& idx) const
+	{
+		if (m_hash_index.IsOpen() == false || m_structure_changed)
+			return false;
+
+		const RECORD_CLASS* records = get_records();
+		INDEX_TYPE nrecords = GetNumRecords();
+
+		uint64_t key = record.GetKeyPrefix();
+		uint32_t slot = m_hash_index.GetFirstSlot(key);
+		uint32_t i;
+		while (m_hash_index.GetNextCandidate(key, slot, i))
+		{
+			if (i < nrecords && record.Compare(records[i]) == 0)
+			{
+				idx = (INDEX_TYPE)i;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// Called once the records have been saved to file_name, rewrites <file>.idx unless it still describes them
+	inline bool save_hash_index(const char* file_name, string& err_msg)
+	{
+		if (m_use_hash_index == false)
+			return true;
+
+		if (m_hash_index.IsOpen() && m_structure_changed == false && m_hash_index_stale == false &&
+			m_hash_index.GetNumRecords() == GetNumRecords())
+		{
+			return true;
+		}
+
+		vector<uint64_t> keys;
+		keys.resize(GetNumRecords());
+
+		const RECORD_CLASS* records = get_records();
+		for (INDEX_TYPE idx = 0; idx < GetNumRecords(); idx++)
+			keys[idx] = records[idx].GetKeyPrefix();
+
+		string index_file_name = get_hash_index_file_name(file_name);
+
+		// windows won't replace a mapped file
+		m_hash_index.Close();
+
+		if (HashIndex::Build(index_file_name.c_str(), RECORD_CLASS::GetSizeBytes(), keys, err_msg) == false)
+			return false;
+
+		m_hash_index_stale = false;
+		return m_hash_index.Open(index_file_name.c_str(), RECORD_CLASS::GetSizeBytes(), GetNumRecords(), err_msg);
+	}
+
+	inline void log_operation(uint8_t op, const RECORD_CLASS& record)
+	{
+		if (m_use_log == false)
+			return;
+
+		uint32_t record_sz = RECORD_CLASS::GetSizeBytes();
+		size_t n = m_log_pending.size();
+		m_log_pending.resize(n + 1 + record_sz);
+		m_log_pending[n] = op;
+		memmove(&m_log_pending[n + 1], &record, record_sz);
+	}
+
+	inline bool append_log(const char* log_file_name, string& err_msg)
+	{
+		if (m_log_pending.size() == 0)
+			return true;
+
+		FILE* stream = fopen(log_file_name, "ab");
+		if (stream == 0)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to open log file: ";
+			err_msg += log_file_name;
+			return false;
+		}
+
+		// A torn entry left by an interrupted append is cut off first, the entries written after it would
+		// be misaligned and lost to read_log_entries()
+		uint32_t entry_sz = 1 + RECORD_CLASS::GetSizeBytes();
+		int64_t flen = filelength64(log_file_name);
+		if (flen < 0)
+			flen = 0;
+
+		if ((flen % entry_sz) && truncate_stream(stream, (uint64_t)(flen - flen % entry_sz)) == false)
+		{
+			fclose(stream);
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to truncate the torn entry of log file: ";
+			err_msg += log_file_name;
+			return false;
+		}
+
+		if (fwrite(&m_log_pending[0], 1, m_log_pending.size(), stream) != m_log_pending.size())
+		{
+			fclose(stream);
+			ERROR_LOCATION(err_msg);
+			err_msg += "problem writing to log file: ";
+			err_msg += log_file_name;
+			return false;
+		}
+
+		if (FileSync::Commit(stream, log_file_name, err_msg) == false)
+		{
+			fclose(stream);
+			return false;
+		}
+
+		fclose(stream);
+
+		// Entries which another process appended in between are left to the next replay_log_tail()
+		if (m_log_bytes == (uint64_t)(flen - flen % entry_sz))
+			m_log_bytes += m_log_pending.size();
+		else
+			m_log_unread = true;
+
+		m_log_pending.clear();
+		return true;
+	}
+
+	// Appends the entries in data, [op][record image] each, to entries
+	static inline bool parse_log_entries(const uint8_t* data, uint32_t nentries, const char* log_file_name, vector<LogEntry>& entries, string& err_msg)
+	{
+		uint32_t entry_sz = 1 + RECORD_CLASS::GetSizeBytes();
+		uint32_t nprev = (uint32_t)entries.size();
+		entries.resize(nprev + nentries);
+
+		for (uint32_t i = 0; i < nentries; i++)
+		{
+			const uint8_t* b = &data[i * entry_sz];
+			LogEntry& entry = entries[nprev + i];
+			entry.op = b[0];
+			entry.seq = nprev + i;
+
+			if (entry.op < SIMPLEDB_LOG_INSERT || entry.op > SIMPLEDB_LOG_REMOVE || entry.record.LoadFromBuffer(b + 1) == 0)
+			{
+				ERROR_LOCATION(err_msg);
+				err_msg += "invalid log entry ";
+				append_integer(err_msg, i);
+				err_msg += " : ";
+				err_msg += log_file_name;
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	// Appends the entries of a log or run file to entries
+	static inline bool read_log_entries(const char* log_file_name, vector<LogEntry>& entries, string& err_msg)
+	{
+		int flen = filelength(log_file_name);
+		if (flen <= 0)
+			return true;
+
+		uint32_t record_sz = RECORD_CLASS::GetSizeBytes();
+		uint32_t entry_sz = 1 + record_sz;
+		uint32_t nentries = flen / entry_sz; // a torn entry at the end of the log is ignored, and cut off by the next append_log()
+
+		if (nentries == 0)
+			return true;
+
+		vector<uint8_t> data;
+		data.resize(nentries * entry_sz);
+
+		FILE* stream = fopen(log_file_name, "rb");
+		if (!stream)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to open log file for reading: ";
+			err_msg += log_file_name;
+			return false;
+		}
+
+		if (fread(&data[0], 1, data.size(), stream) != data.size())
+		{
+			fclose(stream);
+			ERROR_LOCATION(err_msg);
+			err_msg += "problem reading data from log file: ";
+			err_msg += log_file_name;
+			return false;
+		}
+
+		fclose(stream);
+
+		return parse_log_entries(&data[0], nentries, log_file_name, entries, err_msg);
+	}
+
+	// Only the last operation logged for each record matters, leaves that one in record order
+	static inline void collapse_log_entries(vector<LogEntry>& entries)
+	{
+		std::sort(entries.begin(), entries.end(), LogEntryLess());
+
+		size_t n = 0;
+		for (size_t i = 0; i < entries.size(); i++)
+		{
+			if (i + 1 < entries.size() && entries[i].record.Compare(entries[i + 1].record) == 0)
+				continue;
+
+			if (n != i)
+				entries[n] = entries[i];
+			n++;
+		}
+
+		entries.resize(n);
+	}
+
+	// Applies a log or run file to the records, which were loaded from the base file and the runs before it
+	inline bool replay_log(const char* log_file_name, string& err_msg)
+	{
+		vector<LogEntry> entries;
+		if (read_log_entries(log_file_name, entries, err_msg) == false)
+			return false;
+
+		collapse_log_entries(entries);
+
+		return apply_log_entries(entries, err_msg);
+	}
+
+	// Applies the entries which were appended to the log since it was last read - by this object, or by another process
+	// which saved its changes of records in place (see CanSaveInPlace())
+	inline bool replay_log_tail(const char* log_file_name, string& err_msg)
+	{
+		int64_t flen = filelength64(log_file_name);
+		if (flen < 0)
+			flen = 0;
+
+		if ((uint64_t)flen < m_log_bytes)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "log file was replaced since it was read: ";
+			err_msg += log_file_name;
+			return false;
+		}
+
+		// A torn entry at the end is ignored, it is cut off by the next append_log()
+		uint32_t entry_sz = 1 + RECORD_CLASS::GetSizeBytes();
+		uint32_t nentries = (uint32_t)(((uint64_t)flen - m_log_bytes) / entry_sz);
+		if (nentries == 0)
+			return true;
+
+		vector<uint8_t> data;
+		data.resize((size_t)nentries * entry_sz);
+
+		FILE* stream = fopen(log_file_name, "rb");
+		if (!stream)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to open log file for reading: ";
+			err_msg += log_file_name;
+			return false;
+		}
+
+		if (fseek64(stream, m_log_bytes) == false || fread(&data[0], 1, data.size(), stream) != data.size())
+		{
+			fclose(stream);
+			ERROR_LOCATION(err_msg);
+			err_msg += "problem reading data from log file: ";
+			err_msg += log_file_name;
+			return false;
+		}
+
+		fclose(stream);
+
+		vector<LogEntry> entries;
+		if (parse_log_entries(&data[0], nentries, log_file_name, entries, err_msg) == false)
+			return false;
+
+		collapse_log_entries(entries);
+
+		if (apply_log_entries(entries, err_msg) == false)
+			return false;
+
+		m_log_bytes += data.size();
+		return true;
+	}
+
+	// Collapses <file>.log and the entries not yet logged into the next run, a run holds the last operation on
+	// each record in record order - removed records are kept as SIMPLEDB_LOG_REMOVE entries (tombstones) until
+	// the runs are merged into the base file
+	inline bool write_run(const char* file_name, const char* log_file_name, string& err_msg)
+	{
+		uint32_t entry_sz = 1 + RECORD_CLASS::GetSizeBytes();
+		int64_t flen = filelength64(log_file_name);
+		if (flen > 0 && m_log_bytes != (uint64_t)(flen - flen % entry_sz))
+			m_log_unread = true;
+
+		vector<LogEntry> entries;
+		if (read_log_entries(log_file_name, entries, err_msg) == false)
+			return false;
+
+		if (m_log_pending.size() && parse_log_entries(&m_log_pending[0], (uint32_t)(m_log_pending.size() / entry_sz), log_file_name, entries, err_msg) == false)
+			return false;
+
+		collapse_log_entries(entries);
+
+		vector<uint8_t> data;
+		data.resize(entries.size() * entry_sz);
+		for (size_t i = 0; i < entries.size(); i++)
+		{
+			data[i * entry_sz] = entries[i].op;
+			memmove(&data[i * entry_sz + 1], &entries[i].record, entry_sz - 1);
+		}
+
+		string run_file_name = get_run_file_name(file_name, m_nruns);
+
+		AtomicFileWriter file;
+		if (file.Open(run_file_name.c_str(), err_msg) == false)
+			return false;
+
+		if (data.size() && fwrite(&data[0], 1, data.size(), file.GetStream()) != data.size())
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "problem writing data to create file: ";
+			err_msg += run_file_name.c_str();
+			return false;
+		}
+
+		if (file.Commit(err_msg) == false)
+			return false;
+
+		// Everything in the log is now in the run
+		if (DoesFileExist(log_file_name) && DeleteFile(log_file_name) == false)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to delete file: ";
+			err_msg += log_file_name;
+			return false;
+		}
+
+		m_log_pending.clear();
+		m_log_bytes = 0;
+		m_nruns++;
+		return true;
+	}
+
+	// Applies collapsed log entries to the records.
+	// Updates of existing records are applied in place, anything else is merged in a single pass.
+	inline bool apply_log_entries(const vector<LogEntry>& entries, string& err_msg)
+	{
+		uint32_t n = (uint32_t)entries.size();
+		if (n == 0)
+			return true;
+
+		// Common case - existing records were modified, the mapping (if any) is kept
+		bool in_place = true;
+		for (uint32_t i = 0; i < n; i++)
+		{
+			bool exists;
+			GetRecordIndex(entries[i].record, exists);
+			if (exists == false || entries[i].op == SIMPLEDB_LOG_REMOVE)
+			{
+				in_place = false;
+				break;
+			}
+		}
+
+		if (in_place)
+		{
+			RECORD_CLASS* records = get_records();
+			for (uint32_t i = 0; i < n; i++)
+			{
+				bool exists;
+				INDEX_TYPE idx = GetRecordIndex(entries[i].record, exists);
+				if (records[idx].Update(entries[i].record, err_msg) == false)
+					return false;
+			}
+
+			return true;
+		}
+
+		if (detach_mapping(err_msg) == false)
+			return false;
+
+		vector<RECORD_CLASS> merged;
+		merged.resize(m_records.size() + n);
+
+		INDEX_TYPE nmerged = 0;
+		size_t i = 0, j = 0;
+		while (i < m_records.size() || j < n)
+		{
+			int state = 0;
+			if (i < m_records.size() && j < n)
+				state = m_records[i].Compare(entries[j].record);
+
+			if (j == n || (i < m_records.size() && state < 0))
+			{
+				if (copy_record(merged[nmerged++], m_records[i++], err_msg) == false)
+					return false;
+				continue;
+			}
+
+			if (i == m_records.size() || state > 0)
+			{
+				if (entries[j].op != SIMPLEDB_LOG_REMOVE)
+				{
+					if (copy_record(merged[nmerged++], entries[j].record, err_msg) == false)
+						return false;
+				}
+				j++;
+				continue;
+			}
+
+			// Same record in the base file and the log
+			if (entries[j].op != SIMPLEDB_LOG_REMOVE)
+			{
+				if (copy_record(merged[nmerged], m_records[i], err_msg) == false)
+					return false;
+
+				if (merged[nmerged++].Update(entries[j].record, err_msg) == false)
+					return false;
+			}
+
+			i++;
+			j++;
+		}
+
+		merged.resize(nmerged);
+		m_records.swap(merged);
+
+		return true;
+	}
+
+	static inline uint32_t get_records_per_block(void)
+	{
+		uint32_t record_sz = RECORD_CLASS::GetSizeBytes();
+		return record_sz < SIMPLEDB_BLOCK_SIZE ? SIMPLEDB_BLOCK_SIZE / record_sz : 1;
+	}
+
+	static inline uint64_t get_nblocks(uint64_t nrecords)
+	{
+		uint32_t records_per_block = get_records_per_block();
+		return (nrecords + records_per_block - 1) / records_per_block;
+	}
+
+	// CRC32C of the file image of block iblock, the last block may hold fewer records
+	static inline uint32_t get_block_crc(const RECORD_CLASS* records, uint64_t nrecords, uint64_t iblock)
+	{
+		uint32_t record_sz = RECORD_CLASS::GetSizeBytes();
+		uint64_t istart = iblock * get_records_per_block();
+		uint64_t n = nrecords - istart;
+		if (n > get_records_per_block())
+			n = get_records_per_block();
+
+		return CRC32C::Compute((const uint8_t*)records + istart * record_sz, (size_t)(n * record_sz));
+	}
+
+	static inline void set_header(FileHeader& header, uint64_t nrecords, uint64_t generation, const vector<uint32_t>& block_crcs)
+	{
+		memset(&header, 0, sizeof(header));
+		header.magic = SIMPLEDB_MAGIC;
+		header.version = SIMPLEDB_FORMAT_VERSION;
+		header.header_size = sizeof(FileHeader);
+		header.record_size = RECORD_CLASS::GetSizeBytes();
+		header.records_per_block = get_records_per_block();
+		header.nrecords = nrecords;
+		header.generation = generation;
+		header.table_crc = CRC32C::Compute(block_crcs.size() ? &block_crcs[0] : 0, block_crcs.size() * sizeof(uint32_t));
+		header.header_crc = CRC32C::Compute(&header, offsetof(FileHeader, header_crc));
+	}
+
+	static inline bool is_valid_header(const FileHeader& header, int64_t flen)
+	{
+		return header.magic == SIMPLEDB_MAGIC && header.version == SIMPLEDB_FORMAT_VERSION &&
+			header.header_size == sizeof(FileHeader) && header.record_size == RECORD_CLASS::GetSizeBytes() &&
+			header.records_per_block == get_records_per_block() &&
+			header.header_crc == CRC32C::Compute(&header, offsetof(FileHeader, header_crc)) &&
+			header.nrecords <= (uint64_t)(INDEX_TYPE)-1 && flen == (int64_t)GetFileSize(header.nrecords);
+	}
+
+	// Reads and checks the header and the block checksum table, the records themselves are checked by check_blocks().
+	// has_header is false for a file written before the header was added - plain records, header.nrecords is set from the file size.
+	static inline bool read_header(const char* file_name, FileHeader& header, vector<uint32_t>& block_crcs, bool& has_header, string& err_msg)
+	{
+		has_header = false;
+		block_crcs.clear();
+
+		int64_t flen = filelength64(file_name);
+		if (flen < 0)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "file does not exist: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		FILE* stream = fopen(file_name, "rb");
+		if (!stream)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to open file for reading: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		if (flen < (int64_t)sizeof(FileHeader) || fread(&header, sizeof(FileHeader), 1, stream) != 1 || header.magic != SIMPLEDB_MAGIC)
+		{
+			fclose(stream);
+
+			uint32_t record_sz = RECORD_CLASS::GetSizeBytes();
+			if (flen % record_sz)
+			{
+				ERROR_LOCATION(err_msg);
+				err_msg += "file has invalid size:";
+				append_integer(err_msg, (uint32_t)flen);
+				err_msg += " must be a multiple or record size: ";
+				append_integer(err_msg, record_sz);
+				err_msg += " :";
+				err_msg += file_name;
+				return false;
+			}
+
+			memset(&header, 0, sizeof(header));
+			header.nrecords = (uint64_t)flen / record_sz;
+			return true;
+		}
+
+		if (is_valid_header(header, flen) == false)
+		{
+			fclose(stream);
+			ERROR_LOCATION(err_msg);
+			err_msg += "invalid header, the file is damaged or has a different record layout: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		block_crcs.resize((size_t)get_nblocks(header.nrecords));
+		if (block_crcs.size() &&
+			(fseek64(stream, sizeof(FileHeader) + header.nrecords * RECORD_CLASS::GetSizeBytes()) == false ||
+			fread(&block_crcs[0], sizeof(uint32_t), block_crcs.size(), stream) != block_crcs.size()))
+		{
+			fclose(stream);
+			ERROR_LOCATION(err_msg);
+			err_msg += "problem reading the block checksums from file: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		fclose(stream);
+
+		if (CRC32C::Compute(block_crcs.size() ? &block_crcs[0] : 0, block_crcs.size() * sizeof(uint32_t)) != header.table_crc)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "block checksums are damaged: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		has_header = true;
+		return true;
+	}
+
+	// Reads the records of a file with a header and checks every block - a full scan
+	static inline bool check_file_blocks(const char* file_name, const FileHeader& header, const vector<uint32_t>& block_crcs, string& err_msg)
+	{
+		size_t nbytes = (size_t)header.nrecords * RECORD_CLASS::GetSizeBytes();
+		if (nbytes == 0)
+			return true;
+
+		vector<uint8_t> data;
+		data.resize(nbytes);
+
+		FILE* stream = fopen(file_name, "rb");
+		if (!stream)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to open file for reading: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		if (fseek64(stream, sizeof(FileHeader)) == false || fread(&data[0], 1, nbytes, stream) != nbytes)
+		{
+			fclose(stream);
+			ERROR_LOCATION(err_msg);
+			err_msg += "problem reading data from file: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		fclose(stream);
+
+		return check_blocks((const RECORD_CLASS*)&data[0], header, block_crcs, file_name, err_msg);
+	}
+
+	static inline bool check_blocks(const RECORD_CLASS* records, const FileHeader& header, const vector<uint32_t>& block_crcs, const char* file_name, string& err_msg)
+	{
+		for (size_t iblock = 0; iblock < block_crcs.size(); iblock++)
+		{
+			if (get_block_crc(records, header.nrecords, iblock) != block_crcs[iblock])
+			{
+				ERROR_LOCATION(err_msg);
+				err_msg += "checksum mismatch in block ";
+				append_integer(err_msg, (uint32_t)iblock);
+				err_msg += " of file: ";
+				err_msg += file_name;
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	// Writes the changed records at their position in the base file.
+	// Only valid while the records are in the same order as the file, i.e. nothing inserted or removed and no log to replay.
+	inline bool save_changed_records(const char* file_name, string& err_msg)
+	{
+		if (m_changed_records.size())
+		{
+			std::sort(m_changed_records.begin(), m_changed_records.end());
+
+			FILE* stream = fopen(file_name, "r+b");
+			if (stream == 0)
+			{
+				ERROR_LOCATION(err_msg);
+				err_msg += "unable to open file for update: ";
+				err_msg += file_name;
+				return false;
+			}
+
+			uint32_t record_sz = RECORD_CLASS::GetSizeBytes();
+			const RECORD_CLASS* records = get_records();
+			INDEX_TYPE nrecords = GetNumRecords();
+
+			vector<uint64_t> blocks;
+			for (size_t i = 0; i < m_changed_records.size(); i++)
+			{
+				INDEX_TYPE idx = m_changed_records[i];
+				if (i && idx == m_changed_records[i - 1])
+					continue;
+
+				uint64_t iblock = idx / get_records_per_block();
+				if (blocks.size() == 0 || blocks.back() != iblock)
+					blocks.push_back(iblock);
+
+				if (fseek64(stream, sizeof(FileHeader) + (uint64_t)idx * record_sz) == false || fwrite(&records[idx], record_sz, 1, stream) != 1)
+				{
+					fclose(stream);
+					ERROR_LOCATION(err_msg);
+					err_msg += "problem updating record ";
+					append_integer(err_msg, idx);
+					err_msg += " in file: ";
+					err_msg += file_name;
+					return false;
+				}
+			}
+
+			// Checksums of the blocks which were written, then the header which covers the checksum table
+			uint64_t table_offset = sizeof(FileHeader) + (uint64_t)nrecords * record_sz;
+			bool status = true;
+			for (size_t i = 0; i < blocks.size() && status; i++)
+			{
+				m_block_crcs[blocks[i]] = get_block_crc(records, nrecords, blocks[i]);
+				status = fseek64(stream, table_offset + blocks[i] * sizeof(uint32_t)) &&
+					fwrite(&m_block_crcs[blocks[i]], sizeof(uint32_t), 1, stream) == 1;
+			}
+
+			FileHeader header;
+			set_header(header, nrecords, m_generation + 1, m_block_crcs);
+
+			if (status == false || fseek64(stream, 0) == false || fwrite(&header, sizeof(FileHeader), 1, stream) != 1)
+			{
+				fclose(stream);
+				ERROR_LOCATION(err_msg);
+				err_msg += "problem updating the checksums in file: ";
+				err_msg += file_name;
+				return false;
+			}
+
+			if (FileSync::Commit(stream, file_name, err_msg) == false)
+			{
+				fclose(stream);
+				return false;
+			}
+
+			fclose(stream);
+			m_generation++;
+		}
+
+		m_changed_records.clear();
+		m_log_pending.clear(); // the log entries only describe the records which have just been written
+
+		return save_hash_index(file_name, err_msg);
+	}
+
+	// Checks the header and every block checksum, a file without a header is loaded as plain records.
+	// A mapped file's blocks are checked when they are first used instead.
+	inline bool load_base_file(const char *file_name, string &err_msg)
+	{
+		FileHeader header;
+		vector<uint32_t> block_crcs;
+		bool has_header;
+		if (read_header(file_name, header, block_crcs, has_header, err_msg) == false)
+			return false;
+
+		release_mapping();
+
+		m_block_crcs.swap(block_crcs);
+		m_base_file_has_header = has_header;
+		m_generation = header.generation;
+
+		INDEX_TYPE nrecords = (INDEX_TYPE)header.nrecords;
+		if (nrecords == 0)
+		{
+			m_records.resize(0);
+			return true;
+		}
+
+		size_t offset = has_header ? sizeof(FileHeader) : 0;
+		size_t nbytes = (size_t)nrecords * RECORD_CLASS::GetSizeBytes();
+
+		if (m_use_file_mapping)
+		{
+			if (m_mapped_file.Open(file_name, err_msg) == false)
+				return false;
+
+			if (m_mapped_file.GetSize() < offset + nbytes)
+			{
+				m_mapped_file.Close();
+				ERROR_LOCATION(err_msg);
+				err_msg += "file was truncated: ";
+				err_msg += file_name;
+				return false;
+			}
+
+			// The blocks are checked as they are used, see verify_block()
+			m_records.resize(0);
+			m_mapped_records = (RECORD_CLASS*)(m_mapped_file.GetData() + offset);
+			m_nmapped_records = nrecords;
+			m_mapped_file_name = file_name;
+			m_block_verified.assign(m_block_crcs.size(), false);
+			m_block_err_msg.clear();
+			return true;
+		}
+		
+		vector<uint8_t> data;
+		data.resize(nbytes);
+		
+		FILE* stream = fopen(file_name, "rb");
+		if (!stream)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to open file for reading: ";
+			err_msg += file_name;
+			return false;
+		}
+		
+		if (fseek64(stream, offset) == false || fread(&data[0], 1, nbytes, stream) != nbytes)
+		{
+			fclose(stream);
+			ERROR_LOCATION(err_msg);
+			err_msg += "problem reading data from file: ";
+			err_msg += file_name;
+			return false;
+		}
+		
+		fclose (stream);
+
+		if (check_blocks((const RECORD_CLASS*)&data[0], header, m_block_crcs, file_name, err_msg) == false)
+			return false;
+		
+		return LoadFromBuffer (&data[0], nrecords, err_msg);
+	}
+		
+public:
+
+	inline SimpleDB(void)
+	{
+		m_use_file_mapping = false;
+		m_mapped_records = 0;
+		m_nmapped_records = 0;
+		m_use_log = false;
+		m_log_compaction_bytes = SIMPLEDB_LOG_COMPACTION_BYTES;
+		m_use_runs = false;
+		m_max_runs = SIMPLEDB_MAX_RUNS;
+		m_nruns = 0;
+		m_log_bytes = 0;
+		m_log_unread = false;
+		m_generation = 0;
+		m_base_file_has_header = false;
+		m_structure_changed = false;
+		m_use_interpolation_search = false;
+		m_use_hash_index = false;
+		m_hash_index_stale = false;
+	}
+
+	// When enabled, SaveToFile() appends the inserts / updates / removes made since the last load or save
+	// to <file>.log instead of rewriting the file. The file is rewritten and the log deleted when the log
+	// would grow past log_compaction_bytes. An existing log is always replayed by LoadFromFile().
+	inline void EnableLog(bool use_log, uint32_t log_compaction_bytes = SIMPLEDB_LOG_COMPACTION_BYTES)
+	{
+		m_use_log = use_log;
+		m_log_compaction_bytes = log_compaction_bytes;
+	}
+
+	// Log structured saves - when enabled together with the log, a full log is collapsed into a sorted run
+	// <file>.run<N> instead of rewriting the file, so the file is only rewritten (the runs merged into it)
+	// once more than max_runs runs have built up. Existing runs are always replayed by LoadFromFile().
+	inline void EnableRuns(bool use_runs, uint32_t max_runs = SIMPLEDB_MAX_RUNS)
+	{
+		m_use_runs = use_runs;
+		m_max_runs = max_runs;
+	}
+
+	// Records may be modified through their mutable members (e.g. DRM_ProgramRecord::IncrementNQueries()),
+	// SimpleDB can't see those changes, call this so that they are logged
+	inline bool MarkRecordChanged(INDEX_TYPE idx)
+	{
+		if (idx < 0 || idx >= GetNumRecords())
+			return false;
+
+		log_operation(SIMPLEDB_LOG_UPDATE, get_records()[idx]);
+		m_changed_records.push_back(idx);
+		return true;
+	}
+
+	// Same as above for a record returned by GetRecord() / GetRecordByIndex()
+	inline bool MarkRecordChanged(const RECORD_CLASS* rec)
+	{
+		const RECORD_CLASS* records = get_records();
+		if (records == 0 || rec < records || rec >= records + GetNumRecords())
+			return false;
+
+		return MarkRecordChanged((INDEX_TYPE)(rec - records));
+	}
+
+	// When enabled, LoadFromFile() maps the file instead of reading it.
+	// Lookups are then served from the mapping and a private copy is only made when a record is inserted or removed.
+	inline void EnableFileMapping(bool use_file_mapping)
+	{
+		m_use_file_mapping = use_file_mapping;
+	}
+
+	// When enabled, GetRecordIndex() interpolates on RECORD_CLASS::GetKeyPrefix(), the leading key bytes as a big endian
+	// integer. This takes O(log log n) probes when the keys are uniformly distributed, e.g. hashed IDs.
+	inline void EnableInterpolationSearch(bool use_interpolation_search)
+	{
+		m_use_interpolation_search = use_interpolation_search;
+	}
+
+	// When enabled, exact lookups go through the hash index <file>.idx written next to the file on every save,
+	// touching one slot and one record instead of binary searching. Lookups fall back to the normal search
+	// for a record which is missing from the index, and once records have been inserted or removed.
+	inline void EnableHashIndex(bool use_hash_index)
+	{
+		m_use_hash_index = use_hash_index;
+	}
+
+	inline bool IsMapped(void) const
+	{
+		return m_mapped_records != 0;
+	}
+
+	// Copies the records of a mapped file into memory and closes the hash index, so that nothing of <file> or
+	// <file>.idx stays mapped - windows won't replace a mapped file, and other processes save by replacing it.
+	// Lookups go without the hash index until the next save or load.
+	inline bool ReleaseFileMappings(string& err_msg)
+	{
+		m_hash_index.Close();
+		return detach_mapping(err_msg);
+	}
+
+	// True if changes of records in place (MarkRecordChanged(), UpdateRecord() of an existing record) would be saved by
+	// appending them to the log, with room for one more entry - nothing was inserted or removed. Other processes which
+	// have the file loaded read them with ReloadRecord(). Changes written over the records of the base file are not saved
+	// in place this way, the processes which have the file mapped check its blocks against the checksums they loaded.
+	inline bool CanSaveInPlace(const char* file_name) const
+	{
+		if (m_use_log == false || m_structure_changed || m_base_file != file_name || DoesFileExist(file_name) == false)
+			return false;
+
+		string log_file_name = get_log_file_name(file_name);
+		int log_len = filelength(log_file_name.c_str());
+		if (log_len < 0)
+			log_len = 0;
+
+		return log_len + m_log_pending.size() + 1 + RECORD_CLASS::GetSizeBytes() <= m_log_compaction_bytes;
+	}
+
+	// The range of the base file which holds the record, returns false if there is no such record
+	inline bool GetRecordRange(const RECORD_CLASS& token, uint64_t& offset, uint64_t& len) const
+	{
+		bool exists;
+		INDEX_TYPE idx = GetRecordIndex(token, exists);
+		if (exists == false)
+			return false;
+
+		len = RECORD_CLASS::GetSizeBytes();
+		offset = sizeof(FileHeader) + (uint64_t)idx * len;
+		return true;
+	}
+
+	// Brings the record up to date with the changes which other processes saved in place (see CanSaveInPlace()) - the
+	// entries appended to the log since it was read are applied, so every record they changed is up to date.
+	// Updates of existing records are applied where the records are, pointers to them remain valid.
+	inline bool ReloadRecord(const RECORD_CLASS& token, string& err_msg)
+	{
+		return Refresh(err_msg);
+	}
+
+	// Same as ReloadRecord() for all the records
+	inline bool Refresh(string& err_msg)
+	{
+		if (m_use_log == false || m_base_file.size() == 0)
+			return true;
+
+		string log_file_name = get_log_file_name(m_base_file.c_str());
+		return replay_log_tail(log_file_name.c_str(), err_msg);
+	}
+
+	// Checks every block of a mapped file which has not been used yet - a full scan, e.g. at startup.
+	// Also fails once a damaged block has been found by a lookup.
+	inline bool CheckBlocks(string& err_msg) const
+	{
+		for (size_t iblock = 0; iblock < m_block_verified.size(); iblock++)
+			verify_block((INDEX_TYPE)(iblock * get_records_per_block()));
+
+		if (m_block_err_msg.size())
+		{
+			err_msg += m_block_err_msg;
+			return false;
+		}
+
+		return true;
+	}
+
+	inline INDEX_TYPE GetNumRecords(void) const
+	{
+		if (m_mapped_records)
+			return m_nmapped_records;
+
+		return (INDEX_TYPE)m_records.size();
+	}
+
+	inline bool RemoveRecord(INDEX_TYPE idx, string& err_msg)
+	{
+		if (idx < 0 || idx >= GetNumRecords())
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "() invalid record index ";
+			append_integer(err_msg, idx);
+			return false;
+		}
+
+		if (detach_mapping(err_msg) == false)
+			return false;
+
+		log_operation(SIMPLEDB_LOG_REMOVE, m_records[idx]);
+		m_structure_changed = true;
+
+		m_records.erase(m_records.begin() + idx);
+
+		return true;
+	}
+
+	// Removes every record for which pred(record) returns true, compacting the records in a single pass
+	template <class PREDICATE> inline bool RemoveIf(PREDICATE pred, INDEX_TYPE& nremoved, string& err_msg)
+	{
+		nremoved = 0;
+
+		// Every record is looked at
+		if (CheckBlocks(err_msg) == false)
+			return false;
+
+		// Nothing is copied out of a mapped file unless there is something to remove
+		INDEX_TYPE nrecords = GetNumRecords();
+		INDEX_TYPE ifirst = 0;
+		while (ifirst < nrecords && pred((const RECORD_CLASS&)get_records()[ifirst]) == false)
+			ifirst++;
+
+		if (ifirst == nrecords)
+			return true;
+
+		if (detach_mapping(err_msg) == false)
+			return false;
+
+		INDEX_TYPE iput = ifirst;
+		for (INDEX_TYPE i = ifirst; i < nrecords; i++)
+		{
+			if (pred((const RECORD_CLASS&)m_records[i]))
+			{
+				log_operation(SIMPLEDB_LOG_REMOVE, m_records[i]);
+				continue;
+			}
+
+			if (copy_record(m_records[iput], m_records[i], err_msg) == false)
+				return false;
+			iput++;
+		}
+
+		nremoved = nrecords - iput;
+		m_records.resize(iput);
+		m_structure_changed = true;
+
+		return true;
+	}
+
+	// Removes the records at the given indexes in a single pass, the indexes may be in any order
+	inline bool RemoveIndices(const vector<INDEX_TYPE>& indices, INDEX_TYPE& nremoved, string& err_msg)
+	{
+		nremoved = 0;
+
+		if (indices.size() == 0)
+			return true;
+
+		vector<INDEX_TYPE> sorted_indices = indices;
+		std::sort(sorted_indices.begin(), sorted_indices.end());
+
+		INDEX_TYPE nrecords = GetNumRecords();
+		if (sorted_indices.back() >= nrecords)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "() invalid record index ";
+			append_integer(err_msg, sorted_indices.back());
+			return false;
+		}
+
+		if (detach_mapping(err_msg) == false)
+			return false;
+
+		// The records kept between two removed records are moved down as one block
+		INDEX_TYPE iput = sorted_indices[0];
+		size_t j = 0;
+		while (j < sorted_indices.size())
+		{
+			INDEX_TYPE idx = sorted_indices[j];
+			log_operation(SIMPLEDB_LOG_REMOVE, m_records[idx]);
+
+			while (j < sorted_indices.size() && sorted_indices[j] == idx)
+				j++;
+
+			INDEX_TYPE inext = j < sorted_indices.size() ? sorted_indices[j] : nrecords;
+			if (move_records(iput, idx + 1, inext - idx - 1, err_msg) == false)
+				return false;
+
+			iput += inext - idx - 1;
+		}
+
+		nremoved = nrecords - iput;
+		m_records.resize(iput);
+		m_structure_changed = true;
+
+		return true;
+	}
+
+	inline bool LoadFromBuffer (const void *buffer, INDEX_TYPE nrecords, string &err_msg)
+	{
+		release_mapping();
+
+		// The records no longer correspond to a base file, the next save will be a full save
+		m_log_pending.clear();
+		m_log_bytes = 0;
+		m_log_unread = false;
+		m_base_file.clear();
+		m_structure_changed = true;
+
+		return load_records(buffer, nrecords, err_msg);
+	}
+
+	inline const RECORD_CLASS* GetRecord(const RECORD_CLASS& token, INDEX_TYPE *ret_idx=0) const
+	{
+		bool exists;
+		INDEX_TYPE idx = GetRecordIndex(token, exists);
+
+		if (ret_idx)
+			*ret_idx = idx;
+
+		if (exists == false)
+			return 0;
+
+		return &get_records()[idx];
+	}
+
+	inline const RECORD_CLASS *GetRecordByIndex(INDEX_TYPE idx) const
+	{
+		if (idx < 0 || idx >= GetNumRecords() || verify_block(idx) == false)
+			return 0;
+
+		return &get_records()[idx];
+	}
+	
+	// Returns the index of the existing record
+	// Otherwise returns the index of the insert position for this record
+	inline INDEX_TYPE GetRecordIndex(const RECORD_CLASS &record, bool &exists) const
+	{
+		INDEX_TYPE nrecords = GetNumRecords();
+
+		if (nrecords == 0)
+		{
+			exists = false;
+			return 0;
+		}
+		
+		INDEX_TYPE idx;
+
+		// Straight search when there <= 6 records
+		if (nrecords <= 6)
+		{
+			idx = linear_search(record, 0, nrecords - 1, exists);
+			if (exists && verify_block(idx) == false)
+				exists = false;
+
+			return idx;
+		}
+
+		if (hash_index_lookup(record, idx))
+		{
+			exists = verify_block(idx);
+			return idx;
+		}
+
+		if (m_use_interpolation_search)
+			idx = interpolation_search(record, 0, nrecords - 1, exists);
+		else
+			idx = binary_search(record, 0, nrecords - 1, exists);
+
+		if (exists && m_hash_index.IsOpen() && m_structure_changed == false)
+			m_hash_index_stale = true;
+
+		if (exists && verify_block(idx) == false)
+			exists = false;
+
+		return idx;
+	}
+
+	// Index of the first record which is not less than token
+	inline INDEX_TYPE LowerBound(const RECORD_CLASS& token) const
+	{
+		bool exists;
+		return GetRecordIndex(token, exists);
+	}
+
+	// Index of the first record which is greater than token
+	inline INDEX_TYPE UpperBound(const RECORD_CLASS& token) const
 	{
 		bool exists;
 		INDEX_TYPE idx = GetRecordIndex(token, exists);
+		return exists ? idx + 1 : idx;
+	}
 
-		if (ret_idx)
-			*ret_idx = idx;
+	// Records [istart, iend) whose leading key fields match those of token.
+	// compare(a, b) is a three way comparison of the leading key fields, consistent with the record order.
+	// The records are contiguous, returns the first one or 0 when there are none.
+	template <class PREFIX_COMPARE> inline const RECORD_CLASS* EqualRange(const RECORD_CLASS& token, PREFIX_COMPARE compare, INDEX_TYPE& istart, INDEX_TYPE& iend) const
+	{
+		const RECORD_CLASS* records = get_records();
 
-		if (exists == false)
+		istart = 0;
+		iend = GetNumRecords();
+		while (istart < iend)
+		{
+			INDEX_TYPE i = istart + (iend - istart) / 2;
+			if (compare(records[i], token) < 0)
+				istart = i + 1;
+			else
+				iend = i;
+		}
+
+		iend = GetNumRecords();
+		INDEX_TYPE i0 = istart;
+		while (i0 < iend)
+		{
+			INDEX_TYPE i = i0 + (iend - i0) / 2;
+			if (compare(records[i], token) <= 0)
+				i0 = i + 1;
+			else
+				iend = i;
+		}
+
+		if (istart == iend)
 			return 0;
 
-		return &m_records[idx];
-	}
+		bool valid = verify_block(iend - 1);
+		for (INDEX_TYPE i = istart; i < iend && valid; i += get_records_per_block())
+			valid = verify_block(i);
 
-	inline const RECORD_CLASS *GetRecordByIndex(INDEX_TYPE idx) const
-	{
-		if (idx < 0 || idx >= m_records.size())
+		if (valid == false)
+		{
+			iend = istart;
 			return 0;
+		}
 
-		return &m_records[idx];
+		return &records[istart];
 	}
-	
-	// Returns the index of the existing record
-	// Otherwise returns the index of the insert position for this record
-	inline INDEX_TYPE GetRecordIndex(const RECORD_CLASS &record, bool &exists) const
+
+	// Removes the records [istart, iend) with a single move of the records after them
+	inline bool RemoveRange(INDEX_TYPE istart, INDEX_TYPE iend, string& err_msg)
 	{
-		if (m_records.size() == 0)
+		if (istart > iend || iend > GetNumRecords())
 		{
-			exists = false;
-			return 0;
+			ERROR_LOCATION(err_msg);
+			err_msg += "() invalid record range ";
+			append_integer(err_msg, istart);
+			err_msg += " ";
+			append_integer(err_msg, iend);
+			return false;
 		}
-		
-		// Straight search when there <= 6 records
-		if (m_records.size() <= 6)
-			return linear_search(record,0,m_records.size()-1, exists);
-		
-		INDEX_TYPE istart = 0;
-		INDEX_TYPE iend = m_records.size() - 1;
-		INDEX_TYPE i = m_records.size() / 2;
 
-		while (1)
-		{
-			if (record < m_records[i])
-				iend = i - 1;
-			else
-			{
-				if (record > m_records[i])
-					istart = i + 1;
-				else
-				{
-					exists = true;
-					return i;
-				}
-			}
+		if (istart == iend)
+			return true;
+
+		if (detach_mapping(err_msg) == false)
+			return false;
 
-			if (iend - istart < 4)
-				return linear_search(record,istart,iend,exists);
+		for (INDEX_TYPE i = istart; i < iend; i++)
+			log_operation(SIMPLEDB_LOG_REMOVE, m_records[i]);
 
-			i = (iend - istart) / 2;
-			i += istart;
-		}
+		m_records.erase(m_records.begin() + istart, m_records.begin() + iend);
+		m_structure_changed = true;
+
+		return true;
 	}
-	
+
 	inline bool InsertRecord(const RECORD_CLASS &record, INDEX_TYPE idx, string &err_msg)
 	{
-		if (idx > (INDEX_TYPE)m_records.size() || idx < 0)
+		if (idx > GetNumRecords() || idx < 0)
 		{
 			ERROR_LOCATION(err_msg);
 			err_msg += "invalid idx: ";
 			append_integer(err_msg,idx);
 			return false;
 		}
+
+		if (detach_mapping(err_msg) == false)
+			return false;
 		
 		m_records.resize (m_records.size() + 1);
-		for (INDEX_TYPE i=(INDEX_TYPE)(m_records.size()-1); i > idx; i--)
-		{
-			if (m_records[i].Assign(m_records[i-1],err_msg) == false)
-				return false;
-		}
+		if (move_records(idx + 1, idx, (INDEX_TYPE)(m_records.size() - 1) - idx, err_msg) == false)
+			return false;
 		
-		return m_records[idx].Assign(record,err_msg);
+		if (copy_record(m_records[idx], record, err_msg) == false)
+			return false;
+
+		log_operation(SIMPLEDB_LOG_INSERT, record);
+		m_structure_changed = true;
+		return true;
 	}
 	
 	inline bool UpdateRecord(const RECORD_CLASS &record, bool &changes_made, string &err_msg)
@@ -178,21 +1694,106 @@ public:
 			return status;
 		}
 		
-		if (m_records[idx].HasSameData(record) == true)
+		// An update in place doesn't need a private copy of a mapped file
+		RECORD_CLASS& existing = get_records()[idx];
+
+		if (existing.HasSameData(record) == true)
 		{
 			changes_made = false;
 			return true;
 		}
 		
-		bool status = m_records[idx].Update(record, err_msg);
+		bool status = existing.Update(record, err_msg);
 		if (status == true)
+		{
 			changes_made = true;
+			log_operation(SIMPLEDB_LOG_UPDATE, existing);
+			m_changed_records.push_back(idx);
+		}
 			
 		return status;
 	}
 
+	// Inserts a batch of records in a single merge pass instead of one InsertRecord() per record.
+	// Records which already exist are updated as UpdateRecord() would, if the batch holds the same record
+	// more than once the last one wins. nchanged is the number of records inserted or changed.
+	inline bool InsertRecords(const vector<RECORD_CLASS>& records, INDEX_TYPE& nchanged, string& err_msg)
+	{
+		nchanged = 0;
+
+		if (records.size() == 0)
+			return true;
+
+		vector<RECORD_CLASS> batch = records;
+		std::stable_sort(batch.begin(), batch.end(), RecordLess());
+
+		// New records are collected in order for the merge, existing records are updated in place
+		vector<RECORD_CLASS> inserts;
+		for (size_t i = 0; i < batch.size(); i++)
+		{
+			if (i + 1 < batch.size() && batch[i].Compare(batch[i + 1]) == 0)
+				continue; // a later record in the batch replaces this one
+
+			bool exists;
+			INDEX_TYPE idx = GetRecordIndex(batch[i], exists);
+
+			if (exists == false)
+			{
+				inserts.push_back(batch[i]);
+				continue;
+			}
+
+			RECORD_CLASS& existing = get_records()[idx];
+			if (existing.HasSameData(batch[i]) == true)
+				continue;
+
+			if (existing.Update(batch[i], err_msg) == false)
+				return false;
+
+			log_operation(SIMPLEDB_LOG_UPDATE, existing);
+			m_changed_records.push_back(idx);
+			nchanged++;
+		}
+
+		if (inserts.size() == 0)
+			return true;
+
+		if (detach_mapping(err_msg) == false)
+			return false;
+
+		// Merge from the back so that every record is moved at most once
+		size_t i = m_records.size();
+		size_t j = inserts.size();
+		size_t iput = i + j;
+
+		m_records.resize(iput);
+
+		while (j > 0)
+		{
+			if (i > 0 && m_records[i - 1].Compare(inserts[j - 1]) > 0)
+			{
+				if (copy_record(m_records[--iput], m_records[--i], err_msg) == false)
+					return false;
+				continue;
+			}
+
+			if (copy_record(m_records[--iput], inserts[--j], err_msg) == false)
+				return false;
+
+			log_operation(SIMPLEDB_LOG_INSERT, inserts[j]);
+		}
+
+		nchanged += (INDEX_TYPE)inserts.size();
+		m_structure_changed = true;
+
+		return true;
+	}
+
 	inline bool GenerateReport(const char* file_name, string& err_msg)
 	{
+		if (CheckBlocks(err_msg) == false)
+			return false;
+
 		FILE* stream = fopen(file_name, "w");
 		if (stream == 0)
 		{
@@ -202,13 +1803,15 @@ public:
 			return false;
 		}
 
+		const RECORD_CLASS* records = get_records();
+
 		int i = 0;
-		while (i < (int)m_records.size())
+		while (i < (int)GetNumRecords())
 		{
 			fprintf(stream, "[%ld]\n",i);
 
 			string s;
-			m_records[i].Report(s);
+			records[i].Report(s);
 			fprintf(stream, "%s\n", s.c_str());
 
 			i++;
@@ -218,115 +1821,323 @@ public:
 		return true;
 	}
 	
+	// Persists only the records which were changed in place (UpdateRecord() of an existing record, MarkRecordChanged()).
+	// Records are fixed size, so each one is written at its offset in the file without rewriting the rest.
+	// Falls back to SaveToFile() if records were inserted or removed, if the file has a log or runs which are replayed after it,
+	// or if the log is enabled - the changes are appended to it then.
+	// NOTE: changes made through mutable members are only saved if MarkRecordChanged() was called
+	inline bool SaveChangedRecords(const char *file_name, string &err_msg)
+	{
+		string log_file_name = get_log_file_name(file_name);
+
+		if (m_use_log || m_structure_changed || m_base_file != file_name || DoesFileExist(log_file_name.c_str()) || m_nruns ||
+			m_base_file_has_header == false || filelength64(file_name) != (int64_t)GetFileSize(GetNumRecords()))
+		{
+			return SaveToFile(file_name, err_msg);
+		}
+
+		return save_changed_records(file_name, err_msg);
+	}
+
+	// NOTE: when the records are mapped, pointers returned by GetRecord() / GetRecordByIndex() are not valid after a full save
 	inline bool SaveToFile(const char *file_name, string &err_msg)
 	{
-		string unique_file_name;
-		make_unique_filename(unique_file_name, file_name);
-				
-		FILE* stream = fopen(unique_file_name.c_str(), "wb");
+		string log_file_name = get_log_file_name(file_name);
+
+		// Append to the log while it is below the compaction threshold
+		if (m_use_log && m_base_file == file_name && DoesFileExist(file_name))
+		{
+			int log_len = filelength(log_file_name.c_str());
+			if (log_len < 0)
+				log_len = 0;
+
+			if (log_len + m_log_pending.size() <= m_log_compaction_bytes)
+			{
+				if (append_log(log_file_name.c_str(), err_msg) == false)
+					return false;
+
+				if (save_hash_index(file_name, err_msg) == false)
+					return false;
+
+				m_changed_records.clear();
+				m_structure_changed = false;
+				return true;
+			}
+
+			// Full log - becomes the next run while there is room for it
+			if (m_use_runs && m_nruns < m_max_runs)
+			{
+				if (write_run(file_name, log_file_name.c_str(), err_msg) == false)
+					return false;
+
+				if (save_hash_index(file_name, err_msg) == false)
+					return false;
+
+				m_changed_records.clear();
+				m_structure_changed = false;
+				return true;
+			}
+		}
+
+		// The file being replaced may be the one which is mapped - windows won't replace a mapped file
+		if (detach_mapping(err_msg) == false)
+			return false;
+
+		AtomicFileWriter file;
+		if (file.Open(file_name, err_msg) == false)
+			return false;
 		
-		if (stream == 0)
+		vector<uint32_t> block_crcs;
+		block_crcs.resize((size_t)get_nblocks(m_records.size()));
+		for (size_t iblock = 0; iblock < block_crcs.size(); iblock++)
+			block_crcs[iblock] = get_block_crc(get_records(), m_records.size(), iblock);
+
+		// The next generation of the file being replaced, which may have been written by another instance
+		uint64_t generation = m_generation;
+		if (DoesFileExist(file_name))
+		{
+			FileHeader existing_header;
+			vector<uint32_t> existing_block_crcs;
+			bool has_header;
+			string header_err_msg;
+			if (read_header(file_name, existing_header, existing_block_crcs, has_header, header_err_msg) && existing_header.generation > generation)
+				generation = existing_header.generation;
+		}
+		generation++;
+
+		FileHeader header;
+		set_header(header, m_records.size(), generation, block_crcs);
+
+		FILE* stream = file.GetStream();
+		if (fwrite(&header, sizeof(FileHeader), 1, stream) != 1 ||
+			(m_records.size() && fwrite(&m_records[0], RECORD_CLASS::GetSizeBytes(), m_records.size(), stream) != m_records.size()) ||
+			(block_crcs.size() && fwrite(&block_crcs[0], sizeof(uint32_t), block_crcs.size(), stream) != block_crcs.size()))
 		{
 			ERROR_LOCATION(err_msg);
-			err_msg += "unable to create file: ";
-			err_msg += unique_file_name.c_str();
+			err_msg += "problem writing data to create file: ";
+			err_msg += file_name;
 			return false;
 		}
 		
-		if (m_records.size())
+		// Swap in the newly written db file
+		if (file.Commit(err_msg) == false)
+			return false;
+
+		// Everything in the runs and the log is now part of the base file
+		if (delete_runs(file_name, err_msg) == false)
+			return false;
+
+		if (DoesFileExist(log_file_name.c_str()) && DeleteFile(log_file_name.c_str()) == false)
 		{
-			if (fwrite(&m_records[0], RECORD_CLASS::GetSizeBytes(), m_records.size(), stream) != m_records.size())
-			{
-				fclose(stream);
-				ERROR_LOCATION(err_msg);
-				err_msg += "problem writing data to create file: ";
-				err_msg += unique_file_name.c_str();
-				return false;
-			}
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to delete file: ";
+			err_msg += log_file_name.c_str();
+			return false;
 		}
 
-		fclose(stream);
+		m_log_pending.clear();
+		m_log_bytes = 0;
+		m_log_unread = false;
+		m_nruns = 0;
+		m_base_file = file_name;
+		m_block_crcs.swap(block_crcs);
+		m_generation = generation;
+		m_base_file_has_header = true;
+		m_changed_records.clear();
+
+		if (save_hash_index(file_name, err_msg) == false)
+			return false;
+
+		m_structure_changed = false;
 		
-		// Delete the existing db file
+		return true;
+	}
+
+	// Size of a file holding nrecords records - header, records and one checksum per block
+	static inline uint64_t GetFileSize(uint64_t nrecords)
+	{
+		return sizeof(FileHeader) + nrecords * RECORD_CLASS::GetSizeBytes() + get_nblocks(nrecords) * sizeof(uint32_t);
+	}
+
+	// Incremented by every save which rewrites or updates the file
+	inline uint64_t GetGeneration(void) const
+	{
+		return m_generation;
+	}
+
+	// A saved state of the file - its generation, the checksum of its block checksum table, the runs and the bytes of
+	// the log which have been read. Within a generation runs are only added and the log only grows until it becomes a run,
+	// so the same state is the same records in every process, which lets a file derived from them (see IndexedDB) be reused.
+	struct SavedState
+	{
+		uint64_t generation;
+		uint64_t log_bytes;
+		uint32_t table_crc;
+		uint32_t nruns;
+	};
+
+	// False if the records are not those of a saved state - they have unsaved changes, or another process saved log
+	// entries before the ones of this object which were not read
+	inline bool GetSavedState(SavedState& state) const
+	{
+		if (m_base_file.size() == 0 || m_structure_changed || m_changed_records.size() || m_log_pending.size() || m_log_unread)
+			return false;
+
+		state.generation = m_generation;
+		state.log_bytes = m_log_bytes;
+		state.table_crc = CRC32C::Compute(m_block_crcs.size() ? &m_block_crcs[0] : 0, m_block_crcs.size() * sizeof(uint32_t));
+		state.nruns = m_nruns;
+		return true;
+	}
+
+	// SaveToFile() used to write <file>.NN, delete the file and then rename <file>.NN. If such a save was interrupted
+	// after the delete, the complete <file>.NN with the newest generation is renamed into place. Every block of each
+	// candidate is checked. The runs and log of the file predate it and are deleted.
+	// Saves now replace the file with a single rename (AtomicFileWriter), so the file is never missing.
+	static inline bool RecoverFile(const char* file_name, bool& recovered, string& err_msg)
+	{
+		recovered = false;
+
 		if (DoesFileExist(file_name))
+			return true;
+
+		string recovered_file_name;
+		uint64_t generation = 0;
+		for (int i = 0; i < 99; i++)
 		{
-			if (DeleteFile(file_name)==false)
+			char ext[4];
+			sprintf(ext, ".%02d", i);
+			string candidate = file_name;
+			candidate += ext;
+
+			if (DoesFileExist(candidate.c_str()) == false)
+				continue;
+
+			FileHeader header;
+			vector<uint32_t> block_crcs;
+			bool has_header;
+			string candidate_err_msg;
+			if (read_header(candidate.c_str(), header, block_crcs, has_header, candidate_err_msg) == false || has_header == false ||
+				check_file_blocks(candidate.c_str(), header, block_crcs, candidate_err_msg) == false)
 			{
-				ERROR_LOCATION(err_msg);
-				err_msg += "unable to delete file: ";
-				err_msg += file_name;
-				return false;
+				continue;
+			}
+
+			if (recovered_file_name.size() == 0 || header.generation > generation)
+			{
+				recovered_file_name = candidate;
+				generation = header.generation;
 			}
 		}
-		
-		// Swap in the newly written db file
-		if (rename(unique_file_name.c_str(),file_name))
+
+		if (recovered_file_name.size() == 0)
+			return true;
+
+		if (rename(recovered_file_name.c_str(), file_name))
 		{
 			ERROR_LOCATION(err_msg);
 			err_msg += "unable to rename: ";
-			err_msg += unique_file_name.c_str();
+			err_msg += recovered_file_name.c_str();
 			err_msg += " -> ";
 			err_msg += file_name;
 			return false;
 		}
-		
+
+		if (delete_runs(file_name, err_msg) == false)
+			return false;
+
+		string log_file_name = get_log_file_name(file_name);
+		if (DoesFileExist(log_file_name.c_str()) && DeleteFile(log_file_name.c_str()) == false)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to delete file: ";
+			err_msg += log_file_name.c_str();
+			return false;
+		}
+
+		recovered = true;
 		return true;
 	}
-	
-	inline bool LoadFromFile(const char *file_name, string &err_msg)
+
+	// Deletes a db file together with its mutation log, runs and hash index
+	static inline bool DeleteFiles(const char* file_name, string& err_msg)
 	{
-		int flen = filelength(file_name);
-		if (flen < 0)
+		string log_file_name = get_log_file_name(file_name);
+		string index_file_name = get_hash_index_file_name(file_name);
+
+		if (DoesFileExist(index_file_name.c_str()) && DeleteFile(index_file_name.c_str()) == false)
 		{
 			ERROR_LOCATION(err_msg);
-			err_msg += "file does not exist: ";
-			err_msg += file_name;
+			err_msg += "unable to delete file: ";
+			err_msg += index_file_name.c_str();
 			return false;
 		}
-		
-		if (flen == 0)
-		{
-			m_records.resize(0);
-			return true;
-		}
-		
-		INDEX_TYPE record_sz = RECORD_CLASS::GetSizeBytes();
-		
-		if (flen % record_sz)
+
+		if (DoesFileExist(file_name) && DeleteFile(file_name) == false)
 		{
 			ERROR_LOCATION(err_msg);
-			err_msg += "file has invalid size:";
-			append_integer(err_msg,flen);
-			err_msg += " must be a multiple or record size: ";
-			append_integer(err_msg,record_sz);
-			err_msg += " :";
+			err_msg += "unable to delete file: ";
 			err_msg += file_name;
 			return false;
 		}
-		
-		vector<uint8_t> data;
-		data.resize(flen);
-		
-		FILE* stream = fopen(file_name, "rb");
-		if (!stream)
+
+		if (delete_runs(file_name, err_msg) == false)
+			return false;
+
+		if (DoesFileExist(log_file_name.c_str()) && DeleteFile(log_file_name.c_str()) == false)
 		{
 			ERROR_LOCATION(err_msg);
-			err_msg += "unable to open file for reading: ";
-			err_msg += file_name;
+			err_msg += "unable to delete file: ";
+			err_msg += log_file_name.c_str();
 			return false;
 		}
-		
-		if (fread(&data[0],1,flen,stream)!= flen)
+
+		return true;
+	}
+
+	inline bool LoadFromFile(const char *file_name, string &err_msg)
+	{
+		m_log_pending.clear();
+		m_log_bytes = 0;
+		m_log_unread = false;
+		m_base_file.clear();
+		m_nruns = 0;
+
+		bool recovered;
+		if (RecoverFile(file_name, recovered, err_msg) == false)
+			return false;
+
+		if (load_base_file(file_name, err_msg) == false)
+			return false;
+
+		// Runs in the order they were written, then the log
+		uint32_t nruns = count_runs(file_name);
+		for (uint32_t irun = 0; irun < nruns; irun++)
 		{
-			fclose(stream);
-			ERROR_LOCATION(err_msg);
-			err_msg += "problem reading data from file: ";
-			err_msg += file_name;
+			if (replay_log(get_run_file_name(file_name, irun).c_str(), err_msg) == false)
+				return false;
+		}
+
+		m_nruns = nruns;
+
+		string log_file_name = get_log_file_name(file_name);
+		if (replay_log_tail(log_file_name.c_str(), err_msg) == false)
 			return false;
+
+		m_base_file = file_name;
+		m_changed_records.clear();
+		m_structure_changed = false;
+
+		// A missing or mismatched index is rebuilt by the next save
+		m_hash_index.Close();
+		if (m_use_hash_index)
+		{
+			string index_file_name = get_hash_index_file_name(file_name);
+			string index_err_msg;
+			m_hash_index_stale = m_hash_index.Open(index_file_name.c_str(), RECORD_CLASS::GetSizeBytes(), GetNumRecords(), index_err_msg) == false;
 		}
-		
-		fclose (stream);
-		
-		return LoadFromBuffer (&data[0],flen/record_sz,err_msg);
+
+		return true;
 	}
-};
+
+};
\ No newline at end of file
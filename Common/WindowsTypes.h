@@ -11,6 +11,18 @@
 
 #else
 
+#include <stdint.h>
+
+typedef uint32_t DWORD;
+typedef int32_t BOOL;
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#define INFINITE 0xFFFFFFFF
+
 typedef struct _GUID {
     uint32_t  Data1;
     uint16_t Data2;
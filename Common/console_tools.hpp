@@ -146,7 +146,8 @@ inline bool get_instance_hash_prev(const DRM_ProgramRecord* program_rec, uint8_t
 }
 
 
-inline bool SendEncryptedCachedStdout(const DRM_ProgramRecord* prog_rec, bool modify_leading_guid=true)
+// The encrypted g_stdout_cache, as hex characters in braces, is appended to output
+inline bool EncryptCachedStdout(const DRM_ProgramRecord* prog_rec, bool modify_leading_guid, string& output)
 {
 	if (g_stdout_cache.size() == 0)
 		return false;
@@ -189,7 +190,20 @@ inline bool SendEncryptedCachedStdout(const DRM_ProgramRecord* prog_rec, bool mo
 
 	bin_to_hex_char(&buf1[0], buf1.size(), output_string);
 
-	printf("{%s}", output_string.c_str());
+	output += "{";
+	output += output_string.c_str();
+	output += "}";
+
+	return true;
+}
+
+inline bool SendEncryptedCachedStdout(const DRM_ProgramRecord* prog_rec, bool modify_leading_guid=true)
+{
+	string output;
+	if (EncryptCachedStdout(prog_rec, modify_leading_guid, output) == false)
+		return false;
+
+	printf("%s", output.c_str());
 
 	return true;
 }
\ No newline at end of file
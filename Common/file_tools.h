@@ -3,10 +3,22 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <string>
-#include <direct.h>
+#include <vector>
+#include <algorithm>
+
+#include <time.h>
+
+#include "string_tools.h"
+#include "time_tools.h"
 
 #ifdef WIN32
 #include <io.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #endif
 
 #pragma once
@@ -20,6 +32,42 @@ inline int filelength(const char *file_name)
   return (int)st.st_size;
 }
 
+// File length for files which may be larger than 2GB, -1 if the file does not exist
+inline int64_t filelength64(const char *file_name)
+{
+#ifdef WIN32
+	struct _stat64 st;
+	if (_stat64(file_name, &st))
+		return -1;
+#else
+	struct stat st;
+	if (stat(file_name, &st))
+		return -1;
+#endif
+
+	return (int64_t)st.st_size;
+}
+
+// Positions stream at a 64 bit offset from the start of the file
+inline bool fseek64(FILE* stream, uint64_t offset)
+{
+#ifdef WIN32
+	return _fseeki64(stream, (__int64)offset, SEEK_SET) == 0;
+#else
+	return fseeko(stream, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+// Cuts the file of stream to size bytes, nothing written to the stream may be pending
+inline bool truncate_stream(FILE* stream, uint64_t size)
+{
+#ifdef WIN32
+	return _chsize_s(_fileno(stream), (__int64)size) == 0;
+#else
+	return ftruncate(fileno(stream), (off_t)size) == 0;
+#endif
+}
+
 inline bool DoesFileExist(const char* file_name)
 {
 #ifdef WIN32
@@ -37,6 +85,46 @@ inline bool DeleteFile(const char* file_name)
 		
 	return unlink(file_name) ? false : true;
 }
+
+// Same as the Win32 function: the target is replaced unless fail_if_exists is set
+inline bool CopyFile(const char* source_file, const char* target_file, bool fail_if_exists)
+{
+	if (fail_if_exists && DoesFileExist(target_file))
+		return false;
+
+	FILE* source = fopen(source_file, "rb");
+	if (source == 0)
+		return false;
+
+	FILE* target = fopen(target_file, "wb");
+	if (target == 0)
+	{
+		fclose(source);
+		return false;
+	}
+
+	bool status = true;
+
+	char buf[0x10000];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), source)) > 0)
+	{
+		if (fwrite(buf, 1, n, target) != n)
+		{
+			status = false;
+			break;
+		}
+	}
+
+	if (ferror(source))
+		status = false;
+
+	fclose(source);
+	if (fclose(target))
+		status = false;
+
+	return status;
+}
 #endif
 
 inline bool make_unique_filename (std::string &unique_file_name, const char *file_name)
@@ -54,6 +142,540 @@ inline bool make_unique_filename (std::string &unique_file_name, const char *fil
 	return false;
 }
 
+// Directory part of a path, "." if there is none
+inline std::string get_directory_name(const char* file_name)
+{
+	std::string directory = file_name;
+	size_t pos = directory.find_last_of("/\\");
+	if (pos == std::string::npos)
+		return ".";
+
+	if (pos == 0)
+		return directory.substr(0, 1);
+
+	return directory.substr(0, pos);
+}
+
+// Durability policies of the db files, see FileSync::SetPolicy()
+#define FILESYNC_NONE 0				// leave it to the OS when written data reaches the disk
+#define FILESYNC_COMMIT 1			// each commit waits for its own fsync
+#define FILESYNC_GROUPED 2			// commits made until the next Flush() share one fsync of each file they wrote
+
+// Default age of the oldest queued commit after which the next commit flushes the queue itself
+#define FILESYNC_GROUP_WINDOW_MS 5
+
+// Counted since the start of the process, commits made under FILESYNC_NONE are not counted
+struct FileSyncStats
+{
+	uint64_t ncommits;				// commits, renames included
+	uint64_t nflushes;				// waits for the disk - one per commit under FILESYNC_COMMIT, one per non-empty queue flushed under FILESYNC_GROUPED
+	uint64_t nsyncs;				// fsync calls on files and directories, made by those waits
+	double flush_time_ms;			// wall clock time of all the waits
+	double max_flush_time_ms;		// longest single wait
+};
+
+// Process wide durability policy applied to every commit of a db file - an append to a log, records written in place
+// or a file replaced by AtomicFileWriter.
+//
+// Under FILESYNC_GROUPED a commit only queues its file, the queue is flushed by the first commit made after the group
+// window has passed, by Flush(), or at process exit. A file about to be renamed over another is always synced before
+// the rename (policy permitting), otherwise a crash could leave a renamed but empty file - only the directory entry is grouped.
+//
+// A group never spans more than the commits made between two calls of Flush(). A caller which has to report its commits
+// as durable (e.g. a server before it replies) calls Flush() first, so its group is limited to its own commits.
+class FileSync
+{
+public:
+
+	static inline void SetPolicy(uint32_t policy, uint32_t group_window_ms = FILESYNC_GROUP_WINDOW_MS)
+	{
+		State& state = get_state();
+		std::string err_msg;
+		if (policy != state.policy)
+			Flush(err_msg);
+
+		state.policy = policy;
+		state.group_window_ms = group_window_ms;
+	}
+
+	static inline uint32_t GetPolicy(void)
+	{
+		return get_state().policy;
+	}
+
+	// Called once everything has been written to stream, which stays open
+	static inline bool Commit(FILE* stream, const char* file_name, std::string& err_msg)
+	{
+		State& state = get_state();
+
+		if (fflush(stream))
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "problem writing data to file: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		if (state.policy == FILESYNC_NONE)
+			return true;
+
+		state.stats.ncommits++;
+
+		if (state.policy == FILESYNC_COMMIT)
+			return sync_now(fileno(stream), file_name, err_msg);
+
+#ifdef WIN32
+		int fd = _dup(_fileno(stream));
+#else
+		int fd = dup(fileno(stream));
+#endif
+		if (fd < 0)
+			return sync_now(fileno(stream), file_name, err_msg);
+
+		if (state.fds.size() == 0 && state.directories.size() == 0)
+			clock_gettime(CLOCK_REALTIME, &state.t_first_pending);
+
+		// Repeated commits of a file need one fsync, of its latest descriptor (the file may have been recreated)
+		size_t i = std::find(state.fd_file_names.begin(), state.fd_file_names.end(), std::string(file_name)) - state.fd_file_names.begin();
+		if (i < state.fds.size())
+		{
+#ifdef WIN32
+			_close(state.fds[i]);
+#else
+			close(state.fds[i]);
+#endif
+			state.fds[i] = fd;
+		}
+		else
+		{
+			state.fds.push_back(fd);
+			state.fd_file_names.push_back(file_name);
+		}
+
+		return flush_if_due(err_msg);
+	}
+
+	// Data of a file which is about to be renamed over file_name
+	static inline bool CommitBeforeRename(FILE* stream, const char* file_name, std::string& err_msg)
+	{
+		State& state = get_state();
+
+		if (fflush(stream))
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "problem writing data to file: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		if (state.policy == FILESYNC_NONE)
+			return true;
+
+		state.stats.ncommits++;
+		return sync_now(fileno(stream), file_name, err_msg);
+	}
+
+	// Called after a file was renamed to file_name, makes the directory entry durable
+	static inline bool CommitRename(const char* file_name, std::string& err_msg)
+	{
+		State& state = get_state();
+
+		if (state.policy == FILESYNC_NONE)
+			return true;
+
+		std::string directory = get_directory_name(file_name);
+
+		if (state.policy == FILESYNC_COMMIT)
+		{
+			timespec t0, t1;
+			clock_gettime(CLOCK_REALTIME, &t0);
+			bool status = sync_directory(directory.c_str(), err_msg);
+			clock_gettime(CLOCK_REALTIME, &t1);
+
+			state.stats.nsyncs++;
+			add_flush_time(compute_delta_time_ms(t0, t1));
+			return status;
+		}
+
+		if (std::find(state.directories.begin(), state.directories.end(), directory) == state.directories.end())
+		{
+			if (state.fds.size() == 0 && state.directories.size() == 0)
+				clock_gettime(CLOCK_REALTIME, &state.t_first_pending);
+
+			state.directories.push_back(directory);
+		}
+
+		return flush_if_due(err_msg);
+	}
+
+	// Syncs everything queued by grouped commits
+	static inline bool Flush(std::string& err_msg)
+	{
+		State& state = get_state();
+
+		if (state.fds.size() == 0 && state.directories.size() == 0)
+			return true;
+
+		timespec t0, t1;
+		clock_gettime(CLOCK_REALTIME, &t0);
+
+		bool status = true;
+		for (size_t i = 0; i < state.fds.size(); i++)
+		{
+			if (sync_fd(state.fds[i]) == false && status)
+			{
+				ERROR_LOCATION(err_msg);
+				err_msg += "fsync failed: ";
+				err_msg += state.fd_file_names[i].c_str();
+				status = false;
+			}
+
+#ifdef WIN32
+			_close(state.fds[i]);
+#else
+			close(state.fds[i]);
+#endif
+		}
+
+		for (size_t i = 0; i < state.directories.size(); i++)
+		{
+			if (sync_directory(state.directories[i].c_str(), err_msg) == false)
+				status = false;
+		}
+
+		state.stats.nsyncs += state.fds.size() + state.directories.size();
+		state.fds.clear();
+		state.fd_file_names.clear();
+		state.directories.clear();
+
+		clock_gettime(CLOCK_REALTIME, &t1);
+		add_flush_time(compute_delta_time_ms(t0, t1));
+
+		return status;
+	}
+
+	static inline const FileSyncStats& GetStats(void)
+	{
+		return get_state().stats;
+	}
+
+	static inline const char* Report(std::string& s)
+	{
+		const State& state = get_state();
+
+		const char* policy_names[] = { "none", "commit", "grouped" };
+
+		char tmp[256];
+		sprintf(tmp, "sync policy: %s commits: %llu disk waits: %llu fsync calls: %llu wait time: %.3f ms (longest %.3f ms)\n",
+			state.policy <= FILESYNC_GROUPED ? policy_names[state.policy] : "?",
+			(unsigned long long)state.stats.ncommits, (unsigned long long)state.stats.nflushes,
+			(unsigned long long)state.stats.nsyncs, state.stats.flush_time_ms, state.stats.max_flush_time_ms);
+		s += tmp;
+
+		return s.c_str();
+	}
+
+private:
+
+	struct State
+	{
+		uint32_t policy;
+		uint32_t group_window_ms;
+		std::vector<int> fds;				// duplicates of the descriptors of files with grouped commits
+		std::vector<std::string> fd_file_names;
+		std::vector<std::string> directories;		// with a grouped rename
+		timespec t_first_pending;
+		FileSyncStats stats;
+
+		inline State(void)
+		{
+			policy = FILESYNC_NONE;
+			group_window_ms = FILESYNC_GROUP_WINDOW_MS;
+			memset(&stats, 0, sizeof(stats));
+		}
+
+		// Grouped commits still pending at exit
+		inline ~State(void)
+		{
+			std::string err_msg;
+			Flush(err_msg);
+		}
+	};
+
+	static inline State& get_state(void)
+	{
+		static State state;
+		return state;
+	}
+
+	static inline bool sync_fd(int fd)
+	{
+#ifdef WIN32
+		return _commit(fd) == 0;
+#else
+		return fsync(fd) == 0;
+#endif
+	}
+
+	// A directory can't be flushed on windows, NTFS journals the rename itself
+	static inline bool sync_directory(const char* directory, std::string& err_msg)
+	{
+#ifndef WIN32
+		int fd = open(directory, O_RDONLY);
+		if (fd < 0 || fsync(fd))
+		{
+			if (fd >= 0)
+				close(fd);
+
+			ERROR_LOCATION(err_msg);
+			err_msg += "fsync failed: ";
+			err_msg += directory;
+			return false;
+		}
+
+		close(fd);
+#endif
+		return true;
+	}
+
+	static inline bool sync_now(int fd, const char* file_name, std::string& err_msg)
+	{
+		timespec t0, t1;
+		clock_gettime(CLOCK_REALTIME, &t0);
+		bool status = sync_fd(fd);
+		clock_gettime(CLOCK_REALTIME, &t1);
+
+		get_state().stats.nsyncs++;
+		add_flush_time(compute_delta_time_ms(t0, t1));
+
+		if (status == false)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "fsync failed: ";
+			err_msg += file_name;
+		}
+
+		return status;
+	}
+
+	static inline void add_flush_time(double dt_ms)
+	{
+		FileSyncStats& stats = get_state().stats;
+		stats.nflushes++;
+		stats.flush_time_ms += dt_ms;
+		if (dt_ms > stats.max_flush_time_ms)
+			stats.max_flush_time_ms = dt_ms;
+	}
+
+	static inline bool flush_if_due(std::string& err_msg)
+	{
+		State& state = get_state();
+
+		timespec t;
+		clock_gettime(CLOCK_REALTIME, &t);
+		if (compute_delta_time_ms(state.t_first_pending, t) < state.group_window_ms)
+			return true;
+
+		return Flush(err_msg);
+	}
+};
+
+// Writes a new version of a file and swaps it in with a single rename over the old one, so readers see
+// either the old or the new file and never a missing one.
+//
+// On linux the data goes to an unnamed O_TMPFILE in the directory of the file, which only gets a name
+// (<file>.<pid>.tmp, immediately renamed) in Commit() - an interrupted save leaves nothing behind. Otherwise,
+// or if the file system doesn't support O_TMPFILE, <file>.<pid>.tmp is written directly and removed if not committed.
+class AtomicFileWriter
+{
+public:
+
+	inline AtomicFileWriter(void)
+	{
+		m_stream = 0;
+		m_unnamed = false;
+	}
+
+	inline ~AtomicFileWriter(void)
+	{
+		Abort();
+	}
+
+	inline bool Open(const char* file_name, std::string& err_msg)
+	{
+		Abort();
+
+		m_unnamed = false;
+		m_file_name = file_name;
+
+		char ext[32];
+#ifdef WIN32
+		sprintf(ext, ".%lu.tmp", (unsigned long)GetCurrentProcessId());
+#else
+		sprintf(ext, ".%lu.tmp", (unsigned long)getpid());
+#endif
+		m_temp_file_name = m_file_name + ext;
+
+#if !defined(WIN32) && defined(O_TMPFILE)
+		std::string directory = get_directory_name(file_name);
+		int fd = open(directory.c_str(), O_TMPFILE | O_WRONLY, 0644);
+		if (fd >= 0)
+		{
+			m_stream = fdopen(fd, "wb");
+			if (m_stream)
+			{
+				m_unnamed = true;
+				return true;
+			}
+
+			close(fd);
+		}
+#endif
+
+		m_stream = fopen(m_temp_file_name.c_str(), "wb");
+		if (m_stream == 0)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to create file: ";
+			err_msg += m_temp_file_name.c_str();
+			return false;
+		}
+
+		return true;
+	}
+
+	inline FILE* GetStream(void) const
+	{
+		return m_stream;
+	}
+
+	// Replaces the file with what was written, the writer is closed either way
+	inline bool Commit(std::string& err_msg)
+	{
+		if (m_stream == 0)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "file is not open";
+			return false;
+		}
+
+		std::string sync_err_msg;
+		bool status = ferror(m_stream) == 0 && FileSync::CommitBeforeRename(m_stream, m_file_name.c_str(), sync_err_msg);
+
+#if !defined(WIN32) && defined(O_TMPFILE)
+		// An unnamed file can only be linked to a new name, which is then renamed over the file
+		if (status && m_unnamed)
+		{
+			char fd_path[64];
+			sprintf(fd_path, "/proc/self/fd/%d", fileno(m_stream));
+
+			unlink(m_temp_file_name.c_str()); // left by an earlier process with the same id
+			status = linkat(AT_FDCWD, fd_path, AT_FDCWD, m_temp_file_name.c_str(), AT_SYMLINK_FOLLOW) == 0;
+		}
+#endif
+
+		fclose(m_stream);
+		m_stream = 0;
+
+		if (status == false)
+		{
+			if (m_unnamed == false)
+				DeleteFile(m_temp_file_name.c_str());
+
+			if (sync_err_msg.size())
+			{
+				err_msg += sync_err_msg;
+				return false;
+			}
+
+			ERROR_LOCATION(err_msg);
+			err_msg += "problem writing data to create file: ";
+			err_msg += m_file_name.c_str();
+			return false;
+		}
+
+#ifdef WIN32
+		if (MoveFileEx(m_temp_file_name.c_str(), m_file_name.c_str(), MOVEFILE_REPLACE_EXISTING) == FALSE)
+#else
+		if (rename(m_temp_file_name.c_str(), m_file_name.c_str()))
+#endif
+		{
+			DeleteFile(m_temp_file_name.c_str());
+			ERROR_LOCATION(err_msg);
+			err_msg += "unable to rename: ";
+			err_msg += m_temp_file_name.c_str();
+			err_msg += " -> ";
+			err_msg += m_file_name.c_str();
+			return false;
+		}
+
+		return FileSync::CommitRename(m_file_name.c_str(), err_msg);
+	}
+
+	// Discards what was written, the file is left as it was
+	inline void Abort(void)
+	{
+		if (m_stream == 0)
+			return;
+
+		fclose(m_stream);
+		m_stream = 0;
+
+		if (m_unnamed == false)
+			DeleteFile(m_temp_file_name.c_str());
+	}
+
+private:
+
+	FILE* m_stream;
+	bool m_unnamed;				// O_TMPFILE, there is no temp file until Commit()
+	std::string m_file_name;
+	std::string m_temp_file_name;
+};
+
+// Names, without the directory, of the files in directory which start with prefix
+inline bool GetFileNames(const char* directory, const char* prefix, std::vector<std::string>& file_names)
+{
+	file_names.clear();
+
+#ifdef WIN32
+	std::string pattern = directory;
+	pattern += "\\";
+	pattern += prefix;
+	pattern += "*";
+
+	WIN32_FIND_DATA data;
+	HANDLE h = FindFirstFile(pattern.c_str(), &data);
+	if (h == INVALID_HANDLE_VALUE)
+		return GetLastError() == ERROR_FILE_NOT_FOUND; // no matching files
+
+	do
+	{
+		if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+			file_names.push_back(data.cFileName);
+	} while (FindNextFile(h, &data));
+
+	FindClose(h);
+#else
+	DIR* dir = opendir(directory);
+	if (dir == 0)
+		return false;
+
+	size_t len = strlen(prefix);
+
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != 0)
+	{
+		if (strncmp(entry->d_name, prefix, len) == 0)
+			file_names.push_back(entry->d_name);
+	}
+
+	closedir(dir);
+#endif
+
+	return true;
+}
+
 inline bool CreateDirectoryIfNecessary(const char* directory)
 {
 	struct stat st;	
@@ -62,14 +684,14 @@ inline bool CreateDirectoryIfNecessary(const char* directory)
 #ifdef WIN32
 		if (_mkdir(directory) == 0)
 #else
-		if (mkdir(directory) == 0)
+		if (mkdir(directory, 0777) == 0)
 #endif
 			return true;
 		else
 			return false;
 	}
 
-	if (st.st_mode != S_IFDIR)
+	if ((st.st_mode & S_IFMT) != S_IFDIR)
 		return false;
 
 	return true;
@@ -5,9 +5,12 @@
 #include "MurmurHash3.h"
 #include "time_tools.h"
 
-#pragma once
+#ifndef WINDOWS
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
-#ifdef WINDOWS
+#pragma once
 
 inline bool randomize_buffer(uint8_t* b, int32_t sz)
 {
@@ -46,6 +49,7 @@ inline void create_random_buffer(uint8_t* b, int32_t sz, uint32_t time_target_ms
 {
 	uint8_t* b0 = b; 
 
+#ifdef WINDOWS
 	SYSTEMTIME st;
 	GetSystemTime(&st);
 
@@ -106,6 +110,42 @@ inline void create_random_buffer(uint8_t* b, int32_t sz, uint32_t time_target_ms
 		b += 32;
 		sz -= 32;
 	}
+#else
+	// The kernel's random data, with the time and the process id mixed in should /dev/urandom be unreadable
+	int sz0 = sz;
+	int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	int n = 0;
+	if (fd >= 0)
+	{
+		while (n < sz)
+		{
+			ssize_t r = read(fd, b + n, sz - n);
+			if (r <= 0)
+				break;
+
+			n += (int)r;
+		}
+
+		close(fd);
+	}
+
+	if (n < sz)
+	{
+		timespec t;
+		clock_gettime(CLOCK_REALTIME, &t);
+
+		uint32_t seed = (uint32_t)getpid();
+		uint8_t data[32];
+		MurmurHash3_x64_128(&t, sizeof(t), seed, &data[0]);
+		MurmurHash3_x64_128(data, 16, seed, &data[16]);
+
+		for (int i = n; i < sz; i++)
+			b[i] ^= data[i % sizeof(data)];
+
+		if (sz >= 4)
+			randomize_buffer(b, sz);
+	}
+#endif
 
 	if (time_target_ms == 0) // no time based randomization requested
 		return;
@@ -137,5 +177,3 @@ inline void create_random_buffer(uint8_t* b, int32_t sz, uint32_t time_target_ms
 		t1 = get_time_ms(); // grab the time again so that we can check to see if full time has expired
 	}
 }
-
-#endif
@@ -0,0 +1,460 @@
+// Copyright (c) AlgoMachines
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <string>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include "string_tools.h"
+
+#ifdef WIN32
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/time.h>
+#endif
+
+#pragma once
+
+// Blocking stream sockets for the server modes.
+//
+// An address is "host:port" or ":port" (all interfaces) for TCP, anything else is the path of a unix domain socket
+// (not available on windows).
+
+#ifdef WIN32
+typedef SOCKET socket_t;
+#define INVALID_SOCKET_T INVALID_SOCKET
+#else
+typedef int socket_t;
+#define INVALID_SOCKET_T (-1)
+#endif
+
+#define SOCKET_LISTEN_BACKLOG 64
+
+inline bool socket_startup(std::string& err_msg)
+{
+#ifdef WIN32
+	static bool started = false;
+	if (started)
+		return true;
+
+	WSADATA data;
+	if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+	{
+		ERROR_LOCATION(err_msg);
+		err_msg += "WSAStartup() fails";
+		return false;
+	}
+
+	started = true;
+#else
+	// A peer which closes its end early shows up as a failed send, rather than as SIGPIPE
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	return true;
+}
+
+inline void socket_close(socket_t s)
+{
+	if (s == INVALID_SOCKET_T)
+		return;
+
+#ifdef WIN32
+	closesocket(s);
+#else
+	close(s);
+#endif
+}
+
+inline int socket_last_error(void)
+{
+#ifdef WIN32
+	return WSAGetLastError();
+#else
+	return errno;
+#endif
+}
+
+inline bool socket_interrupted(void)
+{
+#ifdef WIN32
+	return WSAGetLastError() == WSAEINTR;
+#else
+	return errno == EINTR;
+#endif
+}
+
+inline void socket_append_error(std::string& err_msg, const char* function, const char* address)
+{
+	err_msg += function;
+	err_msg += "() fails, error: ";
+	append_integer(err_msg, (uint32_t)socket_last_error());
+	if (address)
+	{
+		err_msg += " address: ";
+		err_msg += address;
+	}
+}
+
+inline bool socket_is_unix_address(const char* address)
+{
+#ifdef WIN32
+	return false;
+#else
+	return strchr(address, ':') == 0;
+#endif
+}
+
+// Returns false if a TCP address can't be parsed
+inline bool socket_parse_tcp_address(const char* address, struct sockaddr_in& addr)
+{
+	const char* colon = strrchr(address, ':');
+	if (colon == 0)
+		return false;
+
+	int port = atoi(colon + 1);
+	if (port <= 0 || port > 0xFFFF)
+		return false;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	std::string host(address, colon - address);
+	if (host.length() == 0 || host == "*")
+		return true;
+
+	if (host == "localhost")
+		host = "127.0.0.1";
+
+	addr.sin_addr.s_addr = inet_addr(host.c_str());
+	return addr.sin_addr.s_addr != INADDR_NONE;
+}
+
+// For unix domain sockets, a socket file which is left from an earlier run is replaced
+inline bool socket_listen(const char* address, socket_t& s, std::string& err_msg)
+{
+	s = INVALID_SOCKET_T;
+
+	if (socket_startup(err_msg) == false)
+		return false;
+
+#ifndef WIN32
+	if (socket_is_unix_address(address))
+	{
+		struct sockaddr_un addr;
+		if (strlen(address) >= sizeof(addr.sun_path))
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unix socket path is too long: ";
+			err_msg += address;
+			return false;
+		}
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, address);
+
+		s = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (s == INVALID_SOCKET_T)
+		{
+			ERROR_LOCATION(err_msg);
+			socket_append_error(err_msg, "socket", address);
+			return false;
+		}
+
+		unlink(address);
+
+		if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) || listen(s, SOCKET_LISTEN_BACKLOG))
+		{
+			ERROR_LOCATION(err_msg);
+			socket_append_error(err_msg, "bind/listen", address);
+			socket_close(s);
+			s = INVALID_SOCKET_T;
+			return false;
+		}
+
+		return true;
+	}
+#endif
+
+	struct sockaddr_in addr;
+	if (socket_parse_tcp_address(address, addr) == false)
+	{
+		ERROR_LOCATION(err_msg);
+		err_msg += "invalid address: ";
+		err_msg += address;
+		return false;
+	}
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	if (s == INVALID_SOCKET_T)
+	{
+		ERROR_LOCATION(err_msg);
+		socket_append_error(err_msg, "socket", address);
+		return false;
+	}
+
+	int on = 1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+
+	if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) || listen(s, SOCKET_LISTEN_BACKLOG))
+	{
+		ERROR_LOCATION(err_msg);
+		socket_append_error(err_msg, "bind/listen", address);
+		socket_close(s);
+		s = INVALID_SOCKET_T;
+		return false;
+	}
+
+	return true;
+}
+
+inline bool socket_connect(const char* address, socket_t& s, std::string& err_msg)
+{
+	s = INVALID_SOCKET_T;
+
+	if (socket_startup(err_msg) == false)
+		return false;
+
+#ifndef WIN32
+	if (socket_is_unix_address(address))
+	{
+		struct sockaddr_un addr;
+		if (strlen(address) >= sizeof(addr.sun_path))
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unix socket path is too long: ";
+			err_msg += address;
+			return false;
+		}
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, address);
+
+		s = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (s == INVALID_SOCKET_T)
+		{
+			ERROR_LOCATION(err_msg);
+			socket_append_error(err_msg, "socket", address);
+			return false;
+		}
+
+		if (connect(s, (struct sockaddr*)&addr, sizeof(addr)))
+		{
+			ERROR_LOCATION(err_msg);
+			socket_append_error(err_msg, "connect", address);
+			socket_close(s);
+			s = INVALID_SOCKET_T;
+			return false;
+		}
+
+		return true;
+	}
+#endif
+
+	struct sockaddr_in addr;
+	if (socket_parse_tcp_address(address, addr) == false || addr.sin_addr.s_addr == htonl(INADDR_ANY))
+	{
+		ERROR_LOCATION(err_msg);
+		err_msg += "invalid address: ";
+		err_msg += address;
+		return false;
+	}
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	if (s == INVALID_SOCKET_T)
+	{
+		ERROR_LOCATION(err_msg);
+		socket_append_error(err_msg, "socket", address);
+		return false;
+	}
+
+	if (connect(s, (struct sockaddr*)&addr, sizeof(addr)))
+	{
+		ERROR_LOCATION(err_msg);
+		socket_append_error(err_msg, "connect", address);
+		socket_close(s);
+		s = INVALID_SOCKET_T;
+		return false;
+	}
+
+	return true;
+}
+
+// Returns false on error, or when interrupted by a signal (socket_interrupted() is then true)
+inline bool socket_accept(socket_t listen_s, socket_t& s, std::string& err_msg)
+{
+	s = accept(listen_s, 0, 0);
+	if (s == INVALID_SOCKET_T)
+	{
+		if (socket_interrupted() == false)
+		{
+			ERROR_LOCATION(err_msg);
+			socket_append_error(err_msg, "accept", 0);
+		}
+		return false;
+	}
+
+	return true;
+}
+
+inline bool socket_send_all(socket_t s, const void* buf, size_t n)
+{
+	const char* b = (const char*)buf;
+	while (n)
+	{
+		int nsent = send(s, b, (int)(n > 0x10000 ? 0x10000 : n), 0);
+		if (nsent < 0 && socket_interrupted())
+			continue;
+
+		if (nsent <= 0)
+			return false;
+
+		b += nsent;
+		n -= nsent;
+	}
+
+	return true;
+}
+
+// Returns false on error, or if the peer closes the connection before n bytes have arrived
+inline bool socket_recv_all(socket_t s, void* buf, size_t n)
+{
+	char* b = (char*)buf;
+	while (n)
+	{
+		int nrecv = recv(s, b, (int)(n > 0x10000 ? 0x10000 : n), 0);
+		if (nrecv < 0 && socket_interrupted())
+			continue;
+
+		if (nrecv <= 0)
+			return false;
+
+		b += nrecv;
+		n -= nrecv;
+	}
+
+	return true;
+}
+
+// SIGTERM / SIGINT end the accept loops of the servers, a request which is in progress is finished first.
+// The handlers are installed without SA_RESTART, so a blocking accept() returns when a signal arrives.
+inline volatile sig_atomic_t& socket_stop_flag(void)
+{
+	static volatile sig_atomic_t stop = 0;
+	return stop;
+}
+
+inline void socket_stop_signal_handler(int)
+{
+	socket_stop_flag() = 1;
+}
+
+inline void socket_catch_stop_signals(void)
+{
+#ifdef WIN32
+	signal(SIGTERM, socket_stop_signal_handler);
+	signal(SIGINT, socket_stop_signal_handler);
+#else
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = socket_stop_signal_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, 0);
+	sigaction(SIGINT, &sa, 0);
+#endif
+}
+
+inline bool socket_stop_requested(void)
+{
+	return socket_stop_flag() != 0;
+}
+
+// A peer which stops sending or reading for timeout_ms is given up on
+inline void socket_set_timeout(socket_t s, uint32_t timeout_ms)
+{
+#ifdef WIN32
+	DWORD tv = timeout_ms;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof(tv));
+#else
+	struct timeval tv;
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#endif
+}
+
+// poll() of the sockets in fds, returns the number which are ready, 0 on timeout, -1 on error
+inline int socket_poll(struct pollfd* fds, size_t n, int timeout_ms)
+{
+#ifdef WIN32
+	return WSAPoll(fds, (ULONG)n, timeout_ms);
+#else
+	return poll(fds, (nfds_t)n, timeout_ms);
+#endif
+}
+
+#ifndef WIN32
+
+// Serves one connection at a time until a stop signal is caught: handler.Serve(socket_t) for each connection, which
+// is closed afterwards, and handler.Idle() whenever nothing has arrived for idle_ms. Returns true when stopped by
+// a signal, false on error.
+template <class HANDLER> inline bool socket_serve_sequentially(socket_t listen_s, uint32_t idle_ms, uint32_t timeout_ms, HANDLER& handler, std::string& err_msg)
+{
+	while (socket_stop_requested() == false)
+	{
+		struct pollfd pfd;
+		pfd.fd = listen_s;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		int n = poll(&pfd, 1, (int)idle_ms);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			ERROR_LOCATION(err_msg);
+			socket_append_error(err_msg, "poll", 0);
+			return false;
+		}
+
+		if (n == 0)
+		{
+			handler.Idle();
+			continue;
+		}
+
+		socket_t s;
+		if (socket_accept(listen_s, s, err_msg) == false)
+		{
+			if (socket_interrupted())
+				continue;
+
+			return false;
+		}
+
+		socket_set_timeout(s, timeout_ms);
+		handler.Serve(s);
+		socket_close(s);
+	}
+
+	return true;
+}
+#endif
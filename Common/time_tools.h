@@ -33,6 +33,21 @@ bool get_file_time_ms(const char* file_name, uint64_t &t_ms)
 
 	return true;
 }
+#else
+#include <sys/stat.h>
+
+// Last write time of the file as a unix time multiplied by 1000 (resolution ms)
+inline bool get_file_time_ms(const char* file_name, uint64_t &t_ms)
+{
+	struct stat st;
+	if (stat(file_name, &st))
+		return false;
+
+	t_ms = st.st_mtim.tv_sec * 1000LLU;
+	t_ms += st.st_mtim.tv_nsec / 1000000LLU;
+
+	return true;
+}
 #endif
 
 inline double compute_delta_time_ms(const timespec &t0, const timespec &t1)
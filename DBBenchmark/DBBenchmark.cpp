@@ -0,0 +1,267 @@
+// Copyright (c) AlgoMachines
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Runs the same workload against each storage policy of DBStorage.h with 1k, 10k, 100k and 1M client records
+// (DRM_ProgramRecord, the DB.bin / DB.btree record):
+//
+// build   - N records are written to a new file
+// open    - LoadFromFile() of the file
+// lookup  - BENCH_LOOKUPS lookups of existing records
+// insert  - BENCH_WRITES new records, saved every BENCH_WRITES_PER_SAVE inserts
+// update  - BENCH_WRITES in place updates, each one saved with SaveChangedRecords() like a request
+// remove  - BENCH_WRITES removes, saved every BENCH_WRITES_PER_SAVE removes
+//
+// usage: DBBenchmark [directory] [max records]
+
+#include "OS.h"
+
+#include "memory_tools.h"
+#include "file_tools.h"
+
+#include "WindowsTypes.h"
+#include "time_tools.h"
+#include "Encryption.h"
+
+#include "DBStorage.h"
+#include "DRM_ProgramRecord.h"
+
+#define BENCH_LOOKUPS 10000
+#define BENCH_WRITES 1000
+#define BENCH_WRITES_PER_SAVE 100
+
+// Deterministic, uniformly distributed IDs, as the hashed client IDs are
+inline void make_bench_id(uint8_t* id, uint64_t i)
+{
+	uint64_t x = i * 0x9E3779B97F4A7C15ULL + 1;
+	for (int k = 0; k < ID_SIZE_BYTES; k += 8)
+	{
+		x ^= x >> 33;
+		x *= 0xFF51AFD7ED558CCDULL;
+		x ^= x >> 33;
+		memmove(id + k, &x, 8);
+	}
+}
+
+inline void make_bench_record(DRM_ProgramRecord& rec, uint64_t i)
+{
+	uint8_t id[ID_SIZE_BYTES];
+	make_bench_id(id, i);
+	rec.Zero();
+	rec.SetID(id);
+	rec.SetNQueries(i);
+}
+
+inline double elapsed_ms(const timespec& t0)
+{
+	timespec t1;
+	clock_gettime(CLOCK_REALTIME, &t1);
+	return compute_delta_time_ms(t0, t1);
+}
+
+// The engines differ in how they are filled in bulk and how a record is removed
+
+template <class RECORD_CLASS> inline bool populate(SimpleDB<RECORD_CLASS>& db, vector<RECORD_CLASS>& records, string& err_msg)
+{
+	std::sort(records.begin(), records.end());
+	return db.LoadFromBuffer(records.size() ? &records[0] : 0, (uint32_t)records.size(), err_msg);
+}
+
+template <class RECORD_CLASS> inline bool populate(BTreeDB<RECORD_CLASS>& db, vector<RECORD_CLASS>& records, string& err_msg)
+{
+	std::sort(records.begin(), records.end());
+	for (size_t i = 0; i < records.size(); i++)
+	{
+		bool changes_made;
+		if (db.UpdateRecord(records[i], changes_made, err_msg) == false)
+			return false;
+	}
+
+	return true;
+}
+
+template <class RECORD_CLASS> inline bool remove_record(SimpleDB<RECORD_CLASS>& db, const RECORD_CLASS& token, string& err_msg)
+{
+	uint32_t idx;
+	if (db.GetRecord(token, &idx) == 0)
+		return true;
+
+	return db.RemoveRecord(idx, err_msg);
+}
+
+template <class RECORD_CLASS> inline bool remove_record(BTreeDB<RECORD_CLASS>& db, const RECORD_CLASS& token, string& err_msg)
+{
+	return db.RemoveRecord(token, err_msg);
+}
+
+// Bytes in file_name and the files next to it which belong to it (<file>.log, <file>.run<N>, <file>.idx, <file>.journal)
+inline int64_t get_files_size(const char* directory, const char* file_name)
+{
+	string prefix = file_name;
+	size_t pos = prefix.find_last_of("/\\");
+	if (pos != string::npos)
+		prefix = prefix.substr(pos + 1);
+
+	vector<string> names;
+	if (GetFileNames(directory, prefix.c_str(), names) == false)
+		return -1;
+
+	int64_t sz = 0;
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		string path = directory;
+		path += "/";
+		path += names[i];
+
+		int64_t len = filelength64(path.c_str());
+		if (len > 0)
+			sz += len;
+	}
+
+	return sz;
+}
+
+template <class POLICY> bool run_benchmark(const char* name, const char* directory, uint32_t nrecords, string& err_msg)
+{
+	typedef StorageDB<DRM_ProgramRecord, POLICY> DB;
+
+	char file_name[1024];
+	sprintf(file_name, "%s/bench_%s_%lu.db", directory, name, (unsigned long)nrecords);
+
+	timespec t0;
+	double build_ms, open_ms, lookup_us, insert_us, update_us, remove_us;
+
+	{
+		if (DB::DeleteFiles(file_name, err_msg) == false)
+			return false;
+
+		DB db;
+
+		vector<DRM_ProgramRecord> records(nrecords);
+		for (uint32_t i = 0; i < nrecords; i++)
+			make_bench_record(records[i], i);
+
+		clock_gettime(CLOCK_REALTIME, &t0);
+		if (populate(db, records, err_msg) == false || db.SaveToFile(file_name, err_msg) == false)
+			return false;
+		build_ms = elapsed_ms(t0);
+	}
+
+	// Closed before its files are deleted
+	{
+		DB db;
+
+		clock_gettime(CLOCK_REALTIME, &t0);
+		if (db.LoadFromFile(file_name, err_msg) == false)
+			return false;
+		open_ms = elapsed_ms(t0);
+
+		clock_gettime(CLOCK_REALTIME, &t0);
+		uint32_t nfound = 0;
+		for (uint32_t i = 0; i < BENCH_LOOKUPS; i++)
+		{
+			DRM_ProgramRecord token;
+			make_bench_record(token, (i * 7919ULL) % nrecords);
+			if (db.GetRecord(token))
+				nfound++;
+		}
+		lookup_us = elapsed_ms(t0) * 1000.0 / BENCH_LOOKUPS;
+
+		if (nfound != BENCH_LOOKUPS)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "records missing from: ";
+			err_msg += file_name;
+			return false;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &t0);
+		for (uint32_t i = 0; i < BENCH_WRITES; i++)
+		{
+			DRM_ProgramRecord rec;
+			make_bench_record(rec, nrecords + i);
+
+			bool changes_made;
+			if (db.UpdateRecord(rec, changes_made, err_msg) == false)
+				return false;
+
+			if ((i + 1) % BENCH_WRITES_PER_SAVE == 0 && db.SaveToFile(file_name, err_msg) == false)
+				return false;
+		}
+		insert_us = elapsed_ms(t0) * 1000.0 / BENCH_WRITES;
+
+		clock_gettime(CLOCK_REALTIME, &t0);
+		for (uint32_t i = 0; i < BENCH_WRITES; i++)
+		{
+			DRM_ProgramRecord token;
+			make_bench_record(token, (i * 104729ULL) % nrecords);
+
+			const DRM_ProgramRecord* rec = db.GetRecord(token);
+			if (rec == 0)
+				continue;
+
+			rec->IncrementNQueries();
+			db.MarkRecordChanged(rec);
+
+			if (db.SaveChangedRecords(file_name, err_msg) == false)
+				return false;
+		}
+		update_us = elapsed_ms(t0) * 1000.0 / BENCH_WRITES;
+
+		clock_gettime(CLOCK_REALTIME, &t0);
+		for (uint32_t i = 0; i < BENCH_WRITES; i++)
+		{
+			DRM_ProgramRecord token;
+			make_bench_record(token, nrecords + i);
+
+			if (remove_record(db, token, err_msg) == false)
+				return false;
+
+			if ((i + 1) % BENCH_WRITES_PER_SAVE == 0 && db.SaveToFile(file_name, err_msg) == false)
+				return false;
+		}
+		remove_us = elapsed_ms(t0) * 1000.0 / BENCH_WRITES;
+
+		if (db.GetNumRecords() != nrecords)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "unexpected number of records in: ";
+			err_msg += file_name;
+			return false;
+		}
+	}
+
+	printf("%-8s %8lu %10.1f %10.2f %10.2f %10.1f %10.1f %10.1f %12lld\n", name, (unsigned long)nrecords,
+		build_ms, open_ms, lookup_us, insert_us, update_us, remove_us, (long long)get_files_size(directory, file_name));
+	fflush(stdout);
+
+	return DB::DeleteFiles(file_name, err_msg);
+}
+
+int main(int argc, const char** argv)
+{
+	const char* directory = argc > 1 ? argv[1] : ".";
+
+	uint32_t max_records = 1000000;
+	if (argc > 2)
+		max_records = (uint32_t)atol(argv[2]);
+
+	string err_msg;
+
+	printf("%-8s %8s %10s %10s %10s %10s %10s %10s %12s\n", "storage", "records",
+		"build ms", "open ms", "lookup us", "insert us", "update us", "remove us", "file bytes");
+
+	for (uint32_t nrecords = 1000; nrecords <= max_records; nrecords *= 10)
+	{
+		if (run_benchmark<SimpleDBVectorStorage>("vector", directory, nrecords, err_msg) == false ||
+			run_benchmark<SimpleDBMappedStorage>("mapped", directory, nrecords, err_msg) == false ||
+			run_benchmark<SimpleDBLogStorage>("log", directory, nrecords, err_msg) == false ||
+			run_benchmark<BTreeStorage>("btree", directory, nrecords, err_msg) == false)
+		{
+			printf("%s\n", err_msg.c_str());
+			return 1;
+		}
+	}
+
+	return 0;
+}
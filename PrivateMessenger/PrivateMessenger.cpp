@@ -16,7 +16,10 @@
 
 #include "WindowsTypes.h"
 #include "SimpleDB.hpp"
-//#include "IndexedDB.hpp"
+#include "SegmentedDB.hpp"
+#include "ShardedDB.hpp"
+#include "BTreeDB.hpp"
+#include "DBStorage.h"
 
 #include "time_tools.h"
 #include "Encryption.h"
@@ -25,10 +28,21 @@
 
 #include "DRM_ProgramRecord.h"
 #include "DRM_PrivateMessageRecord.h"
+#include "DRM_PendingSenderRecord.h"
 #include "ProcessControl.h"
+#include "FastCGI.h"
+#include "HttpServer.h"
+#include "CGIRelay.h"
+#include "MessengerStore.h"
+#include "RangeLock.h"
 
 const char* ownership_reg_db_file_name = "../DRM/DB.bin";			 // Generated - Program ID database
+const char* ownership_btree_file_name = "../DRM/DB.btree";			 // Generated - Program ID database, B+tree format
 const char* messages_db_file_name = "../DRM/MSG.bin";				 // Generated - Message database
+const char* db_epoch_file_name = "../DRM/DB.epoch";					 // Generated - Change counter of the databases
+const char* db_lock_file_name = "../DRM/DB.lock";					 // Generated - Byte range locks of the requests (linux)
+const char* zygote_socket_file_name = "../DRM/zygote.sock";			 // Created by --zygote - The warm server of the CGI instances
+const char* store_socket_file_name = "../DRM/store.sock";			 // Created by --store - The store daemon, the one writer of the databases
 
 const char* generated_code_dir = "../DRM/Generated";							// Created at install time time with correct security / priviledges
 const char* backup_dir = "../DRM/Backup";
@@ -45,17 +59,54 @@ const char* CGI_name = "PrivateMessenger";
 // 7*24*3600*1000 = 604,800,000 - one week
 #define STALE_MESSAGE_TIME_LIMIT_MS 604800000LL
 
+// MSG.bin is split into one file per day of message timestamps, MSG.bin.shard<K>.seg<N>
+// Expired days are removed by deleting their files.
+#define MESSAGE_SEGMENT_MS 86400000LL
+
+// MSG.bin is sharded by the leading bits of the receiver ID into MESSAGE_SHARDS shards, MSG.bin.shard<K>.
+// A send or a receive only loads the receiver's shard. Must be a power of two, at most 64 (the shard mask
+// of DRM_PendingSenderRecord), and must not be changed while there are pending messages.
+#define MESSAGE_SHARDS 16
+
 // A particular sender may not exceed this number of pending messages
 // If a client sends a message which will exceed this limit, then the oldest
 // pending message from that client is deleted to make room for the new pending message.
 #define MAX_PENDING_MESSAGES_PER_SENDER 20
 
+// Durability of the db files - FILESYNC_NONE (no fsync), FILESYNC_COMMIT (fsync every commit) or
+// FILESYNC_GROUPED (the commits of a request share one flush, made before the response is sent).
+// Grouping is per request only, also in the FastCGI, HTTP and store daemon modes - each response waits for the
+// flush of its own commits, commits of other requests are not held back to share it. A request which takes longer
+// than DB_SYNC_GROUP_WINDOW_MS may flush more than once. The counters of FileSyncStats, since the start of the
+// process (one request in CGI mode), are written to the debug log after each request.
+#define DB_SYNC_POLICY FILESYNC_NONE
+#define DB_SYNC_GROUP_WINDOW_MS 5
+
+// Requests are hex characters, longer requests are rejected
+#define MAX_REQUEST_CONTENT_LENGTH 500
+
 // record size is 32+8+8+8+8+16 = 80 bytes = sizeof(DRM_ProgramRecord)
 // 800,000 size limit on this file restricts the number of clients to 10,000
 // DB.bin
 #define OWNERSHIP_DB_MAX_SIZE 800000
 
-const int MAX_CLIENTS = OWNERSHIP_DB_MAX_SIZE / sizeof(DRM_ProgramRecord);
+// The client registry is kept in DB.btree, a paged B+tree. A request reads the pages on the path to its client
+// and writes back only the changed pages, so the cost doesn't grow with the number of clients.
+// An existing DB.bin is imported into DB.btree the first time it is opened.
+// Comment this out to keep the registry in DB.bin, a sorted array which is limited to OWNERSHIP_DB_MAX_SIZE.
+#define USE_BTREE_PROGRAM_DB
+
+#ifdef USE_BTREE_PROGRAM_DB
+typedef StorageDB<DRM_ProgramRecord, BTreeStorage> ProgramDB;
+const char*& program_db_file_name = ownership_btree_file_name;
+#define PROGRAM_DB_BACKUP_FORMAT "%s/DB.[%04ld].btree"
+const uint64_t MAX_CLIENTS = 100000000;
+#else
+typedef StorageDB<DRM_ProgramRecord, SimpleDBLogStorage> ProgramDB;
+const char*& program_db_file_name = ownership_reg_db_file_name;
+#define PROGRAM_DB_BACKUP_FORMAT "%s/DB.[%04ld].bin"
+const uint64_t MAX_CLIENTS = OWNERSHIP_DB_MAX_SIZE / sizeof(DRM_ProgramRecord);
+#endif
 
 bool BackupOwnershipDB(void);
 
@@ -118,960 +169,2905 @@ const uint8_t AdminID[32] = { 0xaf, 0xfe, 0x8f, 0x25, 0x3b, 0x3c, 0xbf, 0x20,
 // 
 // Total of 328 bytes per message
 //
-// Sort order for the db is b)
+// The db is sharded by the leading bits of b) into MESSAGE_SHARDS shards
+// Each shard is partitioned by c) into one segment per MESSAGE_SEGMENT_MS
+// Sort order for each segment is b)
 // Indexes are maintained for a) and c)
+//
+// MSG.bin.summary holds the number of messages in each shard, for the MAX_PENDING_MESSAGES limit
+// MSG.bin.senders holds the number of messages of each sender and the shards they are in, for the
+// MAX_PENDING_MESSAGES_PER_SENDER limit
+
+// Sends and deliveries are appended to the segment log, a full log becomes a sorted run (delivered messages
+// as tombstones) and the segment file is only rewritten when its runs are merged.
+// Nothing is copied out of the mapped segment files unless messages are added or removed.
+typedef SimpleDBLogStorage MessageStorage;
 
-inline bool CheckPendingMessageLimits(SimpleDB<DRM_PrivateMessageRecord>& db, const uint8_t* hashed_sender_id)
+typedef ShardedDB<DRM_PrivateMessageRecord> MessageDB;
+typedef SegmentedDB<DRM_PrivateMessageRecord> MessageShard;
+typedef StorageDB<DRM_PendingSenderRecord, SimpleDBLogStorage> SenderSummaryDB;
+
+inline bool open_message_database(MessageDB& db, string& err_msg)
 {
-	if (db.GetNumRecords() >= MAX_PENDING_MESSAGES) // We are at the maximum number of unsent messages
-	{
-		// remove stale pending messages
-		uint32_t idx = 0;
-		uint64_t tnow = get_time_ms();
-		while (idx < db.GetNumRecords())
-		{
-			const DRM_PrivateMessageRecord* rec = db.GetRecordByIndex(idx);
+	db.SetNumShards(MESSAGE_SHARDS);
+	db.SetSegmentDuration(MESSAGE_SEGMENT_MS);
+	MessageStorage::Configure(db);
 
-			if (!rec)
-				break; // should not happen
+	return db.LoadFromFile(messages_db_file_name, err_msg);
+}
 
-			uint64_t t = rec->GetTimestamp();
+inline string get_sender_summary_file_name(void)
+{
+	string file_name = messages_db_file_name;
+	file_name += ".senders";
+	return file_name;
+}
 
-			if (tnow < t)
-				break; // should not happen
+inline bool save_sender_summary(SenderSummaryDB& senders, string& err_msg)
+{
+	string file_name = get_sender_summary_file_name();
+	return senders.SaveToFile(file_name.c_str(), err_msg);
+}
 
-			if (tnow - t < STALE_MESSAGE_TIME_LIMIT_MS)
-			{
-				idx++;
-				continue;
-			}
+// Number of pending messages from a sender in one shard, and the oldest of them
+inline uint32_t count_sender_messages(MessageShard& shard, const void* hashed_sender_id, uint64_t& t_oldest, uint32_t& iseg_oldest, uint32_t& idx_oldest)
+{
+	DRM_PrivateMessageRecord token;
+	token.SetHashedIDSender(hashed_sender_id);
 
-			// Remove the stale message
-			string err_msg;
-			if (db.RemoveRecord(idx, err_msg) == false)
-				break; // should not happen
-		}
-	}
+	// The sender's pending messages are adjacent in the sender index of each segment
+	uint32_t index_num = DRM_PrivateMessageRecord::SenderIDIndexNum();
 
-	if (db.GetNumRecords() >= MAX_PENDING_MESSAGES)
-		return false; // can't add any more pending messages
+	uint32_t n = 0;
 
-	// Check pending message count for this client.
-	// If we are about to exceed the pending message limit, then delete the oldest pending message before adding this one.
+	for (uint32_t iseg = 0; iseg < shard.GetNumSegments(); iseg++)
 	{
-		uint32_t n = 0;
-		uint32_t idx = 0;
+		IndexedDB<DRM_PrivateMessageRecord>& seg = shard.GetSegment(iseg);
 
-		uint64_t t_oldest = get_time_ms();
-		uint32_t idx_oldest = 0xFFFFFFFF;
+		uint32_t istart, iend;
+		seg.GetIndexRange(index_num, token, istart, iend);
 
-		while (idx < db.GetNumRecords())
+		n += iend - istart;
+
+		for (uint32_t pos = istart; pos < iend; pos++)
 		{
-			const DRM_PrivateMessageRecord* rec = db.GetRecordByIndex(idx);
+			uint32_t idx;
+			const DRM_PrivateMessageRecord* rec = seg.GetRecordByIndexPosition(index_num, pos, &idx);
 
 			if (!rec)
 				break; // should not happen
 
-			if (memcmp(rec->GetHashedIDSender(), hashed_sender_id, 32) == 0)
+			if (t_oldest > rec->GetTimestamp())
 			{
-				if (t_oldest > rec->GetTimestamp())
-				{
-					t_oldest = rec->GetTimestamp();
-					idx_oldest = idx;
-				}
-
-				n++;
+				t_oldest = rec->GetTimestamp();
+				iseg_oldest = iseg;
+				idx_oldest = idx;
 			}
-
-			idx++;
-		}
-
-		if (n > MAX_PENDING_MESSAGES_PER_SENDER)
-		{
-			string err_msg;
-			if (db.RemoveRecord(idx_oldest, err_msg) == false)
-				return false;
 		}
 	}
 
+	return n;
+}
+
+// Records that a sender has nremoved fewer messages in shard ishard, the shard is cleared from the sender's
+// mask once it holds none of the sender's messages
+inline bool remove_from_sender_summary(SenderSummaryDB& senders, MessageShard& shard, uint32_t ishard, const void* hashed_sender_id, uint32_t nremoved, string& err_msg)
+{
+	DRM_PendingSenderRecord token;
+	token.SetHashedIDSender(hashed_sender_id);
+
+	uint32_t idx;
+	const DRM_PendingSenderRecord* sender = senders.GetRecord(token, &idx);
+	if (sender == 0)
+		return true;
+
+	if (sender->GetNPending() <= nremoved)
+		return senders.RemoveRecord(idx, err_msg);
+
+	sender->SetNPending(sender->GetNPending() - nremoved);
+
+	uint64_t t_oldest = get_time_ms();
+	uint32_t iseg_oldest, idx_oldest;
+	if (count_sender_messages(shard, hashed_sender_id, t_oldest, iseg_oldest, idx_oldest) == 0)
+		sender->SetShardMask(sender->GetShardMask() & ~(1ULL << ishard));
+
+	senders.MarkRecordChanged(idx);
 	return true;
 }
 
-// [OP == 1] 1 byte
-//[Hashed recipient ID] 32 bytes - this will be the hash of a program ID of the recipient
-//[Message size] 2 bytes 
-//[Message] number of bytes as specified by message size, ascii text only
-inline bool SendPrivateMessage(const DRM_ProgramRecord *prog_rec, const uint8_t* buf, int buf_sz)
+// Recounts the messages of every sender in every shard. Used after messages were removed
+// without being recorded in the sender summary, i.e. stale messages
+inline bool rebuild_sender_summary(MessageDB& db, SenderSummaryDB& senders, string& err_msg)
 {
-	if (ID_SIZE_BYTES != 32)
-	{
-		DEBUG_ERROR("Invalid ID size");
-		CacheStdout("0001");
-		return false;
-	}
+	vector<DRM_PendingSenderRecord> summary;
 
-	if (buf_sz < ID_SIZE_BYTES + 2 + 1)
+	for (uint32_t ishard = 0; ishard < db.GetNumShards(); ishard++)
 	{
+		MessageShard* shard = db.GetShard(ishard, err_msg);
+		if (shard == 0)
+			return false;
 
-		DEBUG_ERROR("Invalid buf_sz, must be at least 67");
-		CacheStdout("0002");
-		return false;
+		for (uint32_t iseg = 0; iseg < shard->GetNumSegments(); iseg++)
+		{
+			IndexedDB<DRM_PrivateMessageRecord>& seg = shard->GetSegment(iseg);
+
+			for (uint32_t idx = 0; idx < seg.GetNumRecords(); idx++)
+			{
+				DRM_PendingSenderRecord sender;
+				sender.SetHashedIDSender(seg.GetRecordByIndex(idx)->GetHashedIDSender());
+				sender.SetNPending(1);
+				sender.SetShardMask(1ULL << ishard);
+				summary.push_back(sender);
+			}
+		}
 	}
 
-	SimpleDB<DRM_PrivateMessageRecord> db;
-	string err_msg;
+	std::sort(summary.begin(), summary.end());
 
-	if (DoesFileExist(messages_db_file_name))
+	size_t n = 0;
+	for (size_t i = 0; i < summary.size(); i++)
 	{
-		if (db.LoadFromFile(messages_db_file_name, err_msg) == false)
+		if (n && summary[n - 1].Compare(summary[i]) == 0)
 		{
-			DEBUG_ERROR(err_msg.c_str());
-			CacheStdout("0003");
-			return false;
+			summary[n - 1].SetNPending(summary[n - 1].GetNPending() + 1);
+			summary[n - 1].SetShardMask(summary[n - 1].GetShardMask() | summary[i].GetShardMask());
+			continue;
 		}
+
+		summary[n++] = summary[i];
 	}
 
-	const uint8_t* hashed_id_sender = prog_rec->GetID();
-	const uint8_t* hashed_id_receiver = buf;
+	return senders.LoadFromBuffer(n ? &summary[0] : 0, (uint32_t)n, err_msg);
+}
 
-	buf += 32;
+// A missing summary (e.g. the messages were just moved into shards) is rebuilt, which loads every shard once
+inline bool open_sender_summary(MessageDB& db, SenderSummaryDB& senders, string& err_msg)
+{
+	string file_name = get_sender_summary_file_name();
+	if (DoesFileExist(file_name.c_str()))
+		return senders.LoadFromFile(file_name.c_str(), err_msg);
 
-	// Limit the total database size
-	if (CheckPendingMessageLimits(db, hashed_id_sender) == false)
-	{
-		DEBUG_ERROR("Exceeded sender limit.");
-		CacheStdout("0004");
+	if (db.GetNumRecords() == 0)
+		return true;
+
+	if (rebuild_sender_summary(db, senders, err_msg) == false)
 		return false;
-	}
 
-	const uint8_t* buf0 = buf;
+	return save_sender_summary(senders, err_msg);
+}
 
-#ifdef ENABLE_DEBUGGING
-	string s_sender, s_receiver;
-	bin_to_ascii_char(hashed_id_sender, 32, s_sender);
-	bin_to_ascii_char(hashed_id_receiver, 32, s_receiver);
-#endif
+// DB.epoch holds two counters, one for the registry (DB.bin / DB.btree) and one for the message store (MSG.bin and
+// the sender summary). A counter is incremented by every request which saves its databases - except for a client's
+// query count saved in place, which the other processes read again (reload_client()). A process which has
+// loaded the databases loads them again when a counter is not the value it last saw, i.e. when another process
+// (a CGI instance, another worker) has changed the files in between.
+#define DB_EPOCH_REGISTRY 0
+#define DB_EPOCH_MESSAGES 1
 
-	DRM_PrivateMessageRecord rec;
+inline uint64_t read_db_epoch(int i)
+{
+	uint64_t epoch = 0;
 
-	rec.SetHashedIDSender(hashed_id_sender); 
-	rec.SetHashedIDReceiver(hashed_id_receiver); 
+	FILE* stream = fopen(db_epoch_file_name, "rb");
+	if (stream)
+	{
+		if (fseek(stream, i * sizeof(epoch), SEEK_SET) != 0 || fread(&epoch, sizeof(epoch), 1, stream) != 1)
+			epoch = 0;
 
-	uint16_t msg_len;
-	memmove(&msg_len, buf, 2); buf += 2;
+		fclose(stream);
+	}
 
-	rec.SetMessage(buf, msg_len); buf += msg_len;
+	return epoch;
+}
 
-	uint64_t time_ms = get_time_ms();
-	rec.SetTimestamp(&time_ms);
+// With the lock of the counter's databases held. Only this counter is written, the other one may be incremented
+// by another process at the same time.
+inline bool increment_db_epoch(int i, uint64_t& epoch, string& err_msg)
+{
+	epoch = read_db_epoch(i) + 1;
 
-	bool changes_made;
-	if (db.UpdateRecord(rec, changes_made, err_msg) == false)
+	// Created without truncating a file which another process has just created
+	FILE* stream = fopen(db_epoch_file_name, "ab");
+	if (stream)
 	{
-		DEBUG_ERROR(err_msg.c_str());
-		CacheStdout("0005");
-		return false;
+		fclose(stream);
+		stream = fopen(db_epoch_file_name, "r+b");
 	}
 
-	if (changes_made)
+	if (stream == 0)
 	{
-		if (db.GetNumRecords() > MAX_PENDING_MESSAGES)
-		{
-			DEBUG_ERROR("Can't add more unsent messages, limit has been reached");
-			CacheStdout("0006");
-			return false;
-		}
-
-		if (db.SaveToFile(messages_db_file_name, err_msg) == false)
-		{
-			DEBUG_ERROR(err_msg.c_str());
-			CacheStdout("0007");
-			return false;
-		}
-
-#ifdef ENABLE_DEBUGGING
-		string report_file = messages_db_file_name;
-		report_file += ".txt";
-		if (db.GenerateReport(report_file.c_str(), err_msg) == false)
-		{
-			DEBUG_ERROR(err_msg.c_str());
-		}
-#endif
+		ERROR_LOCATION(err_msg);
+		err_msg += "unable to open file for writing: ";
+		err_msg += db_epoch_file_name;
+		return false;
+	}
 
+	if (fseek(stream, i * sizeof(epoch), SEEK_SET) != 0 || fwrite(&epoch, sizeof(epoch), 1, stream) != 1)
+	{
+		fclose(stream);
+		ERROR_LOCATION(err_msg);
+		err_msg += "problem writing data to file: ";
+		err_msg += db_epoch_file_name;
+		return false;
 	}
 
-	CacheStdout("0000");
+	fclose(stream);
 	return true;
 }
 
-// key is a 16 byte random buffer created on the server
-// seed is a 4 byte random buffer created on the server
-// ev is an 8 byte random buffer created on the server
-inline void create_random_values(const uint8_t* hashed_id, uint8_t* key, uint32_t& seed, uint64_t& ev)
-{
-	vector<uint8_t> rbuf;
-	rbuf.resize(0x1000);
-	create_random_buffer(&rbuf[0], rbuf.size(), (uint32_t)100); // 100 ms processing time
+bool open_program_record_database(ProgramDB& db, bool may_write, bool& write_needed);
 
-	// Create a random 16 byte key value
-	memmove(key, &rbuf[sizeof(seed)], 16);
+// The databases which serve the requests. A CGI process opens them for its one request, a persistent worker keeps
+// them resident - each db is loaded by the first request which uses it, and stays loaded for the next requests.
+// A db with changes which could not be saved (a failed request) is closed, the next request loads it again
+// from its files, as a new CGI process would.
+//
+// The registry and the message store are locked separately (RequestLocks), each one is checked against its
+// DB.epoch counter whenever its lock is taken - even a CGI process may have to load a db again within its request.
+class MessengerDatabases
+{
+public:
 
-	// Only the seed value and the hashed_id will be used to create the expected value
-	uint32_t e0, e1;
-	MurmurHash3_x86_32(hashed_id, ID_SIZE_BYTES, seed, &e0);
-	MurmurHash3_x86_32(hashed_id, ID_SIZE_BYTES, e0, &e1);
+	inline MessengerDatabases(bool resident)
+	{
+		m_resident = resident;
+		m_prog_db = 0;
+		m_msg_db = 0;
+		m_senders = 0;
+		m_registry_epoch = 0;
+		m_messages_epoch = 0;
+		m_registry_changed = false;
+		m_messages_changed = false;
+	}
 
-	ev = e1;
-	ev = ev << 32;
-	ev = ev + e0;
-}
+	inline ~MessengerDatabases(void)
+	{
+		Close();
+	}
 
-// hashed_id - 32 byte value from the client
-// key - 32 byte value from the server
-// seed - 4 byte value from the server
-// ev - 8 byte vlaue from the server
-bool generate_source_code(const char *code_template_file, const char *generated_code_directory, const uint8_t* hashed_id, const uint8_t* key, uint32_t& seed, uint64_t& ev, string& source_code_file, string& err_msg)
-{
-	if (DoesFileExist(code_template_file) == FALSE)
+	inline bool IsResident(void) const
 	{
-		err_msg = "Missing file: ";
-		err_msg += (const char*)code_template_file;
-		return false;
+		return m_resident;
 	}
 
-	if (DoesFileExist(generated_code_directory) == false)
+	// With the registry lock held, before the program db is used
+	inline void BeginRegistry(void)
 	{
-		if (_mkdir(generated_code_directory))
+		m_registry_changed = false;
+
+		uint64_t epoch = read_db_epoch(DB_EPOCH_REGISTRY);
+		if (epoch != m_registry_epoch)
 		{
-			err_msg = "Unable to create directory: ";
-			err_msg += (const char*)generated_code_directory;
-			return false;
+			CloseProgramDB();
+			m_registry_epoch = epoch;
 		}
 	}
 
-	int flen = filelength(code_template_file);
+	// With the message store lock held, before the message db or the sender summary is used
+	inline void BeginMessages(void)
+	{
+		m_messages_changed = false;
 
-	FILE* stream = 0;
-	fopen_s(&stream, code_template_file, "rb");
+		uint64_t epoch = read_db_epoch(DB_EPOCH_MESSAGES);
+		if (epoch != m_messages_epoch)
+		{
+			CloseMessageDB();
+			m_messages_epoch = epoch;
+		}
+	}
 
-	vector<char> code;
-	code.resize(flen);
+	// True if another process has changed the databases since they were last used
+	inline bool IsOutOfDate(void) const
+	{
+		return read_db_epoch(DB_EPOCH_REGISTRY) != m_registry_epoch || read_db_epoch(DB_EPOCH_MESSAGES) != m_messages_epoch;
+	}
 
-	if (fread(&code[0], 1, flen, stream) != flen)
+	// Before a db is saved - the copies of other processes are out of date from then on, even if the save fails
+	inline void MarkRegistryChanged(void)
 	{
-		fclose(stream);
-		err_msg = "Problem reading from file: ";
-		err_msg += code_template_file;
+		m_registry_changed = true;
 	}
 
-	fclose(stream);
+	inline void MarkMessagesChanged(void)
+	{
+		m_messages_changed = true;
+	}
 
-	char s_seed[32];
-	sprintf_s(s_seed, sizeof(s_seed), "0x%08lX", seed);
+	// With the registry lock held, after the last save of the program db
+	inline void EndRegistry(void)
+	{
+		if (m_registry_changed)
+			increment_epoch(DB_EPOCH_REGISTRY, m_registry_epoch);
 
-	int n = replace_string(code, "#SEED#", s_seed);
+		m_registry_changed = false;
+	}
 
-	if (n == 0)
+	// With the message store lock held, after the last save of the message db and the sender summary
+	inline void EndMessages(void)
 	{
-		err_msg = "Did not find \"#SEED#\" in file: ";
-		err_msg += (const char*)code_template_file;
-		return false;
+		if (m_messages_changed)
+			increment_epoch(DB_EPOCH_MESSAGES, m_messages_epoch);
+
+		m_messages_changed = false;
 	}
 
-	if (n > 1)
+	inline bool IsProgramDBOpen(void) const
 	{
-		err_msg = "Found more than one instance of \"#SEED#\" in file: ";
-		err_msg += (const char*)code_template_file;
-		return false;
+		return m_prog_db != 0;
 	}
 
-	char s_ev[32];
-	sprintf_s(s_ev, "0x%016llX", ev);
+	// Returns 0 on error. With the registry lock held exclusive, or shared - then a load which would have to write
+	// (may_write false) returns 0 with write_needed set instead, see get_program_db().
+	inline ProgramDB* GetProgramDB(bool may_write = true, bool* write_needed = 0)
+	{
+		if (write_needed)
+			*write_needed = false;
 
-	n = replace_string(code, "#EV#", s_ev);
+		if (m_prog_db)
+			return m_prog_db;
 
-	if (n == 0)
+		ProgramDB* db = new ProgramDB;
+		bool needed;
+		if (open_program_record_database(*db, may_write, needed) == false)
+		{
+			if (write_needed)
+				*write_needed = needed;
+
+			delete db;
+			return 0;
+		}
+
+		m_prog_db = db;
+		return db;
+	}
+
+	// Returns 0 on error
+	inline MessageDB* GetMessageDB(string& err_msg)
 	{
-		err_msg = "Did not find \"#EV#\" in file: ";
-		err_msg += (const char*)code_template_file;
-		return false;
+		if (m_msg_db)
+			return m_msg_db;
+
+		MessageDB* db = new MessageDB;
+		if (open_message_database(*db, err_msg) == false)
+		{
+			delete db;
+			return 0;
+		}
+
+		m_msg_db = db;
+		return db;
 	}
 
-	//if (n > 1)
-	//{
-	//    err_msg = "Found more than one instance of \"#EV#\" in file: ";
-	//    err_msg += (const char*)code_template_file;
-	//    return false;
-	//}
+	// Returns 0 on error, the message db is opened first
+	inline SenderSummaryDB* GetSenderSummary(string& err_msg)
+	{
+		if (m_senders)
+			return m_senders;
 
-	string s_key;
-	bin_to_hex_char(key, 16, s_key);
+		MessageDB* db = GetMessageDB(err_msg);
+		if (db == 0)
+			return 0;
 
-	n = replace_string(code, "#KEY#", s_key.c_str());
+		SenderSummaryDB* senders = new SenderSummaryDB;
+		if (open_sender_summary(*db, *senders, err_msg) == false)
+		{
+			delete senders;
+			return 0;
+		}
 
-	if (n == 0)
+		m_senders = senders;
+		return senders;
+	}
+
+	inline void CloseProgramDB(void)
 	{
-		err_msg = "Did not find \"#KEY#\" in file: ";
-		err_msg += (const char*)code_template_file;
-		return false;
+		delete m_prog_db;
+		m_prog_db = 0;
 	}
 
-	if (n > 1)
+	inline void CloseSenderSummary(void)
 	{
-		err_msg = "Found more than one instance of \"#KEY#\" in file: ";
-		err_msg += (const char*)code_template_file;
-		return false;
+		delete m_senders;
+		m_senders = 0;
 	}
 
-	string fname;
-	bin_to_ascii_char(hashed_id, 32, fname);
-	source_code_file = generated_code_directory;
-	source_code_file += "/";
-	source_code_file += fname.c_str();
-	source_code_file += ".code";
+	// The sender summary is closed too, it describes the messages
+	inline void CloseMessageDB(void)
+	{
+		CloseSenderSummary();
 
-	fopen_s(&stream, source_code_file.c_str(), "wb");
+		delete m_msg_db;
+		m_msg_db = 0;
+	}
 
-	if (!stream)
+	inline void Close(void)
 	{
-		err_msg = "Unable to create file: ";
-		err_msg += source_code_file.c_str();
-		return false;
+		CloseProgramDB();
+		CloseMessageDB();
 	}
 
-	if (fwrite(&code[0], 1, code.size(), stream) != code.size())
+	// At the end of each request, with its locks still held (see RequestEnd). Windows won't replace a mapped file,
+	// so a resident process there lets go of the files which the other processes' full saves replace - MSG.bin
+	// shards and segments, the sender summary, DB.bin and its .idx.
+	inline void EndRequest(void)
 	{
-		fclose(stream);
-		err_msg = "Problem writing to file: ";
-		err_msg += source_code_file.c_str();
-		return false;
+#ifdef WIN32
+		if (m_resident)
+			ReleaseFileMappings();
+#endif
 	}
 
-	fclose(stream);
+	// A db which can't be copied out of its mapping (a damaged block) is closed, the next request loads it again
+	inline void ReleaseFileMappings(void)
+	{
+		string err_msg;
 
-	return true;
-}
+		if (m_prog_db && m_prog_db->ReleaseFileMappings(err_msg) == false)
+		{
+			DEBUG_ERROR(err_msg.c_str());
+			CloseProgramDB();
+		}
 
-bool RunCompiler(const char* source_code_file, const char* pwd, const char* compiled_code_file, string &err_msg)
-{
-	if (DoesFileExist(compiler_exe) == false)
-	{
-		err_msg = "File does not exist: ";
-		err_msg += compiler_exe;
-		return false;
+		if (m_senders && m_senders->ReleaseFileMappings(err_msg) == false)
+		{
+			DEBUG_ERROR(err_msg.c_str());
+			CloseSenderSummary();
+		}
+
+		if (m_msg_db && m_msg_db->ReleaseFileMappings(err_msg) == false)
+		{
+			DEBUG_ERROR(err_msg.c_str());
+			CloseMessageDB();
+		}
 	}
 
-	// Compiler <source_file> [compiled_code_file] [pwd] [params_file]
+	// With the registry and message store locks held, after the program db was loaded by get_program_db() - a resident process
+	// loads every db and message shard ahead of the requests, rather than in the first request which needs it. Anything which
+	// is out of date (DB.epoch) is loaded again.
+	inline bool Preload(string& err_msg)
+	{
+		BeginRegistry();
+		BeginMessages();
 
-	char working_directory[1024];
-	_getcwd(working_directory, sizeof(working_directory));
-	//strcat_s(working_directory, sizeof(working_directory), "\\..\\DRM");
+		if (GetProgramDB(false) == 0)
+		{
+			ERROR_LOCATION(err_msg);
+			err_msg += "Unable to open the program record database";
+			return false;
+		}
 
-	//const char* working_directory = "C:\\Program Files\\Apache Software Foundation\\Apache2.4\\DRM";
+		if (GetSenderSummary(err_msg) == 0)
+			return false;
 
-	char params[1024];
-	sprintf_s(params, sizeof(params), "\"%s\" \"%s\" \"%s\"", source_code_file, compiled_code_file, pwd);
+		for (uint32_t ishard = 0; ishard < m_msg_db->GetNumShards(); ishard++)
+		{
+			if (m_msg_db->GetShard(ishard, err_msg) == 0)
+				return false;
+		}
 
-	string target_file = source_code_file;
-	target_file += ".txt";
+		return true;
+	}
 
-	DWORD timeout_sec = 20;
-	DWORD exit_code = 0;
-	bool bShowProcess = false;
+private:
 
-	uint64_t t0 = get_time_ms();
+	// Not copyable, the databases are owned by exactly one object
+	MessengerDatabases(const MessengerDatabases&);
+	MessengerDatabases& operator = (const MessengerDatabases&);
 
-	bool status = RunProcess
-	(
-		compiler_exe,
-		working_directory,
-		params,
-		target_file.c_str(),
-		err_msg,
-		timeout_sec,
-		&exit_code,
-		bShowProcess
-	);
+	bool m_resident;
 
-	uint64_t t1 = get_time_ms();
+	ProgramDB* m_prog_db;
+	MessageDB* m_msg_db;
+	SenderSummaryDB* m_senders;
 
-#ifdef ENABLE_DEBUGGING
-	// log to the target file
-	FILE* stream = 0;
-	fopen_s(&stream, target_file.c_str(), "a");
-	if (stream)
-	{
-		fprintf_s(stream, "\ncompiler_exe: %s\n", compiler_exe);
-		fprintf_s(stream, "working_directory: %s\n", working_directory);
-		fprintf_s(stream, "params: %s\n", params);
-		fprintf_s(stream, "err_msg: %s\n", err_msg.c_str());
-		fprintf_s(stream, "exit_code: %ld\n", exit_code);
-		fprintf_s(stream, "status: %s\n", status ? "true" : "false");
-		fprintf_s(stream, "elapsed_ms: %lld\n", t1 - t0);
+	uint64_t m_registry_epoch;	// the DB.epoch counters which the loaded dbs correspond to
+	uint64_t m_messages_epoch;
+	bool m_registry_changed;	// the request has saved (or tried to save) a db
+	bool m_messages_changed;
 
-		fclose(stream);
+	inline void increment_epoch(int i, uint64_t& epoch)
+	{
+		string err_msg;
+		if (increment_db_epoch(i, epoch, err_msg) == false)
+		{
+			DEBUG_ERROR(err_msg.c_str());
+		}
 	}
-#else
-	_unlink(target_file.c_str());
-#endif
+};
 
-	if (status == false)
-		return false;
+inline bool CheckPendingMessageLimits(MessageDB& db, SenderSummaryDB& senders, const uint8_t* hashed_sender_id)
+{
+	string err_msg;
 
-	if (exit_code != 0)
+	if (db.GetNumRecords() >= MAX_PENDING_MESSAGES) // We are at the maximum number of unsent messages
 	{
-		err_msg = "Compiler fails, exit code: ";
-		char tmp[100];
-		sprintf_s(tmp, sizeof(tmp), "%04lX", exit_code);
-		err_msg += tmp;
-		return false;
+		// remove stale pending messages, this loads every shard
+		uint64_t tnow = get_time_ms();
+
+		uint32_t nremoved = 0;
+		if (tnow > STALE_MESSAGE_TIME_LIMIT_MS)
+			db.RemoveOlderThan(tnow - STALE_MESSAGE_TIME_LIMIT_MS + 1, nremoved, err_msg);
+
+		if (nremoved && rebuild_sender_summary(db, senders, err_msg) == false)
+			return false;
 	}
 
-	return true;
-}
+	if (db.GetNumRecords() >= MAX_PENDING_MESSAGES)
+		return false; // can't add any more pending messages
 
-// OP == 0
-//
-//[My hashed ID] - 32 bytes
-//
-// Return value:
-//[size of compiled binary] - 2 bytes
-//[body of compiled binary] - N bytes
-//
-// Note: Password for the compiled binary is My hashed ID
-// On error the size of the compiled binary return value is 0
-//
-inline const DRM_ProgramRecord* AddClient(const uint8_t* buf, int buf_sz, SimpleDB<DRM_ProgramRecord> &db)
-{
-	if (db.GetNumRecords() >= MAX_CLIENTS)
+	// Check pending message count for this client.
+	// If we are about to exceed the pending message limit, then delete the oldest pending message before adding this one.
+	DRM_PendingSenderRecord token;
+	token.SetHashedIDSender(hashed_sender_id);
+
+	const DRM_PendingSenderRecord* sender = senders.GetRecord(token);
+	if (sender == 0 || sender->GetNPending() <= MAX_PENDING_MESSAGES_PER_SENDER)
+		return true;
+
+	// Only the shards which hold the sender's messages are searched
+	uint64_t t_oldest = get_time_ms();
+	uint32_t ishard_oldest = 0xFFFFFFFF;
+	uint32_t iseg_oldest = 0xFFFFFFFF;
+	uint32_t idx_oldest = 0xFFFFFFFF;
+
+	for (uint32_t ishard = 0; ishard < db.GetNumShards(); ishard++)
 	{
-		DEBUG_ERROR("DB.bin has the maximum number of clients already.");
-		CacheStdout("0000");
-		return 0;
+		if ((sender->GetShardMask() & (1ULL << ishard)) == 0)
+			continue;
+
+		MessageShard* shard = db.GetShard(ishard, err_msg);
+		if (shard == 0)
+			return false;
+
+		uint64_t t_prev = t_oldest;
+		count_sender_messages(*shard, hashed_sender_id, t_oldest, iseg_oldest, idx_oldest);
+		if (t_oldest < t_prev)
+			ishard_oldest = ishard;
 	}
 
+	if (ishard_oldest == 0xFFFFFFFF)
+		return true; // should not happen
+
+	MessageShard* shard = db.GetShard(ishard_oldest, err_msg);
+	if (shard->RemoveRecord(iseg_oldest, idx_oldest, err_msg) == false)
+		return false;
+
+	return remove_from_sender_summary(senders, *shard, ishard_oldest, hashed_sender_id, 1, err_msg);
+}
+
+// [OP == 1] 1 byte
+//[Hashed recipient ID] 32 bytes - this will be the hash of a program ID of the recipient
+//[Message size] 2 bytes 
+//[Message] number of bytes as specified by message size, ascii text only
+inline bool SendPrivateMessage(MessengerDatabases& dbs, const DRM_ProgramRecord *prog_rec, const uint8_t* buf, int buf_sz)
+{
 	if (ID_SIZE_BYTES != 32)
 	{
 		DEBUG_ERROR("Invalid ID size");
-		CacheStdout("0000");
-		return 0;
+		CacheStdout("0001");
+		return false;
 	}
 
-	if (buf_sz != ID_SIZE_BYTES)
+	if (buf_sz < ID_SIZE_BYTES + 2 + 1)
 	{
 
-		DEBUG_ERROR("Invalid buf_sz, must 32");
-		CacheStdout("0000");
-		return 0;
+		DEBUG_ERROR("Invalid buf_sz, must be at least 67");
+		CacheStdout("0002");
+		return false;
 	}
 
 	string err_msg;
 
-	const uint8_t* hashed_id = buf;
-	
-	DRM_ProgramRecord rec;
-	rec.SetID(hashed_id);
+	MessageDB* db = dbs.GetMessageDB(err_msg);
+	SenderSummaryDB* senders = db ? dbs.GetSenderSummary(err_msg) : 0;
 
-	if (db.GetRecord(rec))
+	if (db == 0 || senders == 0)
 	{
-		DEBUG_ERROR("ID already exists.");
-		CacheStdout("0000");
-		return 0;
+		DEBUG_ERROR(err_msg.c_str());
+		CacheStdout("0003");
+		return false;
 	}
 
-	// These random values are used to generate source code which will be compiled and sent to the client by the server
-	uint8_t key[16];
-	uint32_t seed;
-	uint64_t ev;
-	create_random_values(hashed_id, key, seed, ev);
+	const uint8_t* hashed_id_sender = prog_rec->GetID();
+	const uint8_t* hashed_id_receiver = buf;
 
-	//const char* generated_code_directory = "Generated";
-	string source_code_file;
-	if (generate_source_code(code_template_file, generated_code_dir, hashed_id, key, seed, ev, source_code_file, err_msg) == false)
+	buf += 32;
+
+	// Limit the total database size
+	if (CheckPendingMessageLimits(*db, *senders, hashed_id_sender) == false)
 	{
-		DEBUG_ERROR(err_msg.c_str());
-		CacheStdout("0000");
-		return 0;
+		DEBUG_ERROR("Exceeded sender limit.");
+		CacheStdout("0004");
+		return false;
 	}
 
-	// compiled_code_file has extension .bin
-	string compiled_code_file = source_code_file;
-	compiled_code_file.erase(compiled_code_file.length() - 4, 4);
-	compiled_code_file += "bin";
+	const uint8_t* buf0 = buf;
 
-	string s_hashed_id;
-	bin_to_ascii_char(hashed_id, ID_SIZE_BYTES, s_hashed_id);
+#ifdef ENABLE_DEBUGGING
+	string s_sender, s_receiver;
+	bin_to_ascii_char(hashed_id_sender, 32, s_sender);
+	bin_to_ascii_char(hashed_id_receiver, 32, s_receiver);
+#endif
 
-	// Compile the source to a bytecode file
-	uint64_t t0 = get_time_ms();
-	bool status = RunCompiler(source_code_file.c_str(), s_hashed_id.c_str(), compiled_code_file.c_str(), err_msg);
-	uint64_t t1 = get_time_ms();
-	uint64_t delta = t1 - t0;
+	DRM_PrivateMessageRecord rec;
 
-	char msg[1024];
-	sprintf_s(msg, sizeof(msg), "Compile time: %llu ms\n", delta);
+	rec.SetHashedIDSender(hashed_id_sender); 
+	rec.SetHashedIDReceiver(hashed_id_receiver); 
 
-	DEBUG_MSG(msg);
+	uint16_t msg_len;
+	memmove(&msg_len, buf, 2); buf += 2;
 
-	if (status == false)
-	{
-		DEBUG_ERROR2("Compiler error", err_msg.c_str());
-		CacheStdout("0000");
-		return 0;
-	}
+	rec.SetMessage(buf, msg_len); buf += msg_len;
 
-	// read the bytecode file
-	vector<uint8_t> bin;
+	uint64_t time_ms = get_time_ms();
+	rec.SetTimestamp(&time_ms);
 
-	int sz = filelength(compiled_code_file.c_str());
-	bin.resize(sz);
+	uint32_t nrecords = db->GetNumRecords();
 
-	FILE* stream = fopen(compiled_code_file.c_str(), "rb");
-	if (!stream)
+	bool changes_made;
+	if (db->UpdateRecord(rec, changes_made, err_msg) == false)
 	{
-		DEBUG_ERROR2("Problem opening file for reading: ", compiled_code_file);
-		CacheStdout("0000");
-		return 0;
+		DEBUG_ERROR(err_msg.c_str());
+		CacheStdout("0005");
+		return false;
 	}
 
-	if (fread(&bin[0], 1, bin.size(), stream) != bin.size())
+	if (changes_made)
 	{
-		fclose(stream);
-		DEBUG_ERROR2("Problem reading file: ", compiled_code_file);
-		CacheStdout("0000");
-		return 0;
-	}
+		if (db->GetNumRecords() > MAX_PENDING_MESSAGES)
+		{
+			DEBUG_ERROR("Can't add more unsent messages, limit has been reached");
+			CacheStdout("0006");
+			return false;
+		}
 
-	fclose(stream);
+		// A new message, rather than a changed one, is counted against the sender
+		if (db->GetNumRecords() > nrecords)
+		{
+			DRM_PendingSenderRecord sender;
+			sender.SetHashedIDSender(hashed_id_sender);
 
-	uint16_t sz_u16 = bin.size();
-	CacheBinStdout(&sz_u16, sizeof(sz_u16)); // cache the sz of the message
-	CacheBinStdout(&bin[0], bin.size());
+			const DRM_PendingSenderRecord* existing = senders->GetRecord(sender);
+			if (existing)
+			{
+				sender.SetNPending(existing->GetNPending());
+				sender.SetShardMask(existing->GetShardMask());
+			}
 
-	bool changes_made = false;
-	if (db.UpdateRecord(rec, changes_made, err_msg) == false)
-	{
-		DEBUG_ERROR(err_msg.c_str());
-		return 0;
-	}
+			sender.SetNPending(sender.GetNPending() + 1);
+			sender.SetShardMask(sender.GetShardMask() | (1ULL << db->GetShardNumber(rec)));
 
-	const DRM_ProgramRecord *prog_rec = db.GetRecord(rec);
+			bool sender_changed;
+			if (senders->UpdateRecord(sender, sender_changed, err_msg) == false)
+			{
+				DEBUG_ERROR(err_msg.c_str());
+				CacheStdout("0005");
+				return false;
+			}
+		}
 
-	if (prog_rec)
-		prog_rec->SetKey(key); // make sure that the new record has the key which has just be geneated
+		dbs.MarkMessagesChanged();
+		if (db->SaveToFile(messages_db_file_name, err_msg) == false)
+		{
+			DEBUG_ERROR(err_msg.c_str());
+			CacheStdout("0007");
+			return false;
+		}
 
-#ifndef ENABLE_DEBUGGING
-	_unlink(compiled_code_file.c_str());
-	_unlink(source_code_file.c_str());
-#endif
-	
-	return prog_rec;
-}
+		// The messages are saved first, a summary which is behind is corrected by the next rebuild
+		if (save_sender_summary(*senders, err_msg) == false)
+		{
+			DEBUG_ERROR(err_msg.c_str());
+			CacheStdout("0007");
+			return false;
+		}
+
+#ifdef ENABLE_DEBUGGING
+		string report_file = messages_db_file_name;
+		report_file += ".txt";
+		if (db->GenerateReport(report_file.c_str(), err_msg) == false)
+		{
+			DEBUG_ERROR(err_msg.c_str());
+		}
+#endif
+
+	}
+
+	CacheStdout("0000");
+	return true;
+}
+
+// key is a 16 byte random buffer created on the server
+// seed is a 4 byte random buffer created on the server
+// ev is an 8 byte random buffer created on the server
+inline void create_random_values(const uint8_t* hashed_id, uint8_t* key, uint32_t& seed, uint64_t& ev)
+{
+	vector<uint8_t> rbuf;
+	rbuf.resize(0x1000);
+	create_random_buffer(&rbuf[0], rbuf.size(), (uint32_t)100); // 100 ms processing time
+
+	// Create a random 16 byte key value
+	memmove(key, &rbuf[sizeof(seed)], 16);
+
+	// Only the seed value and the hashed_id will be used to create the expected value
+	uint32_t e0, e1;
+	MurmurHash3_x86_32(hashed_id, ID_SIZE_BYTES, seed, &e0);
+	MurmurHash3_x86_32(hashed_id, ID_SIZE_BYTES, e0, &e1);
+
+	ev = e1;
+	ev = ev << 32;
+	ev = ev + e0;
+}
+
+// hashed_id - 32 byte value from the client
+// key - 32 byte value from the server
+// seed - 4 byte value from the server
+// ev - 8 byte vlaue from the server
+bool generate_source_code(const char *code_template_file, const char *generated_code_directory, const uint8_t* hashed_id, const uint8_t* key, uint32_t& seed, uint64_t& ev, string& source_code_file, string& err_msg)
+{
+	if (DoesFileExist(code_template_file) == FALSE)
+	{
+		err_msg = "Missing file: ";
+		err_msg += (const char*)code_template_file;
+		return false;
+	}
+
+	if (DoesFileExist(generated_code_directory) == false)
+	{
+		if (CreateDirectoryIfNecessary(generated_code_directory) == false)
+		{
+			err_msg = "Unable to create directory: ";
+			err_msg += (const char*)generated_code_directory;
+			return false;
+		}
+	}
+
+	int flen = filelength(code_template_file);
+
+	FILE* stream = 0;
+	stream = fopen(code_template_file, "rb");
+
+	vector<char> code;
+	code.resize(flen);
+
+	if (fread(&code[0], 1, flen, stream) != flen)
+	{
+		fclose(stream);
+		err_msg = "Problem reading from file: ";
+		err_msg += code_template_file;
+	}
+
+	fclose(stream);
+
+	char s_seed[32];
+	snprintf(s_seed, sizeof(s_seed), "0x%08lX", (unsigned long)seed);
+
+	int n = replace_string(code, "#SEED#", s_seed);
+
+	if (n == 0)
+	{
+		err_msg = "Did not find \"#SEED#\" in file: ";
+		err_msg += (const char*)code_template_file;
+		return false;
+	}
+
+	if (n > 1)
+	{
+		err_msg = "Found more than one instance of \"#SEED#\" in file: ";
+		err_msg += (const char*)code_template_file;
+		return false;
+	}
+
+	char s_ev[32];
+	snprintf(s_ev, sizeof(s_ev), "0x%016llX", (unsigned long long)ev);
+
+	n = replace_string(code, "#EV#", s_ev);
+
+	if (n == 0)
+	{
+		err_msg = "Did not find \"#EV#\" in file: ";
+		err_msg += (const char*)code_template_file;
+		return false;
+	}
+
+	//if (n > 1)
+	//{
+	//    err_msg = "Found more than one instance of \"#EV#\" in file: ";
+	//    err_msg += (const char*)code_template_file;
+	//    return false;
+	//}
+
+	string s_key;
+	bin_to_hex_char(key, 16, s_key);
+
+	n = replace_string(code, "#KEY#", s_key.c_str());
+
+	if (n == 0)
+	{
+		err_msg = "Did not find \"#KEY#\" in file: ";
+		err_msg += (const char*)code_template_file;
+		return false;
+	}
+
+	if (n > 1)
+	{
+		err_msg = "Found more than one instance of \"#KEY#\" in file: ";
+		err_msg += (const char*)code_template_file;
+		return false;
+	}
+
+	string fname;
+	bin_to_ascii_char(hashed_id, 32, fname);
+	source_code_file = generated_code_directory;
+	source_code_file += "/";
+	source_code_file += fname.c_str();
+	source_code_file += ".code";
+
+	stream = fopen(source_code_file.c_str(), "wb");
+
+	if (!stream)
+	{
+		err_msg = "Unable to create file: ";
+		err_msg += source_code_file.c_str();
+		return false;
+	}
+
+	if (fwrite(&code[0], 1, code.size(), stream) != code.size())
+	{
+		fclose(stream);
+		err_msg = "Problem writing to file: ";
+		err_msg += source_code_file.c_str();
+		return false;
+	}
+
+	fclose(stream);
+
+	return true;
+}
+
+bool RunCompiler(const char* source_code_file, const char* pwd, const char* compiled_code_file, string &err_msg)
+{
+	if (DoesFileExist(compiler_exe) == false)
+	{
+		err_msg = "File does not exist: ";
+		err_msg += compiler_exe;
+		return false;
+	}
+
+	// Compiler <source_file> [compiled_code_file] [pwd] [params_file]
+
+	char working_directory[1024];
+#ifdef WIN32
+	_getcwd(working_directory, sizeof(working_directory));
+#else
+	getcwd(working_directory, sizeof(working_directory));
+#endif
+	//strcat_s(working_directory, sizeof(working_directory), "\\..\\DRM");
+
+	//const char* working_directory = "C:\\Program Files\\Apache Software Foundation\\Apache2.4\\DRM";
+
+	char params[1024];
+	snprintf(params, sizeof(params), "\"%s\" \"%s\" \"%s\"", source_code_file, compiled_code_file, pwd);
+
+	string target_file = source_code_file;
+	target_file += ".txt";
+
+	DWORD timeout_sec = 20;
+	DWORD exit_code = 0;
+	bool bShowProcess = false;
+
+	uint64_t t0 = get_time_ms();
+
+	bool status = RunProcess
+	(
+		compiler_exe,
+		working_directory,
+		params,
+		target_file.c_str(),
+		err_msg,
+		timeout_sec,
+		&exit_code,
+		bShowProcess
+	);
+
+	uint64_t t1 = get_time_ms();
+
+#ifdef ENABLE_DEBUGGING
+	// log to the target file
+	FILE* stream = 0;
+	stream = fopen(target_file.c_str(), "a");
+	if (stream)
+	{
+		fprintf(stream, "\ncompiler_exe: %s\n", compiler_exe);
+		fprintf(stream, "working_directory: %s\n", working_directory);
+		fprintf(stream, "params: %s\n", params);
+		fprintf(stream, "err_msg: %s\n", err_msg.c_str());
+		fprintf(stream, "exit_code: %ld\n", (long)exit_code);
+		fprintf(stream, "status: %s\n", status ? "true" : "false");
+		fprintf(stream, "elapsed_ms: %lld\n", (long long)(t1 - t0));
+
+		fclose(stream);
+	}
+#else
+	DeleteFile(target_file.c_str());
+#endif
+
+	if (status == false)
+		return false;
+
+	if (exit_code != 0)
+	{
+		err_msg = "Compiler fails, exit code: ";
+		char tmp[100];
+		snprintf(tmp, sizeof(tmp), "%04lX", (unsigned long)exit_code);
+		err_msg += tmp;
+		return false;
+	}
+
+	return true;
+}
+
+// OP == 0
+//
+//[My hashed ID] - 32 bytes
+//
+// Return value:
+//[size of compiled binary] - 2 bytes
+//[body of compiled binary] - N bytes
+//
+// Note: Password for the compiled binary is My hashed ID
+// On error the size of the compiled binary return value is 0
+//
+// The client is added in two steps, the client code is compiled in between without the registry lock:
+// CanAddClient() and BuildClientCode(), then InsertClient() with the registry locked again.
+
+// Returns false if the registry is full, or if the ID exists already
+inline bool CanAddClient(const uint8_t* hashed_id, ProgramDB &db)
+{
+	if (db.GetNumRecords() >= MAX_CLIENTS)
+	{
+		DEBUG_ERROR("The client registry has the maximum number of clients already.");
+		return false;
+	}
+
+	DRM_ProgramRecord rec;
+	rec.SetID(hashed_id);
+
+	if (db.GetRecord(rec))
+	{
+		DEBUG_ERROR("ID already exists.");
+		return false;
+	}
+
+	return true;
+}
+
+// The key of a new client is created, and its compiled code is cached for the reply.
+// The registry is not used - a store front end builds the code before the daemon adds the client.
+inline bool BuildClientCode(const uint8_t* hashed_id, uint8_t* key)
+{
+	string err_msg;
+
+	// These random values are used to generate source code which will be compiled and sent to the client by the server
+	uint32_t seed;
+	uint64_t ev;
+	create_random_values(hashed_id, key, seed, ev);
+
+	//const char* generated_code_directory = "Generated";
+	string source_code_file;
+	if (generate_source_code(code_template_file, generated_code_dir, hashed_id, key, seed, ev, source_code_file, err_msg) == false)
+	{
+		DEBUG_ERROR(err_msg.c_str());
+		return false;
+	}
+
+	// compiled_code_file has extension .bin
+	string compiled_code_file = source_code_file;
+	compiled_code_file.erase(compiled_code_file.length() - 4, 4);
+	compiled_code_file += "bin";
+
+	string s_hashed_id;
+	bin_to_ascii_char(hashed_id, ID_SIZE_BYTES, s_hashed_id);
+
+	// Compile the source to a bytecode file
+	uint64_t t0 = get_time_ms();
+	bool status = RunCompiler(source_code_file.c_str(), s_hashed_id.c_str(), compiled_code_file.c_str(), err_msg);
+	uint64_t t1 = get_time_ms();
+	uint64_t delta = t1 - t0;
+
+	char msg[1024];
+	snprintf(msg, sizeof(msg), "Compile time: %llu ms\n", (unsigned long long)delta);
+
+	DEBUG_MSG(msg);
+
+	if (status == false)
+	{
+		DEBUG_ERROR2("Compiler error", err_msg.c_str());
+		return false;
+	}
+
+	// read the bytecode file
+	vector<uint8_t> bin;
+
+	int sz = filelength(compiled_code_file.c_str());
+	bin.resize(sz);
+
+	FILE* stream = fopen(compiled_code_file.c_str(), "rb");
+	if (!stream)
+	{
+		DEBUG_ERROR2("Problem opening file for reading: ", compiled_code_file);
+		return false;
+	}
+
+	if (fread(&bin[0], 1, bin.size(), stream) != bin.size())
+	{
+		fclose(stream);
+		DEBUG_ERROR2("Problem reading file: ", compiled_code_file);
+		return false;
+	}
+
+	fclose(stream);
+
+	uint16_t sz_u16 = bin.size();
+	CacheBinStdout(&sz_u16, sizeof(sz_u16)); // cache the sz of the message
+	CacheBinStdout(&bin[0], bin.size());
+
+#ifndef ENABLE_DEBUGGING
+	DeleteFile(compiled_code_file.c_str());
+	DeleteFile(source_code_file.c_str());
+#endif
+
+	return true;
+}
+
+// The record of a new client, with its key. Returns 0 on error.
+inline const DRM_ProgramRecord* InsertClient(const uint8_t* hashed_id, const uint8_t* key, ProgramDB &db)
+{
+	string err_msg;
+
+	DRM_ProgramRecord rec;
+	rec.SetID(hashed_id);
+
+	bool changes_made = false;
+	if (db.UpdateRecord(rec, changes_made, err_msg) == false)
+	{
+		DEBUG_ERROR(err_msg.c_str());
+		return 0;
+	}
+
+	const DRM_ProgramRecord *prog_rec = db.GetRecord(rec);
+
+	if (prog_rec)
+	{
+		prog_rec->SetKey(key); // make sure that the new record has the key which has just be geneated
+		db.MarkRecordChanged(prog_rec);
+	}
+
+	return prog_rec;
+}
+
+// A pending message and its location in the segmented message db
+struct PendingMessage
+{
+	const DRM_PrivateMessageRecord* rec;
+	uint32_t iseg;
+	uint32_t idx;
+
+	inline bool operator < (const PendingMessage& msg) const
+	{
+		return *rec < *msg.rec;
+	}
+};
+
+// Receive Pending Messages - from any senders
+// [OP == 2] 1 byte 
+//
+// If the hashed ID is not in the instance db then return 00 - i.e. no messages pending
+// If the hashed ID is in the instance db then return pending messages if there are any
+// Hashed IDs are added to the instance db via a separate operation
+// 
+// Return value:
+//[Status message] - 4 bytes, "0000" for success
+//[size of message1] - 1 byte
+//[Hash of ID of sender1] - 32 bytes
+//[Timestamp of msg] - 8 bytes
+//[Message1] 
+//[size of message2] - 1 byte
+//[Hash of ID of sender2] - 32 bytes
+//[Timestamp of msg] - 8 bytes
+//[message2] 
+// ... 
+//[size of message] - 1 byte - value is zero, indicates that there are no more messages
+//
+// do_not_return_messges - under some circumstances we do not want to return any messgages - e.g. during a recovery operation
+inline bool ReceivePendingMessages(MessengerDatabases& dbs, const DRM_ProgramRecord *prog_rec, bool do_not_return_messages)
+{
+	string err_msg;
+
+	MessageDB* db = dbs.GetMessageDB(err_msg);
+	if (db == 0)
+	{
+		DEBUG_ERROR(err_msg.c_str());
+		CacheStdout("0001");
+		return false;
+	}
+
+	DRM_PrivateMessageRecord token;
+
+	token.SetHashedIDReceiver(prog_rec->GetID());  // SenderID will be zeros
+
+	// Only the receiver's shard is loaded
+	uint32_t ishard = db->GetShardNumber(token);
+	MessageShard* shard = db->GetShard(ishard, err_msg);
+	if (shard == 0)
+	{
+		DEBUG_ERROR(err_msg.c_str());
+		CacheStdout("0001");
+		return false;
+	}
+
+#ifdef ENABLE_DEBUGGING
+	string s_receiver_id;
+	bin_to_ascii_char(prog_rec->GetID(), 32, s_receiver_id);
+#endif
+
+	// The receiver's messages are one contiguous range [inbox_start, inbox_end) in each segment,
+	// the ranges are merged into record order
+	vector<uint32_t> inbox_start, inbox_end;
+	inbox_start.resize(shard->GetNumSegments());
+	inbox_end.resize(shard->GetNumSegments());
+
+	vector<PendingMessage> pending;
+
+	for (uint32_t iseg = 0; iseg < shard->GetNumSegments(); iseg++)
+	{
+		IndexedDB<DRM_PrivateMessageRecord>& seg = shard->GetSegment(iseg);
+
+		const DRM_PrivateMessageRecord* inbox = seg.EqualRange(token, DRM_PrivateMessageRecord::CompareReceiver, inbox_start[iseg], inbox_end[iseg]);
+
+		for (uint32_t idx = inbox_start[iseg]; idx < inbox_end[iseg]; idx++)
+		{
+			const DRM_PrivateMessageRecord* rec = &inbox[idx - inbox_start[iseg]];
+
+			PendingMessage msg;
+			msg.rec = rec;
+			msg.iseg = iseg;
+			msg.idx = idx;
+			pending.push_back(msg);
+		}
+	}
+
+	std::sort(pending.begin(), pending.end());
+
+	if (pending.size() == 0 || do_not_return_messages)
+	{
+		DEBUG_MSG("No messages");
+		CacheStdout("0000"); // Success 
+		CacheStdout("00"); // No messages
+		return true;
+	}
+
+	bool changes_made = false;
+
+	// Need to insert the status string later
+	int insert_pos = CacheGetInsertPosition();
+
+	string s;
+
+#ifdef ENABLE_DEBUGGING
+	FILE* stream = 0;
+#endif
+
+	for (size_t i = 0; i < pending.size(); i++)
+	{
+		const DRM_PrivateMessageRecord* rec = pending[i].rec;
+		uint32_t idx = pending[i].idx;
+
+#ifdef ENABLE_DEBUGGING
+		string s_rec_receiver_id, s_rec_sender_id;
+		bin_to_ascii_char((const uint8_t *)rec->GetHashedIDReciever(), 32, s_rec_receiver_id);
+		bin_to_ascii_char((const uint8_t*)rec->GetHashedIDSender(), 32, s_rec_sender_id);
+#endif
+
+		// unread message found
+		uint8_t hashed_id_sender[ID_SIZE_BYTES];
+		memmove(hashed_id_sender, rec->GetHashedIDSender(), ID_SIZE_BYTES);
+
+		string s_msg;
+		rec->GetMessage(s_msg);
+		int msg_len = strlen(s_msg.c_str());
+
+		if (msg_len == 0)
+			continue;
+
+		uint8_t sz = (uint8_t)min(msg_len, 256);
+		CacheStdout(bin_to_hex_char(&sz, 1, s)); // cache the sz of the message
+
+		string s_hashed_id_sender;
+		bin_to_hex_char(hashed_id_sender, ID_SIZE_BYTES, s_hashed_id_sender);
+		CacheStdout(s_hashed_id_sender.c_str()); // cache the hashed id of the sender
+
+		uint64_t t = rec->GetTimestamp();
+		string s_timestamp;
+		bin_to_hex_char((const uint8_t*)&t, sizeof(t), s_timestamp);
+		CacheStdout(s_timestamp.c_str());
+
+		CacheStdout(s_msg.c_str());
+
+#ifdef ENABLE_DEBUGGING
+		if (stream == 0)
+		{
+			string log_file;
+			log_file = messages_db_file_name;
+			log_file += ".sent.txt";
+			stream = fopen(log_file.c_str(), "w");
+		}
+
+		if (stream)
+		{
+			fprintf(stream, "[%lu]\n", (unsigned long)idx);
+			fprintf(stream, "hashed_ID_sender: %s\n", s_rec_sender_id.c_str());
+			fprintf(stream, "hashed_ID_receiver: %s\n", s_rec_receiver_id.c_str());
+			fprintf(stream, "Timestamp_ms: %llu\n", (unsigned long long)t);
+			fprintf(stream, "%s\n", s_msg.c_str());
+		}
+#endif
+	}
+
+#ifdef ENABLE_DEBUGGING
+	if (stream)
+		fclose(stream);
+#endif
+
+	// The senders of the delivered messages, counted before the records are removed.
+	// The sender summary is opened first, a missing summary is rebuilt from the messages as they are now.
+	SenderSummaryDB* senders = dbs.GetSenderSummary(err_msg);
+	bool senders_ok = senders != 0;
+	if (senders_ok == false)
+	{
+		DEBUG_ERROR(err_msg.c_str());
+	}
+
+	vector<DRM_PendingSenderRecord> delivered;
+	for (size_t i = 0; i < pending.size(); i++)
+	{
+		if (delivered.size() && memcmp(delivered.back().GetHashedIDSender(), pending[i].rec->GetHashedIDSender(), ID_SIZE_BYTES) == 0)
+		{
+			delivered.back().SetNPending(delivered.back().GetNPending() + 1);
+			continue;
+		}
+
+		DRM_PendingSenderRecord sender;
+		sender.SetHashedIDSender(pending[i].rec->GetHashedIDSender());
+		sender.SetNPending(1);
+		delivered.push_back(sender);
+	}
+
+	// Every message in the receiver's ranges has been delivered, each range is removed in one step
+	for (uint32_t iseg = 0; iseg < shard->GetNumSegments(); iseg++)
+	{
+		if (inbox_start[iseg] == inbox_end[iseg])
+			continue;
+
+		if (shard->RemoveRange(iseg, inbox_start[iseg], inbox_end[iseg], err_msg) == false)
+		{
+			DEBUG_ERROR(err_msg.c_str());
+			CacheStdout("0004", 0,0, insert_pos);
+			return false;
+		}
+
+		changes_made = true;
+	}
+
+	// Send out the termination character
+	uint8_t term_byte = 0;
+	CacheStdout(bin_to_hex_char(&term_byte, 1, s));
+
+	// A failed save is reported through the return value, the messages are sent regardless
+	bool saved = true;
+
+	if (changes_made)
+	{
+		dbs.MarkMessagesChanged();
+		if (db->SaveToFile(messages_db_file_name, err_msg) == false)
+		{
+			DEBUG_ERROR(err_msg.c_str());
+			saved = false;
+		}
+
+		if (senders_ok)
+		{
+			bool status = true;
+			for (size_t i = 0; status && i < delivered.size(); i++)
+				status = remove_from_sender_summary(*senders, *shard, ishard, delivered[i].GetHashedIDSender(), delivered[i].GetNPending(), err_msg);
+
+			if (status == false || save_sender_summary(*senders, err_msg) == false)
+			{
+				DEBUG_ERROR(err_msg.c_str());
+				saved = false;
+			}
+		}
+	}
+
+	CacheStdout("0000", 0,0, insert_pos); // insert success indicator
+	return saved;
+}
+
+// Clean all pending messages older than the specified time
+//
+//[Time_ms] 8 bytes - clean messages which were originated before this time
+//
+inline bool CleanOldMessages(MessengerDatabases& dbs, const DRM_ProgramRecord *prog_rec, const uint8_t *buf, int buf_sz)
+{
+	if (memcmp(prog_rec->GetID(), AdminID, ID_SIZE_BYTES))
+	{
+		DEBUG_ERROR("Given ID does not match AdminID.");
+		CacheStdout("Fail");
+		return false;
+	}
+
+	uint64_t t_ms;
+	memmove(&t_ms, buf, sizeof(t_ms));
+
+	uint64_t t_now = get_time_ms();
+
+	if (t_ms > t_now)
+	{
+		DEBUG_ERROR("t_ms > t_now");
+		CacheStdout("Fail");
+		return false;
+	}
+
+
+	string err_msg;
+
+	MessageDB* db = dbs.GetMessageDB(err_msg);
+	if (db == 0)
+	{
+		DEBUG_ERROR(err_msg.c_str());
+		CacheStdout("Fail");
+		return false;
+	}
+
+	if (db->GetNumRecords() == 0)
+	{
+		char msg[1024];
+		sprintf(msg, "Success - message db does not exist: %s", messages_db_file_name);
+		DEBUG_MSG(msg);
+		CacheStdout(msg);
+		return true;
+	}
+
+	// Days which are entirely older than t_ms are deleted whole
+	uint32_t n = 0;
+	if (db->RemoveOlderThan(t_ms, n, err_msg) == false)
+	{
+		DEBUG_ERROR(err_msg.c_str());
+		CacheStdout("Fail");
+		return false;
+	}
+
+	if (n)
+	{
+		dbs.MarkMessagesChanged();
+		if (db->SaveToFile(messages_db_file_name, err_msg) == false)
+		{
+			DEBUG_ERROR(err_msg.c_str());
+			CacheStdout("Fail");
+			return false;
+		}
+
+		// The rebuilt summary replaces the file, the next request loads it from there
+		dbs.CloseSenderSummary();
+
+		SenderSummaryDB senders;
+		if (rebuild_sender_summary(*db, senders, err_msg) == false || save_sender_summary(senders, err_msg) == false)
+		{
+			DEBUG_ERROR(err_msg.c_str());
+			CacheStdout("Fail");
+			return false;
+		}
+	}
+
+	char msg[1024];
+	sprintf(msg, "Success - %ld messages removed", (long)n);
+	DEBUG_ERROR(msg);
+	CacheStdout(msg);
+	return true;
+}
+
+
+// key is 16 bytes
+// 
+// buf[]
+// hashed_id of client - 32 bytes
+// instance_hash - 8 bytes - decrypted with modified guid 
+// remainder - ?? bytes - to be decrypted with modified guid
+const DRM_ProgramRecord *decrypt_with_modified_guid(uint8_t* buf, int buf_sz, const GUID& leading_guid, ProgramDB &db)
+{
+	if (buf_sz <= ID_SIZE_BYTES + 8)
+	{
+		DEBUG_ERROR2(__FUNCTION__,"() Invalid buf_sz");
+		return 0;
+	}
+
+	string err_msg;
+
+	const uint8_t* hashed_id = buf;
+
+	DRM_ProgramRecord token;
+	token.SetID(hashed_id);
+
+	const DRM_ProgramRecord *prog_rec = db.GetRecord(token);
+
+#ifdef ENABLE_DEBUGGING
+	string primary_check;
+	bin_to_ascii_char(prog_rec->GetID(), 32, primary_check);
+#endif
+
+	if (prog_rec == 0)
+	{
+		DEBUG_ERROR("ID does not exist.");
+		return 0;
+	}
+
+	GUID modified_leading_guid;
+	create_modified_guid(prog_rec->GetKey(), (const uint8_t*)&leading_guid, (uint8_t*)&modified_leading_guid);
+
+	symmetric_encryption(buf + ID_SIZE_BYTES, buf_sz - ID_SIZE_BYTES, modified_leading_guid);
+
+	return prog_rec;
+}
+
+// A load which is not allowed to write (may_write false) fails with write_needed set if it would have to - to complete
+// an interrupted save from DB.btree.journal, or to import DB.bin.
+#ifdef USE_BTREE_PROGRAM_DB
+bool open_program_record_database(ProgramDB& db, bool may_write, bool& write_needed)
+{
+	string err_msg;
+
+	bool import_array_db = DoesFileExist(ownership_btree_file_name) == false && DoesFileExist(ownership_reg_db_file_name);
+
+	write_needed = import_array_db && may_write == false;
+	if (write_needed)
+		return false;
+
+	db.EnableJournalReplay(may_write);
+	if (db.LoadFromFile(ownership_btree_file_name, err_msg) == false)
+	{
+		DEBUG_ERROR(err_msg.c_str());
+		return false;
+	}
+
+	// The journal of a save which another process is making, or which was interrupted
+	write_needed = db.IsJournalPending();
+	if (write_needed)
+		return false;
+
+	// First use of DB.btree - the clients registered in DB.bin (and DB.bin.log) are moved over
+	if (import_array_db)
+	{
+		SimpleDB<DRM_ProgramRecord> array_db;
+		if (array_db.LoadFromFile(ownership_reg_db_file_name, err_msg) == false)
+		{
+			DEBUG_ERROR(err_msg.c_str());
+			return false;
+		}
+
+		for (uint32_t i = 0; i < array_db.GetNumRecords(); i++)
+		{
+			bool changes_made;
+			if (db.UpdateRecord(*array_db.GetRecordByIndex(i), changes_made, err_msg) == false)
+			{
+				DEBUG_ERROR(err_msg.c_str());
+				return false;
+			}
+		}
+
+		if (db.SaveToFile(ownership_btree_file_name, err_msg) == false)
+		{
+			DEBUG_ERROR(err_msg.c_str());
+			return false;
+		}
+	}
+
+	return true;
+}
+#else
+bool open_program_record_database(ProgramDB& db, bool may_write, bool& write_needed)
+{
+	string err_msg;
+
+	// RecoverFile() may rename a DB.bin.NN into place
+	write_needed = DoesFileExist(ownership_reg_db_file_name) == false && may_write == false;
+	if (write_needed)
+		return false;
+
+	// Storage is set by SimpleDBLogStorage - lookups are served straight from the mapped DB.bin, a copy is only
+	// made if a client is added, and per request changes are appended to DB.bin.log rather than rewriting DB.bin
+
+	// Records are sorted by hashed ID, the IDs are uniformly distributed
+	db.EnableInterpolationSearch(true);
+
+	// Client lookups go through DB.bin.idx, which is rewritten whenever a client is added
+	db.EnableHashIndex(true);
+
+	// A save by an earlier version, interrupted while DB.bin was being replaced, leaves the new file as DB.bin.NN
+	bool recovered;
+	if (ProgramDB::RecoverFile(ownership_reg_db_file_name, recovered, err_msg) == false)
+	{
+		DEBUG_ERROR(err_msg.c_str());
+		return false;
+	}
+
+	if (DoesFileExist(ownership_reg_db_file_name))
+	{
+		// This should not happen, the DB.bin only grows with the AddNewClient() procedure and that procedure won't allow this
+		if (filelength64(ownership_reg_db_file_name) > (int64_t)ProgramDB::GetFileSize(MAX_CLIENTS))
+		{
+			char msg[1024];
+			snprintf(msg, sizeof(msg), "file %s is too large, must be less than %lu bytes", ownership_reg_db_file_name, (unsigned long)ProgramDB::GetFileSize(MAX_CLIENTS));
+			DEBUG_ERROR(msg);
+			return false;
+		}
+
+		if (db.LoadFromFile(ownership_reg_db_file_name, err_msg) == false)
+		{
+			DEBUG_ERROR(err_msg.c_str());
+			return false;
+		}
+	}
+
+	return true;
+}
+#endif
+
+bool validate_instance_hash(const uint8_t* b, int buf_sz, const DRM_ProgramRecord* prog_rec, bool& matches_prev)
+{
+	matches_prev = false;
+
+	uint8_t instance_hash[16];
+	get_instance_hash(prog_rec, instance_hash);
+
+	bool success = memcmp(b, &instance_hash, sizeof(instance_hash)) == 0;
+
+	if (success == false)
+	{
+		if (get_instance_hash_prev(prog_rec, instance_hash))
+			matches_prev = memcmp(b, &instance_hash, sizeof(instance_hash)) == 0;
+	}
+
+#ifdef ENABLE_DEBUGGING
+	string s;
+	bin_to_ascii_char(b, 16, s);
+	DEBUG_MSG2("instance_hash[in] ", s.c_str());
+
+	if (success == false)
+		DEBUG_MSG("instance hash does not match");
+#endif
+
+	return success;
+}
+
+inline void modify_item(const char*& item, vector<char>& static_str, const char* s_find, const char* s_replace)
+{
+	int len = strlen(item);
+	static_str.resize(len + 1);
+	memmove(&static_str[0], item, len);
+	replace_string(static_str, s_find, s_replace);
+	item = &static_str[0];
+}
+
+static string s_fname;
+
+static vector<char> s_ownership_reg_db_file_name;		// = "../DRM/DB.bin";								// Generated - Program ID database
+static vector<char> s_ownership_btree_file_name;		// = "../DRM/DB.btree";								// Generated - Program ID database, B+tree format
+static vector<char> s_messages_db_file_name;			// = "../DRM/MSG.bin";								// Generated - Message database
+static vector<char> s_db_epoch_file_name;				// = "../DRM/DB.epoch";								// Generated - Change counter of the databases
+static vector<char> s_db_lock_file_name;				// = "../DRM/DB.lock";								// Generated - Byte range locks of the requests (linux)
+static vector<char> s_zygote_socket_file_name;			// = "../DRM/zygote.sock";							// Created by --zygote - The warm server of the CGI instances
+static vector<char> s_store_socket_file_name;			// = "../DRM/store.sock";							// Created by --store - The store daemon, the one writer of the databases
+
+static vector<char> s_generated_code_dir;				// = "../DRM/Generated";							// Created at install time with correct security / priviledges
+static vector<char> s_backup_dir;						// = "../DRM/Backup";								// Created at install time wiith correct security / priviledges
+static vector<char> s_compiler_exe;						// = "../DRM/Generated/Compiler.exe";				// Installed
+static vector<char> s_code_template_file;				// = "../DRM/Generated/modify_guid_template.code";	// Installed
+
+inline void construct_names_and_paths(const char* executable)
+{
+	const char* c0 = 0;
+#ifdef WIN32
+	c0 = strrchr(executable, '\\');
+#endif
+
+	if (c0 == 0)
+		c0 = strrchr(executable, '/');
+	
+	if (c0 == 0)
+		s_fname = "PrivateMessenger";
+	else
+	{
+		c0++;
+		const char *c1 = strrchr(c0, '.');
+
+		if (c1)
+		{
+			int len = (int)(c1 - c0);
+			s_fname.assign(c0, len);
+		}
+		else
+		{
+			s_fname = c0;
+		}
+	}
+
+	CGI_name = s_fname.c_str();
+
+	const char* s_find = "/DRM/";
+
+	string s_replace = "/";
+	s_replace += CGI_name;
+	s_replace += "/";
+
+	modify_item(ownership_reg_db_file_name, s_ownership_reg_db_file_name, s_find, s_replace.c_str());
+	modify_item(ownership_btree_file_name, s_ownership_btree_file_name, s_find, s_replace.c_str());
+	modify_item(messages_db_file_name, s_messages_db_file_name, s_find, s_replace.c_str());
+	modify_item(db_epoch_file_name, s_db_epoch_file_name, s_find, s_replace.c_str());
+	modify_item(db_lock_file_name, s_db_lock_file_name, s_find, s_replace.c_str());
+	modify_item(zygote_socket_file_name, s_zygote_socket_file_name, s_find, s_replace.c_str());
+	modify_item(store_socket_file_name, s_store_socket_file_name, s_find, s_replace.c_str());
+	modify_item(generated_code_dir, s_generated_code_dir, s_find, s_replace.c_str());
+	modify_item(backup_dir, s_backup_dir, s_find, s_replace.c_str());
+	modify_item(compiler_exe, s_compiler_exe, s_find, s_replace.c_str());
+	modify_item(code_template_file, s_code_template_file, s_find, s_replace.c_str());
+}
+
+#ifndef __linux__
+// Without byte range locks (see RequestLocks), requests are serialized by a named semaphore, which is shared by
+// every process serving CGI_name. Returns NULL if the semaphore can't be had within 10 seconds.
+inline HANDLE acquire_request_lock(void)
+{
+	char semaphore_name[256];
+	snprintf(semaphore_name, sizeof(semaphore_name), "Global_%s", CGI_name);
+	HANDLE h_semaphore = CreateSemaphore(NULL, 1, 1, semaphore_name);
+
+	if (h_semaphore == NULL)
+	{
+		char msg[1024];
+		snprintf(msg, sizeof(msg), "Failed trying to createsemaphore: %s : code: %lu", semaphore_name, GetLastError());
+		DEBUG_ERROR(msg);
+		return NULL;
+	}
+
+	// Wait up to 10 seconds
+	DWORD scode = WaitForSingleObject(h_semaphore, 10000);
+	if (scode != WAIT_OBJECT_0)
+	{
+		char msg[1024];
+		snprintf(msg, sizeof(msg), "Failed waiting for semaphore: %s : code: %lu", semaphore_name, scode);
+		DEBUG_ERROR(msg);
+		CloseHandle(h_semaphore);
+		return NULL;
+	}
+
+	return h_semaphore;
+}
+
+inline void release_request_lock(HANDLE h_semaphore)
+{
+	LONG prev;
+	ReleaseSemaphore(h_semaphore, 1, &prev);
+	CloseHandle(h_semaphore);
+}
+#endif
+
+#define REQUEST_LOCK_TIMEOUT_MS 10000
+#define REQUEST_LOCK_REGISTRY 0
+#define REQUEST_LOCK_MESSAGES 1
+#define REQUEST_LOCK_REGISTRY_WRITE 2
+#define REQUEST_LOCK_CLIENT_BASE 1024
+#define REQUEST_LOCK_CLIENT_SLOTS 0x10000
+#define REQUEST_LOCK_RECORD_BASE 0x100000000ULL
+
+// The locks of one request. On linux they are byte range locks of DB.lock:
+//
+// REQUEST_LOCK_REGISTRY       - DB.bin / DB.btree, shared to load and look up records and to change records in place,
+//                               exclusive to add clients and for any other save
+// REQUEST_LOCK_MESSAGES       - MSG.bin and the sender summary, shared to load, exclusive to change and save
+// REQUEST_LOCK_REGISTRY_WRITE - exclusive for a save of records in place, and for a load of the registry which has to
+//                               complete an interrupted save from its journal, with the registry lock held shared
+// REQUEST_LOCK_CLIENT_BASE    - one byte per slot of client IDs, exclusive for the whole request of a client. The
+//                               client's record does not change while its slot is locked, so the record can be looked
+//                               up under the shared registry lock and used after it is released.
+// REQUEST_LOCK_RECORD_BASE    - plus the range of the registry file which holds a record (ProgramDB::GetRecordRange()),
+//                               exclusive while it is saved in place, shared while it is read again (ReloadRecord())
+//
+// The requests of one client are applied in order, the requests of other clients only wait for the short spells
+// in which a db is changed - and for a change of a client's record in place, only the requests of the clients whose
+// records share its range wait. The locks are taken in the order client, registry, registry write, message store,
+// record. A request holds one db lock at a time, only a resident process which loads both dbs holds both (shared).
+//
+// Elsewhere the first lock takes the named semaphore, which is held until the object is destroyed.
+class RequestLocks
+{
+public:
+
+	inline RequestLocks(void)
+	{
+		m_client_locked = false;
+		m_client_slot = 0;
+		m_registry_locked = false;
+		m_registry_exclusive = false;
+		m_registry_write_locked = false;
+		m_messages_locked = false;
+		m_record_locked = false;
+		m_record_offset = 0;
+		m_record_len = 0;
+#ifndef __linux__
+		m_semaphore = NULL;
+#endif
+	}
+
+	inline ~RequestLocks(void)
+	{
+		UnlockRecord();
+		UnlockMessages();
+		UnlockRegistryWrite();
+		UnlockRegistry();
+		UnlockClient();
+
+#ifndef __linux__
+		if (m_semaphore)
+			release_request_lock(m_semaphore);
+#endif
+	}
+
+	inline bool LockClient(const uint8_t* hashed_id)
+	{
+		uint32_t slot;
+		memmove(&slot, hashed_id, sizeof(slot));
+		m_client_slot = slot % REQUEST_LOCK_CLIENT_SLOTS;
+
+		m_client_locked = lock(REQUEST_LOCK_CLIENT_BASE + m_client_slot, 1, true);
+		return m_client_locked;
+	}
+
+	inline void UnlockClient(void)
+	{
+		if (m_client_locked)
+			unlock(REQUEST_LOCK_CLIENT_BASE + m_client_slot, 1);
+
+		m_client_locked = false;
+	}
+
+	inline bool LockRegistry(bool exclusive)
+	{
+		m_registry_locked = lock(REQUEST_LOCK_REGISTRY, 1, exclusive);
+		m_registry_exclusive = m_registry_locked && exclusive;
+		return m_registry_locked;
+	}
+
+	inline void UnlockRegistry(void)
+	{
+		if (m_registry_locked)
+			unlock(REQUEST_LOCK_REGISTRY, 1);
+
+		m_registry_locked = false;
+		m_registry_exclusive = false;
+	}
+
+	inline bool IsRegistryExclusive(void) const
+	{
+		return m_registry_exclusive;
+	}
+
+	inline bool LockRegistryWrite(void)
+	{
+		m_registry_write_locked = lock(REQUEST_LOCK_REGISTRY_WRITE, 1, true);
+		return m_registry_write_locked;
+	}
+
+	inline void UnlockRegistryWrite(void)
+	{
+		if (m_registry_write_locked)
+			unlock(REQUEST_LOCK_REGISTRY_WRITE, 1);
+
+		m_registry_write_locked = false;
+	}
+
+	inline bool IsRegistryWriteLocked(void) const
+	{
+		return m_registry_write_locked;
+	}
+
+	inline bool LockMessages(bool exclusive)
+	{
+		m_messages_locked = lock(REQUEST_LOCK_MESSAGES, 1, exclusive);
+		return m_messages_locked;
+	}
+
+	inline void UnlockMessages(void)
+	{
+		if (m_messages_locked)
+			unlock(REQUEST_LOCK_MESSAGES, 1);
+
+		m_messages_locked = false;
+	}
+
+	// offset and len as returned by ProgramDB::GetRecordRange(), one record range at a time
+	inline bool LockRecord(uint64_t offset, uint64_t len, bool exclusive)
+	{
+		UnlockRecord();
+
+		m_record_locked = lock(REQUEST_LOCK_RECORD_BASE + offset, len, exclusive);
+		m_record_offset = offset;
+		m_record_len = len;
+		return m_record_locked;
+	}
+
+	inline void UnlockRecord(void)
+	{
+		if (m_record_locked)
+			unlock(REQUEST_LOCK_RECORD_BASE + m_record_offset, m_record_len);
+
+		m_record_locked = false;
+	}
+
+private:
+
+	// Not copyable, the locks are released by exactly one object
+	RequestLocks(const RequestLocks&);
+	RequestLocks& operator = (const RequestLocks&);
+
+	bool m_client_locked;
+	uint32_t m_client_slot;
+	bool m_registry_locked;
+	bool m_registry_exclusive;
+	bool m_registry_write_locked;
+	bool m_messages_locked;
+	bool m_record_locked;
+	uint64_t m_record_offset;
+	uint64_t m_record_len;
+
+#ifdef __linux__
+	// One open lock file per process, the requests of a process come one after another
+	static inline RangeLockFile& lock_file(void)
+	{
+		static RangeLockFile file;
+		return file;
+	}
+
+	inline bool lock(uint64_t offset, uint64_t len, bool exclusive)
+	{
+		string err_msg;
+
+		RangeLockFile& file = lock_file();
+		if (file.IsOpen() == false && file.Open(db_lock_file_name, err_msg) == false)
+		{
+			DEBUG_ERROR(err_msg.c_str());
+			return false;
+		}
+
+		if (file.Lock(offset, len, exclusive, REQUEST_LOCK_TIMEOUT_MS, err_msg) == false)
+		{
+			DEBUG_ERROR(err_msg.c_str());
+			return false;
+		}
+
+		return true;
+	}
+
+	inline void unlock(uint64_t offset, uint64_t len)
+	{
+		lock_file().Unlock(offset, len);
+	}
+#else
+	HANDLE m_semaphore;
+
+	inline bool lock(uint64_t offset, uint64_t len, bool exclusive)
+	{
+		if (m_semaphore == NULL)
+			m_semaphore = acquire_request_lock();
+
+		return m_semaphore != NULL;
+	}
+
+	inline void unlock(uint64_t offset, uint64_t len)
+	{
+	}
+#endif
+};
+
+// Calls MessengerDatabases::EndRequest() when a request returns. Declared after the request's RequestLocks, so the
+// locks are still held - on windows they are one semaphore, held until RequestLocks is destroyed.
+class RequestEnd
+{
+public:
+
+	inline RequestEnd(MessengerDatabases& dbs) : m_dbs(dbs)
+	{
+	}
+
+	inline ~RequestEnd(void)
+	{
+		m_dbs.EndRequest();
+	}
+
+private:
+
+	// Not copyable, the request is ended once
+	RequestEnd(const RequestEnd&);
+	RequestEnd& operator = (const RequestEnd&);
+
+	MessengerDatabases& m_dbs;
+};
+
+// With the registry lock held. A load of the program db only reads, unless it has to complete an interrupted save
+// (or import DB.bin) - then it is made again with the registry write lock held, see REQUEST_LOCK_REGISTRY_WRITE.
+// Returns 0 on error.
+inline ProgramDB* get_program_db(MessengerDatabases& dbs, RequestLocks& locks)
+{
+	if (dbs.IsProgramDBOpen() || locks.IsRegistryExclusive() || locks.IsRegistryWriteLocked())
+		return dbs.GetProgramDB();
+
+	bool write_needed;
+	ProgramDB* prog_db = dbs.GetProgramDB(false, &write_needed);
+	if (prog_db || write_needed == false)
+		return prog_db;
+
+	if (locks.LockRegistryWrite() == false)
+		return 0;
+
+	prog_db = dbs.GetProgramDB();
+	locks.UnlockRegistryWrite();
+	return prog_db;
+}
+
+// With the registry lock held. The requests of other clients save their records in place without a change of DB.epoch
+// (see finish_request()), the part of the registry which holds the client's record is read again before the record is
+// used. Its range stays locked until RequestLocks::UnlockRecord(). Returns false if it can't be read, the db is closed then.
+inline bool reload_client(MessengerDatabases& dbs, RequestLocks& locks, ProgramDB& db, const DRM_ProgramRecord& token, bool exclusive)
+{
+	// Not there - nothing to read again
+	uint64_t offset, len;
+	if (db.GetRecordRange(token, offset, len) == false)
+		return true;
+
+	if (locks.LockRecord(offset, len, exclusive) == false)
+		return false;
+
+	string err_msg;
+	if (db.ReloadRecord(token, err_msg) == false)
+	{
+		DEBUG_ERROR(err_msg.c_str());
+		dbs.CloseProgramDB();
+		return false;
+	}
+
+	return true;
+}
+
+// s is the request body as posted by the client (hex characters). The leading guid is taken off, buf starts with
+// the op and the client's hashed id, which are decrypted. Returns false if s is not a request.
+inline bool decode_request(const string& s, vector<uint8_t>& buf, GUID& leading_guid)
+{
+	DEBUG_MSG2("input: ", s.c_str());
+
+	if (hex_char_to_bin(s, buf) == false)
+	{
+		DEBUG_ERROR("hex_char_to_bin() failure");
+		return false;
+	}
 
-// Receive Pending Messages - from any senders
-// [OP == 2] 1 byte 
-//
-// If the hashed ID is not in the instance db then return 00 - i.e. no messages pending
-// If the hashed ID is in the instance db then return pending messages if there are any
-// Hashed IDs are added to the instance db via a separate operation
-// 
-// Return value:
-//[Status message] - 4 bytes, "0000" for success
-//[size of message1] - 1 byte
-//[Hash of ID of sender1] - 32 bytes
-//[Timestamp of msg] - 8 bytes
-//[Message1] 
-//[size of message2] - 1 byte
-//[Hash of ID of sender2] - 32 bytes
-//[Timestamp of msg] - 8 bytes
-//[message2] 
-// ... 
-//[size of message] - 1 byte - value is zero, indicates that there are no more messages
+	if (buf.size() < sizeof(GUID) + 1 + ID_SIZE_BYTES)
+	{
+		DEBUG_ERROR("Invalid request size");
+		return false;
+	}
+
+	memmove(&leading_guid, &buf[0], sizeof(GUID));
+
+	buf.erase(buf.begin(), buf.begin() + sizeof(GUID));
+
+	// Only the op byte and the client hashed id is encrypted with the leading guid
+	symmetric_encryption(&buf[0], 1+ID_SIZE_BYTES, leading_guid);
+
+	return true;
+}
+
+// finish_request() of a client which is not added - the query count is saved in place (ProgramDB::CanSaveInPlace()) with
+// the registry lock held shared, and the client's range locked exclusive. Lookups of other clients go on meanwhile, and
+// the processes which have the registry loaded keep it - DB.epoch is not changed, they read the record again before
+// they use it (reload_client()). done is false if the change can't be saved in place, nothing was changed then.
+inline bool update_client(MessengerDatabases& dbs, RequestLocks& locks, const DRM_ProgramRecord& token, bool increment_nqueries, DRM_ProgramRecord& rec, bool& done)
+{
+	done = false;
+
+	if (locks.LockRegistry(false) == false)
+		return false;
+
+	if (increment_nqueries && locks.LockRegistryWrite() == false)
+		return false;
+
+	// Another client's request may have saved the registry since it was read
+	dbs.BeginRegistry();
+
+	ProgramDB* prog_db = get_program_db(dbs, locks);
+	if (prog_db == 0)
+		return false;
+
+	if (increment_nqueries)
+	{
+		if (prog_db->CanSaveInPlace(program_db_file_name) == false)
+		{
+			locks.UnlockRegistryWrite();
+			locks.UnlockRegistry();
+			return true;
+		}
+
+		// The range may hold other clients' records, which their requests have saved since it was read
+		if (reload_client(dbs, locks, *prog_db, token, true) == false)
+			return false;
+	}
+
+	const DRM_ProgramRecord* prog_rec = prog_db->GetRecord(token);
+	if (prog_rec == 0)
+		return false;
+
+	if (increment_nqueries)
+	{
+		prog_rec->IncrementNQueries();
+		prog_db->MarkRecordChanged(prog_rec);
+
+		BackupOwnershipDB();
+
+		// Normally only this record is written. Failure here will not affect the client's synchronization with the
+		// server - the file may have been written in part though, the other processes load it again.
+		string err_msg;
+		if (prog_db->SaveChangedRecords(program_db_file_name, err_msg) == false)
+		{
+			DEBUG_ERROR(err_msg.c_str());
+			dbs.MarkRegistryChanged();
+			dbs.CloseProgramDB();
+			dbs.EndRegistry();
+
+			return false; // don't send anything to the client if we fail at this point
+		}
+	}
+
+	rec = *prog_rec;
+
+	locks.UnlockRecord();
+	locks.UnlockRegistryWrite();
+	locks.UnlockRegistry();
+
+	done = true;
+	return true;
+}
+
+// The end of a request, with the client's lock held. The client's query count, and so its instance hash, moves on
+// if increment_nqueries, and the changes of the request are made durable. new_client_key is not 0 for AddClient,
+// the client is added first - if the ID is still new. rec is the client's record as it is now. Returns false if
+// the client is not there or it could not be saved - nothing is sent to the client then.
 //
-// do_not_return_messges - under some circumstances we do not want to return any messgages - e.g. during a recovery operation
-inline bool ReceivePendingMessages(const DRM_ProgramRecord *prog_rec, bool do_not_return_messages)
+// Adding a client, or a save which is not in place (see update_client()), takes the registry lock exclusive and
+// changes DB.epoch - the other processes load the registry again.
+inline bool finish_request(MessengerDatabases& dbs, RequestLocks& locks, const uint8_t* hashed_id, const uint8_t* new_client_key, bool increment_nqueries, DRM_ProgramRecord& rec)
 {
 	string err_msg;
 
-	SimpleDB<DRM_PrivateMessageRecord> db;
+	DRM_ProgramRecord token;
+	token.SetID(hashed_id);
+
+	bool done = false;
+	if (new_client_key == 0 && update_client(dbs, locks, token, increment_nqueries, rec, done) == false)
+		return false;
+
+	if (done == false)
+	{
+		if (locks.LockRegistry(true) == false)
+			return false;
+
+		dbs.BeginRegistry();
+
+		ProgramDB* prog_db = dbs.GetProgramDB();
+		if (prog_db == 0)
+			return false;
+
+		// The records which other clients' requests have saved in place since it was loaded
+		if (prog_db->Refresh(err_msg) == false)
+		{
+			DEBUG_ERROR(err_msg.c_str());
+			dbs.CloseProgramDB();
+			return false;
+		}
+
+		if (new_client_key)
+		{
+			if (CanAddClient(hashed_id, *prog_db) == false)
+				return false;
+
+			if (InsertClient(hashed_id, new_client_key, *prog_db) == 0)
+			{
+				dbs.CloseProgramDB();
+				return false;
+			}
+		}
+
+		const DRM_ProgramRecord* prog_rec = prog_db->GetRecord(token);
+		if (prog_rec == 0)
+		{
+			if (new_client_key)
+				dbs.CloseProgramDB();
+
+			return false;
+		}
+
+		if (increment_nqueries)
+		{
+			prog_rec->IncrementNQueries();
+			prog_db->MarkRecordChanged(prog_rec);
+		}
+
+		BackupOwnershipDB();
+
+		// Save the modified prog_rec immediately.
+		// Failure here will not affect the client's synchronization with the server
+		dbs.MarkRegistryChanged();
+		if (prog_db->SaveChangedRecords(program_db_file_name, err_msg) == false)
+		{
+			dbs.CloseProgramDB();
+			dbs.EndRegistry();
+
+			return false; // don't send anything to the client if we fail at this point
+		}
+
+		// prog_rec may point into the mapped DB.bin, which does not survive a full save
+		prog_rec = prog_db->GetRecord(token);
+		if (prog_rec == 0)
+		{
+			dbs.EndRegistry();
+			return false;
+		}
+
+		rec = *prog_rec;
+
+		dbs.EndRegistry();
+		locks.UnlockRegistry();
+	}
+
+	// Grouped commits of this request are durable before the client sees the new instance hash
+	if (FileSync::Flush(err_msg) == false)
+		DEBUG_ERROR(err_msg.c_str());
+
+	string sync_report;
+	DEBUG_MSG2("", FileSync::Report(sync_report));
+
+	return true;
+}
+
+// One request - s is the request body as posted by the client (hex characters). The reply, {hex characters},
+// is appended to response. Nothing is appended if the request is rejected before the client's record is found.
+inline void process_request(MessengerDatabases& dbs, const string& s, string& response)
+{
+	vector<uint8_t> buf;
+	GUID leading_guid;
+	if (decode_request(s, buf, leading_guid) == false)
+		return;
+
+	int op = buf[0];
+	uint8_t* hashed_id = &buf[1];
+
+	// The requests of one client are applied one after another, other clients go ahead
+	RequestLocks locks;
+	RequestEnd request_end(dbs);
+	if (locks.LockClient(hashed_id) == false)
+		return;
+
+	g_stdout_cache.clear();
+
+	// The client is identified with a shared registry lock
+	if (locks.LockRegistry(false) == false)
+		return;
+
+	dbs.BeginRegistry();
+
+	ProgramDB* prog_db = 0;
+	const DRM_ProgramRecord* prog_rec = 0;
+	bool add_client = false;
+	bool run_op = false;
+	bool matches_prev = false;
+
+	uint8_t* b = &buf[1];
+	int buf_sz = buf.size() - 1;
+
+	////////////////////////////////////////////////////////////////////////////////////////
+	// For NewClient command, op == 0
+	//[leading_guid] - 16 bytes
+	//[op] - one byte, encrypted with leading guid 
+	//[hashed id of client] - 32 bytes, encrypted with leading guid
+
+	///////////////////////////////////////////////////////////////////////////////////////
+	// For anything other than AddClient command
+	//[leading_guid] - 16 bytes
+	//[op] - one byte, encrypted with leading guid 
+	//[hashed id of client] - 32 bytes, encrypted with leading guid
+	//[instance_hash] - 16 bytes, encrypted with modified_leading_guid
+	//[data] - ?? bytes - varies by the op, encrypted with modified_leading_guid
+
+	// NOTE: Instance_hash is only computed on the server. The client stores
+	// this value. This value changes every time a client successfully queries the server.
+	// Possession of an active instance_hash signifies ownership of the 
+	// client ID, access to its messages, being able to send messages as that id, etc.
+	//
+	// Instance_hash is necessairly a 1:1 mapping between a particular client program and
+	// a particular server.
+
+	// Q. Why do we send bytecode to the client?
+	// 
+	// A. This provides added security to client-server communications.
+	// 
+	// 1) The algorithm which is used to encrypt/decrypt client-server communications:
+	// 	a) Depends on the byte code implented algo to scramble the guid
+	//	a) Is not included in client source code - so the client source may be disclosed without destroying security
+	//	b) Can't be run except by someone who has access to the client ID.
+	//     Note that the client ID is created by the client, stored with password encryption on the client.
+
+	while (1)
+	{
+		prog_db = get_program_db(dbs, locks);
+		if (prog_db == 0)
+		{
+			CacheStdout("0103");
+			break;
+		}
+
+		// Special processing for the AddClient operation
+		if (op == 0)
+		{
+			// Add a new client ID to the client id instance database - the client code is compiled without the
+			// registry lock, and the client is added by finish_request() if the ID is still new then.
+			// If successful, the compiled binary code for encrypting messages is returned
+			add_client = (buf_sz == ID_SIZE_BYTES && CanAddClient(hashed_id, *prog_db));
+			if (add_client == false)
+				CacheStdout("0000");
+			break;
+		}
+
+		//////////////////////////////////////////////////////////////
+		// Standard processing
+
+		int data_sz = buf_sz - ID_SIZE_BYTES;
+
+		if (data_sz < 8) // Data must consist of at least an instance hash, which is 8 bytes
+		{
+			CacheStdout("0100");
+			DEBUG_ERROR("Invalid data sz");
+			break;
+		}
+
+		// Other clients' requests may have saved the part of the registry with the client's record since it was read
+		DRM_ProgramRecord token;
+		token.SetID(hashed_id);
+		if (reload_client(dbs, locks, *prog_db, token, false) == false)
+		{
+			CacheStdout("0103");
+			break;
+		}
+
+		locks.UnlockRecord();
+
+		// Validate the hashed client ID and decrypt the data following the hashed client ID
+		prog_rec = decrypt_with_modified_guid(b, buf_sz, leading_guid, *prog_db);
+		if (prog_rec == 0) 
+			break;
+
+		// Advance past the hashed client ID
+		b += ID_SIZE_BYTES;
+		buf_sz -= ID_SIZE_BYTES;
+
+		// next up is the hashed client instance
+		// This will fail if the server and the client don't agree on the instance
+		if (validate_instance_hash(b, buf_sz, prog_rec, matches_prev) == false)
+		{
+			if (op != 2 && matches_prev) // If the instance_hash is wrong, but matches the previous instance_hash
+			{							 // and if the command is ReceivePendingMessages, then proceed. 
+				CacheStdout("0101");	 // We will not return any messages, but we will send the correct instance hash.
+				break;
+			}
+		}
+
+		// Advance past the hashed client instance
+		b += 16;
+		buf_sz -= 16;
+
+		if (op == 1 || op == 2 /*|| op == 99*/)
+		{
+			run_op = true;
+			break;
+		}
+
+		CacheStdout("0102");
+		DEBUG_ERROR("undefined op");
+
+		break;
+	}
+
+	// prog_rec stays valid, this process does not change the registry in between
+	locks.UnlockRegistry();
+
+	uint8_t new_client_key[16];
+	if (add_client)
+		add_client = BuildClientCode(hashed_id, new_client_key);
+
+	if (run_op)
+	{
+		if (locks.LockMessages(true) == false)
+			return;
+
+		dbs.BeginMessages();
+
+		bool message_request_ok = true;
+		if (op == 1)  message_request_ok = SendPrivateMessage(dbs, prog_rec, b, buf_sz);
+		if (op == 2)  message_request_ok = ReceivePendingMessages(dbs, prog_rec, matches_prev);
+		//if (op == 99) message_request_ok = CleanOldMessages(dbs, prog_rec, b, buf_sz);
+
+		// Changes of a failed message request were not saved, the message db is loaded again by the next request
+		if (message_request_ok == false)
+			dbs.CloseMessageDB();
+
+		dbs.EndMessages();
+		locks.UnlockMessages();
+	}
+
+	bool modify_leading_guid = (op != 0);
+	bool increment_nqueries = (op != 2); // not increment nqueries / instance_hash for ReceivePendingMessages 
+	if (op != 2) increment_nqueries = true;
+
+	// prog_rec is 0 if the client was not identified, nothing is sent back
+	DRM_ProgramRecord rec;
+	if (prog_rec == 0 && add_client == false)
+		return;
+
+	if (finish_request(dbs, locks, hashed_id, add_client ? new_client_key : 0, increment_nqueries, rec) == false)
+		return;
+
+	// Send data to the client, including the upated instance_hash. Any failure here:
+	// 
+	// 1) client does not receive the buffer
+	// 2) client receives corrupted buffer
+	// 3) client crashes before saving the new instance hash
+	//
+	// will be recovered through the recovery process.
+	EncryptCachedStdout(&rec, modify_leading_guid, response);
+}
+
+// FastCGI worker - the databases stay resident between requests. Each request still takes the request locks and
+// checks DB.epoch, so CGI instances and other workers can serve the same files.
+struct FastCGIRequestHandler
+{
+	MessengerDatabases* dbs;
 
-	if (DoesFileExist(messages_db_file_name))
+	inline void operator () (const FastCGIRequest& request, string& response)
 	{
-		if (db.LoadFromFile(messages_db_file_name, err_msg) == false)
+		response = "Content-type: text/html\n\n";
+
+		const string& s = request.GetContent();
+		if (s.length() > MAX_REQUEST_CONTENT_LENGTH)
 		{
-			DEBUG_ERROR(err_msg.c_str());
-			CacheStdout("0001");
-			return false;
+			if (g_debug) fprintf(g_debug_stream, "invalid : content_length: %lu, expected no more than %d\n", (unsigned long)s.length(), MAX_REQUEST_CONTENT_LENGTH);
+			return;
 		}
+
+		process_request(*dbs, s, response);
 	}
+};
 
-	DRM_PrivateMessageRecord token;
+// address == 0 - the listening socket is inherited from the web server
+inline int run_fastcgi(const char* address)
+{
+	string err_msg;
 
-	token.SetHashedIDReceiver(prog_rec->GetID());  // SenderID will be zeros
+	FastCGIServer server;
+	if (server.Open(address, err_msg) == false)
+	{
+		fprintf(stderr, "%s\n", err_msg.c_str());
+		return 1;
+	}
 
-#ifdef ENABLE_DEBUGGING
-	string s_receiver_id;
-	bin_to_ascii_char(prog_rec->GetID(), 32, s_receiver_id);
-#endif
+	socket_catch_stop_signals();
+
+	MessengerDatabases dbs(true);
 
-	bool exists;
-	uint32_t idx = db.GetRecordIndex(token, exists);
+	FastCGIRequestHandler handler;
+	handler.dbs = &dbs;
 
-	if (exists)
+	if (server.Run(handler, err_msg) == false)
 	{
-		DEBUG_ERROR("Internal error.");
-		CacheStdout("0003");
-		return false;
+		fprintf(stderr, "%s\n", err_msg.c_str());
+		return 1;
 	}
 
-	if (idx == db.GetNumRecords() || do_not_return_messages)
+	return 0;
+}
+
+#ifdef __linux__
+// HTTP server - the request body is posted as it is to the CGI program, the {...} reply is the response body
+struct HttpRequestHandler
+{
+	MessengerDatabases* dbs;
+
+	inline void operator () (const HttpRequest& request, string& body)
 	{
-		DEBUG_MSG("No messages");
-		CacheStdout("0000"); // Success 
-		CacheStdout("00"); // No messages
-		return true;
+		process_request(*dbs, request.GetBody(), body);
 	}
+};
 
-	bool changes_made = false;
+inline int run_http(const char* address)
+{
+	string err_msg;
 
-	// Need to insert the status string later
-	int insert_pos = CacheGetInsertPosition();
+	HttpServer server;
+	server.SetMaxContentLength(MAX_REQUEST_CONTENT_LENGTH);
 
-	string s;
+	if (server.Open(address, err_msg) == false)
+	{
+		fprintf(stderr, "%s\n", err_msg.c_str());
+		return 1;
+	}
 
-#ifdef ENABLE_DEBUGGING
-	FILE* stream = 0;
-#endif
+	socket_catch_stop_signals();
+
+	MessengerDatabases dbs(true);
+
+	HttpRequestHandler handler;
+	handler.dbs = &dbs;
 
-	while (idx < db.GetNumRecords())
+	if (server.Run(handler, err_msg) == false)
 	{
-		const DRM_PrivateMessageRecord* rec = db.GetRecordByIndex(idx);
+		fprintf(stderr, "%s\n", err_msg.c_str());
+		return 1;
+	}
 
-#ifdef ENABLE_DEBUGGING
-		string s_rec_receiver_id, s_rec_sender_id;
-		bin_to_ascii_char((const uint8_t *)rec->GetHashedIDReciever(), 32, s_rec_receiver_id);
-		bin_to_ascii_char((const uint8_t*)rec->GetHashedIDSender(), 32, s_rec_sender_id);
+	return 0;
+}
 #endif
 
-		if (memcmp(rec->GetHashedIDReciever(), prog_rec->GetID(), ID_SIZE_BYTES))
-			break;
+#ifndef WIN32
+// A resident process loads the databases before the first request, and between requests after another process
+// has changed them
+inline void preload_databases(MessengerDatabases& dbs)
+{
+	RequestLocks locks;
+	if (locks.LockRegistry(false) == false)
+		return;
 
-		// unread message found
-		uint8_t hashed_id_sender[ID_SIZE_BYTES];
-		memmove(hashed_id_sender, rec->GetHashedIDSender(), ID_SIZE_BYTES);
+	// The program db first - a load which needs the registry write lock takes it before the message store lock
+	dbs.BeginRegistry();
+	get_program_db(dbs, locks);
 
-		string s_msg;
-		rec->GetMessage(s_msg);
-		int msg_len = strlen(s_msg.c_str());
+	if (locks.LockMessages(false) == false)
+		return;
+
+	string err_msg;
+	if (dbs.Preload(err_msg) == false)
+	{
+		DEBUG_ERROR(err_msg.c_str());
+	}
+}
+
+// Zygote - the warm server of a host which runs CGI programs only. It is started from the CGI directory with
+// --zygote, by the same user as the CGI instances, and keeps the databases loaded. A CGI instance which finds
+// zygote.sock forwards its request there (forward_to_zygote()) and loads nothing itself.
+struct ZygoteRequestHandler
+{
+	MessengerDatabases* dbs;
 
-		if (db.RemoveRecord(idx, err_msg) == false)
+	inline void operator () (const CGIRelayRequest& request, string& response)
+	{
+		const string& s = request.GetContent();
+		if (s.length() > MAX_REQUEST_CONTENT_LENGTH)
 		{
-			DEBUG_ERROR(err_msg.c_str());
-			CacheStdout("0004", 0,0, insert_pos);
-			return false;
+			if (g_debug) fprintf(g_debug_stream, "invalid : content_length: %lu, expected no more than %d\n", (unsigned long)s.length(), MAX_REQUEST_CONTENT_LENGTH);
+			return;
 		}
 
-		changes_made = true;
+		process_request(*dbs, s, response);
+	}
 
-		if (msg_len == 0)
-			continue;
+	// Between requests - the databases which another process has changed are loaded again now, rather than
+	// in the next request
+	inline void Idle(void)
+	{
+		if (dbs->IsOutOfDate())
+			preload_databases(*dbs);
+	}
+};
 
-		uint8_t sz = (uint8_t)min(msg_len, 256);
-		CacheStdout(bin_to_hex_char(&sz, 1, s)); // cache the sz of the message
+inline int run_zygote(void)
+{
+	string err_msg;
 
-		string s_hashed_id_sender;
-		bin_to_hex_char(hashed_id_sender, ID_SIZE_BYTES, s_hashed_id_sender);
-		CacheStdout(s_hashed_id_sender.c_str()); // cache the hashed id of the sender
+	CGIRelayServer server;
+	if (server.Open(zygote_socket_file_name, err_msg) == false)
+	{
+		fprintf(stderr, "%s\n", err_msg.c_str());
+		return 1;
+	}
 
-		uint64_t t = rec->GetTimestamp();
-		string s_timestamp;
-		bin_to_hex_char((const uint8_t*)&t, sizeof(t), s_timestamp);
-		CacheStdout(s_timestamp.c_str());
+	socket_catch_stop_signals();
 
-		CacheStdout(s_msg.c_str());
+	MessengerDatabases dbs(true);
+	preload_databases(dbs);
 
-#ifdef ENABLE_DEBUGGING
-		if (stream == 0)
-		{
-			string log_file;
-			log_file = messages_db_file_name;
-			log_file += ".sent.txt";
-			fopen_s(&stream, log_file.c_str(), "w");
-		}
+	ZygoteRequestHandler handler;
+	handler.dbs = &dbs;
 
-		if (stream)
-		{
-			fprintf_s(stream, "[%lu]\n", idx);
-			fprintf_s(stream, "hashed_ID_sender: %s\n", s_rec_sender_id.c_str());
-			fprintf_s(stream, "hashed_ID_receiver: %s\n", s_rec_receiver_id.c_str());
-			fprintf_s(stream, "Timestamp_ms: %llu\n", t);
-			fprintf_s(stream, "%s\n", s_msg.c_str());
-		}
-#endif
+	if (server.Run(handler, err_msg) == false)
+	{
+		fprintf(stderr, "%s\n", err_msg.c_str());
+		return 1;
 	}
 
-#ifdef ENABLE_DEBUGGING
-	if (stream)
-		fclose(stream);
-#endif
+	return 0;
+}
 
-	// Send out the termination character
-	uint8_t term_byte = 0;
-	CacheStdout(bin_to_hex_char(&term_byte, 1, s));
+// Returns false if the zygote is not running, the request is then served by this process. Once the request has
+// been forwarded it is not served here again, whatever happens - a lost reply is recovered by the client.
+inline bool forward_to_zygote(const string& s, string& response)
+{
+	CGIRelayRequest request;
+	request.SetVariablesFromEnvironment();
+	request.SetContent(s);
 
-	if (changes_made)
+	bool connected;
+	string err_msg;
+	if (cgi_relay_forward(zygote_socket_file_name, request, response, connected, err_msg) == false)
 	{
-		if (db.SaveToFile(messages_db_file_name, err_msg) == false)
-		{
-			DEBUG_ERROR(err_msg.c_str());
-		}
+		if (connected == false)
+			return false;
+
+		DEBUG_ERROR(err_msg.c_str());
+		response.clear();
 	}
 
-	CacheStdout("0000", 0,0, insert_pos); // insert success indicator
 	return true;
 }
 
-// Clean all pending messages older than the specified time
-//
-//[Time_ms] 8 bytes - clean messages which were originated before this time
-//
-inline bool CleanOldMessages(const DRM_ProgramRecord *prog_rec, const uint8_t *buf, int buf_sz)
+// Store daemon - the one writer of the databases, for the CGI instances which are its front ends
+// (process_request_via_store()). It is started from the CGI directory with --store, by the same user as the CGI
+// instances, and applies the commands one at a time. The request locks are still taken for each command - they
+// are not contended while the front ends use the daemon, and keep out a CGI instance which serves a request
+// itself while the daemon is restarted.
+struct StoreCommandHandler
 {
-	if (memcmp(prog_rec->GetID(), AdminID, ID_SIZE_BYTES))
+	MessengerDatabases* dbs;
+
+	inline void operator () (const StoreCommand& command, StoreReply& reply)
 	{
-		DEBUG_ERROR("Given ID does not match AdminID.");
-		CacheStdout("Fail");
-		return false;
-	}
+		reply.status = STORE_FAILED;
 
-	uint64_t t_ms;
-	memmove(&t_ms, buf, sizeof(t_ms));
+		RequestLocks locks;
+		if (locks.LockClient(command.id) == false)
+			return;
 
-	uint64_t t_now = get_time_ms();
+		g_stdout_cache.clear();
 
-	if (t_ms > t_now)
+		DRM_ProgramRecord rec;
+		if (apply(command, locks, reply, rec))
+		{
+			reply.status = STORE_OK;
+			reply.record = rec;
+			reply.output = g_stdout_cache;
+		}
+	}
+
+	inline void Idle(void)
 	{
-		DEBUG_ERROR("t_ms > t_now");
-		CacheStdout("Fail");
-		return false;
+		if (dbs->IsOutOfDate())
+			preload_databases(*dbs);
 	}
 
+	// Returns false if the command was not applied, reply.status says why
+	inline bool apply(const StoreCommand& command, RequestLocks& locks, StoreReply& reply, DRM_ProgramRecord& rec)
+	{
+		if (locks.LockRegistry(false) == false)
+			return false;
 
-	SimpleDB<DRM_PrivateMessageRecord> db;
-	string err_msg;
+		dbs->BeginRegistry();
 
-	if (DoesFileExist(messages_db_file_name) == false)
-	{
-		char msg[1024];
-		sprintf(msg, "Success - message db does not exist: %s", messages_db_file_name);
-		DEBUG_MSG(msg);
-		CacheStdout(msg);
-		return true;
-	}
+		ProgramDB* prog_db = get_program_db(*dbs, locks);
+		if (prog_db == 0)
+			return false;
 
+		DRM_ProgramRecord token;
+		token.SetID(command.id);
 
-	if (db.LoadFromFile(messages_db_file_name, err_msg) == false)
-	{
-		DEBUG_ERROR(err_msg.c_str());
-		CacheStdout("Fail");
-		return false;
-	}
+		// Other clients' commands may have saved the part of the registry with the client's record since it was read
+		if (reload_client(*dbs, locks, *prog_db, token, false) == false)
+			return false;
 
-	int n = 0;
-	for (uint32_t idx = 0; idx < db.GetNumRecords(); idx++)
-	{
-		const DRM_PrivateMessageRecord* rec = db.GetRecordByIndex(idx);
-		if (rec->GetTimestamp() < t_ms)
+		locks.UnlockRecord();
+
+		// Stays valid, this process does not change the registry before finish_request()
+		const DRM_ProgramRecord* prog_rec = prog_db->GetRecord(token);
+
+		locks.UnlockRegistry();
+
+		if (command.command == STORE_ADD_CLIENT)
 		{
-			if (db.RemoveRecord(idx, err_msg) == false)
+			if (prog_rec || command.data.size() != 16)
+				return false;
+		}
+		else
+		{
+			if (prog_rec == 0)
 			{
-				DEBUG_ERROR(err_msg.c_str());
-				CacheStdout("Fail");
+				reply.status = STORE_NOT_FOUND;
 				return false;
 			}
 
-			n++;
+			if (command.command == STORE_GET_CLIENT)
+			{
+				rec = *prog_rec;
+				return true;
+			}
+
+			// The front end validated the request with an instance hash which is no longer current
+			if (prog_rec->GetNQueries() != command.nqueries)
+			{
+				reply.status = STORE_STALE;
+				return false;
+			}
 		}
-	}
 
-	if (n)
-	{
-		if (db.SaveToFile(messages_db_file_name, err_msg) == false)
+		bool increment_nqueries = true;
+
+		if (command.command == STORE_QUERY)
 		{
-			DEBUG_ERROR(err_msg.c_str());
-			CacheStdout("Fail");
-			return false;
+			g_stdout_cache.assign(command.data.begin(), command.data.end());
 		}
-	}
+		else if (command.command == STORE_SEND_MESSAGE || command.command == STORE_RECEIVE)
+		{
+			if (locks.LockMessages(true) == false)
+				return false;
 
-	char msg[1024];
-	sprintf(msg, "Success - %ld messages removed", n);
-	DEBUG_ERROR(msg);
-	CacheStdout(msg);
-	return true;
-}
+			dbs->BeginMessages();
 
+			bool message_request_ok;
+			if (command.command == STORE_SEND_MESSAGE)
+			{
+				message_request_ok = SendPrivateMessage(*dbs, prog_rec, command.data.size() ? &command.data[0] : 0, (int)command.data.size());
+			}
+			else
+			{
+				message_request_ok = ReceivePendingMessages(*dbs, prog_rec, (command.flags & STORE_DO_NOT_RETURN_MESSAGES) != 0);
+				increment_nqueries = false;
+			}
 
-// key is 16 bytes
-// 
-// buf[]
-// hashed_id of client - 32 bytes
-// instance_hash - 8 bytes - decrypted with modified guid 
-// remainder - ?? bytes - to be decrypted with modified guid
-const DRM_ProgramRecord *decrypt_with_modified_guid(uint8_t* buf, int buf_sz, const GUID& leading_guid, SimpleDB<DRM_ProgramRecord> &db)
-{
-	if (buf_sz <= ID_SIZE_BYTES + 8)
-	{
-		DEBUG_ERROR2(__FUNCTION__,"() Invalid buf_sz");
-		return 0;
+			// Changes of a failed message request were not saved, the message db is loaded again by the next command
+			if (message_request_ok == false)
+				dbs->CloseMessageDB();
+
+			dbs->EndMessages();
+			locks.UnlockMessages();
+		}
+		else if (command.command != STORE_ADD_CLIENT)
+		{
+			DEBUG_ERROR("undefined store command");
+			return false;
+		}
+
+		const uint8_t* new_client_key = (command.command == STORE_ADD_CLIENT) ? &command.data[0] : 0;
+		return finish_request(*dbs, locks, command.id, new_client_key, increment_nqueries, rec);
 	}
+};
 
+inline int run_store(void)
+{
 	string err_msg;
 
-	const uint8_t* hashed_id = buf;
+	StoreServer server;
+	if (server.Open(store_socket_file_name, err_msg) == false)
+	{
+		fprintf(stderr, "%s\n", err_msg.c_str());
+		return 1;
+	}
 
-	DRM_ProgramRecord token;
-	token.SetID(hashed_id);
+	socket_catch_stop_signals();
 
-	const DRM_ProgramRecord *prog_rec = db.GetRecord(token);
+	MessengerDatabases dbs(true);
+	preload_databases(dbs);
 
-#ifdef ENABLE_DEBUGGING
-	string primary_check;
-	bin_to_ascii_char(prog_rec->GetID(), 32, primary_check);
-#endif
+	StoreCommandHandler handler;
+	handler.dbs = &dbs;
 
-	if (prog_rec == 0)
+	if (server.Run(handler, err_msg) == false)
 	{
-		DEBUG_ERROR("ID does not exist.");
-		return 0;
+		fprintf(stderr, "%s\n", err_msg.c_str());
+		return 1;
 	}
 
-	GUID modified_leading_guid;
-	create_modified_guid(prog_rec->GetKey(), (const uint8_t*)&leading_guid, (uint8_t*)&modified_leading_guid);
+	return 0;
+}
 
-	symmetric_encryption(buf + ID_SIZE_BYTES, buf_sz - ID_SIZE_BYTES, modified_leading_guid);
+// Returns false if the daemon could not be reached, or if the outcome of the command is unknown
+inline bool call_store_daemon(const StoreCommand& command, StoreReply& reply, bool& connected)
+{
+	string err_msg;
+	if (store_call(store_socket_file_name, command, reply, connected, err_msg))
+		return true;
 
-	return prog_rec;
+	if (connected)
+		DEBUG_ERROR(err_msg.c_str());
+
+	return false;
 }
 
-bool open_program_record_database(SimpleDB<DRM_ProgramRecord>& db)
+// A request is validated again with the client's current record when another request of the same client
+// was applied in between
+#define STORE_MAX_ATTEMPTS 4
+
+// Store front end - the request is decrypted and validated by this process, with the client's record as the store
+// daemon has it, and applied by the daemon. Nothing is loaded, and no request lock is taken here.
+// Returns false if the daemon is not running, the request is then served by this process.
+inline bool process_request_via_store(const string& s, string& response)
 {
-	string err_msg;
-	if (DoesFileExist(ownership_reg_db_file_name))
-	{
-		// This should not happen, the DB.bin only grows with the AddNewClient() procedure and that procedure won't allow this
-		if (filelength(ownership_reg_db_file_name) > OWNERSHIP_DB_MAX_SIZE)
-		{
-			char msg[1024];
-			sprintf_s(msg, sizeof(msg), "file %s is too large, must be less than %ld bytes", ownership_reg_db_file_name, OWNERSHIP_DB_MAX_SIZE);
-			DEBUG_ERROR(msg);
-			return false;
-		}
+	vector<uint8_t> buf;
+	GUID leading_guid;
+	if (decode_request(s, buf, leading_guid) == false)
+		return true;
+
+	int op = buf[0];
+	const uint8_t* hashed_id = &buf[1];
+	int data_sz = (int)buf.size() - 1 - ID_SIZE_BYTES;
+
+	StoreCommand command;
+	memmove(command.id, hashed_id, ID_SIZE_BYTES);
 
-		if (db.LoadFromFile(ownership_reg_db_file_name, err_msg) == false)
+	StoreReply reply;
+	bool connected;
+
+	g_stdout_cache.clear();
+
+	// AddClient - the client code is compiled here, the daemon adds the client if the ID is still new
+	if (op == 0)
+	{
+		command.command = STORE_GET_CLIENT;
+		if (call_store_daemon(command, reply, connected) == false)
+			return connected;
+
+		if (reply.status != STORE_NOT_FOUND || data_sz != 0)
 		{
-			DEBUG_ERROR(err_msg.c_str());
-			return false;
+			DEBUG_ERROR("Invalid AddClient request, or the ID exists already.");
+			return true;
 		}
-	}
 
-	return true;
-}
+		uint8_t key[16];
+		if (BuildClientCode(hashed_id, key) == false)
+			return true;
 
-bool validate_instance_hash(const uint8_t* b, int buf_sz, const DRM_ProgramRecord* prog_rec, bool& matches_prev)
-{
-	matches_prev = false;
+		vector<char> client_code = g_stdout_cache;
 
-	uint8_t instance_hash[16];
-	get_instance_hash(prog_rec, instance_hash);
+		command.command = STORE_ADD_CLIENT;
+		command.data.assign(key, key + sizeof(key));
+		if (call_store_daemon(command, reply, connected) == false || reply.status != STORE_OK)
+			return true;
 
-	bool success = memcmp(b, &instance_hash, sizeof(instance_hash)) == 0;
+		g_stdout_cache = client_code;
+		EncryptCachedStdout(&reply.record, false, response);
+		return true;
+	}
 
-	if (success == false)
+	// Data must consist of at least an instance hash
+	if (data_sz < 16)
 	{
-		if (get_instance_hash_prev(prog_rec, instance_hash))
-			matches_prev = memcmp(b, &instance_hash, sizeof(instance_hash)) == 0;
+		DEBUG_ERROR("Invalid data sz");
+		return true;
 	}
 
-#ifdef ENABLE_DEBUGGING
-	string s;
-	bin_to_ascii_char(b, 16, s);
-	DEBUG_MSG2("instance_hash[in] ", s.c_str());
-
-	if (success == false)
-		DEBUG_MSG("instance hash does not match");
-#endif
-
-	return success;
-}
+	for (int attempt = 0; attempt < STORE_MAX_ATTEMPTS; attempt++)
+	{
+		command.command = STORE_GET_CLIENT;
+		command.flags = 0;
+		command.data.clear();
+		if (call_store_daemon(command, reply, connected) == false)
+			return attempt > 0 || connected;
 
-inline void modify_item(const char*& item, vector<char>& static_str, const char* s_find, const char* s_replace)
-{
-	int len = strlen(item);
-	static_str.resize(len + 1);
-	memmove(&static_str[0], item, len);
-	replace_string(static_str, s_find, s_replace);
-	item = &static_str[0];
-}
+		if (reply.status != STORE_OK)
+		{
+			DEBUG_ERROR("ID does not exist.");
+			return true;
+		}
 
-static string s_fname;
+		DRM_ProgramRecord prog_rec = reply.record;
 
-static vector<char> s_ownership_reg_db_file_name;		// = "../DRM/DB.bin";								// Generated - Program ID database
-static vector<char> s_messages_db_file_name;			// = "../DRM/MSG.bin";								// Generated - Message database
+		// The instance hash and the data which follow the hashed client ID
+		vector<uint8_t> data(buf.begin() + 1 + ID_SIZE_BYTES, buf.end());
 
-static vector<char> s_generated_code_dir;				// = "../DRM/Generated";							// Created at install time with correct security / priviledges
-static vector<char> s_backup_dir;						// = "../DRM/Backup";								// Created at install time wiith correct security / priviledges
-static vector<char> s_compiler_exe;						// = "../DRM/Generated/Compiler.exe";				// Installed
-static vector<char> s_code_template_file;				// = "../DRM/Generated/modify_guid_template.code";	// Installed
+		GUID modified_leading_guid;
+		create_modified_guid(prog_rec.GetKey(), (const uint8_t*)&leading_guid, (uint8_t*)&modified_leading_guid);
+		symmetric_encryption(&data[0], data.size(), modified_leading_guid);
 
-inline void construct_names_and_paths(const char* executable)
-{
-	const char* c0 = 0;
-#ifdef WIN32
-	c0 = strrchr(executable, '\\');
-#endif
+		// The same decisions as process_request() makes
+		bool matches_prev = false;
+		bool valid = validate_instance_hash(&data[0], (int)data.size(), &prog_rec, matches_prev);
 
-	if (c0 == 0)
-		c0 = strrchr(executable, '/');
-	
-	if (c0 == 0)
-		s_fname = "PrivateMessenger";
-	else
-	{
-		c0++;
-		const char *c1 = strrchr(c0, '.');
+		g_stdout_cache.clear();
+		command.nqueries = prog_rec.GetNQueries();
 
-		if (c1)
+		if (valid == false && op != 2 && matches_prev)
 		{
-			int len = (int)(c1 - c0);
-			s_fname.assign(c0, len);
+			CacheStdout("0101");
+			command.command = STORE_QUERY;
+			command.data.assign(g_stdout_cache.begin(), g_stdout_cache.end());
+		}
+		else if (op == 1)
+		{
+			command.command = STORE_SEND_MESSAGE;
+			command.data.assign(data.begin() + 16, data.end());
+		}
+		else if (op == 2)
+		{
+			command.command = STORE_RECEIVE;
+			command.flags = matches_prev ? STORE_DO_NOT_RETURN_MESSAGES : 0;
 		}
 		else
 		{
-			s_fname = c0;
+			DEBUG_ERROR("undefined op");
+			CacheStdout("0102");
+			command.command = STORE_QUERY;
+			command.data.assign(g_stdout_cache.begin(), g_stdout_cache.end());
 		}
-	}
 
-	CGI_name = s_fname.c_str();
+		if (call_store_daemon(command, reply, connected) == false)
+			return true;
 
-	const char* s_find = "/DRM/";
+		if (reply.status == STORE_STALE)
+			continue;
 
-	string s_replace = "/";
-	s_replace += CGI_name;
-	s_replace += "/";
+		if (reply.status != STORE_OK)
+			return true;
 
-	modify_item(ownership_reg_db_file_name, s_ownership_reg_db_file_name, s_find, s_replace.c_str());
-	modify_item(messages_db_file_name, s_messages_db_file_name, s_find, s_replace.c_str());
-	modify_item(generated_code_dir, s_generated_code_dir, s_find, s_replace.c_str());
-	modify_item(backup_dir, s_backup_dir, s_find, s_replace.c_str());
-	modify_item(compiler_exe, s_compiler_exe, s_find, s_replace.c_str());
-	modify_item(code_template_file, s_code_template_file, s_find, s_replace.c_str());
+		g_stdout_cache = reply.output;
+		EncryptCachedStdout(&reply.record, true, response);
+		return true;
+	}
+
+	DEBUG_ERROR("The client's record changed during each attempt");
+	return true;
 }
+#endif
 
 int main(int argc, const char** argv)
 {
 	construct_names_and_paths(argv[0]);
 
+	FileSync::SetPolicy(DB_SYNC_POLICY, DB_SYNC_GROUP_WINDOW_MS);
+
+	// FastCGI - started by the web server with a listening socket as stdin, or on its own with: --fastcgi <address>
+	if (argc > 2 && strcmp(argv[1], "--fastcgi") == 0)
+		return run_fastcgi(argv[2]);
+
+	if (FastCGIServer::IsListenSocketInherited())
+		return run_fastcgi(0);
+
+#ifdef __linux__
+	// Standalone HTTP/1.1 server, e.g. behind a reverse proxy: --http <host:port>
+	if (argc > 2 && strcmp(argv[1], "--http") == 0)
+		return run_http(argv[2]);
+#endif
+
+#ifndef WIN32
+	// Warm server of the CGI instances: --zygote
+	if (argc > 1 && strcmp(argv[1], "--zygote") == 0)
+		return run_zygote();
+
+	// The one writer of the databases for the CGI instances: --store
+	if (argc > 1 && strcmp(argv[1], "--store") == 0)
+		return run_store();
+#endif
+
 	const char* s_content_length = getenv("CONTENT_LENGTH");
 
 	vector<char> s_content_len_storage;
@@ -1087,7 +3083,7 @@ int main(int argc, const char** argv)
 
 		s_content_len_storage.resize(10);
 
-		sprintf(&s_content_len_storage[0], "%ld", len);
+		sprintf(&s_content_len_storage[0], "%ld", (long)len);
 
 		s_content_length = &s_content_len_storage[0];
 	}
@@ -1097,9 +3093,9 @@ int main(int argc, const char** argv)
 	DEBUG_MSG2("Component: ", CGI_name);
 
 	bool valid_content = true;  int content_length = 0;
-	if (sscanf(s_content_length, "%d", &content_length) != 1 || content_length > 500)
+	if (sscanf(s_content_length, "%d", &content_length) != 1 || content_length > MAX_REQUEST_CONTENT_LENGTH)
 	{
-		if (g_debug) fprintf(g_debug_stream, "invalid : content_length: %s, expected no more than 500\n", s_content_length);
+		if (g_debug) fprintf(g_debug_stream, "invalid : content_length: %s, expected no more than %d\n", s_content_length, MAX_REQUEST_CONTENT_LENGTH);
 		return 0;
 	}
 
@@ -1116,187 +3112,59 @@ int main(int argc, const char** argv)
 		s = content;
 	}
 
-	DEBUG_MSG2("input: ", s.c_str());
-
-	string err_msg;
-
-	vector<uint8_t> buf;
-	if (hex_char_to_bin(s, buf) == false)
-	{
-		DEBUG_ERROR("hex_char_to_bin() failure");
-		return 0;
-	}
-
-	GUID leading_guid;
-	memmove(&leading_guid, &buf[0], sizeof(GUID));
-
-	buf.erase(buf.begin(), buf.begin() + sizeof(GUID));
-
-	// Only the op byte and the client hashed id is encrypted with the leading guid
-	symmetric_encryption(&buf[0], 1+ID_SIZE_BYTES, leading_guid);
-
-	int op = buf[0];
-	uint8_t* hashed_id = &buf[1];
-
-	// need global semaphore lock here
-	char semaphore_name[256];
-	sprintf_s(semaphore_name, "Global_%s", CGI_name);
-	HANDLE h_semaphore = CreateSemaphore(NULL, 1, 1, semaphore_name);
-
-	if (h_semaphore == NULL)
-	{
-		char msg[1024];
-		sprintf_s(msg, sizeof(msg), "Failed trying to createsemaphore: %s : code: %lu", semaphore_name, GetLastError());
-		DEBUG_ERROR(msg);
-		return 0;
-	}
+	string response;
 
-	// Wait up to 10 seconds
-	DWORD scode = WaitForSingleObject(h_semaphore, 10000);
-	if (scode != WAIT_OBJECT_0)
+#ifndef WIN32
+	if (process_request_via_store(s, response) || forward_to_zygote(s, response))
 	{
-		char msg[1024];
-		sprintf_s(msg, sizeof(msg), "Failed waiting for semaphore: %s : code: %lu", semaphore_name, scode);
-		DEBUG_ERROR(msg);
+		printf("%s", response.c_str());
 		return 0;
 	}
+#endif
 
-	SimpleDB<DRM_ProgramRecord> prog_db;
-	const DRM_ProgramRecord* prog_rec = 0;
-
-	uint8_t* b = &buf[1];
-	int buf_sz = buf.size() - 1;
-
-	////////////////////////////////////////////////////////////////////////////////////////
-	// For NewClient command, op == 0
-	//[leading_guid] - 16 bytes
-	//[op] - one byte, encrypted with leading guid 
-	//[hashed id of client] - 32 bytes, encrypted with leading guid
-
-	///////////////////////////////////////////////////////////////////////////////////////
-	// For anything other than AddClient command
-	//[leading_guid] - 16 bytes
-	//[op] - one byte, encrypted with leading guid 
-	//[hashed id of client] - 32 bytes, encrypted with leading guid
-	//[instance_hash] - 16 bytes, encrypted with modified_leading_guid
-	//[data] - ?? bytes - varies by the op, encrypted with modified_leading_guid
-
-	// NOTE: Instance_hash is only computed on the server. The client stores
-	// this value. This value changes every time a client successfully queries the server.
-	// Possession of an active instance_hash signifies ownership of the 
-	// client ID, access to its messages, being able to send messages as that id, etc.
-	//
-	// Instance_hash is necessairly a 1:1 mapping between a particular client program and
-	// a particular server.
-
-	// Q. Why do we send bytecode to the client?
-	// 
-	// A. This provides added security to client-server communications.
-	// 
-	// 1) The algorithm which is used to encrypt/decrypt client-server communications:
-	// 	a) Depends on the byte code implented algo to scramble the guid
-	//	a) Is not included in client source code - so the client source may be disclosed without destroying security
-	//	b) Can't be run except by someone who has access to the client ID.
-	//     Note that the client ID is created by the client, stored with password encryption on the client.
-
-	while (1)
-	{
-		if (open_program_record_database(prog_db) == false)
-		{
-			CacheStdout("0103");
-			break;
-		}
-
-		// Special processing for the AddClient operation
-		if (op == 0)
-		{
-			// Add a new client ID to the client id instance database
-			// If successful, the compiled binary code for encrypting messages is returned
-			prog_rec = AddClient(b, buf_sz, prog_db);
-			break;
-		}
-
-		//////////////////////////////////////////////////////////////
-		// Standard processing
-
-		int data_sz = buf_sz - ID_SIZE_BYTES;
-
-		if (data_sz < 8) // Data must consist of at least an instance hash, which is 8 bytes
-		{
-			CacheStdout("0100");
-			DEBUG_ERROR("Invalid data sz");
-			break;
-		}
-
-		// Validate the hashed client ID and decrypt the data following the hashed client ID
-		prog_rec = decrypt_with_modified_guid(b, buf_sz, leading_guid, prog_db);
-		if (prog_rec == 0) 
-			break;
-
-		// Advance past the hashed client ID
-		b += ID_SIZE_BYTES;
-		buf_sz -= ID_SIZE_BYTES;
-
-		// next up is the hashed client instance
-		// This will fail if the server and the client don't agree on the instance
-		bool matches_prev = false;
-		if (validate_instance_hash(b, buf_sz, prog_rec, matches_prev) == false)
-		{
-			if (op != 2 && matches_prev) // If the instance_hash is wrong, but matches the previous instance_hash
-			{							 // and if the command is ReceivePendingMessages, then proceed. 
-				CacheStdout("0101");	 // We will not return any messages, but we will send the correct instance hash.
-				break;
-			}
-		}
+	MessengerDatabases dbs(false);
+	process_request(dbs, s, response);
 
-		// Advance past the hashed client instance
-		b += 16;
-		buf_sz -= 16;
+	printf("%s", response.c_str());
 
-		if (op == 1)  { SendPrivateMessage(prog_rec, b, buf_sz); break; }
-		if (op == 2)  { ReceivePendingMessages(prog_rec, matches_prev); break; }
-		//if (op == 99) { CleanOldMessages(prog_rec, b, buf_sz); break; }
+	return 0;
+}
 
-		CacheStdout("0102");
-		DEBUG_ERROR("undefined op");
+// A db file is backed up together with its mutation log, the log holds the changes since the db file was last written
+BOOL copy_db_file(const char* source_file, const char* target_file)
+{
+	if (CopyFile(source_file, target_file, FALSE) == FALSE)
+		return FALSE;
 
-		break;
-	}
+	string source_log = source_file;
+	source_log += ".log";
 
-	bool modify_leading_guid = (op != 0);
-	bool increment_nqueries = (op != 2); // not increment nqueries / instance_hash for ReceivePendingMessages 
-	if (op != 2) increment_nqueries = true;
+	string target_log = target_file;
+	target_log += ".log";
 
-	if (increment_nqueries)
-	{
-		prog_rec->IncrementNQueries();
+	if (DoesFileExist(source_log.c_str()))
+		return CopyFile(source_log.c_str(), target_log.c_str(), FALSE);
 
-		BackupOwnershipDB();
+	if (DoesFileExist(target_log.c_str()))
+		DeleteFile(target_log.c_str());
 
-		// Save the modified prog_rec immediately.
-		// Failure here will not affect the client's synchronization with the server
-		if (prog_db.SaveToFile(ownership_reg_db_file_name, err_msg) == false)
-		{
-			LONG prev;
-			ReleaseSemaphore(h_semaphore, 1, &prev);
+	return TRUE;
+}
 
-			return 0; // don't send anything to the client if we fail at this point
-		}
-	}
+// The db file itself may not have been written for some time, its log is more recent
+bool get_db_file_time_ms(const char* file_name, uint64_t& t_ms)
+{
+	if (get_file_time_ms(file_name, t_ms) == false)
+		return false;
 
-	// Send data to the client, including the upated instance_hash. Any failure here:
-	// 
-	// 1) client does not receive the buffer
-	// 2) client receives corrupted buffer
-	// 3) client crashes before saving the new instance hash
-	//
-	// will be recovered through the recovery process.
-	SendEncryptedCachedStdout(prog_rec, modify_leading_guid);
+	string log_file = file_name;
+	log_file += ".log";
 
-	LONG prev;
-	ReleaseSemaphore(h_semaphore, 1, &prev);
+	uint64_t t_log;
+	if (get_file_time_ms(log_file.c_str(), t_log) && t_log > t_ms)
+		t_ms = t_log;
 
-	return 0;
+	return true;
 }
 
 BOOL replace_backup(const char* source_file, const char* target_file, int min)
@@ -1307,9 +3175,9 @@ BOOL replace_backup(const char* source_file, const char* target_file, int min)
 	uint64_t t_now = get_time_ms();
 
 	uint64_t t_file;
-	if (get_file_time_ms(target_file, t_file) == false)
+	if (get_db_file_time_ms(target_file, t_file) == false)
 	{
-		return CopyFile(source_file, target_file, FALSE);
+		return copy_db_file(source_file, target_file);
 	}
 	else
 	{
@@ -1319,7 +3187,7 @@ BOOL replace_backup(const char* source_file, const char* target_file, int min)
 
 		if ((t_file < t_now) && ((t_now - t_file) > delta_ms)) 
 		{
-			return CopyFile(source_file, target_file, FALSE);
+			return copy_db_file(source_file, target_file);
 		}
 	}
 
@@ -1331,7 +3199,7 @@ bool BackupOwnershipDB(void)
 	if (DoesFileExist(backup_dir) == false)
 		return false;
 
-	if (DoesFileExist(ownership_reg_db_file_name) == false)
+	if (DoesFileExist(program_db_file_name) == false)
 		return false;
 
 	char file_name[1024];
@@ -1344,14 +3212,14 @@ bool BackupOwnershipDB(void)
 	// Create the backup file names
 	for (int i = 0; i < file_names.size(); i++)
 	{
-		sprintf_s(file_name, "%s/DB.[%04ld].bin", backup_dir, t_min[i]);
+		snprintf(file_name, sizeof(file_name), PROGRAM_DB_BACKUP_FORMAT, backup_dir, (long)t_min[i]);
 		file_names[i] = file_name;
 	}
 
 	for (int i = file_names.size() - 1; i > 0; i--)
 		replace_backup(file_names[i - 1].c_str(), file_names[i].c_str(), t_min[i]);
 
-	replace_backup(ownership_reg_db_file_name, file_names[0].c_str(), t_min[0]);
+	replace_backup(program_db_file_name, file_names[0].c_str(), t_min[0]);
 
 	return true;
 }
\ No newline at end of file
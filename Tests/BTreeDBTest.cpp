@@ -0,0 +1,481 @@
+// Copyright (c) AlgoMachines
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Tests of the BTreeDB file handling, with DRM_ProgramRecord (the DB.bin record):
+//
+// bounded_cache - the page cache is trimmed by a save, while the records of the pages in use stay valid
+// mark_changed - a record changed through its mutable members is saved once MarkRecordChanged() is called
+// checksums - a damaged page or header is found when it is read
+// journal - a save which did not reach the pages of the file is completed by the next load from the journal, a journal
+//           older than the file is not applied
+// clean_load - a load of a file whose last save completed writes nothing, a load with the journal replay disabled leaves
+//              a save which did not reach all of its pages alone and reports it
+// legacy - a file without checksums (version 0) is read, and is rewritten with them by its first save
+// reload - a record saved in place by another instance is read again, and a save of its leaf by this one keeps it
+
+#include "OS.h"
+
+#include "memory_tools.h"
+#include "file_tools.h"
+
+#include "WindowsTypes.h"
+#include "time_tools.h"
+#include "Encryption.h"
+
+#include "BTreeDB.hpp"
+#include "DRM_ProgramRecord.h"
+
+#define CHECK(X) { if ((X) == false) { fprintf(stderr, "%s(%d): check failed: %s\n", __FILE__, __LINE__, #X); exit(1); } }
+
+#define TEST_RECORDS 2000
+#define TEST_CACHE_PAGES 4
+
+typedef BTreeDB<DRM_ProgramRecord> TestDB;
+
+static void make_test_record(DRM_ProgramRecord& rec, uint32_t i, uint64_t nqueries)
+{
+	uint8_t id[ID_SIZE_BYTES];
+	for (int k = 0; k < ID_SIZE_BYTES; k++)
+		id[k] = (uint8_t)(i * 31 + k * 7 + 1);
+
+	memmove(id, &i, sizeof(i));		// more records than the pattern has
+
+	rec.Zero();
+	rec.SetID(id);
+	rec.SetNQueries(nqueries);
+}
+
+static const DRM_ProgramRecord* get_record(TestDB& db, uint32_t i)
+{
+	DRM_ProgramRecord token;
+	make_test_record(token, i, 0);
+
+	const DRM_ProgramRecord* rec = db.GetRecord(token);
+	CHECK(rec != 0);
+	return rec;
+}
+
+static vector<uint8_t> read_file(const char* file_name)
+{
+	vector<uint8_t> b((size_t)filelength64(file_name));
+	FILE* stream = fopen(file_name, "rb");
+	CHECK(stream != 0);
+	CHECK(b.size() == 0 || fread(&b[0], b.size(), 1, stream) == 1);
+	fclose(stream);
+	return b;
+}
+
+static void write_file(const char* file_name, const vector<uint8_t>& b)
+{
+	FILE* stream = fopen(file_name, "wb");
+	CHECK(stream != 0);
+	CHECK(b.size() == 0 || fwrite(&b[0], b.size(), 1, stream) == 1);
+	fclose(stream);
+}
+
+static void delete_test_db(const char* file_name)
+{
+	string err_msg;
+	CHECK(TestDB::DeleteFiles(file_name, err_msg));
+}
+
+// Adds n to the query count of every 10th record
+static void update_test_db(const char* file_name, uint64_t n)
+{
+	string err_msg;
+	TestDB db;
+	CHECK(db.LoadFromFile(file_name, err_msg));
+
+	for (uint32_t i = 0; i < TEST_RECORDS; i += 10)
+	{
+		const DRM_ProgramRecord* rec = get_record(db, i);
+
+		DRM_ProgramRecord updated = *rec;
+		updated.SetNQueries(rec->GetNQueries() + n);
+
+		bool changes_made;
+		CHECK(db.UpdateRecord(updated, changes_made, err_msg) && changes_made);
+	}
+
+	CHECK(db.SaveToFile(file_name, err_msg));
+}
+
+static void check_test_db(const char* file_name, uint64_t n)
+{
+	string err_msg;
+	TestDB db;
+	CHECK(db.LoadFromFile(file_name, err_msg));
+	CHECK(db.GetNumRecords() == TEST_RECORDS);
+
+	for (uint32_t i = 0; i < TEST_RECORDS; i++)
+		CHECK(get_record(db, i)->GetNQueries() == (i % 10 == 0 ? i + n : i));
+}
+
+static void create_test_db(const char* file_name)
+{
+	delete_test_db(file_name);
+
+	string err_msg;
+	TestDB db;
+	CHECK(db.LoadFromFile(file_name, err_msg));
+
+	for (uint32_t i = 0; i < TEST_RECORDS; i++)
+	{
+		DRM_ProgramRecord rec;
+		make_test_record(rec, i, i);
+
+		bool changes_made;
+		CHECK(db.UpdateRecord(rec, changes_made, err_msg) && changes_made);
+	}
+
+	CHECK(db.SaveToFile(file_name, err_msg));
+	CHECK(db.GetNumRecords() == TEST_RECORDS);
+}
+
+static void test_bounded_cache(const char* file_name)
+{
+	create_test_db(file_name);
+
+	string err_msg;
+	TestDB db;
+	db.SetCachePages(TEST_CACHE_PAGES);
+	CHECK(db.LoadFromFile(file_name, err_msg));
+
+	const DRM_ProgramRecord* rec = 0;
+	for (uint32_t i = 0; i < TEST_RECORDS; i++)
+	{
+		rec = get_record(db, i);
+		CHECK(rec->GetNQueries() == i);
+
+		if (i % 100 == 99)
+		{
+			CHECK(db.SaveToFile(file_name, err_msg));
+
+			// The record which was looked up last is still in the cache
+			CHECK(rec->GetNQueries() == i);
+			CHECK(get_record(db, i) == rec);
+		}
+	}
+
+	size_t npages = db.GetNumCachedPages();
+	CHECK(db.SaveToFile(file_name, err_msg));
+	CHECK(db.SaveToFile(file_name, err_msg));
+	CHECK(db.GetNumCachedPages() <= TEST_CACHE_PAGES);
+	CHECK(db.GetNumCachedPages() < npages);
+
+	delete_test_db(file_name);
+}
+
+static void test_mark_changed(const char* file_name)
+{
+	create_test_db(file_name);
+
+	string err_msg;
+	{
+		TestDB db;
+		CHECK(db.LoadFromFile(file_name, err_msg));
+
+		for (uint32_t i = 0; i < TEST_RECORDS; i += 97)
+		{
+			const DRM_ProgramRecord* rec = get_record(db, i);
+			rec->IncrementNQueries();
+			CHECK(db.MarkRecordChanged(rec));
+		}
+
+		// Not a record of the tree
+		DRM_ProgramRecord other;
+		make_test_record(other, 0, 0);
+		CHECK(db.MarkRecordChanged(&other) == false);
+
+		CHECK(db.SaveToFile(file_name, err_msg));
+	}
+
+	TestDB db;
+	CHECK(db.LoadFromFile(file_name, err_msg));
+
+	for (uint32_t i = 0; i < TEST_RECORDS; i++)
+		CHECK(get_record(db, i)->GetNQueries() == (i % 97 == 0 ? i + 1 : i));
+
+	delete_test_db(file_name);
+}
+
+static void test_checksums(const char* file_name)
+{
+	create_test_db(file_name);
+	vector<uint8_t> b = read_file(file_name);
+
+	// A record image in page 2
+	vector<uint8_t> damaged = b;
+	damaged[2 * BTREEDB_PAGE_SIZE + 100] ^= 1;
+	write_file(file_name, damaged);
+
+	string err_msg;
+	{
+		TestDB db;
+		CHECK(db.LoadFromFile(file_name, err_msg));
+
+		uint32_t nmissing = 0;
+		for (uint32_t i = 0; i < TEST_RECORDS; i++)
+		{
+			DRM_ProgramRecord token;
+			make_test_record(token, i, 0);
+			if (db.GetRecord(token) == 0)
+				nmissing++;
+		}
+		CHECK(nmissing > 0 && nmissing < TEST_RECORDS);
+
+		struct Counter
+		{
+			inline bool operator () (const DRM_ProgramRecord&) { return true; }
+		} counter;
+
+		err_msg.clear();
+		CHECK(db.ForEachRecord(counter, err_msg) == false);
+		CHECK(err_msg.find("checksum mismatch in page 2") != string::npos);
+	}
+
+	// The record count in the header
+	damaged = b;
+	damaged[32] ^= 1;
+	write_file(file_name, damaged);
+	{
+		TestDB db;
+		CHECK(db.LoadFromFile(file_name, err_msg) == false);
+	}
+
+	delete_test_db(file_name);
+}
+
+static void test_journal(const char* file_name)
+{
+	string journal_file_name = file_name;
+	journal_file_name += ".journal";
+
+	create_test_db(file_name);
+	update_test_db(file_name, 1000);
+	vector<uint8_t> a = read_file(file_name);
+
+	update_test_db(file_name, 1000);
+	check_test_db(file_name, 2000);
+	vector<uint8_t> journal_b = read_file(journal_file_name.c_str());
+
+	// None of the pages were written in place
+	write_file(file_name, a);
+	check_test_db(file_name, 2000);
+
+	// Some of them, and not the header
+	vector<uint8_t> b = read_file(file_name);
+	vector<uint8_t> torn = a;
+	memcpy(&torn[BTREEDB_PAGE_SIZE], &b[BTREEDB_PAGE_SIZE], BTREEDB_PAGE_SIZE);
+	write_file(file_name, torn);
+	check_test_db(file_name, 2000);
+
+	// A damaged journal was not committed, the file is as it was
+	write_file(file_name, a);
+	vector<uint8_t> damaged = journal_b;
+	damaged[damaged.size() / 2] ^= 1;
+	write_file(journal_file_name.c_str(), damaged);
+	check_test_db(file_name, 1000);
+
+	// The journal of an earlier save
+	write_file(file_name, b);
+	update_test_db(file_name, 1000);
+	write_file(journal_file_name.c_str(), journal_b);
+	check_test_db(file_name, 3000);
+
+	CHECK(DoesFileExist(journal_file_name.c_str()));
+	delete_test_db(file_name);
+	CHECK(DoesFileExist(journal_file_name.c_str()) == false);
+	CHECK(DoesFileExist(file_name) == false);
+}
+
+static void test_clean_load(const char* file_name)
+{
+	string journal_file_name = file_name;
+	journal_file_name += ".journal";
+
+	create_test_db(file_name);
+	update_test_db(file_name, 1000);
+	vector<uint8_t> a = read_file(file_name);
+
+	update_test_db(file_name, 1000);
+	vector<uint8_t> b = read_file(file_name);
+	CHECK(DoesFileExist(journal_file_name.c_str()));
+
+	struct stat st_before, st_after;
+	CHECK(stat(file_name, &st_before) == 0);
+
+	// The journal's pages are already in the file
+	FileSync::SetPolicy(FILESYNC_COMMIT);
+	uint64_t ncommits = FileSync::GetStats().ncommits;
+	check_test_db(file_name, 2000);
+	CHECK(FileSync::GetStats().ncommits == ncommits);
+	FileSync::SetPolicy(FILESYNC_NONE);
+
+	CHECK(stat(file_name, &st_after) == 0);
+	CHECK(st_after.st_mtim.tv_sec == st_before.st_mtim.tv_sec && st_after.st_mtim.tv_nsec == st_before.st_mtim.tv_nsec);
+	CHECK(read_file(file_name) == b);
+
+	// The header of the last save made it to the disk, one of its leaves did not
+	size_t npages = b.size() / BTREEDB_PAGE_SIZE;
+	size_t changed_page = 1;
+	while (changed_page < npages && memcmp(&a[changed_page * BTREEDB_PAGE_SIZE], &b[changed_page * BTREEDB_PAGE_SIZE], BTREEDB_PAGE_SIZE) == 0)
+		changed_page++;
+	CHECK(changed_page < npages);
+
+	vector<uint8_t> torn = b;
+	memcpy(&torn[changed_page * BTREEDB_PAGE_SIZE], &a[changed_page * BTREEDB_PAGE_SIZE], BTREEDB_PAGE_SIZE);
+	write_file(file_name, torn);
+
+	string err_msg;
+	{
+		TestDB db;
+		db.EnableJournalReplay(false);
+		CHECK(db.LoadFromFile(file_name, err_msg));
+		CHECK(db.IsJournalPending());
+		CHECK(read_file(file_name) == torn);
+	}
+
+	check_test_db(file_name, 2000);
+	CHECK(read_file(file_name) == b);
+
+	{
+		TestDB db;
+		db.EnableJournalReplay(false);
+		CHECK(db.LoadFromFile(file_name, err_msg));
+		CHECK(db.IsJournalPending() == false);
+	}
+
+	delete_test_db(file_name);
+}
+
+static void test_legacy(const char* file_name)
+{
+	create_test_db(file_name);
+
+	// Version 0: the header fields from the version on, and the page checksums, were zero
+	vector<uint8_t> b = read_file(file_name);
+	b[12] = 0;
+	memset(&b[40], 0, 16);
+	for (size_t page = 1; page < b.size() / BTREEDB_PAGE_SIZE; page++)
+		memset(&b[page * BTREEDB_PAGE_SIZE + 4], 0, 4);
+	write_file(file_name, b);
+
+	check_test_db(file_name, 0);
+	update_test_db(file_name, 1000);
+	check_test_db(file_name, 1000);
+
+	b = read_file(file_name);
+	CHECK(b[12] == BTREEDB_VERSION);
+
+	b[2 * BTREEDB_PAGE_SIZE + 100] ^= 1;
+	write_file(file_name, b);
+
+	string err_msg;
+	TestDB db;
+	CHECK(db.LoadFromFile(file_name, err_msg));
+
+	uint32_t nmissing = 0;
+	for (uint32_t i = 0; i < TEST_RECORDS; i++)
+	{
+		DRM_ProgramRecord token;
+		make_test_record(token, i, 0);
+		if (db.GetRecord(token) == 0)
+			nmissing++;
+	}
+	CHECK(nmissing > 0);
+
+	delete_test_db(file_name);
+}
+
+static void test_reload(const char* file_name)
+{
+	create_test_db(file_name);
+
+	string err_msg;
+	TestDB a, b;
+	CHECK(a.LoadFromFile(file_name, err_msg));
+	CHECK(b.LoadFromFile(file_name, err_msg));
+
+	// Records 0 and 256 are in one leaf
+	DRM_ProgramRecord token0, token256;
+	make_test_record(token0, 0, 0);
+	make_test_record(token256, 256, 0);
+
+	uint64_t offset0, len0, offset256, len256;
+	CHECK(a.GetRecordRange(token0, offset0, len0) && a.GetRecordRange(token256, offset256, len256));
+	CHECK(offset0 == offset256 && len0 == BTREEDB_PAGE_SIZE);
+
+	const DRM_ProgramRecord* b_rec0 = get_record(b, 0);
+
+	CHECK(a.CanSaveInPlace(file_name));
+	const DRM_ProgramRecord* rec = get_record(a, 0);
+	rec->IncrementNQueries();
+	CHECK(a.MarkRecordChanged(rec));
+	CHECK(a.SaveChangedRecords(file_name, err_msg));
+
+	CHECK(b_rec0->GetNQueries() == 0);
+	CHECK(b.ReloadRecord(token0, err_msg));
+	CHECK(b_rec0->GetNQueries() == 1);
+
+	rec = get_record(b, 256);
+	rec->IncrementNQueries();
+	CHECK(b.MarkRecordChanged(rec));
+	CHECK(b.SaveChangedRecords(file_name, err_msg));
+
+	{
+		TestDB c;
+		CHECK(c.LoadFromFile(file_name, err_msg));
+		CHECK(get_record(c, 0)->GetNQueries() == 1);
+		CHECK(get_record(c, 256)->GetNQueries() == 257);
+	}
+
+	// a's cache is out of date
+	CHECK(a.Refresh(err_msg));
+	CHECK(a.GetNumCachedPages() == 0);
+	CHECK(get_record(a, 256)->GetNQueries() == 257);
+
+	// An insert is not saved in place
+	DRM_ProgramRecord inserted;
+	make_test_record(inserted, TEST_RECORDS, 0);
+
+	bool changes_made;
+	CHECK(a.UpdateRecord(inserted, changes_made, err_msg) && changes_made);
+	CHECK(a.CanSaveInPlace(file_name) == false);
+
+	delete_test_db(file_name);
+}
+
+int main(int argc, const char** argv)
+{
+	char temp_dir[] = "/tmp/BTreeDBTest.XXXXXX";
+	CHECK(mkdtemp(temp_dir) != 0);
+
+	string file_name = temp_dir;
+	file_name += "/DB.btree";
+
+	test_bounded_cache(file_name.c_str());
+	printf("bounded_cache: OK\n");
+
+	test_mark_changed(file_name.c_str());
+	printf("mark_changed: OK\n");
+
+	test_checksums(file_name.c_str());
+	printf("checksums: OK\n");
+
+	test_journal(file_name.c_str());
+	printf("journal: OK\n");
+
+	test_clean_load(file_name.c_str());
+	printf("clean_load: OK\n");
+
+	test_legacy(file_name.c_str());
+	printf("legacy: OK\n");
+
+	test_reload(file_name.c_str());
+	printf("reload: OK\n");
+
+	rmdir(temp_dir);
+	return 0;
+}
@@ -0,0 +1,545 @@
+// Copyright (c) AlgoMachines
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Smoke tests of the server modes of PrivateMessenger (linux):
+//
+//   MessengerSmokeTest <PrivateMessenger executable> http   - the --http server, with this client and with curl
+//   MessengerSmokeTest <PrivateMessenger executable> fastcgi - the --fastcgi worker, with connections which are kept
+//   MessengerSmokeTest <PrivateMessenger executable> store  - the --store daemon, with CGI instances as front ends
+//
+// The servers run as child processes of the executable. The clients are added to the db directly, there is no
+// compiler for AddClient here. The request and reply encoding is the one of PrivateMessenger.cpp, which is built
+// into this test with its main() renamed.
+
+#define main private_messenger_main
+#include "../PrivateMessenger/PrivateMessenger.cpp"
+#undef main
+
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#define CHECK(X) { if ((X) == false) { fprintf(stderr, "%s(%d): check failed: %s\n", __FILE__, __LINE__, #X); exit(1); } }
+
+#define SERVER_START_TIMEOUT_MS 5000
+
+struct TestClient
+{
+	uint8_t id[ID_SIZE_BYTES];
+	uint8_t key[16];
+	uint8_t instance_hash[16];
+};
+
+static void add_test_client(TestClient& client, int i)
+{
+	for (int k = 0; k < ID_SIZE_BYTES; k++)
+		client.id[k] = (uint8_t)(i * 31 + k * 7 + 1);
+
+	for (int k = 0; k < 16; k++)
+		client.key[k] = (uint8_t)(i + k * 3);
+
+	ProgramDB db;
+	bool write_needed;
+	CHECK(open_program_record_database(db, true, write_needed));
+
+	DRM_ProgramRecord rec;
+	rec.SetID(client.id);
+
+	bool changed;
+	string err_msg;
+	CHECK(db.UpdateRecord(rec, changed, err_msg));
+
+	const DRM_ProgramRecord* p = db.GetRecord(rec);
+	CHECK(p != 0);
+	p->SetKey(client.key);
+	db.MarkRecordChanged(p);
+	CHECK(db.SaveToFile(program_db_file_name, err_msg));
+
+	get_instance_hash(db.GetRecord(rec), client.instance_hash);
+}
+
+// [leading guid][op][ID] encrypted with the leading guid, [instance hash][data] with the modified guid
+static string make_request(const TestClient& client, int op, const vector<uint8_t>& data)
+{
+	GUID leading_guid = create_random_guid();
+
+	vector<uint8_t> b(sizeof(GUID) + 1 + ID_SIZE_BYTES + 16 + data.size());
+	memmove(&b[0], &leading_guid, sizeof(GUID));
+	b[16] = (uint8_t)op;
+	memmove(&b[17], client.id, ID_SIZE_BYTES);
+	memmove(&b[17 + ID_SIZE_BYTES], client.instance_hash, 16);
+	if (data.size())
+		memmove(&b[33 + ID_SIZE_BYTES], &data[0], data.size());
+
+	symmetric_encryption(&b[16], 1 + ID_SIZE_BYTES, leading_guid);
+
+	GUID modified_guid;
+	create_modified_guid(client.key, (const uint8_t*)&leading_guid, (uint8_t*)&modified_guid);
+	symmetric_encryption(&b[17 + ID_SIZE_BYTES], (int)b.size() - 17 - ID_SIZE_BYTES, modified_guid);
+
+	string s;
+	bin_to_hex_char(&b[0], (int)b.size(), s);
+	return s;
+}
+
+// The plain text of a {...} reply, the client's instance hash is updated
+static string decode_reply(TestClient& client, const string& reply)
+{
+	size_t a = reply.find('{');
+	size_t z = reply.rfind('}');
+	CHECK(a != string::npos && z != string::npos && z > a);
+
+	vector<uint8_t> b;
+	CHECK(hex_char_to_bin(reply.substr(a + 1, z - a - 1), b));
+	CHECK(b.size() >= 32);
+
+	GUID leading_guid;
+	memmove(&leading_guid, &b[0], sizeof(GUID));
+
+	GUID modified_guid;
+	create_modified_guid(client.key, (const uint8_t*)&leading_guid, (uint8_t*)&modified_guid);
+
+	symmetric_encryption(&b[16], 16, modified_guid);
+	symmetric_encryption(&b[32], (int)b.size() - 32, modified_guid);
+	memmove(client.instance_hash, &b[16], 16);
+
+	string s((const char*)&b[32], b.size() - 32);
+	while (s.size() && s[s.size() - 1] == 0)
+		s.erase(s.size() - 1);
+
+	return s;
+}
+
+// Request data of SendPrivateMessage()
+static vector<uint8_t> make_message(const TestClient& receiver, const char* msg)
+{
+	uint16_t len = (uint16_t)strlen(msg);
+
+	vector<uint8_t> data(ID_SIZE_BYTES + sizeof(len) + len + 1, 0);
+	memmove(&data[0], receiver.id, ID_SIZE_BYTES);
+	memmove(&data[ID_SIZE_BYTES], &len, sizeof(len));
+	memmove(&data[ID_SIZE_BYTES + sizeof(len)], msg, len);
+	return data;
+}
+
+static vector<uint8_t> make_receive(void)
+{
+	return vector<uint8_t>(8, 0);
+}
+
+static pid_t start_server(const char* executable, const char* mode, const char* address)
+{
+	pid_t pid = fork();
+	CHECK(pid >= 0);
+
+	if (pid == 0)
+	{
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		execl(executable, executable, mode, address, (char*)0);
+		_exit(127);
+	}
+
+	return pid;
+}
+
+static void stop_server(pid_t pid)
+{
+	kill(pid, SIGTERM);
+
+	int status;
+	CHECK(waitpid(pid, &status, 0) == pid);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void wait_for_server(const char* address)
+{
+	for (int ms = 0; ms < SERVER_START_TIMEOUT_MS; ms += 10)
+	{
+		string err_msg;
+		socket_t s;
+		if (socket_connect(address, s, err_msg))
+		{
+			socket_close(s);
+			return;
+		}
+
+		usleep(10000);
+	}
+
+	CHECK(false);
+}
+
+// Output of the executable run as a CGI instance, the request is passed on the command line
+static string run_cgi(const char* executable, const string& request)
+{
+	string command = executable;
+	command += " ";
+	command += request;
+
+	FILE* stream = popen(command.c_str(), "r");
+	CHECK(stream != 0);
+
+	string output;
+	char buf[0x1000];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), stream)) > 0)
+		output.append(buf, n);
+
+	CHECK(pclose(stream) == 0);
+	return output;
+}
+
+static string http_post(const string& body)
+{
+	char header[256];
+	sprintf(header, "POST /cgi-bin/PrivateMessenger HTTP/1.1\r\nHost: localhost\r\nContent-Length: %d\r\n\r\n", (int)body.size());
+	return header + body;
+}
+
+// One response of a keep-alive connection
+static bool http_read_response(socket_t s, string& status_line, string& body)
+{
+	string in;
+	size_t header_end;
+	while ((header_end = in.find("\r\n\r\n")) == string::npos)
+	{
+		char c;
+		if (recv(s, &c, 1, 0) != 1)
+			return false;
+
+		in += c;
+	}
+
+	status_line = in.substr(0, in.find("\r\n"));
+
+	size_t content_length = 0;
+	size_t p = in.find("Content-Length: ");
+	if (p != string::npos)
+		content_length = (size_t)atoi(in.c_str() + p + 16);
+
+	body.resize(content_length);
+	return content_length == 0 || socket_recv_all(s, &body[0], content_length);
+}
+
+static int test_http(const char* executable)
+{
+	TestClient a, b;
+	add_test_client(a, 1);
+	add_test_client(b, 2);
+
+	char address[64];
+	sprintf(address, "127.0.0.1:%d", 20000 + (int)(getpid() % 20000));
+
+	pid_t pid = start_server(executable, "--http", address);
+	wait_for_server(address);
+
+	string err_msg;
+	socket_t s;
+	CHECK(socket_connect(address, s, err_msg));
+
+	// Two requests on one connection
+	string request = http_post(make_request(a, 1, make_message(b, "hello")));
+	CHECK(socket_send_all(s, request.data(), request.size()));
+
+	string status_line, body;
+	CHECK(http_read_response(s, status_line, body));
+	CHECK(status_line == "HTTP/1.1 200 OK");
+	CHECK(decode_reply(a, body) == "0000");
+
+	request = http_post(make_request(b, 2, make_receive()));
+	CHECK(socket_send_all(s, request.data(), request.size()));
+	CHECK(http_read_response(s, status_line, body));
+	CHECK(decode_reply(b, body).find("hello") != string::npos);
+
+	// Pipelined without reading the responses, more than the server reads ahead
+	int npipelined = 2 * (MAX_REQUEST_CONTENT_LENGTH + HTTP_MAX_HEADER_BYTES) / (int)http_post("00").size();
+	pid_t sender = fork();
+	CHECK(sender >= 0);
+	if (sender == 0)
+	{
+		string requests;
+		for (int i = 0; i < npipelined; i++)
+			requests += http_post("00");
+
+		_exit(socket_send_all(s, requests.data(), requests.size()) ? 0 : 1);
+	}
+
+	for (int i = 0; i < npipelined; i++)
+	{
+		CHECK(http_read_response(s, status_line, body));
+		CHECK(status_line == "HTTP/1.1 200 OK");
+	}
+
+	int status;
+	CHECK(waitpid(sender, &status, 0) == sender && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	// CGI instances save b's record in place meanwhile, the registry page which holds a's record as well. The server
+	// reads b's record again, and a save of a's record doesn't write b's back as the server had it.
+	string output = run_cgi(executable, make_request(b, 1, make_message(a, "cgi")));
+	CHECK(decode_reply(b, output) == "0000");
+
+	request = http_post(make_request(a, 1, make_message(b, "after cgi")));
+	CHECK(socket_send_all(s, request.data(), request.size()));
+	CHECK(http_read_response(s, status_line, body));
+	CHECK(decode_reply(a, body) == "0000");
+
+	output = run_cgi(executable, make_request(b, 1, make_message(a, "cgi again")));
+	CHECK(decode_reply(b, output) == "0000");
+
+	request = http_post(make_request(b, 2, make_receive()));
+	CHECK(socket_send_all(s, request.data(), request.size()));
+	CHECK(http_read_response(s, status_line, body));
+	CHECK(decode_reply(b, body).find("after cgi") != string::npos);
+
+	// The saved records have the instance hashes which the clients were sent last
+	{
+		ProgramDB db;
+		bool write_needed;
+		CHECK(open_program_record_database(db, false, write_needed));
+
+		DRM_ProgramRecord token;
+		uint8_t instance_hash[16];
+
+		token.SetID(a.id);
+		CHECK(db.GetRecord(token) != 0);
+		get_instance_hash(db.GetRecord(token), instance_hash);
+		CHECK(memcmp(instance_hash, a.instance_hash, 16) == 0);
+
+		token.SetID(b.id);
+		CHECK(db.GetRecord(token) != 0);
+		get_instance_hash(db.GetRecord(token), instance_hash);
+		CHECK(memcmp(instance_hash, b.instance_hash, 16) == 0);
+	}
+
+	// Larger than the content limit
+	request = http_post(string(MAX_REQUEST_CONTENT_LENGTH + 1, 'A'));
+	CHECK(socket_send_all(s, request.data(), request.size()));
+	CHECK(http_read_response(s, status_line, body));
+	CHECK(status_line.find("HTTP/1.1 413") == 0);
+
+	socket_close(s);
+
+	// curl, when it is installed
+	if (system("curl --version > /dev/null 2>&1") == 0)
+	{
+		FILE* stream = fopen("request.hex", "wb");
+		CHECK(stream != 0);
+		fputs(make_request(a, 1, make_message(b, "curl")).c_str(), stream);
+		fclose(stream);
+
+		string command = "curl -s -f --data-binary @request.hex -o reply.txt http://";
+		command += address;
+		command += "/";
+		CHECK(system(command.c_str()) == 0);
+
+		stream = fopen("reply.txt", "rb");
+		CHECK(stream != 0);
+
+		char reply[0x1000];
+		size_t n = fread(reply, 1, sizeof(reply), stream);
+		fclose(stream);
+		CHECK(decode_reply(a, string(reply, n)) == "0000");
+	}
+
+	stop_server(pid);
+	return 0;
+}
+
+static string fcgi_record(uint8_t type, uint16_t request_id, const string& content)
+{
+	uint8_t header[8] = { FCGI_VERSION_1, type, (uint8_t)(request_id >> 8), (uint8_t)request_id,
+		(uint8_t)(content.size() >> 8), (uint8_t)content.size(), 0, 0 };
+
+	return string((const char*)header, sizeof(header)) + content;
+}
+
+// BEGIN_REQUEST, PARAMS and STDIN of a responder request
+static string fcgi_request(uint16_t request_id, bool keep_conn, const string& body)
+{
+	uint8_t begin[8] = { 0, FCGI_RESPONDER, (uint8_t)(keep_conn ? FCGI_KEEP_CONN : 0), 0, 0, 0, 0, 0 };
+
+	char content_length[16];
+	sprintf(content_length, "%d", (int)body.size());
+
+	string params;
+	params += (char)strlen("CONTENT_LENGTH");
+	params += (char)strlen(content_length);
+	params += "CONTENT_LENGTH";
+	params += content_length;
+
+	string request = fcgi_record(FCGI_BEGIN_REQUEST, request_id, string((const char*)begin, sizeof(begin)));
+	request += fcgi_record(FCGI_PARAMS, request_id, params);
+	request += fcgi_record(FCGI_PARAMS, request_id, "");
+	request += fcgi_record(FCGI_STDIN, request_id, body);
+	request += fcgi_record(FCGI_STDIN, request_id, "");
+	return request;
+}
+
+// The STDOUT stream of the response, up to END_REQUEST
+static bool fcgi_read_response(socket_t s, string& output)
+{
+	output.clear();
+	while (1)
+	{
+		uint8_t header[8];
+		if (socket_recv_all(s, header, sizeof(header)) == false)
+			return false;
+
+		string content((header[4] << 8) | header[5], 0);
+		content.resize(content.size() + header[6]);
+		if (content.size() && socket_recv_all(s, &content[0], content.size()) == false)
+			return false;
+
+		content.resize((header[4] << 8) | header[5]);
+		if (header[1] == FCGI_END_REQUEST)
+			return true;
+
+		if (header[1] == FCGI_STDOUT)
+			output += content;
+	}
+}
+
+static int test_fastcgi(const char* executable)
+{
+	TestClient a, b;
+	add_test_client(a, 1);
+	add_test_client(b, 2);
+
+	char address[64];
+	sprintf(address, "127.0.0.1:%d", 20000 + (int)((getpid() + 7) % 20000));
+
+	pid_t pid = start_server(executable, "--fastcgi", address);
+	wait_for_server(address);
+
+	// A connection which the web server keeps, idle after its request
+	string err_msg;
+	socket_t kept;
+	CHECK(socket_connect(address, kept, err_msg));
+	socket_set_timeout(kept, 5000);
+
+	string request = fcgi_request(1, true, make_request(a, 1, make_message(b, "kept")));
+	CHECK(socket_send_all(kept, request.data(), request.size()));
+
+	string output;
+	CHECK(fcgi_read_response(kept, output));
+	CHECK(output.find("Content-type: text/html\n\n{") == 0);
+	CHECK(decode_reply(a, output) == "0000");
+
+	// Served while the kept connection is idle, and closed after its request
+	socket_t s;
+	CHECK(socket_connect(address, s, err_msg));
+	socket_set_timeout(s, 5000);
+
+	request = fcgi_request(1, false, make_request(b, 2, make_receive()));
+	CHECK(socket_send_all(s, request.data(), request.size()));
+	CHECK(fcgi_read_response(s, output));
+	CHECK(decode_reply(b, output).find("kept") != string::npos);
+
+	char c;
+	CHECK(recv(s, &c, 1, 0) == 0);
+	socket_close(s);
+
+	// The kept connection takes the next request
+	request = fcgi_request(2, true, make_request(a, 1, make_message(b, "again")));
+	CHECK(socket_send_all(kept, request.data(), request.size()));
+	CHECK(fcgi_read_response(kept, output));
+	CHECK(decode_reply(a, output) == "0000");
+
+	socket_close(kept);
+
+	stop_server(pid);
+	return 0;
+}
+
+static int test_store(const char* executable)
+{
+	TestClient a, b;
+	add_test_client(a, 1);
+	add_test_client(b, 2);
+
+	// Served in process while there is no daemon
+	string reply;
+	CHECK(process_request_via_store(make_request(a, 1, make_message(b, "first")), reply) == false);
+
+	pid_t pid = start_server(executable, "--store", 0);
+	wait_for_server(store_socket_file_name);
+
+	CHECK(process_request_via_store(make_request(a, 1, make_message(b, "second")), reply));
+	CHECK(decode_reply(a, reply) == "0000");
+
+	// CGI instances as front ends of the daemon
+	string output = run_cgi(executable, make_request(a, 1, make_message(b, "third")));
+	CHECK(output.find("Content-type: text/html\n\n{") == 0);
+	CHECK(decode_reply(a, output) == "0000");
+
+	output = run_cgi(executable, make_request(b, 2, make_receive()));
+	string messages = decode_reply(b, output);
+	CHECK(messages.find("second") != string::npos && messages.find("third") != string::npos);
+
+	// A command which was validated with an old record is not applied
+	StoreCommand command;
+	command.command = STORE_SEND_MESSAGE;
+	memmove(command.id, a.id, ID_SIZE_BYTES);
+	command.nqueries = 0;
+
+	StoreReply store_reply;
+	bool connected;
+	string err_msg;
+	CHECK(store_call(store_socket_file_name, command, store_reply, connected, err_msg));
+	CHECK(store_reply.status == STORE_STALE);
+
+	stop_server(pid);
+	CHECK(DoesFileExist(store_socket_file_name) == false);
+
+	// And in process again
+	output = run_cgi(executable, make_request(a, 1, make_message(b, "fourth")));
+	CHECK(decode_reply(a, output) == "0000");
+
+	return 0;
+}
+
+int main(int argc, const char** argv)
+{
+	if (argc < 3)
+	{
+		fprintf(stderr, "usage: MessengerSmokeTest <PrivateMessenger executable> http|fastcgi|store\n");
+		return 1;
+	}
+
+	char executable[4096];
+	CHECK(realpath(argv[1], executable) != 0);
+
+	// <temp>/PrivateMessenger holds the databases, the executable runs in <temp>/work
+	char temp_dir[] = "/tmp/MessengerSmokeTest.XXXXXX";
+	CHECK(mkdtemp(temp_dir) != 0);
+
+	string db_dir = temp_dir;
+	db_dir += "/PrivateMessenger";
+	string work_dir = temp_dir;
+	work_dir += "/work";
+
+	CHECK(CreateDirectoryIfNecessary(db_dir.c_str()));
+	CHECK(CreateDirectoryIfNecessary((db_dir + "/Backup").c_str()));
+	CHECK(CreateDirectoryIfNecessary(work_dir.c_str()));
+	CHECK(chdir(work_dir.c_str()) == 0);
+
+	construct_names_and_paths(executable);
+
+	int status = 1;
+	if (strcmp(argv[2], "http") == 0)
+		status = test_http(executable);
+	else if (strcmp(argv[2], "fastcgi") == 0)
+		status = test_fastcgi(executable);
+	else if (strcmp(argv[2], "store") == 0)
+		status = test_store(executable);
+
+	string command = "rm -rf ";
+	command += temp_dir;
+	system(command.c_str());
+
+	if (status == 0)
+		printf("%s: OK\n", argv[2]);
+
+	return status;
+}
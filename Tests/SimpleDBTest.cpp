@@ -0,0 +1,601 @@
+// Copyright (c) AlgoMachines
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Tests of the SimpleDB file handling, with DRM_ProgramRecord (the DB.bin record):
+//
+// crc32c - the block checksums give the CRC-32C check value, also when computed in pieces of any alignment
+// torn_log - an append which was interrupted leaves part of an entry at the end of <file>.log, the entries
+//            appended after it must still be replayed
+// lazy_blocks - a mapped file is loaded without checking its blocks, a damaged block is found when it is used
+// release_mappings - the records of a mapped file are copied into memory, and are saved from there
+// reload_log - changes of records saved in place by another instance are appended to the log, and read by ReloadRecord()
+//
+// And IndexedDB, with DRM_PrivateMessageRecord (the MSG.bin record):
+//
+// index_sidecar - the secondary indexes are saved to <file>.sidx and read back by the next instance, a sidecar which
+//                 was written for another saved state of the file is not used
+// index_damaged_block - the indexes of a mapped file with a damaged block are not built, and the queries find nothing
+//
+// And ShardedDB, with DRM_PrivateMessageRecord:
+//
+// missing_summary - without <file>.summary the records of the shard files are counted, and the summary is written again
+
+#include "OS.h"
+
+#include "memory_tools.h"
+#include "file_tools.h"
+
+#include "WindowsTypes.h"
+#include "time_tools.h"
+#include "Encryption.h"
+
+#include "SimpleDB.hpp"
+#include "DRM_ProgramRecord.h"
+#include "IndexedDB.hpp"
+#include "ShardedDB.hpp"
+#include "DRM_PrivateMessageRecord.h"
+
+#define CHECK(X) { if ((X) == false) { fprintf(stderr, "%s(%d): check failed: %s\n", __FILE__, __LINE__, #X); exit(1); } }
+
+#define TEST_RECORDS 100
+
+typedef SimpleDB<DRM_ProgramRecord> TestDB;
+
+static void test_crc32c(void)
+{
+	CHECK(CRC32C::Compute("123456789", 9) == 0xE3069283);
+
+	uint8_t data[1001];
+	for (uint32_t i = 0; i < sizeof(data); i++)
+		data[i] = (uint8_t)(i * 7);
+
+	uint32_t crc = CRC32C::Compute(data, sizeof(data));
+	for (uint32_t split = 0; split < 16; split++)
+		CHECK(CRC32C::Compute(data + split, sizeof(data) - split, CRC32C::Compute(data, split)) == crc);
+}
+
+static void make_test_record(DRM_ProgramRecord& rec, uint32_t i, uint64_t nqueries)
+{
+	uint8_t id[ID_SIZE_BYTES];
+	for (int k = 0; k < ID_SIZE_BYTES; k++)
+		id[k] = (uint8_t)(i * 31 + k * 7 + 1);
+
+	rec.Zero();
+	rec.SetID(id);
+	rec.SetNQueries(nqueries);
+}
+
+static uint64_t get_nqueries(TestDB& db, uint32_t i)
+{
+	DRM_ProgramRecord token;
+	make_test_record(token, i, 0);
+
+	const DRM_ProgramRecord* rec = db.GetRecord(token);
+	CHECK(rec != 0);
+	return rec->GetNQueries();
+}
+
+static void update_nqueries(TestDB& db, uint32_t i, uint64_t nqueries, const char* file_name)
+{
+	DRM_ProgramRecord rec;
+	make_test_record(rec, i, nqueries);
+
+	bool changes_made;
+	string err_msg;
+	CHECK(db.UpdateRecord(rec, changes_made, err_msg) && changes_made);
+	CHECK(db.SaveToFile(file_name, err_msg));
+}
+
+static void test_torn_log(const char* file_name)
+{
+	string log_file_name = file_name;
+	log_file_name += ".log";
+
+	string err_msg;
+	CHECK(TestDB::DeleteFiles(file_name, err_msg));
+
+	{
+		TestDB db;
+		db.EnableLog(true);
+
+		vector<DRM_ProgramRecord> records(TEST_RECORDS);
+		for (uint32_t i = 0; i < TEST_RECORDS; i++)
+			make_test_record(records[i], i, 0);
+
+		std::sort(records.begin(), records.end());
+		CHECK(db.LoadFromBuffer(&records[0], (uint32_t)records.size(), err_msg));
+		CHECK(db.SaveToFile(file_name, err_msg));
+
+		update_nqueries(db, 1, 11, file_name);
+	}
+
+	uint32_t entry_sz = 1 + DRM_ProgramRecord::GetSizeBytes();
+	CHECK(filelength(log_file_name.c_str()) == (int)entry_sz);
+
+	// Half of the next entry made it to the disk
+	FILE* stream = fopen(log_file_name.c_str(), "ab");
+	CHECK(stream != 0);
+	vector<uint8_t> torn(entry_sz / 2, 0xAB);
+	CHECK(fwrite(&torn[0], 1, torn.size(), stream) == torn.size());
+	fclose(stream);
+
+	{
+		TestDB db;
+		db.EnableLog(true);
+		CHECK(db.LoadFromFile(file_name, err_msg));
+		CHECK(get_nqueries(db, 1) == 11);
+
+		update_nqueries(db, 2, 22, file_name);
+		update_nqueries(db, 3, 33, file_name);
+	}
+
+	CHECK(filelength(log_file_name.c_str()) == (int)(3 * entry_sz));
+
+	TestDB db;
+	db.EnableLog(true);
+	CHECK(db.LoadFromFile(file_name, err_msg));
+	CHECK(get_nqueries(db, 1) == 11);
+	CHECK(get_nqueries(db, 2) == 22);
+	CHECK(get_nqueries(db, 3) == 33);
+
+	CHECK(TestDB::DeleteFiles(file_name, err_msg));
+}
+
+static void test_lazy_blocks(const char* file_name)
+{
+	string err_msg;
+	CHECK(TestDB::DeleteFiles(file_name, err_msg));
+
+	uint32_t record_sz = DRM_ProgramRecord::GetSizeBytes();
+	uint32_t records_per_block = SIMPLEDB_BLOCK_SIZE / record_sz;
+	uint32_t nrecords = records_per_block * 4;
+	uint32_t nblocks = (nrecords + records_per_block - 1) / records_per_block;
+
+	DRM_ProgramRecord first, last;
+	{
+		TestDB db;
+
+		vector<DRM_ProgramRecord> records(nrecords);
+		for (uint32_t i = 0; i < nrecords; i++)
+			make_test_record(records[i], i, i);
+
+		std::sort(records.begin(), records.end());
+		CHECK(db.LoadFromBuffer(&records[0], (uint32_t)records.size(), err_msg));
+		CHECK(db.SaveToFile(file_name, err_msg));
+
+		first = records[0];
+		last = records[nrecords - 1];
+	}
+
+	// The last byte of the last record, in the last block
+	FILE* stream = fopen(file_name, "r+b");
+	CHECK(stream != 0);
+	CHECK(fseek64(stream, TestDB::GetFileSize(nrecords) - nblocks * sizeof(uint32_t) - 1));
+	CHECK(fputc(0x5A, stream) != EOF);
+	fclose(stream);
+
+	// Read - every block is checked by the load
+	{
+		TestDB db;
+		CHECK(db.LoadFromFile(file_name, err_msg) == false);
+	}
+
+	// Mapped - only the blocks which are used
+	TestDB db;
+	db.EnableFileMapping(true);
+	CHECK(db.LoadFromFile(file_name, err_msg));
+	CHECK(db.IsMapped());
+
+	CHECK(db.GetRecord(first) != 0);
+	CHECK(db.GetRecord(last) == 0);
+
+	err_msg.clear();
+	CHECK(db.CheckBlocks(err_msg) == false);
+	CHECK(err_msg.find("checksum mismatch in block") != string::npos);
+
+	// Nothing damaged is written out with new checksums
+	CHECK(db.RemoveRecord(0, err_msg) == false);
+
+	CHECK(TestDB::DeleteFiles(file_name, err_msg));
+}
+
+static void test_release_mappings(const char* file_name)
+{
+	string err_msg;
+	CHECK(TestDB::DeleteFiles(file_name, err_msg));
+
+	{
+		TestDB db;
+
+		vector<DRM_ProgramRecord> records(TEST_RECORDS);
+		for (uint32_t i = 0; i < TEST_RECORDS; i++)
+			make_test_record(records[i], i, i);
+
+		std::sort(records.begin(), records.end());
+		CHECK(db.LoadFromBuffer(&records[0], (uint32_t)records.size(), err_msg));
+		CHECK(db.SaveToFile(file_name, err_msg));
+	}
+
+	TestDB db;
+	db.EnableFileMapping(true);
+	db.EnableHashIndex(true);
+	CHECK(db.LoadFromFile(file_name, err_msg));
+	CHECK(db.IsMapped());
+
+	CHECK(db.ReleaseFileMappings(err_msg));
+	CHECK(db.IsMapped() == false);
+
+	for (uint32_t i = 0; i < TEST_RECORDS; i++)
+		CHECK(get_nqueries(db, i) == i);
+
+	update_nqueries(db, 5, 55, file_name);
+
+	TestDB reloaded;
+	CHECK(reloaded.LoadFromFile(file_name, err_msg));
+	CHECK(get_nqueries(reloaded, 5) == 55);
+	CHECK(get_nqueries(reloaded, 6) == 6);
+
+	CHECK(TestDB::DeleteFiles(file_name, err_msg));
+}
+
+static void test_reload_log(const char* file_name)
+{
+	string log_file_name = file_name;
+	log_file_name += ".log";
+
+	string err_msg;
+	CHECK(TestDB::DeleteFiles(file_name, err_msg));
+
+	{
+		TestDB db;
+		db.EnableLog(true);
+
+		vector<DRM_ProgramRecord> records(TEST_RECORDS);
+		for (uint32_t i = 0; i < TEST_RECORDS; i++)
+			make_test_record(records[i], i, i);
+
+		std::sort(records.begin(), records.end());
+		CHECK(db.LoadFromBuffer(&records[0], (uint32_t)records.size(), err_msg));
+		CHECK(db.SaveToFile(file_name, err_msg));
+	}
+
+	TestDB a, b;
+	a.EnableLog(true);
+	a.EnableFileMapping(true);
+	b.EnableLog(true);
+	b.EnableFileMapping(true);
+	CHECK(a.LoadFromFile(file_name, err_msg));
+	CHECK(b.LoadFromFile(file_name, err_msg));
+
+	DRM_ProgramRecord token5, token6;
+	make_test_record(token5, 5, 0);
+	make_test_record(token6, 6, 0);
+
+	const DRM_ProgramRecord* b_rec5 = b.GetRecord(token5);
+	CHECK(b_rec5 != 0);
+
+	CHECK(a.CanSaveInPlace(file_name));
+	const DRM_ProgramRecord* rec = a.GetRecord(token5);
+	rec->IncrementNQueries();
+	CHECK(a.MarkRecordChanged(rec));
+	CHECK(a.SaveChangedRecords(file_name, err_msg));
+
+	uint32_t entry_sz = 1 + DRM_ProgramRecord::GetSizeBytes();
+	CHECK(filelength(log_file_name.c_str()) == (int)entry_sz);
+
+	CHECK(b_rec5->GetNQueries() == 5);
+	CHECK(b.ReloadRecord(token5, err_msg));
+	CHECK(b.GetRecord(token5) == b_rec5);
+	CHECK(b_rec5->GetNQueries() == 6);
+
+	rec = b.GetRecord(token6);
+	rec->IncrementNQueries();
+	CHECK(b.MarkRecordChanged(rec));
+	CHECK(b.SaveChangedRecords(file_name, err_msg));
+	CHECK(filelength(log_file_name.c_str()) == (int)(2 * entry_sz));
+
+	CHECK(a.Refresh(err_msg));
+	CHECK(get_nqueries(a, 5) == 6);
+	CHECK(get_nqueries(a, 6) == 7);
+
+	// No room in the log
+	a.EnableLog(true, 2 * entry_sz);
+	CHECK(a.CanSaveInPlace(file_name) == false);
+
+	// An insert
+	DRM_ProgramRecord inserted;
+	make_test_record(inserted, TEST_RECORDS, 0);
+
+	bool changes_made;
+	CHECK(b.UpdateRecord(inserted, changes_made, err_msg) && changes_made);
+	CHECK(b.CanSaveInPlace(file_name) == false);
+
+	CHECK(TestDB::DeleteFiles(file_name, err_msg));
+}
+
+typedef IndexedDB<DRM_PrivateMessageRecord> TestIndexedDB;
+
+static void make_test_message(DRM_PrivateMessageRecord& rec, uint32_t i)
+{
+	uint8_t receiver[64], sender[64];
+	for (int k = 0; k < sizeof(receiver); k++)
+	{
+		receiver[k] = (uint8_t)(i % 7 + k);
+		sender[k] = (uint8_t)(i * 13 % 11 + k);
+	}
+
+	uint64_t timestamp_ms = 1000000 - (uint64_t)i * 17 % 1000;
+
+	rec.Zero();
+	rec.SetHashedIDReceiver(receiver);
+	rec.SetHashedIDSender(sender);
+	rec.SetTimestamp(&timestamp_ms);
+}
+
+// Every entry of each index is in index order, and the positions of token's keys hold records with them
+static void check_indexes(TestIndexedDB& db, const DRM_PrivateMessageRecord& token)
+{
+	for (uint32_t index_num = 1; index_num <= DRM_PrivateMessageRecord::GetNumIndexes(); index_num++)
+	{
+		for (uint32_t pos = 1; pos < db.GetNumRecords(); pos++)
+		{
+			const DRM_PrivateMessageRecord* a = db.GetRecordByIndexPosition(index_num, pos - 1);
+			const DRM_PrivateMessageRecord* b = db.GetRecordByIndexPosition(index_num, pos);
+			CHECK(a != 0 && b != 0 && a->CompareIndexKey(index_num, *b) <= 0);
+		}
+
+		CHECK(db.GetRecordByIndexPosition(index_num, db.GetNumRecords()) == 0);
+
+		uint32_t istart, iend;
+		db.GetIndexRange(index_num, token, istart, iend);
+		CHECK(istart < iend);
+
+		for (uint32_t pos = istart; pos < iend; pos++)
+			CHECK(db.GetRecordByIndexPosition(index_num, pos)->CompareIndexKey(index_num, token) == 0);
+	}
+}
+
+static void test_index_sidecar(const char* file_name)
+{
+	string index_file_name = file_name;
+	index_file_name += ".sidx";
+
+	string err_msg;
+	CHECK(TestIndexedDB::DeleteFiles(file_name, err_msg));
+
+	DRM_PrivateMessageRecord token;
+	make_test_message(token, 3);
+
+	{
+		TestIndexedDB db;
+
+		vector<DRM_PrivateMessageRecord> records(TEST_RECORDS);
+		for (uint32_t i = 0; i < TEST_RECORDS; i++)
+			make_test_message(records[i], i);
+
+		std::sort(records.begin(), records.end());
+		CHECK(db.LoadFromBuffer(&records[0], (uint32_t)records.size(), err_msg));
+
+		// Indexes which were never queried are not written
+		CHECK(db.SaveToFile(file_name, err_msg));
+		CHECK(DoesFileExist(index_file_name.c_str()) == false);
+
+		check_indexes(db, token);
+		CHECK(db.AreIndexesSaved() == false);
+		CHECK(db.SaveToFile(file_name, err_msg));
+		CHECK(db.AreIndexesSaved());
+		CHECK(DoesFileExist(index_file_name.c_str()));
+	}
+
+	// Read back instead of sorted
+	{
+		TestIndexedDB db;
+		CHECK(db.LoadFromFile(file_name, err_msg));
+		CHECK(db.AreIndexesLoaded() == false);
+
+		check_indexes(db, token);
+		CHECK(db.AreIndexesSaved());
+	}
+
+	vector<uint8_t> stale((size_t)filelength64(index_file_name.c_str()));
+	FILE* stream = fopen(index_file_name.c_str(), "rb");
+	CHECK(stream != 0);
+	CHECK(fread(&stale[0], 1, stale.size(), stream) == stale.size());
+	fclose(stream);
+
+	// Another instance replaces a record without querying the indexes - the sidecar has the right size but is out of date
+	{
+		TestIndexedDB db;
+		CHECK(db.LoadFromFile(file_name, err_msg));
+
+		DRM_PrivateMessageRecord rec;
+		make_test_message(rec, TEST_RECORDS);
+
+		bool exists;
+		uint32_t idx = db.GetRecordIndex(rec, exists);
+		CHECK(exists == false);
+		CHECK(db.InsertRecord(rec, idx, err_msg));
+		CHECK(db.RemoveRecord(idx == 0 ? 1 : 0, err_msg));
+		CHECK(db.SaveToFile(file_name, err_msg));
+		CHECK(db.AreIndexesLoaded() == false);
+	}
+
+	{
+		TestIndexedDB db;
+		CHECK(db.LoadFromFile(file_name, err_msg));
+
+		check_indexes(db, token);
+		CHECK(db.AreIndexesSaved() == false);
+		CHECK(db.SaveChangedRecords(file_name, err_msg));
+		CHECK(db.AreIndexesSaved());
+	}
+
+	// The sidecar of the earlier state
+	stream = fopen(index_file_name.c_str(), "wb");
+	CHECK(stream != 0);
+	CHECK(fwrite(&stale[0], 1, stale.size(), stream) == stale.size());
+	fclose(stream);
+
+	{
+		TestIndexedDB db;
+		CHECK(db.LoadFromFile(file_name, err_msg));
+
+		check_indexes(db, token);
+		CHECK(db.AreIndexesSaved() == false);
+	}
+
+	CHECK(TestIndexedDB::DeleteFiles(file_name, err_msg));
+	CHECK(DoesFileExist(index_file_name.c_str()) == false);
+}
+
+static void test_index_damaged_block(const char* file_name)
+{
+	string err_msg;
+	CHECK(TestIndexedDB::DeleteFiles(file_name, err_msg));
+
+	uint32_t record_sz = DRM_PrivateMessageRecord::GetSizeBytes();
+	uint32_t records_per_block = SIMPLEDB_BLOCK_SIZE / record_sz;
+	uint32_t nblocks = (TEST_RECORDS + records_per_block - 1) / records_per_block;
+
+	DRM_PrivateMessageRecord token;
+	make_test_message(token, TEST_RECORDS - 1);
+
+	{
+		TestIndexedDB db;
+
+		vector<DRM_PrivateMessageRecord> records(TEST_RECORDS);
+		for (uint32_t i = 0; i < TEST_RECORDS; i++)
+			make_test_message(records[i], i);
+
+		std::sort(records.begin(), records.end());
+		CHECK(db.LoadFromBuffer(&records[0], (uint32_t)records.size(), err_msg));
+		CHECK(db.SaveToFile(file_name, err_msg));
+	}
+
+	// The last byte of the last record
+	FILE* stream = fopen(file_name, "r+b");
+	CHECK(stream != 0);
+	CHECK(fseek64(stream, SimpleDB<DRM_PrivateMessageRecord>::GetFileSize(TEST_RECORDS) - nblocks * sizeof(uint32_t) - 1));
+	CHECK(fputc(0x5A, stream) != EOF);
+	fclose(stream);
+
+	TestIndexedDB db;
+	db.EnableFileMapping(true);
+	CHECK(db.LoadFromFile(file_name, err_msg));
+
+	for (uint32_t index_num = 1; index_num <= DRM_PrivateMessageRecord::GetNumIndexes(); index_num++)
+	{
+		uint32_t istart, iend;
+		db.GetIndexRange(index_num, token, istart, iend);
+		CHECK(istart == iend);
+		CHECK(db.GetRecordByIndexPosition(index_num, 0) == 0);
+	}
+
+	CHECK(db.AreIndexesLoaded() == false);
+
+	CHECK(TestIndexedDB::DeleteFiles(file_name, err_msg));
+}
+
+#define TEST_SHARDS 4
+
+typedef ShardedDB<DRM_PrivateMessageRecord> TestShardedDB;
+
+static void load_sharded_db(TestShardedDB& db, const char* file_name)
+{
+	string err_msg;
+	CHECK(db.SetNumShards(TEST_SHARDS));
+	CHECK(db.LoadFromFile(file_name, err_msg));
+}
+
+static void test_missing_summary(const char* file_name)
+{
+	string summary_file_name = file_name;
+	summary_file_name += ".summary";
+
+	string err_msg;
+	{
+		TestShardedDB db;
+		load_sharded_db(db, file_name);
+
+		// Receivers in every shard
+		for (uint32_t i = 0; i < TEST_RECORDS; i++)
+		{
+			DRM_PrivateMessageRecord rec;
+			make_test_message(rec, i);
+
+			uint8_t receiver[32];
+			memset(receiver, 0, sizeof(receiver));
+			receiver[0] = (uint8_t)(i * 37);
+			receiver[1] = (uint8_t)i;
+			rec.SetHashedIDReceiver(receiver);
+
+			bool changes_made;
+			CHECK(db.UpdateRecord(rec, changes_made, err_msg) && changes_made);
+		}
+
+		CHECK(db.SaveToFile(file_name, err_msg));
+		CHECK(db.GetNumRecords() == TEST_RECORDS);
+	}
+
+	CHECK(DeleteFile(summary_file_name.c_str()));
+
+	{
+		TestShardedDB db;
+		load_sharded_db(db, file_name);
+		CHECK(db.GetNumRecords() == TEST_RECORDS);
+		CHECK(db.SaveToFile(file_name, err_msg));
+	}
+
+	CHECK(DoesFileExist(summary_file_name.c_str()));
+
+	{
+		TestShardedDB db;
+		load_sharded_db(db, file_name);
+		CHECK(db.IsShardLoaded(0) == false);
+		CHECK(db.GetNumRecords() == TEST_RECORDS);
+
+		// Every segment is emptied, and its files deleted
+		uint32_t nremoved;
+		CHECK(db.RemoveOlderThan(0xFFFFFFFFFFFFFFFFULL, nremoved, err_msg) && nremoved == TEST_RECORDS);
+		CHECK(db.SaveToFile(file_name, err_msg));
+	}
+
+	CHECK(DeleteFile(summary_file_name.c_str()));
+}
+
+int main(int argc, const char** argv)
+{
+	char temp_dir[] = "/tmp/SimpleDBTest.XXXXXX";
+	CHECK(mkdtemp(temp_dir) != 0);
+
+	string file_name = temp_dir;
+	file_name += "/DB.bin";
+
+	test_crc32c();
+	printf("crc32c: OK\n");
+
+	test_torn_log(file_name.c_str());
+	printf("torn_log: OK\n");
+
+	test_lazy_blocks(file_name.c_str());
+	printf("lazy_blocks: OK\n");
+
+	test_release_mappings(file_name.c_str());
+	printf("release_mappings: OK\n");
+
+	test_reload_log(file_name.c_str());
+	printf("reload_log: OK\n");
+
+	test_index_sidecar(file_name.c_str());
+	printf("index_sidecar: OK\n");
+
+	test_index_damaged_block(file_name.c_str());
+	printf("index_damaged_block: OK\n");
+
+	test_missing_summary(file_name.c_str());
+	printf("missing_summary: OK\n");
+
+	rmdir(temp_dir);
+	return 0;
+}